@@ -0,0 +1,126 @@
+#include "bench.h"
+
+#include "common/log.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static char **bench_filters;
+
+/* Counted by the malloc() wrappers */
+static uint64_t bench_allocs, bench_alloc_bytes;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+/*
+ * Count allocations by interposing the glibc malloc() family.
+ */
+void *malloc (size_t size)
+{
+    bench_allocs++;
+    bench_alloc_bytes += size;
+
+    return __libc_malloc(size);
+}
+
+void *calloc (size_t nmemb, size_t size)
+{
+    bench_allocs++;
+    bench_alloc_bytes += nmemb * size;
+
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc (void *ptr, size_t size)
+{
+    bench_allocs++;
+    bench_alloc_bytes += size;
+
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+static double bench_now ()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_init (int argc, char **argv)
+{
+    // some benchmarks exercise paths that log warnings, e.g. 405 misses
+    log_set_level(LOG_ERROR);
+
+    if (argc > 1)
+        bench_filters = argv + 1;
+}
+
+static int bench_filter (const char *name)
+{
+    if (!bench_filters)
+        return 1;
+
+    for (char **filter = bench_filters; *filter; filter++) {
+        if (strstr(name, *filter))
+            return 1;
+    }
+
+    return 0;
+}
+
+int bench_run (const char *name, bench_func *func, void *ctx, size_t size)
+{
+    uint64_t allocs, alloc_bytes;
+    double time;
+    unsigned n = 1;
+
+    if (!bench_filter(name))
+        return 0;
+
+    for (;;) {
+        allocs = bench_allocs;
+        alloc_bytes = bench_alloc_bytes;
+
+        double start = bench_now();
+
+        if (func(ctx, n) < 0) {
+            log_error("%s: failed", name);
+            return -1;
+        }
+
+        time = bench_now() - start;
+        allocs = bench_allocs - allocs;
+        alloc_bytes = bench_alloc_bytes - alloc_bytes;
+
+        if (time >= BENCH_TIME || n >= UINT32_MAX / 100)
+            break;
+
+        // aim past BENCH_TIME based on the previous run, growing by at least 2x and at most 100x
+        double next = time > 0 ? n * BENCH_TIME * 1.2 / time : n * 100.0;
+
+        if (next < n * 2.0)
+            next = n * 2.0;
+        if (next > n * 100.0)
+            next = n * 100.0;
+
+        n = next;
+    }
+
+    printf("%-48s %10u %12.1f ns/op", name, n, time * 1e9 / n);
+
+    if (size)
+        printf(" %10.2f MB/s", size * (double) n / time / 1e6);
+
+    printf(" %8llu B/op %6llu allocs/op\n", (unsigned long long) (alloc_bytes / n), (unsigned long long) (allocs / n));
+    fflush(stdout);
+
+    return 0;
+}
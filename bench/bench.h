@@ -0,0 +1,38 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+
+/*
+ * Common harness for the microbenchmarks, see bench_run().
+ */
+
+/* Minimum total time for each benchmark, in seconds */
+#define BENCH_TIME 0.25
+
+/*
+ * Run n iterations of the benchmark.
+ *
+ * Returns <0 on error.
+ */
+typedef int (bench_func)(void *ctx, unsigned n);
+
+/*
+ * Use the command-line arguments as substrings of the benchmark names to run, defaulting to all of them.
+ */
+void bench_init (int argc, char **argv);
+
+/*
+ * Run the benchmark with an increasing number of iterations until it takes at least BENCH_TIME, and print the result of
+ * the last run as a line in the Go benchmark format:
+ *
+ *  <name> <iterations> <ns> ns/op [<MB/s> MB/s] <bytes> B/op <allocs> allocs/op
+ *
+ * The optional size is the number of bytes processed per iteration. The allocated bytes only count malloc(), calloc()
+ * and realloc(), and are only available with glibc.
+ *
+ * Returns 0 if skipped, <0 on error.
+ */
+int bench_run (const char *name, bench_func *func, void *ctx, size_t size);
+
+#endif
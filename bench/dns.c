@@ -0,0 +1,195 @@
+/*
+ * Microbenchmarks for packing queries and responses using dns_pack_*(), and unpacking captured responses using
+ * dns_unpack_*().
+ */
+#include "bench.h"
+
+#include "dns.h"
+#include "dns/dns.h"
+#include "common/log.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * A captured response packet.
+ */
+struct bench_packet {
+    const char *name;
+
+    size_t size;
+    const unsigned char *buf;
+};
+
+/* www.github.com A: a CNAME chain */
+static const unsigned char bench_packet_cname[] = {
+    0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+    0x03, 'w', 'w', 'w', 0x06, 'g', 'i', 't', 'h', 'u', 'b', 0x03, 'c', 'o', 'm', 0x00, 0x00, 0x01, 0x00, 0x01,
+    0xc0, 0x0c, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x0e, 0x10, 0x00, 0x02, 0xc0, 0x10,
+    0xc0, 0x10, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x04, 0x8c, 0x52, 0x79, 0x04,
+};
+
+/* example.com MX: two exchanges, with an additional address */
+static const unsigned char bench_packet_mx[] = {
+    0x56, 0x78, 0x81, 0x80, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x01,
+    0x07, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 0x03, 'c', 'o', 'm', 0x00, 0x00, 0x0f, 0x00, 0x01,
+    0xc0, 0x0c, 0x00, 0x0f, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x08, 0x00, 0x0a, 0x03, 'm', 'x', '1', 0xc0, 0x0c,
+    0xc0, 0x0c, 0x00, 0x0f, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x08, 0x00, 0x14, 0x03, 'm', 'x', '2', 0xc0, 0x0c,
+    0xc0, 0x2b, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x04, 0xc0, 0x00, 0x02, 0x01,
+};
+
+/* example.com AAAA: several addresses, and an EDNS OPT record */
+static const unsigned char bench_packet_aaaa[] = {
+    0x9a, 0xbc, 0x81, 0x80, 0x00, 0x01, 0x00, 0x03, 0x00, 0x00, 0x00, 0x01,
+    0x07, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 0x03, 'c', 'o', 'm', 0x00, 0x00, 0x1c, 0x00, 0x01,
+    0xc0, 0x0c, 0x00, 0x1c, 0x00, 0x01, 0x00, 0x00, 0x0e, 0x10, 0x00, 0x10,
+        0x20, 0x01, 0x0d, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+    0xc0, 0x0c, 0x00, 0x1c, 0x00, 0x01, 0x00, 0x00, 0x0e, 0x10, 0x00, 0x10,
+        0x20, 0x01, 0x0d, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02,
+    0xc0, 0x0c, 0x00, 0x1c, 0x00, 0x01, 0x00, 0x00, 0x0e, 0x10, 0x00, 0x10,
+        0x20, 0x01, 0x0d, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03,
+    0x00, 0x00, 0x29, 0x04, 0xd0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+static const struct bench_packet bench_packets[] = {
+    { "cname",  sizeof(bench_packet_cname), bench_packet_cname },
+    { "mx",     sizeof(bench_packet_mx),    bench_packet_mx },
+    { "aaaa",   sizeof(bench_packet_aaaa),  bench_packet_aaaa },
+    { }
+};
+
+/*
+ * Unpack the header, questions, and all records with their rdata.
+ */
+static int bench_unpack (void *ctx, unsigned n)
+{
+    const struct bench_packet *packet = ctx;
+    struct dns_packet pkt;
+    struct dns_header header;
+    struct dns_question question;
+    struct dns_record rr;
+    union dns_rdata rdata;
+
+    memcpy(pkt.buf, packet->buf, packet->size);
+
+    for (unsigned i = 0; i < n; i++) {
+        pkt.ptr = pkt.buf;
+        pkt.end = pkt.buf + packet->size;
+
+        if (dns_unpack_header(&pkt, &header)) {
+            log_error("dns_unpack_header");
+            return -1;
+        }
+
+        for (unsigned j = 0; j < header.qdcount; j++) {
+            if (dns_unpack_question(&pkt, &question)) {
+                log_error("dns_unpack_question");
+                return -1;
+            }
+        }
+
+        for (unsigned j = 0; j < header.ancount + header.nscount + header.arcount; j++) {
+            if (dns_unpack_record(&pkt, &rr)) {
+                log_error("dns_unpack_record");
+                return -1;
+            }
+
+            if (dns_unpack_rdata(&pkt, &rr, &rdata)) {
+                log_error("dns_unpack_rdata");
+                return -1;
+            }
+        }
+
+        if (pkt.ptr != pkt.end) {
+            log_error("trailing data: %zu bytes", (size_t) (pkt.end - pkt.ptr));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Pack an EDNS query, as sent by the resolver.
+ */
+static int bench_pack_query (void *ctx, unsigned n)
+{
+    struct dns_packet *pkt = ctx;
+    struct dns_header header = { .id = 1, .rd = 1, .qdcount = 1, .arcount = 1 };
+    struct dns_question question = { .qname = "www.example.com", .qtype = DNS_AAAA, .qclass = DNS_IN };
+
+    for (unsigned i = 0; i < n; i++) {
+        pkt->ptr = pkt->buf;
+        pkt->end = pkt->buf + sizeof(pkt->buf);
+
+        if (dns_pack_header(pkt, &header) || dns_pack_question(pkt, &question) || dns_pack_opt(pkt, DNS_PACKET)) {
+            log_error("dns_pack_*");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Pack a response with the names compressed against the question, as sent by the server.
+ */
+static int bench_pack_response (void *ctx, unsigned n)
+{
+    struct dns_packet *pkt = ctx;
+    struct dns_header header = { .id = 1, .qr = 1, .rd = 1, .ra = 1, .qdcount = 1, .ancount = 3, .arcount = 1 };
+    struct dns_question question = { .qname = "example.com", .qtype = DNS_MX, .qclass = DNS_IN };
+    struct dns_record mx = { .name = "example.com", .type = DNS_MX, .class = DNS_IN, .ttl = 300 };
+    struct dns_record a = { .name = "mx1.example.com", .type = DNS_A, .class = DNS_IN, .ttl = 300 };
+    union dns_rdata rdata[4] = {
+        { .MX = { 10, "mx1.example.com" } },
+        { .MX = { 20, "mx2.example.com" } },
+        { .MX = { 30, "backup.mx.example.net" } },
+        { .A = { htonl(0xc0000201) } },
+    };
+
+    for (unsigned i = 0; i < n; i++) {
+        pkt->ptr = pkt->buf;
+        pkt->end = pkt->buf + sizeof(pkt->buf);
+
+        if (dns_pack_header(pkt, &header) || dns_pack_question(pkt, &question)) {
+            log_error("dns_pack_*");
+            return -1;
+        }
+
+        for (unsigned j = 0; j < 3; j++) {
+            if (dns_pack_rdata(pkt, &mx, &rdata[j])) {
+                log_error("dns_pack_rdata: MX");
+                return -1;
+            }
+        }
+
+        if (dns_pack_rdata(pkt, &a, &rdata[3])) {
+            log_error("dns_pack_rdata: A");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int main (int argc, char **argv)
+{
+    struct dns_packet pkt;
+    char name[64];
+    int err = 0;
+
+    bench_init(argc, argv);
+
+    for (const struct bench_packet *packet = bench_packets; packet->name; packet++) {
+        snprintf(name, sizeof(name), "dns_unpack/%s", packet->name);
+
+        err |= bench_run(name, bench_unpack, (void *) packet, packet->size);
+    }
+
+    err |= bench_run("dns_pack/query", bench_pack_query, &pkt, 0);
+    err |= bench_run("dns_pack/response", bench_pack_response, &pkt, 0);
+
+    return err ? 1 : 0;
+}
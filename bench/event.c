@@ -0,0 +1,200 @@
+/*
+ * Microbenchmarks for the cost of switching between two tasks, directly using event_wait()/event_notify(), and through
+ * the event loop using event_yield() ping-pong on a socketpair, for each poll backend.
+ */
+#include "bench.h"
+
+#include "common/event.h"
+#include "common/event_poll.h"
+#include "common/log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+struct bench_event {
+    struct event_main *event_main;
+
+    int fds[2];
+    struct event *events[2];
+
+    /* Iterations for each task */
+    unsigned n;
+    int err;
+
+    /* Task waiting in event_wait() */
+    struct event_task *wait;
+};
+
+static void bench_waiter (void *ctx)
+{
+    struct bench_event *bench = ctx;
+
+    for (unsigned i = 0; i < bench->n; i++) {
+        if (event_wait(bench->events[0], &bench->wait)) {
+            log_error("event_wait");
+            bench->err = -1;
+            return;
+        }
+    }
+}
+
+static void bench_notifier (void *ctx)
+{
+    struct bench_event *bench = ctx;
+
+    for (unsigned i = 0; i < bench->n && !bench->err; i++) {
+        if (event_notify(bench->events[0], &bench->wait)) {
+            log_error("event_notify");
+            bench->err = -1;
+            return;
+        }
+    }
+}
+
+/*
+ * One switch to the waiting task and back per iteration.
+ */
+static int bench_wait_notify (void *ctx, unsigned n)
+{
+    struct bench_event *bench = ctx;
+
+    bench->n = n;
+    bench->err = 0;
+
+    // the waiter returns to us in event_wait(), and then runs within the notifier
+    if (event_start(bench->event_main, bench_waiter, bench) || event_start(bench->event_main, bench_notifier, bench)) {
+        log_error("event_start");
+        return -1;
+    }
+
+    return bench->err;
+}
+
+/*
+ * Send a byte to the peer, and wait for it to be returned.
+ */
+static void bench_ping (void *ctx)
+{
+    struct bench_event *bench = ctx;
+    char c = 0;
+
+    for (unsigned i = 0; i < bench->n; i++) {
+        if (write(bench->fds[0], &c, 1) != 1) {
+            log_perror("write");
+            bench->err = -1;
+            return;
+        }
+
+        if (event_yield(bench->events[0], EVENT_READ, NULL)) {
+            log_error("event_yield");
+            bench->err = -1;
+            return;
+        }
+
+        if (read(bench->fds[0], &c, 1) != 1) {
+            log_perror("read");
+            bench->err = -1;
+            return;
+        }
+    }
+}
+
+static void bench_pong (void *ctx)
+{
+    struct bench_event *bench = ctx;
+    char c;
+
+    for (unsigned i = 0; i < bench->n; i++) {
+        if (event_yield(bench->events[1], EVENT_READ, NULL)) {
+            log_error("event_yield");
+            bench->err = -1;
+            return;
+        }
+
+        if (read(bench->fds[1], &c, 1) != 1 || write(bench->fds[1], &c, 1) != 1) {
+            log_perror("read/write");
+            bench->err = -1;
+            return;
+        }
+    }
+}
+
+/*
+ * One round-trip between the two tasks via the poll backend per iteration.
+ */
+static int bench_ping_pong (void *ctx, unsigned n)
+{
+    struct bench_event *bench = ctx;
+
+    bench->n = n;
+    bench->err = 0;
+
+    if (event_start(bench->event_main, bench_pong, bench) || event_start(bench->event_main, bench_ping, bench)) {
+        log_error("event_start");
+        return -1;
+    }
+
+    if (event_main_run(bench->event_main)) {
+        log_error("event_main_run");
+        return -1;
+    }
+
+    return bench->err;
+}
+
+static int bench_poll (const char *poll)
+{
+    struct bench_event bench = { };
+    char name[64];
+    int err = 0;
+
+    if (event_main_create_poll(&bench.event_main, poll)) {
+        log_error("event_main_create_poll: %s", poll);
+        return -1;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, bench.fds)) {
+        log_perror("socketpair");
+        return -1;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (event_create(bench.event_main, &bench.events[i], bench.fds[i])) {
+            log_error("event_create");
+            return -1;
+        }
+    }
+
+    // the direct switch does not depend on the poll backend
+    if (!strcmp(poll, "select"))
+        err |= bench_run("event_wait/notify", bench_wait_notify, &bench, 0);
+
+    snprintf(name, sizeof(name), "event_yield/%s/socketpair", poll);
+    err |= bench_run(name, bench_ping_pong, &bench, 0);
+
+    for (int i = 0; i < 2; i++) {
+        event_destroy(bench.events[i]);
+        close(bench.fds[i]);
+    }
+
+    return err;
+}
+
+int main (int argc, char **argv)
+{
+    int err = 0;
+
+    bench_init(argc, argv);
+
+#ifdef EVENT_POLL_EPOLL
+    err |= bench_poll("epoll");
+#endif
+#ifdef EVENT_POLL_KQUEUE
+    err |= bench_poll("kqueue");
+#endif
+    err |= bench_poll("select");
+
+    return err ? 1 : 0;
+}
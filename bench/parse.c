@@ -0,0 +1,199 @@
+/*
+ * Microbenchmarks for url_parse(), url_decode() and tokenize(), using the compiled state machines vs scanning the
+ * transitions.
+ */
+#include "bench.h"
+
+#include "common/parse_test.h"
+#include "common/log.h"
+#include "common/url.h"
+
+#include <stdio.h>
+#include <string.h>
+
+struct bench_parse {
+    const char *str;
+
+    char buf[URL_MAX];
+};
+
+/*
+ * An URL with a path of the given length, in segments of 16 chars, and a query string.
+ */
+static void bench_url (char *buf, size_t size, unsigned length)
+{
+    int len = snprintf(buf, size, "http://www.example.com:8080/");
+
+    for (unsigned i = 0; len + 16 < size && i < length; i += 16)
+        len += snprintf(buf + len, size - len, "segment%08u/", i / 16);
+
+    snprintf(buf + len, size - len, "index.html?foo=bar&baz=quux");
+}
+
+/*
+ * A query string of the given number of params, with some quoting.
+ */
+static void bench_query (char *buf, size_t size, unsigned count)
+{
+    int len = 0;
+
+    for (unsigned i = 0; len + 32 < size && i < count; i++)
+        len += snprintf(buf + len, size - len, "%sparam%u=value+%u%%2Fpath", i ? "&" : "", i, i);
+}
+
+static int bench_url_parse (void *ctx, unsigned n)
+{
+    struct bench_parse *bench = ctx;
+    struct urlbuf urlbuf;
+
+    for (unsigned i = 0; i < n; i++) {
+        if (urlbuf_parse(&urlbuf, bench->str)) {
+            log_error("urlbuf_parse: %s", bench->str);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Split the path into components, as in server_static_lookup().
+ */
+static int bench_tokenize (void *ctx, unsigned n)
+{
+    struct bench_parse *bench = ctx;
+    enum { START, EMPTY, SELF, PARENT, NAME };
+    const struct parse parsing[] = {
+        { START,    '/',    EMPTY   },
+        { START,    '.',    SELF,   PARSE_KEEP  },
+        { START,    -1,     NAME,   PARSE_KEEP  },
+
+        { SELF,     '.',    PARENT, PARSE_KEEP  },
+        { SELF,     '/',    SELF    },
+        { SELF,     -1,     NAME,   PARSE_KEEP  },
+
+        { PARENT,   '/',    PARENT  },
+        { PARENT,   -1,     NAME,   PARSE_KEEP  },
+
+        { NAME,     '/',    NAME    },
+
+        { }
+    };
+    char name[URL_MAX];
+
+    for (unsigned i = 0; i < n; i++) {
+        const char *lookup = bench->str;
+
+        while (*lookup) {
+            if (tokenize(name, sizeof(name), parsing, &lookup, START) < 0) {
+                log_error("tokenize: %s", lookup);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Iterate over all the params, decoding the query in-place from a fresh copy each time.
+ */
+static int bench_url_decode (void *ctx, unsigned n)
+{
+    struct bench_parse *bench = ctx;
+    size_t len = strlen(bench->str) + 1;
+    const char *name, *value;
+    int err;
+
+    for (unsigned i = 0; i < n; i++) {
+        char *query = bench->buf;
+
+        memcpy(bench->buf, bench->str, len);
+
+        while (!(err = url_decode(&query, &name, &value)))
+            ;
+
+        if (err < 0) {
+            log_error("url_decode: %s", bench->str);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int bench_url_params (void *ctx, unsigned n)
+{
+    struct bench_parse *bench = ctx;
+    size_t len = strlen(bench->str) + 1;
+    struct url_params params;
+
+    for (unsigned i = 0; i < n; i++) {
+        memcpy(bench->buf, bench->str, len);
+
+        if (url_params_parse(&params, bench->buf)) {
+            log_error("url_params_parse: %s", bench->str);
+            return -1;
+        }
+
+        if (!url_params_get(&params, "param0")) {
+            log_error("url_params_get: param0");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Run the benchmark both with and without compiling the state machines.
+ */
+static int bench_compile (const char *name, bench_func *func, struct bench_parse *bench)
+{
+    char buf[64];
+    size_t size = strlen(bench->str);
+    int err = 0;
+
+    parse_set_compile(false);
+    snprintf(buf, sizeof(buf), "%s/len=%zu/scan", name, size);
+    err |= bench_run(buf, func, bench, size);
+
+    parse_set_compile(true);
+    snprintf(buf, sizeof(buf), "%s/len=%zu/compiled", name, size);
+    err |= bench_run(buf, func, bench, size);
+
+    return err;
+}
+
+int main (int argc, char **argv)
+{
+    struct bench_parse bench;
+    char url[URL_MAX], query[URL_MAX], name[64];
+    int err = 0;
+
+    bench_init(argc, argv);
+
+    for (unsigned length = 16; length < URL_MAX - 64; length *= 2) {
+        bench_url(url, sizeof(url), length);
+
+        bench.str = url;
+        err |= bench_compile("url_parse", bench_url_parse, &bench);
+
+        // without the scheme://host:port/
+        bench.str = strchr(url + strlen("http://"), '/') + 1;
+        err |= bench_compile("tokenize", bench_tokenize, &bench);
+    }
+
+    for (unsigned count = 1; count <= URL_PARAMS_MAX; count *= 4) {
+        bench_query(query, sizeof(query), count);
+        bench.str = query;
+
+        snprintf(name, sizeof(name), "url_decode/params=%u", count);
+        err |= bench_run(name, bench_url_decode, &bench, strlen(query));
+
+        snprintf(name, sizeof(name), "url_params_parse/params=%u", count);
+        err |= bench_run(name, bench_url_params, &bench, strlen(query));
+    }
+
+    return err ? 1 : 0;
+}
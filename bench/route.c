@@ -0,0 +1,104 @@
+/*
+ * Microbenchmark for server_lookup_handler() with a growing number of routes.
+ */
+#include "bench.h"
+
+#include "server/server_test.h"
+#include "common/log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_ROUTES_MAX 4096
+
+struct bench_route {
+    struct server *server;
+
+    /* A mix of matching routes, deeper paths below them, and static fallbacks */
+    char paths[16][64];
+
+    /* Lookups without any matching handler */
+    unsigned miss;
+};
+
+static struct server_handler bench_handler;
+
+/*
+ * Register routes in the style of a REST API, with a static fallback.
+ */
+static int bench_routes (struct server *server, unsigned count)
+{
+    static char paths[BENCH_ROUTES_MAX][64];
+
+    for (unsigned i = 0; i < count; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "api/v%u/resource%u/", i % 4, i);
+
+        if (server_add_handler(server, (i % 2) ? "POST" : "GET", paths[i], &bench_handler)) {
+            log_error("server_add_handler: %s", paths[i]);
+            return -1;
+        }
+    }
+
+    return server_add_handler(server, "GET", "", &bench_handler);
+}
+
+static int bench_lookup (void *ctx, unsigned n)
+{
+    struct bench_route *bench = ctx;
+    struct server_handler *handler;
+
+    for (unsigned i = 0; i < n; i++) {
+        if (server_lookup_handler(bench->server, "GET", bench->paths[i % 16], &handler))
+            bench->miss++;
+    }
+
+    return 0;
+}
+
+static int bench_count (unsigned count)
+{
+    struct bench_route bench = { };
+    char name[64];
+    int err;
+
+    if (server_create(NULL, &bench.server)) {
+        log_error("server_create");
+        return -1;
+    }
+
+    if (bench_routes(bench.server, count)) {
+        server_destroy(bench.server);
+        return -1;
+    }
+
+    for (unsigned i = 0; i < 16; i++) {
+        unsigned n = (i * 7919) % count;
+
+        switch (i % 4) {
+            case 0: snprintf(bench.paths[i], sizeof(bench.paths[i]), "api/v%u/resource%u", n % 4, n); break;
+            case 1: snprintf(bench.paths[i], sizeof(bench.paths[i]), "api/v%u/resource%u/item/%u", n % 4, n, i); break;
+            case 2: snprintf(bench.paths[i], sizeof(bench.paths[i]), "static/index%u.css", i); break;
+            case 3: snprintf(bench.paths[i], sizeof(bench.paths[i]), "api/v%u/missing%u", n % 4, n); break;
+        }
+    }
+
+    snprintf(name, sizeof(name), "server_lookup_handler/routes=%u", count);
+
+    err = bench_run(name, bench_lookup, &bench, 0);
+
+    server_destroy(bench.server);
+
+    return err;
+}
+
+int main (int argc, char **argv)
+{
+    bench_init(argc, argv);
+
+    for (unsigned count = 4; count <= BENCH_ROUTES_MAX; count *= 4) {
+        if (bench_count(count))
+            return 1;
+    }
+
+    return 0;
+}
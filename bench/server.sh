@@ -0,0 +1,258 @@
+#!/bin/sh
+#
+# End-to-end performance regression test for bin/server, using bin/bench and bin/dns.
+#
+# Each scenario runs against a fresh bin/server, recording the throughput, latency percentiles and the resident memory
+# of the server as "<scenario> <metric> <value>" lines, which are compared against a baseline from an earlier run.
+#
+# Usage: bench/server.sh [-u] [-D seconds] [-p port] [-b baseline] [-o results] [scenario ...]
+
+set -e
+
+BIN=${BIN:-bin}
+DURATION=${DURATION:-5}
+PORT=${PORT:-18080}
+IDLE=${IDLE:-10000}
+BASELINE=${BASELINE:-bench/server.baseline}
+
+# Extra bin/server options, such as --event-poll io_uring
+SERVER_ARGS=${SERVER_ARGS:-}
+RESULTS=
+UPDATE=
+
+# Allowed regressions, in percent
+THRESHOLD_RATE=${THRESHOLD_RATE:-20}
+THRESHOLD_LATENCY=${THRESHOLD_LATENCY:-50}
+THRESHOLD_RSS=${THRESHOLD_RSS:-25}
+
+# Ignore latency changes smaller than this, in milliseconds
+LATENCY_MIN=${LATENCY_MIN:-0.1}
+
+SCENARIOS="small large pipeline idle upload dns-cached dns-uncached"
+
+usage () {
+    echo "Usage: $0 [-u] [-D seconds] [-p port] [-b baseline] [-o results] [scenario ...]"
+    echo
+    echo "   -u    Update the baseline with these results, rather than comparing"
+    echo "   -D    Duration of each scenario, in seconds (default $DURATION)"
+    echo "   -p    Port for bin/server, with bin/dns on the next port (default $PORT)"
+    echo "   -b    Baseline file (default $BASELINE)"
+    echo "   -o    Also write the results to the given file"
+    echo
+    echo "Scenarios: $SCENARIOS"
+}
+
+while getopts "huD:p:b:o:" opt; do
+    case $opt in
+        h) usage; exit 0 ;;
+        u) UPDATE=1 ;;
+        D) DURATION=$OPTARG ;;
+        p) PORT=$OPTARG ;;
+        b) BASELINE=$OPTARG ;;
+        o) RESULTS=$OPTARG ;;
+        *) usage >&2; exit 2 ;;
+    esac
+done
+
+shift $((OPTIND - 1))
+
+if [ $# -gt 0 ]; then
+    SCENARIOS="$*"
+fi
+
+for bin in server bench dns; do
+    if [ ! -x "$BIN/$bin" ]; then
+        echo "$0: missing $BIN/$bin, run make first" >&2
+        exit 2
+    fi
+done
+
+# the idle connections need an fd each, on both ends
+ulimit -n "$(ulimit -Hn)" 2>/dev/null || true
+
+if [ "$(ulimit -n)" != unlimited ] && [ "$(ulimit -n)" -lt $((IDLE + 1000)) ]; then
+    IDLE=$(($(ulimit -n) - 1000))
+
+    echo "$0: limiting idle connections to $IDLE by ulimit -n" >&2
+fi
+
+DIR=$(mktemp -d)
+SERVER_PID=
+DNS_PID=
+
+cleanup () {
+    if [ -n "$SERVER_PID" ]; then
+        kill "$SERVER_PID" 2>/dev/null || true
+    fi
+
+    if [ -n "$DNS_PID" ]; then
+        kill "$DNS_PID" 2>/dev/null || true
+    fi
+
+    rm -rf "$DIR"
+}
+
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# static tree with small files, and a large file served using sendfile()
+mkdir "$DIR/www" "$DIR/upload"
+
+for i in $(seq 1 20); do
+    head -c 2048 /dev/urandom > "$DIR/www/small$i.bin"
+done
+
+head -c $((64 * 1024 * 1024)) /dev/zero > "$DIR/www/large.bin"
+head -c $((64 * 1024)) /dev/urandom > "$DIR/put.bin"
+
+# names without any TTL are not cached by the server
+cat > "$DIR/bench.zone" <<EOF
+cached.bench.test       300 IN A    192.0.2.1
+uncached.bench.test     0   IN A    192.0.2.2
+EOF
+
+DNS_PORT=$((PORT + 1))
+URL=http://localhost:$PORT
+
+echo "PUT $URL/upload/put.bin $DIR/put.bin" > "$DIR/upload.txt"
+
+"$BIN/dns" -q -R 127.0.0.1 -l 127.0.0.1:$DNS_PORT -Z "$DIR/bench.zone" &
+DNS_PID=$!
+
+# wait for the server to accept connections
+server_wait () {
+    for i in $(seq 1 50); do
+        if ! kill -0 "$SERVER_PID" 2>/dev/null; then
+            break
+        elif "$BIN/bench" -q -M -c 1 -n 1 "$URL/small1.bin" 2>/dev/null | grep -q '^status_2xx=1$'; then
+            return 0
+        fi
+
+        sleep 0.1
+    done
+
+    echo "$0: $BIN/server did not start" >&2
+    cat "$DIR/server.log" >&2
+    exit 1
+}
+
+server_start () {
+    "$BIN/server" -q \
+        --header-timeout $((DURATION + 60)) --keepalive-timeout $((DURATION + 60)) \
+        -S "$DIR/www" -U "$DIR/upload" -P -R 127.0.0.1:$DNS_PORT $SERVER_ARGS \
+        localhost:$PORT 2>> "$DIR/server.log" &
+    SERVER_PID=$!
+
+    server_wait
+}
+
+server_stop () {
+    kill "$SERVER_PID"
+    wait "$SERVER_PID" 2>/dev/null || true
+    SERVER_PID=
+}
+
+# bin/bench key=value output, and the peak server memory, as "<scenario> <metric> <value>" lines
+run () {
+    scenario=$1; shift
+
+    server_start
+
+    "$BIN/bench" -q -M -D "$DURATION" "$@" > "$DIR/bench.out"
+
+    awk -v scenario="$scenario" -F= '
+        $1 ~ /^(requests_per_sec|bytes_per_sec|latency_p50_ms|latency_p99_ms)$/ { print scenario, $1, $2 }
+        $1 ~ /^(connect_errors|request_errors|status_1xx|status_3xx|status_4xx|status_5xx|status_other)$/ { errors += $2 }
+        $1 == "idle" && $2 > 0 { print scenario, "idle", $2 }
+        END { print scenario, "errors", errors + 0 }
+    ' "$DIR/bench.out"
+
+    awk -v scenario="$scenario" '
+        $1 == "VmHWM:" { print scenario, "rss_kb", $2 }
+    ' "/proc/$SERVER_PID/status"
+
+    server_stop
+}
+
+scenario () {
+    case $1 in
+        small)
+            urls=
+            for i in $(seq 1 20); do
+                urls="$urls $URL/small$i.bin"
+            done
+
+            run small -c 64 $urls
+            ;;
+
+        large)          run large -c 4 "$URL/large.bin" ;;
+        pipeline)       run pipeline -c 16 -p 16 "$URL/small1.bin" ;;
+        idle)           run idle -c 16 -I "$IDLE" "$URL/small1.bin" ;;
+        upload)         run upload -c 16 -f "$DIR/upload.txt" ;;
+        dns-cached)     run dns-cached -c 16 -F 'name=cached.bench.test&type=A' "$URL/dns-query" ;;
+        dns-uncached)   run dns-uncached -c 16 -F 'name=uncached.bench.test&type=A' "$URL/dns-query" ;;
+
+        *)
+            echo "$0: unknown scenario: $1" >&2
+            exit 2
+            ;;
+    esac
+}
+
+for s in $SCENARIOS; do
+    scenario "$s"
+done > "$DIR/results"
+
+cat "$DIR/results"
+
+if [ -n "$RESULTS" ]; then
+    cp "$DIR/results" "$RESULTS"
+fi
+
+if [ -n "$UPDATE" ] || [ ! -e "$BASELINE" ]; then
+    cp "$DIR/results" "$BASELINE"
+
+    echo "$0: updated $BASELINE"
+    exit 0
+fi
+
+# compare each metric against the baseline, in the direction of a regression
+awk -v rate="$THRESHOLD_RATE" -v latency="$THRESHOLD_LATENCY" -v rss="$THRESHOLD_RSS" -v latency_min="$LATENCY_MIN" '
+    NR == FNR { baseline[$1 " " $2] = $3; next }
+
+    {
+        key = $1 " " $2
+        value = $3
+        base = baseline[key]
+        limit = ""
+
+        if ($2 == "errors") {
+            if (value > 0) {
+                printf "FAIL %s: %s errors\n", key, value
+                failed++
+            }
+            next
+        }
+
+        if (!(key in baseline) || base <= 0)
+            next
+
+        if ($2 ~ /_per_sec$/) {
+            change = (base - value) * 100 / base
+            limit = rate
+        } else if ($2 ~ /^latency_/ && value - base >= latency_min) {
+            change = (value - base) * 100 / base
+            limit = latency
+        } else if ($2 ~ /_kb$/) {
+            change = (value - base) * 100 / base
+            limit = rss
+        }
+
+        if (limit != "" && change > limit) {
+            printf "FAIL %s: %s vs baseline %s, %.1f%% worse (limit %s%%)\n", key, value, base, change, limit
+            failed++
+        }
+    }
+
+    END { exit failed ? 1 : 0 }
+' "$BASELINE" "$DIR/results"
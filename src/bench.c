@@ -0,0 +1,1030 @@
+#include "client/client.h"
+#include "common/daemon.h"
+#include "common/event.h"
+#include "common/log.h"
+#include "common/url.h"
+#include "common/util.h"
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Defaults */
+#define BENCH_CONNECTIONS 10
+#define BENCH_DURATION 10
+
+/* Wait before reconnecting after a failed connect, in microseconds */
+#define BENCH_RECONNECT 100000
+
+/* Maximum --pipeline depth */
+#define BENCH_PIPELINE_MAX 256
+
+/*
+ * HDR-style log-linear histogram of latencies in microseconds, with 2^BENCH_HISTOGRAM_BITS sub-buckets per power of
+ * two, for a relative error below 2^-(BENCH_HISTOGRAM_BITS - 1), covering all 32-bit values.
+ */
+#define BENCH_HISTOGRAM_BITS 6
+#define BENCH_HISTOGRAM_SUB (1u << BENCH_HISTOGRAM_BITS)
+#define BENCH_HISTOGRAM_HALF (BENCH_HISTOGRAM_SUB / 2)
+#define BENCH_HISTOGRAM_SIZE ((34 - BENCH_HISTOGRAM_BITS) * BENCH_HISTOGRAM_HALF)
+
+struct options {
+    unsigned connections;
+    unsigned workers;
+    unsigned duration;
+    unsigned requests;
+    unsigned rate;
+    unsigned pipeline;
+    unsigned idle;
+    const char *file;
+    const char *post;
+    bool machine;
+};
+
+enum opts {
+    OPT_START       = 255,
+};
+
+static const struct option long_options[] = {
+    { "help",           0,  NULL,   'h' },
+    { "quiet",          0,  NULL,   'q' },
+    { "verbose",        0,  NULL,   'v' },
+    { "debug",          0,  NULL,   'd' },
+
+    { "connections",    1,  NULL,   'c' },
+    { "workers",        1,  NULL,   'W' },
+    { "duration",       1,  NULL,   'D' },
+    { "requests",       1,  NULL,   'n' },
+    { "rate",           1,  NULL,   'R' },
+    { "pipeline",       1,  NULL,   'p' },
+    { "idle",           1,  NULL,   'I' },
+    { "file",           1,  NULL,   'f' },
+    { "post",           1,  NULL,   'F' },
+    { "machine",        0,  NULL,   'M' },
+    { }
+};
+
+void help (const char *argv0) {
+    printf(
+            "Usage: %s [options] <url> [<url>] [...]\n"
+            "\n"
+            "   -h --help               Display this text\n"
+            "   -q --quiet              Less output\n"
+            "   -v --verbose            More output\n"
+            "   -d --debug              Debug output\n"
+            "\n"
+            "   -c --connections=N      Number of concurrent HTTP/1.1 keep-alive connections\n"
+            "   -W --workers=N          Run the connections across N worker processes, pinned to separate CPUs\n"
+            "   -D --duration=S         Run for S seconds\n"
+            "   -n --requests=N         Run for a total of N requests, rather than a duration\n"
+            "   -R --rate=N             Send a constant total of N requests per second, correcting for coordinated omission\n"
+            "   -p --pipeline=N         Pipeline GET requests on each connection in batches of N\n"
+            "   -I --idle=N             Hold open N additional idle connections for the duration of the run\n"
+            "   -f --file=path          Replay \"METHOD URL [body]\" lines from file, in order, with PUT uploading the file at body\n"
+            "   -F --post=form-data     POST form data to each URL, rather than GET\n"
+            "   -M --machine            Report the results as key=value lines\n"
+            "\n"
+            "Examples:\n"
+            "\n"
+            "   %s -c 100 -D 30 http://localhost:8080/\n"
+            "   %s -c 100 -W 4 -R 20000 http://localhost:8080/index.html\n"
+            "   %s -c 10 -n 100000 -f requests.txt\n"
+            "   %s -c 10 -p 16 -I 10000 http://localhost:8080/index.html\n"
+            "\n"
+    , argv0, argv0, argv0, argv0, argv0);
+}
+
+struct bench_request {
+    const char *method;
+
+    /* Parsed from a copy of the url string, not moved along with the request */
+    char *buf;
+    struct url url;
+
+    /* POST body, or NULL */
+    const char *body;
+
+    /* PUT file, or NULL */
+    const char *file;
+};
+
+/*
+ * Results from each worker, in shared memory.
+ */
+struct bench_stats {
+    uint64_t requests;
+
+    /* Responses by status class, 1xx-5xx, and others */
+    uint64_t status[6];
+
+    /* Failures to connect, and requests failing without any response */
+    uint64_t connect_errors, request_errors;
+
+    /* Connections opened, and idle connections held open */
+    uint64_t connects, idle;
+
+    /* Response body bytes */
+    uint64_t bytes;
+
+    /* Time spent sending requests, once all idle connections were opened, in microseconds */
+    uint64_t usec;
+
+    uint64_t histogram[BENCH_HISTOGRAM_SIZE];
+};
+
+struct bench {
+    const struct options *options;
+
+    struct bench_request *requests;
+    unsigned count, size;
+
+    /* Per-worker results */
+    struct bench_stats *stats;
+    unsigned workers;
+};
+
+/*
+ * Per-process state for one worker.
+ */
+struct bench_worker {
+    const struct bench *bench;
+
+    struct event_main *event_main;
+    struct bench_stats *stats;
+
+    /* Connections run by this worker, idle connections, and requests sent */
+    unsigned connections, idle;
+    uint64_t sent;
+
+    /* Total requests for this worker, or 0 to run until end */
+    uint64_t quota;
+
+    struct timeval start, end;
+
+    /* Interval between requests per connection with --rate, or zero */
+    struct timeval interval;
+
+    /* Idle connections still opening, before starting the connections sending requests */
+    unsigned opening;
+    struct bench_conn *conns;
+
+    /* Connections still sending requests, and the idle connections to wake up once they are all done */
+    unsigned active;
+    bool finished;
+    struct bench_conn *idle_conns;
+};
+
+struct bench_conn {
+    struct bench_worker *worker;
+
+    unsigned index;
+
+    /* Sleeping idle connection */
+    struct event *event;
+};
+
+static unsigned bench_histogram_index (uint32_t value)
+{
+    unsigned shift;
+
+    if (value < BENCH_HISTOGRAM_SUB)
+        return value;
+
+    shift = (31 - __builtin_clz(value)) - (BENCH_HISTOGRAM_BITS - 1);
+
+    return shift * BENCH_HISTOGRAM_HALF + (value >> shift);
+}
+
+/*
+ * Highest value equivalent to the given histogram index.
+ */
+static uint64_t bench_histogram_value (unsigned index)
+{
+    unsigned shift;
+
+    if (index < BENCH_HISTOGRAM_SUB)
+        return index;
+
+    shift = index / BENCH_HISTOGRAM_HALF - 1;
+
+    return ((uint64_t) (index - shift * BENCH_HISTOGRAM_HALF) << shift) + (1u << shift) - 1;
+}
+
+static void bench_histogram_record (uint64_t *histogram, uint64_t value)
+{
+    histogram[bench_histogram_index(value > UINT32_MAX ? UINT32_MAX : value)]++;
+}
+
+/*
+ * Parse the url for the request.
+ *
+ * Returns 1 on invalid url.
+ */
+static int bench_request_url (struct bench_request *request, const char *url)
+{
+    if (!(request->buf = strdup(url))) {
+        log_perror("strdup");
+        return -1;
+    }
+
+    request->url = (struct url) { };
+
+    if (url_parse(&request->url, request->buf) || !request->url.host || !*request->url.host)
+        return 1;
+
+    // handle empty path
+    if (!request->url.path)
+        request->url.path = "";
+
+    return 0;
+}
+
+/*
+ * Load "METHOD URL [body]" lines, with any body extending to the end of the line.
+ */
+int bench_load (struct bench *bench, const char *path)
+{
+    char line[4096];
+    unsigned lineno = 0;
+    FILE *file;
+    int err = 0;
+
+    if (!(file = fopen(path, "r"))) {
+        log_perror("fopen %s", path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        struct bench_request *request;
+        char *tokens, *method, *url, *body;
+
+        lineno++;
+
+        if (!(method = strtok_r(line, " \t\r\n", &tokens)) || *method == '#')
+            continue;
+
+        if (!(url = strtok_r(NULL, " \t\r\n", &tokens))) {
+            log_error("%s:%u: missing url", path, lineno);
+            err = 1;
+            break;
+        }
+
+        if (strcasecmp(method, "GET") && strcasecmp(method, "POST") && strcasecmp(method, "PUT")) {
+            log_error("%s:%u: unsupported method: %s", path, lineno, method);
+            err = 1;
+            break;
+        }
+
+        // rest of line
+        if ((body = strtok_r(NULL, "\r\n", &tokens)))
+            body += strspn(body, " \t");
+
+        if (bench->count >= bench->size) {
+            unsigned size = bench->size ? bench->size * 2 : 64;
+            struct bench_request *requests;
+
+            if (!(requests = realloc(bench->requests, size * sizeof(*requests)))) {
+                log_perror("realloc");
+                err = -1;
+                break;
+            }
+
+            bench->requests = requests;
+            bench->size = size;
+        }
+
+        request = &bench->requests[bench->count];
+
+        request->method = !strcasecmp(method, "GET") ? "GET" : !strcasecmp(method, "POST") ? "POST" : "PUT";
+        request->body = NULL;
+        request->file = NULL;
+
+        if ((err = bench_request_url(request, url))) {
+            log_error("%s:%u: invalid url: %s", path, lineno, url);
+            break;
+        }
+
+        if (!strcmp(request->method, "PUT") && !body) {
+            log_error("%s:%u: missing PUT file", path, lineno);
+            err = 1;
+            break;
+
+        } else if (!strcmp(request->method, "PUT") && !(request->file = strdup(body))) {
+            log_perror("strdup");
+            err = -1;
+            break;
+
+        } else if (!strcmp(request->method, "POST") && !(request->body = strdup(body ? body : ""))) {
+            log_perror("strdup");
+            err = -1;
+            break;
+        }
+
+        bench->count++;
+    }
+
+    if (!err && ferror(file)) {
+        log_perror("fgets %s", path);
+        err = -1;
+    }
+
+    fclose(file);
+
+    return err;
+}
+
+int bench_add (struct bench *bench, const char *url, const char *post)
+{
+    struct bench_request *requests;
+    int err;
+
+    if (!(requests = realloc(bench->requests, (bench->count + 1) * sizeof(*requests)))) {
+        log_perror("realloc");
+        return -1;
+    }
+
+    bench->requests = requests;
+    bench->size = bench->count + 1;
+
+    struct bench_request *request = &bench->requests[bench->count];
+
+    request->method = post ? "POST" : "GET";
+    request->body = post;
+    request->file = NULL;
+
+    if ((err = bench_request_url(request, url))) {
+        log_error("invalid url: %s", url);
+        return err;
+    }
+
+    bench->count++;
+
+    return 0;
+}
+
+static bool bench_done (struct bench_worker *worker)
+{
+    struct timeval now;
+
+    if (worker->quota)
+        return worker->sent >= worker->quota;
+
+    if (timestamp_clock(&now))
+        return true;
+
+    return timercmp(&now, &worker->end, >=);
+}
+
+/*
+ * Upload the file for a PUT request.
+ */
+static int bench_put (struct client *client, const struct bench_request *request)
+{
+    FILE *file;
+    int err;
+
+    if (!(file = fopen(request->file, "r"))) {
+        log_perror("fopen %s", request->file);
+        return -1;
+    }
+
+    err = client_put(client, &request->url, file);
+
+    fclose(file);
+
+    return err;
+}
+
+/*
+ * Send the next request, or --pipeline batch of GET requests, returning the number of requests sent in *countp.
+ *
+ * Returns <0 on error, >0 on connect error, or the HTTP response status, with the status of each request in statuses.
+ */
+static int bench_send (struct bench_worker *worker, struct client *client, unsigned *statuses, unsigned *countp)
+{
+    const struct bench *bench = worker->bench;
+    unsigned count = bench->options->pipeline;
+    int err;
+
+    if (count) {
+        const struct url *urls[BENCH_PIPELINE_MAX];
+
+        if (worker->quota && count > worker->quota - worker->sent)
+            count = worker->quota - worker->sent;
+
+        for (unsigned i = 0; i < count; i++)
+            urls[i] = &bench->requests[(worker->sent + i) % bench->count].url;
+
+        worker->sent += count;
+        *countp = count;
+
+        if ((err = client_get_pipeline(client, urls, count, count, statuses)))
+            return err;
+
+        return statuses[0];
+    }
+
+    const struct bench_request *request = &bench->requests[worker->sent++ % bench->count];
+
+    if (request->file) {
+        err = bench_put(client, request);
+    } else if (request->body) {
+        err = client_post(client, &request->url, request->body, "application/x-www-form-urlencoded");
+    } else {
+        err = client_get(client, &request->url);
+    }
+
+    statuses[0] = err;
+    *countp = 1;
+
+    return err;
+}
+
+/*
+ * Wake up the idle connections once all connections sending requests are done.
+ */
+static void bench_finish (struct bench_worker *worker)
+{
+    struct timeval end;
+
+    if (--worker->active)
+        return;
+
+    worker->finished = true;
+
+    if (!timestamp_clock(&end)) {
+        timersub(&end, &worker->start, &end);
+
+        worker->stats->usec = end.tv_sec * 1000000 + end.tv_usec;
+    }
+
+    for (unsigned i = 0; i < worker->idle; i++) {
+        if (worker->idle_conns[i].event && event_cancel(worker->idle_conns[i].event) < 0)
+            log_warning("event_cancel");
+    }
+}
+
+/*
+ * Send requests on one keep-alive connection until done.
+ *
+ * With --rate, each request is scheduled at a fixed interval, and its latency is measured from the scheduled time rather
+ * than the actual time sent, so that any queueing behind slow responses counts towards the latency.
+ */
+void bench_conn (void *ctx)
+{
+    struct bench_conn *conn = ctx;
+    struct bench_worker *worker = conn->worker;
+    struct bench_stats *stats = worker->stats;
+    struct client *client;
+    struct client_stats client_stats;
+    struct event *event = NULL;
+    struct timeval next = worker->start;
+    struct timeval reconnect = { 0, BENCH_RECONNECT };
+    unsigned connect_errors = 0;
+    int err;
+
+    if (client_create(worker->event_main, &client)) {
+        log_fatal("client_create");
+        bench_finish(worker);
+        return;
+    }
+
+    if (client_set_request_version(client, HTTP_11) || client_set_response_file(client, NULL, false)) {
+        log_fatal("client_set_*");
+        goto error;
+    }
+
+    // for sleeping
+    if (event_create(worker->event_main, &event, -1)) {
+        log_fatal("event_create");
+        goto error;
+    }
+
+    if (timerisset(&worker->interval)) {
+        // spread out the connections across the interval
+        uint64_t usec = ((uint64_t) worker->interval.tv_sec * 1000000 + worker->interval.tv_usec) * conn->index / worker->connections;
+        struct timeval offset = { usec / 1000000, usec % 1000000 };
+
+        timeradd(&next, &offset, &next);
+    }
+
+    while (!bench_done(worker)) {
+        unsigned statuses[BENCH_PIPELINE_MAX], count;
+        struct timeval start, end, now, timeout;
+
+        if (timerisset(&worker->interval)) {
+            start = next;
+            timeradd(&next, &worker->interval, &next);
+
+            if (timestamp_clock(&now)) {
+                goto error;
+
+            } else if (!timeout_between(&timeout, &now, &start) && event_sleep(event, &timeout)) {
+                log_error("event_sleep");
+                goto error;
+            }
+
+        } else if (timestamp_clock(&start)) {
+            goto error;
+        }
+
+        err = bench_send(worker, client, statuses, &count);
+
+        if (timestamp_clock(&end))
+            goto error;
+
+        client_get_stats(client, &client_stats);
+
+        if (client_stats.connect_errors > connect_errors) {
+            connect_errors = client_stats.connect_errors;
+            stats->connect_errors++;
+
+            if (event_sleep(event, &reconnect)) {
+                log_error("event_sleep");
+                goto error;
+            }
+
+            continue;
+
+        } else if (err < 100) {
+            stats->request_errors += count;
+            continue;
+        }
+
+        stats->requests += count;
+
+        timersub(&end, &start, &end);
+
+        // each pipelined response counts the latency of the whole batch
+        for (unsigned i = 0; i < count; i++) {
+            stats->status[statuses[i] < 600 ? statuses[i] / 100 : 0]++;
+
+            bench_histogram_record(stats->histogram, end.tv_sec * 1000000 + end.tv_usec);
+        }
+    }
+
+error:
+    client_get_stats(client, &client_stats);
+
+    stats->connects += client_stats.connects;
+    stats->bytes += client_stats.bytes;
+
+    if (event)
+        event_destroy(event);
+
+    client_destroy(client);
+
+    bench_finish(worker);
+}
+
+/*
+ * Start the connections sending requests.
+ */
+static int bench_start (struct bench_worker *worker)
+{
+    const struct options *options = worker->bench->options;
+
+    if (timestamp_clock(&worker->start))
+        return -1;
+
+    worker->end = worker->start;
+    worker->end.tv_sec += options->duration;
+
+    for (unsigned i = 0; i < worker->connections; i++) {
+        worker->conns[i] = (struct bench_conn) {
+            .worker = worker,
+            .index  = i,
+        };
+
+        if (event_start(worker->event_main, bench_conn, &worker->conns[i])) {
+            log_fatal("event_start");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Start sending requests once the last idle connection is opened, so that the connects do not count towards the
+ * measured latency.
+ */
+static void bench_opened (struct bench_worker *worker)
+{
+    if (--worker->opening)
+        return;
+
+    if (bench_start(worker))
+        log_fatal("bench_start");
+}
+
+/*
+ * Hold open one idle connection without sending any requests, until all connections sending requests are done.
+ */
+void bench_idle (void *ctx)
+{
+    struct bench_conn *conn = ctx;
+    struct bench_worker *worker = conn->worker;
+    struct bench_stats *stats = worker->stats;
+    struct client *client;
+    struct client_stats client_stats;
+    struct event *event = NULL;
+    struct timeval timeout = { worker->quota ? 86400 : worker->bench->options->duration + 60 };
+
+    if (client_create(worker->event_main, &client)) {
+        log_fatal("client_create");
+        return;
+    }
+
+    if (event_create(worker->event_main, &event, -1)) {
+        log_fatal("event_create");
+        goto error;
+    }
+
+    if (client_open(client, &worker->bench->requests[0].url)) {
+        stats->connect_errors++;
+        bench_opened(worker);
+        goto error;
+    }
+
+    stats->idle++;
+    bench_opened(worker);
+
+    if (!worker->finished) {
+        conn->event = event;
+
+        if (event_sleep(event, &timeout))
+            log_error("event_sleep");
+
+        conn->event = NULL;
+    }
+
+error:
+    client_get_stats(client, &client_stats);
+
+    stats->connects += client_stats.connects;
+
+    if (event)
+        event_destroy(event);
+
+    client_destroy(client);
+}
+
+/*
+ * Run this worker's share of the connections and requests.
+ */
+int bench_worker (void *ctx, unsigned index)
+{
+    struct bench *bench = ctx;
+    const struct options *options = bench->options;
+    struct bench_worker worker = {
+        .bench          = bench,
+        .stats          = &bench->stats[index],
+        .connections    = options->connections / bench->workers + (index < options->connections % bench->workers),
+        .idle           = options->idle / bench->workers + (index < options->idle % bench->workers),
+        .quota          = options->requests / bench->workers + (index < options->requests % bench->workers),
+    };
+    struct bench_conn *conns;
+    int err;
+
+    if (!worker.connections || (options->requests && !worker.quota))
+        return 0;
+
+    if ((err = event_main_create(&worker.event_main))) {
+        log_fatal("event_main_create");
+        return 1;
+    }
+
+    if (!(conns = calloc(worker.connections + worker.idle, sizeof(*conns)))) {
+        log_perror("calloc");
+        return 1;
+    }
+
+    if (options->rate) {
+        // each connection's share of the total rate
+        uint64_t interval = (uint64_t) 1000000 * options->connections / options->rate;
+
+        worker.interval.tv_sec = interval / 1000000;
+        worker.interval.tv_usec = interval % 1000000;
+    }
+
+    worker.conns = conns;
+    worker.idle_conns = conns + worker.connections;
+    worker.opening = worker.idle;
+    worker.active = worker.connections;
+
+    // the idle connections are opened first, and wait for the others to finish
+    for (unsigned i = 0; i < worker.idle; i++) {
+        worker.idle_conns[i] = (struct bench_conn) {
+            .worker = &worker,
+            .index  = i,
+        };
+
+        if ((err = event_start(worker.event_main, bench_idle, &worker.idle_conns[i]))) {
+            log_fatal("event_start");
+            return 1;
+        }
+    }
+
+    if (!worker.idle && bench_start(&worker))
+        return 1;
+
+    if ((err = event_main_run(worker.event_main))) {
+        log_fatal("event_main_run");
+        return err;
+    }
+
+    free(conns);
+
+    return 0;
+}
+
+static void bench_format_bytes (char *buf, size_t size, double bytes)
+{
+    const char *units[] = { "B", "KB", "MB", "GB", "TB", NULL };
+    const char **unit = units;
+
+    while (bytes >= 1024 && unit[1]) {
+        bytes /= 1024;
+        unit++;
+    }
+
+    snprintf(buf, size, "%.2f%s", bytes, *unit);
+}
+
+void bench_report (const struct bench *bench, const struct timeval *elapsed)
+{
+    const struct options *options = bench->options;
+    struct bench_stats total = { };
+    uint64_t responses = 0;
+    double seconds = elapsed->tv_sec + elapsed->tv_usec / 1000000.0;
+    char bytes[32], rate[32];
+
+    for (unsigned i = 0; i < bench->workers; i++) {
+        const struct bench_stats *stats = &bench->stats[i];
+
+        total.requests += stats->requests;
+        total.connect_errors += stats->connect_errors;
+        total.request_errors += stats->request_errors;
+        total.connects += stats->connects;
+        total.idle += stats->idle;
+        total.bytes += stats->bytes;
+
+        if (stats->usec > total.usec)
+            total.usec = stats->usec;
+
+        for (unsigned j = 0; j < 6; j++) {
+            total.status[j] += stats->status[j];
+        }
+
+        for (unsigned j = 0; j < BENCH_HISTOGRAM_SIZE; j++) {
+            total.histogram[j] += stats->histogram[j];
+        }
+    }
+
+    for (unsigned j = 0; j < BENCH_HISTOGRAM_SIZE; j++) {
+        responses += total.histogram[j];
+    }
+
+    // excluding the time spent opening idle connections
+    if (options->idle && total.usec)
+        seconds = total.usec / 1000000.0;
+
+    // latency percentiles, in microseconds
+    const double percentiles[] = { 50, 75, 90, 99, 99.9, 99.99, 100, 0 };
+    uint64_t latencies[sizeof(percentiles) / sizeof(*percentiles)] = { };
+    uint64_t count = 0;
+    unsigned j = 0;
+
+    for (unsigned i = 0; percentiles[i] && responses; i++) {
+        uint64_t rank = (responses * percentiles[i] + 99) / 100;
+
+        if (!rank)
+            rank = 1;
+
+        for (; j < BENCH_HISTOGRAM_SIZE && count + total.histogram[j] < rank; j++) {
+            count += total.histogram[j];
+        }
+
+        latencies[i] = bench_histogram_value(j);
+    }
+
+    if (options->machine) {
+        printf("connections=%u\nworkers=%u\nseconds=%.3f\n", options->connections, bench->workers, seconds);
+        printf("requests=%llu\nrequests_per_sec=%.2f\n", (unsigned long long) total.requests, seconds > 0 ? total.requests / seconds : 0.0);
+        printf("bytes=%llu\nbytes_per_sec=%.0f\n", (unsigned long long) total.bytes, seconds > 0 ? total.bytes / seconds : 0.0);
+
+        for (unsigned i = 1; i < 6; i++)
+            printf("status_%uxx=%llu\n", i, (unsigned long long) total.status[i]);
+
+        printf("status_other=%llu\n", (unsigned long long) total.status[0]);
+        printf("connect_errors=%llu\nrequest_errors=%llu\n", (unsigned long long) total.connect_errors, (unsigned long long) total.request_errors);
+        printf("connects=%llu\nidle=%llu\n", (unsigned long long) total.connects, (unsigned long long) total.idle);
+
+        for (unsigned i = 0; percentiles[i] && responses; i++)
+            printf("latency_p%g_ms=%.3f\n", percentiles[i], latencies[i] / 1000.0);
+
+        return;
+    }
+
+    bench_format_bytes(bytes, sizeof(bytes), total.bytes);
+    bench_format_bytes(rate, sizeof(rate), seconds > 0 ? total.bytes / seconds : 0);
+
+    printf("%u connections, %u workers, %u requests\n", options->connections, bench->workers, bench->count);
+    printf("%llu requests in %.2fs, %s body bytes read\n", (unsigned long long) total.requests, seconds, bytes);
+    printf("Requests/sec: %.2f\n", seconds > 0 ? total.requests / seconds : 0.0);
+    printf("Transfer/sec: %s\n", rate);
+    printf("Responses: 1xx=%llu 2xx=%llu 3xx=%llu 4xx=%llu 5xx=%llu other=%llu\n",
+        (unsigned long long) total.status[1], (unsigned long long) total.status[2], (unsigned long long) total.status[3],
+        (unsigned long long) total.status[4], (unsigned long long) total.status[5], (unsigned long long) total.status[0]
+    );
+    printf("Errors: connect=%llu request=%llu\n", (unsigned long long) total.connect_errors, (unsigned long long) total.request_errors);
+
+    if (options->idle) {
+        printf("Connections: %llu opened, %llu idle\n", (unsigned long long) total.connects, (unsigned long long) total.idle);
+    } else {
+        printf("Connections: %llu opened\n", (unsigned long long) total.connects);
+    }
+
+    if (!responses)
+        return;
+
+    if (options->pipeline) {
+        printf("Latency, for each batch of %u pipelined requests:\n", options->pipeline);
+    } else if (options->rate) {
+        printf("Latency, from the scheduled send time at %u requests/sec:\n", options->rate);
+    } else {
+        printf("Latency, not corrected for coordinated omission without --rate:\n");
+    }
+
+    for (unsigned i = 0; percentiles[i]; i++) {
+        printf("  %8.3f%%  %10.3fms\n", percentiles[i], latencies[i] / 1000.0);
+    }
+}
+
+int main (int argc, char **argv)
+{
+    int opt;
+    enum log_level log_level = LOG_LEVEL;
+    int err = 0;
+
+    struct options options = {
+        .connections    = BENCH_CONNECTIONS,
+        .duration       = BENCH_DURATION,
+    };
+    struct bench bench = {
+        .options        = &options,
+    };
+    struct timeval start, end;
+
+    while ((opt = getopt_long(argc, argv, "hqvdc:W:D:n:R:p:I:f:F:M", long_options, NULL)) >= 0) {
+        switch (opt) {
+            case 'h':
+                help(argv[0]);
+                return 0;
+
+            case 'q':
+                log_level = LOG_ERROR;
+                break;
+
+            case 'v':
+                log_level = LOG_INFO;
+                break;
+
+            case 'd':
+                log_level = LOG_DEBUG;
+                break;
+
+            case 'c':
+                if (str_uint(optarg, &options.connections) || !options.connections) {
+                    log_fatal("invalid --connections/c: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'W':
+                if (str_uint(optarg, &options.workers)) {
+                    log_fatal("invalid --workers/W: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'D':
+                if (str_uint(optarg, &options.duration)) {
+                    log_fatal("invalid --duration/D: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'n':
+                if (str_uint(optarg, &options.requests)) {
+                    log_fatal("invalid --requests/n: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'R':
+                if (str_uint(optarg, &options.rate)) {
+                    log_fatal("invalid --rate/R: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'p':
+                if (str_uint(optarg, &options.pipeline) || options.pipeline > BENCH_PIPELINE_MAX) {
+                    log_fatal("invalid --pipeline/p: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'I':
+                if (str_uint(optarg, &options.idle)) {
+                    log_fatal("invalid --idle/I: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'f':
+                options.file = optarg;
+                break;
+
+            case 'F':
+                options.post = optarg;
+                break;
+
+            case 'M':
+                options.machine = true;
+                break;
+
+            default:
+                help(argv[0]);
+                return 1;
+        }
+    }
+
+    // apply
+    log_set_level(log_level);
+
+    if (options.file && (err = bench_load(&bench, options.file))) {
+        log_fatal("invalid --file: %s", options.file);
+        return 1;
+    }
+
+    while (optind < argc) {
+        if ((err = bench_add(&bench, argv[optind++], options.post))) {
+            return 1;
+        }
+    }
+
+    if (!bench.count) {
+        help(argv[0]);
+        return 1;
+    }
+
+    for (unsigned i = 0; i < bench.count && options.pipeline; i++) {
+        if (strcmp(bench.requests[i].method, "GET")) {
+            log_fatal("--pipeline only supports GET requests");
+            return 1;
+        }
+    }
+
+    if (options.pipeline && options.rate) {
+        log_fatal("--pipeline is not supported with --rate");
+        return 1;
+    }
+
+    bench.workers = options.workers ? options.workers : 1;
+
+    // shared with the worker processes
+    if ((bench.stats = mmap(NULL, bench.workers * sizeof(*bench.stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        log_perror("mmap");
+        return 1;
+    }
+
+    if (timestamp_clock(&start))
+        return 1;
+
+    if (options.workers) {
+        if ((err = daemon_workers(options.workers, bench_worker, &bench))) {
+            log_fatal("daemon_workers");
+        }
+    } else {
+        err = bench_worker(&bench, 0);
+    }
+
+    if (timestamp_clock(&end))
+        return 1;
+
+    timersub(&end, &start, &end);
+
+    bench_report(&bench, &end);
+
+    return err ? 1 : 0;
+}
@@ -1,10 +1,15 @@
 #include "client/client.h"
+#include "dns.h"
 #include "common/log.h"
 #include "common/url.h"
+#include "common/util.h"
 
 #include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 struct options {
@@ -14,9 +19,14 @@ struct options {
     const char *iam;
     enum http_version http_version;
     bool parallel;
+    unsigned pool_host;
+    unsigned pipeline;
+    const char *resolver;
     
     // state
     struct event_main *event_main;
+    struct client_pool *client_pool;
+    struct dns *dns;
 #ifdef WITH_SSL
     struct ssl_main *ssl_main;
 #endif
@@ -25,6 +35,8 @@ struct options {
 enum opts {
     OPT_START       = 255,
     OPT_HTTP_11,
+    OPT_POOL,
+    OPT_PIPELINE,
 };
 
 static const struct option long_options[] = {
@@ -36,6 +48,9 @@ static const struct option long_options[] = {
     { "post",       1,  NULL,       'F' },
     { "http-11",    0,  NULL,       OPT_HTTP_11     },
     { "parallel",   0,  NULL,       'j' },
+    { "pool",       1,  NULL,       OPT_POOL        },
+    { "pipeline",   1,  NULL,       OPT_PIPELINE    },
+    { "resolver",   1,  NULL,       'R' },
     { }
 };
 
@@ -55,6 +70,9 @@ void help (const char *argv0) {
             "   -I --iam=username       Send Iam header\n"
             "      --http-11            Send HTTP/1.1 requests\n"
             "   -j --parallel           Perform requests in parallel\n"
+            "      --pool=N             Keep up to N idle HTTP/1.1 connections per host for re-use, or 0 to disable\n"
+            "      --pipeline=N         Pipeline up to N HTTP/1.1 GET requests per connection\n"
+            "   -R --resolver=host,...  Resolve names using the given DNS resolvers, without blocking other requests\n"
             "\n"
             "Examples:\n"
             "\n"
@@ -74,15 +92,94 @@ void help (const char *argv0) {
             "   Note that this is of fairly limited use, as the responses will be\n"
             "   intermixed arbitrarily. No inter/intra -request ordering is guaranteed.\n"
             "\n"
-    , argv0, argv0, argv0, argv0, argv0, argv0, argv0);
+            "   %s -j -R 8.8.8.8 http://example.com/foo http://example.org/bar\n"
+            "\n"
+            "   Names are otherwise resolved using getaddrinfo(), which blocks all requests.\n"
+            "\n"
+            "Re-use of HTTP/1.1 connections across requests to the same host:\n"
+            "\n"
+            "   %s --http-11 http://example.com/foo http://example.com/bar\n"
+            "\n"
+            "Use of HTTP/1.1 pipelining:\n"
+            "\n"
+            "   %s --http-11 --pipeline=8 http://example.com/foo http://example.com/bar\n"
+            "\n"
+    , argv0, argv0, argv0, argv0, argv0, argv0, argv0, argv0, argv0, argv0);
 }
 
 struct client_task {
     const struct options *options;
 
     const char *arg;
+
+    /* All URLs for --pipeline */
+    char **args;
+    unsigned count;
 };
 
+/*
+ * Apply the options to a new client.
+ */
+int client_setup (struct client *client, const struct options *options)
+{
+#ifdef WITH_SSL
+    if (client_set_ssl(client, options->ssl_main)) {
+        log_fatal("failed to initialize client ssl");
+        return -1;
+    }
+#endif
+
+    if (client_set_request_version(client, options->http_version)) {
+        log_fatal("failed to set client request http version");
+        return -1;
+    }
+
+    if (options->client_pool && client_set_pool(client, options->client_pool)) {
+        log_fatal("failed to set client pool");
+        return -1;
+    }
+
+    if (options->dns && client_set_resolver(client, options->dns)) {
+        log_fatal("failed to set client resolver");
+        return -1;
+    }
+
+    if (options->iam && client_add_header(client, "Iam", options->iam)) {
+        log_fatal("failed to set client Iam header");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Log the response status, returning 0 for 2xx responses.
+ */
+int client_status (int status)
+{
+    if (status >= 200 && status < 300) {
+        log_debug("Server returned 2xx response: %d", status);
+
+        return 0;
+
+    } else if (status >= 300 && status < 400) {
+        log_info("Server returned 3xx response: %d", status);
+
+    } else if (status >= 400 && status < 500) {
+        log_error("Server returned 4xx response: %d", status);
+
+    } else if (status >= 500 && status < 600) {
+        log_warning("Server returned 5xx response: %d", status);
+
+    } else {
+        log_warning("Server returned unknown response type: %d", status);
+
+        return -1;
+    }
+
+    return status;
+}
+
 void client (void *ctx)
 {
     struct client_task *task = ctx;
@@ -107,22 +204,8 @@ void client (void *ctx)
         log_fatal("failed to initialize client");
         return 2;
     }
-#ifdef WITH_SSL
-    if (client_set_ssl(client, options->ssl_main)) {
-        log_fatal("failed to initialize client ssl");
-        err = 2;
-        goto error;
-    }
-#endif
 
-    if (client_set_request_version(client, options->http_version)) {
-        log_fatal("failed to set client request http version");
-        err = 2;
-        goto error;
-    }
-
-    if (options->iam && client_add_header(client, "Iam", options->iam)) {
-        log_fatal("failed to set client Iam header");
+    if (client_setup(client, options)) {
         err = 2;
         goto error;
     }
@@ -192,30 +275,85 @@ void client (void *ctx)
         }
     }
 
-    if (err >= 200 && err < 300) {
-        log_debug("Server errurned 2xx response: %d", err);
+    err = client_status(err);
+
+error:
+    client_destroy(client);
+
+    return err;
+}
+
+static bool client_url_str_eq (const char *a, const char *b)
+{
+    return strcmp(a ? a : "", b ? b : "") == 0;
+}
+
+/*
+ * GET each of the task's URLs, pipelining consecutive requests for the same scheme://host:port.
+ */
+void client_pipeline (void *ctx)
+{
+    struct client_task *task = ctx;
+    const struct options *options = task->options;
+    struct urlbuf *urlbufs = NULL;
+    const struct url **urls = NULL;
+    unsigned *statuses = NULL;
+    struct client *client = NULL;
+    int err = 0;
+
+    if (!(urlbufs = calloc(task->count, sizeof(*urlbufs))) || !(urls = calloc(task->count, sizeof(*urls))) || !(statuses = calloc(task->count, sizeof(*statuses)))) {
+        log_perror("calloc");
+        goto error;
+    }
+
+    for (unsigned i = 0; i < task->count; i++) {
+        if (urlbuf_parse(&urlbufs[i], task->args[i])) {
+            log_fatal("invalid url: %s", task->args[i]);
+            goto error;
+        }
+
+        // handle empty path
+        if (!urlbufs[i].url.path) {
+            urlbufs[i].url.path = "";
+        }
+
+        urls[i] = &urlbufs[i].url;
+    }
 
-        err = 0;
+    if (client_create(options->event_main, &client)) {
+        log_fatal("failed to initialize client");
+        goto error;
+    }
 
-    } else if (err >= 300 && err < 400) {
-        log_info("Server errurned 3xx response: %d", err);
+    if (client_setup(client, options) || client_set_response_file(client, stdout, false)) {
+        goto error;
+    }
 
-    } else if (err >= 400 && err < 500) {
-        log_error("Server errurned 4xx response: %d", err);
+    for (unsigned i = 0, n; i < task->count; i += n) {
+        for (n = 1; i + n < task->count; n++) {
+            const struct url *a = urls[i], *b = urls[i + n];
 
-    } else if (err >= 500 && err < 600) {
-        log_warning("Server errurned 5xx response: %d", err);
+            if (!client_url_str_eq(a->scheme, b->scheme) || !client_url_str_eq(a->host, b->host) || !client_url_str_eq(a->port, b->port))
+                break;
+        }
 
-    } else {
-        log_warning("Server errurned unknown response type: %d", err);
+        if ((err = client_get_pipeline(client, urls + i, n, options->pipeline, statuses + i))) {
+            log_fatal("GET failed: %s", task->args[i]);
+            goto error;
+        }
 
-        err = -1;
+        for (unsigned j = i; j < i + n; j++) {
+            client_status(statuses[j]);
+        }
     }
 
 error:
-    client_destroy(client);
+    if (client)
+        client_destroy(client);
 
-    return err;
+    free(statuses);
+    free(urls);
+    free(urlbufs);
 }
 
 int main (int argc, char **argv)
@@ -231,9 +369,10 @@ int main (int argc, char **argv)
         .iam    = getlogin(),
 
         .http_version   = HTTP_10,
+        .pool_host      = CLIENT_POOL_HOST,
     };
 
-    while ((opt = getopt_long(argc, argv, "hqvdG:P:I:jF:", long_options, NULL)) >= 0) {
+    while ((opt = getopt_long(argc, argv, "hqvdG:P:I:jF:R:", long_options, NULL)) >= 0) {
         switch (opt) {
             case 'h':
                 help(argv[0]);
@@ -271,10 +410,28 @@ int main (int argc, char **argv)
                 options.parallel = true;
                 break;
 
+            case OPT_PIPELINE:
+                if (str_uint(optarg, &options.pipeline)) {
+                    log_fatal("invalid --pipeline: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_POOL:
+                if (str_uint(optarg, &options.pool_host)) {
+                    log_fatal("invalid --pool: %s", optarg);
+                    return 1;
+                }
+                break;
+
             case 'F':
                 options.post = optarg;
                 break;
 
+            case 'R':
+                options.resolver = optarg;
+                break;
+
             default:
                 help(argv[0]);
                 return 1;
@@ -298,6 +455,45 @@ int main (int argc, char **argv)
     }
 #endif
 
+    if (options.resolver && (err = dns_create(options.event_main, &options.dns, options.resolver))) {
+        log_fatal("dns_create: %s", options.resolver);
+        return 1;
+    }
+
+    if (options.pool_host) {
+        struct timeval idle_timeout = { CLIENT_POOL_IDLE, 0 };
+
+        if ((err = client_pool_create(&options.client_pool, options.pool_host, CLIENT_POOL_MAX, &idle_timeout))) {
+            log_fatal("client_pool_create");
+            return 1;
+        }
+    }
+
+    if (options.pipeline && (options.http_version != HTTP_11 || options.get || options.put || options.post)) {
+        log_fatal("--pipeline requires --http-11, and does not support --get/--put/--post");
+        return 1;
+    }
+
+    // all URLs in a single task, which may still be running after event_start()
+    struct client_task pipeline_task = {
+        .options    = &options,
+        .args       = argv + optind,
+        .count      = argc - optind,
+    };
+
+    if (options.pipeline && optind < argc) {
+        optind = argc;
+
+        if (options.parallel) {
+            if ((err = event_start(options.event_main, client_pipeline, &pipeline_task))) {
+                log_fatal("event_start");
+                goto error;
+            }
+        } else {
+            client_pipeline(&pipeline_task);
+        }
+    }
+
     while (optind < argc && !err) {
         struct client_task task = {
             .options    = &options,
@@ -323,5 +519,16 @@ int main (int argc, char **argv)
     }
 
 error:
+    if (options.client_pool)
+        client_pool_destroy(options.client_pool);
+
+    if (options.dns)
+        dns_destroy(options.dns);
+
+#ifdef WITH_SSL
+    if (options.ssl_main)
+        ssl_main_destroy(options.ssl_main);
+#endif
+
     return err;
 }
@@ -1,16 +1,55 @@
 #include "client/client.h"
+#include "dns.h"
 
 #include "common/log.h"
 #include "common/http.h"
 #include "common/tcp.h"
 #include "common/sock.h"
+#include "common/util.h"
 
+#include <netdb.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/queue.h>
 
+/* Maximum length of a scheme://host:port pool key */
+#define CLIENT_POOL_KEY 512
+
+/*
+ * Idle connection in a pool.
+ */
+struct client_pool_conn {
+    char key[CLIENT_POOL_KEY];
+
+    /* Closed once idle past this time */
+    struct timeval expire;
+
+    /* Transport; either-or */
+    struct tcp *tcp;
+#ifdef WITH_SSL
+    struct ssl *ssl;
+#endif
+
+    struct http *http;
+
+    TAILQ_ENTRY(client_pool_conn) pool_conns;
+};
+
+struct client_pool {
+    unsigned host_max, max;
+    struct timeval idle_timeout;
+
+    /* Statistics */
+    unsigned hits, misses;
+
+    /* Idle connections, most recently used first */
+    TAILQ_HEAD(client_pool_conns, client_pool_conn) conns;
+    unsigned count;
+};
+
 struct client {
     /* Settings */
     struct event_main *event_main;
@@ -28,6 +67,9 @@ struct client {
     /* Send HTTP/1.1 requests */
     bool request_http11;
 
+    /* Idle timeout for plain connections, if set */
+    struct timeval timeout;
+
     /* Transport; either-or */
     struct tcp *tcp;
 #ifdef WITH_SSL
@@ -37,6 +79,45 @@ struct client {
     /* Protocol; NULL if not open. */
     struct http *http;
 
+    /* Shared idle connections, or NULL */
+    struct client_pool *pool;
+
+    /* Async resolver, or NULL for getaddrinfo() */
+    struct dns *dns;
+
+    /* Pool key of the open connection */
+    char pool_key[CLIENT_POOL_KEY];
+
+    /* The open connection was taken from the pool */
+    bool reused;
+
+    /* The open connection may be used for further requests */
+    bool persistent;
+
+    /* Statistics */
+    struct client_stats stats;
+
+    /* Streamed request and response, see client_stream_request() */
+    struct client_stream {
+        const struct url *url;
+
+        /* Host header given */
+        bool host;
+
+        /* Request body, and then response body, uses the chunked transfer-encoding */
+        bool chunked;
+
+        /* HEAD request, without any response body */
+        bool head;
+
+        /* Response body framing */
+        bool empty, has_length;
+        size_t remaining;
+
+        /* Close after response */
+        bool close;
+    } stream;
+
     /* Headers */
     TAILQ_HEAD(client_headers, client_header) headers;
 };
@@ -86,8 +167,153 @@ struct client_response {
 
     /* Close connection after response */
     bool close;
+
+    /* Connection: keep-alive, for HTTP/1.0 responses */
+    bool keepalive;
 };
 
+int client_pool_create (struct client_pool **poolp, unsigned host_max, unsigned max, const struct timeval *idle_timeout)
+{
+    struct client_pool *pool;
+
+    if (!(pool = calloc(1, sizeof(*pool)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    pool->host_max = host_max;
+    pool->max = max;
+    pool->idle_timeout = *idle_timeout;
+
+    TAILQ_INIT(&pool->conns);
+
+    *poolp = pool;
+
+    return 0;
+}
+
+static void client_pool_close (struct client_pool *pool, struct client_pool_conn *conn)
+{
+    TAILQ_REMOVE(&pool->conns, conn, pool_conns);
+    pool->count--;
+
+    http_destroy(conn->http);
+
+#ifdef WITH_SSL
+    if (conn->ssl)
+        ssl_destroy(conn->ssl);
+#endif
+
+    if (conn->tcp)
+        tcp_destroy(conn->tcp);
+
+    free(conn);
+}
+
+/*
+ * Take the most recently used idle connection for the key, closing any connections expired by the given
+ * event_main_clock().
+ *
+ * Returns 1 if there are none.
+ */
+static int client_pool_get (struct client_pool *pool, const struct timeval *now, const char *key, struct client_pool_conn **connp)
+{
+    struct client_pool_conn *conn, *next;
+
+    for (conn = TAILQ_FIRST(&pool->conns); conn; conn = next) {
+        next = TAILQ_NEXT(conn, pool_conns);
+
+        if (timercmp(&conn->expire, now, <=)) {
+            log_debug("expired %s", conn->key);
+
+            client_pool_close(pool, conn);
+
+        } else if (!strcmp(conn->key, key)) {
+            TAILQ_REMOVE(&pool->conns, conn, pool_conns);
+            pool->count--;
+            pool->hits++;
+
+            *connp = conn;
+
+            return 0;
+        }
+    }
+
+    pool->misses++;
+
+    return 1;
+}
+
+/*
+ * Keep the client's open connection as idle, closing the least recently used idle connections over the limits.
+ *
+ * Returns 1 if not kept, in which case the connection remains open in the client.
+ */
+static int client_pool_put (struct client_pool *pool, struct client *client)
+{
+    struct client_pool_conn *conn, *lru = NULL;
+    unsigned count = 0;
+
+    if (!pool->host_max || !pool->max)
+        return 1;
+
+    // least recently used for the same host
+    TAILQ_FOREACH(conn, &pool->conns, pool_conns) {
+        if (!strcmp(conn->key, client->pool_key)) {
+            lru = conn;
+            count++;
+        }
+    }
+
+    if (count >= pool->host_max) {
+        log_debug("host limit %s", lru->key);
+
+        client_pool_close(pool, lru);
+    }
+
+    while (pool->count >= pool->max && (conn = TAILQ_LAST(&pool->conns, client_pool_conns))) {
+        log_debug("pool limit %s", conn->key);
+
+        client_pool_close(pool, conn);
+    }
+
+    if (!(conn = calloc(1, sizeof(*conn)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    timeradd(event_main_clock(client->event_main), &pool->idle_timeout, &conn->expire);
+
+    memcpy(conn->key, client->pool_key, sizeof(conn->key));
+
+    conn->tcp = client->tcp; client->tcp = NULL;
+#ifdef WITH_SSL
+    conn->ssl = client->ssl; client->ssl = NULL;
+#endif
+    conn->http = client->http; client->http = NULL;
+
+    TAILQ_INSERT_HEAD(&pool->conns, conn, pool_conns);
+    pool->count++;
+
+    log_debug("idle %s: %u/%u", conn->key, pool->count, pool->max);
+
+    return 0;
+}
+
+void client_pool_destroy (struct client_pool *pool)
+{
+    struct client_pool_conn *conn;
+
+    if (pool->hits || pool->misses)
+        log_info("hits=%u misses=%u", pool->hits, pool->misses);
+
+    while ((conn = TAILQ_FIRST(&pool->conns))) {
+        client_pool_close(pool, conn);
+    }
+
+    free(pool);
+}
+
 int client_create (struct event_main *event_main, struct client **clientp)
 {
     struct client *client;
@@ -115,6 +341,27 @@ int client_set_ssl (struct client *client, struct ssl_main *ssl_main)
 }
 #endif
 
+int client_set_pool (struct client *client, struct client_pool *pool)
+{
+    client->pool = pool;
+
+    return 0;
+}
+
+int client_set_resolver (struct client *client, struct dns *dns)
+{
+    client->dns = dns;
+
+    return 0;
+}
+
+int client_set_timeout (struct client *client, const struct timeval *timeout)
+{
+    client->timeout = *timeout;
+
+    return 0;
+}
+
 int client_set_response_file (struct client *client, FILE *file, bool close)
 {
     if (client->response_file && client->response_file_close) {
@@ -164,17 +411,59 @@ int client_add_header (struct client *client, const char *name, const char *valu
     return 0;
 }
 
-int client_open_http (struct client *client, const struct url *url)
+/*
+ * Connect a socket to the host, resolving names using the async resolver, if set.
+ */
+static int client_connect_sock (struct client *client, const char *host, const char *port, int *sockp)
 {
+    struct addrinfo hints = {
+        .ai_flags       = AI_NUMERICHOST,
+        .ai_family      = AF_UNSPEC,
+        .ai_socktype    = SOCK_STREAM,
+    };
+    struct addrinfo *addrs;
     int err;
+
+    // localhost is not in the DNS, per RFC 6761
+    if (!client->dns || strcasecmp(host, "localhost") == 0)
+        return tcp_connect(client->event_main, sockp, host, port);
+
+    if (!getaddrinfo(host, port, &hints, &addrs)) {
+        err = tcp_connect_addrs(client->event_main, sockp, addrs);
+
+        freeaddrinfo(addrs);
+
+        return err;
+    }
+
+    if ((err = dns_getaddrinfo(client->dns, host, port, &addrs))) {
+        log_error("dns_getaddrinfo %s", host);
+        return err;
+    }
+
+    err = tcp_connect_addrs(client->event_main, sockp, addrs);
+
+    dns_freeaddrinfo(addrs);
+
+    return err;
+}
+
+int client_open_http (struct client *client, const struct url *url)
+{
+    int sock, err;
     const char *port = "http";
 
     // connect
     if (url->port)
         port = url->port;
     
-    if ((err = tcp_client(client->event_main, &client->tcp, url->host, port))) {
-        log_error("tcp_client");
+    if ((err = client_connect_sock(client, url->host, port, &sock))) {
+        log_error("client_connect_sock %s:%s", url->host, port);
+        return err;
+    }
+
+    if ((err = tcp_client_sock(client->event_main, &client->tcp, sock))) {
+        log_error("tcp_client_sock");
         return err;
     }
 
@@ -190,7 +479,7 @@ int client_open_http (struct client *client, const struct url *url)
 #ifdef WITH_SSL
 int client_open_https (struct client *client, const struct url *url)
 {
-    int err;
+    int sock, err;
     const char *port = "https";
 
     if (!client->ssl_main) {
@@ -198,15 +487,16 @@ int client_open_https (struct client *client, const struct url *url)
         return 1;
     }
 
-    if (client->event_main) {
-        log_warning("no async ssl client support; this request will block");
-    }
-
     // connect
     if (url->port)
         port = url->port;
     
-    if ((err = ssl_client(client->ssl_main, &client->ssl, url->host, port))) {
+    if ((err = client_connect_sock(client, url->host, port, &sock))) {
+        log_error("client_connect_sock %s:%s", url->host, port);
+        return err;
+    }
+
+    if ((err = ssl_client(client->ssl_main, client->event_main, &client->ssl, sock, url->host, port))) {
         log_error("ssl_client");
         return err;
     }
@@ -221,8 +511,56 @@ int client_open_https (struct client *client, const struct url *url)
 }
 #endif
 
+/*
+ * Apply the idle timeout to the open connection.
+ */
+static void client_set_timeouts (struct client *client)
+{
+    if (!client->tcp || !timerisset(&client->timeout))
+        return;
+
+    tcp_read_timeout(client->tcp, &client->timeout);
+    tcp_write_timeout(client->tcp, &client->timeout);
+}
+
+/*
+ * Open a new connection for the given scheme://host:port.
+ */
+static int client_connect (struct client *client, const struct url *url)
+{
+    int err;
+
+    client->reused = false;
+
+    if (!url->scheme || !*url->scheme || strcmp(url->scheme, "http") == 0) {
+        err = client_open_http(client, url);
+        
+    } else if (strcmp(url->scheme, "https") == 0) {
+#ifdef WITH_SSL
+        err = client_open_https(client, url);
+#else
+        log_error("unsupported url scheme: %s", url->scheme);
+        return 1;
+#endif
+    } else {
+        log_error("unknown url scheme: %s", url->scheme);
+        return 1;
+    }
+
+    if (err) {
+        client->stats.connect_errors++;
+    } else {
+        client->stats.connects++;
+        client_set_timeouts(client);
+    }
+
+    return err;
+}
+
 int client_open (struct client *client, const struct url *url)
 {
+    const char *scheme = (url->scheme && *url->scheme) ? url->scheme : "http";
+    struct client_pool_conn *conn;
     int err;
 
     if (client->http) {
@@ -236,20 +574,33 @@ int client_open (struct client *client, const struct url *url)
         return 1;
     }
 
-    if (!url->scheme || !*url->scheme || strcmp(url->scheme, "http") == 0) {
-        return client_open_http(client, url);
-        
-    } else if (strcmp(url->scheme, "https") == 0) {
-#ifdef WITH_SSL
-        return client_open_https(client, url);
-#else
-        log_error("unsupported url scheme: %s", url->scheme);
-        return 1;
-#endif
-    } else {
-        log_error("unknown url scheme: %s", url->scheme);
+    if (snprintf(client->pool_key, sizeof(client->pool_key), "%s://%s:%s", scheme, url->host, url->port ? url->port : scheme) >= (int) sizeof(client->pool_key)) {
+        log_error("url too long: %s", url->host);
         return 1;
     }
+
+    if (!client->pool || (err = client_pool_get(client->pool, event_main_clock(client->event_main), client->pool_key, &conn)) > 0) {
+        return client_connect(client, url);
+
+    } else if (err < 0) {
+        return err;
+    }
+
+    log_info("re-use %s", client->pool_key);
+
+    client->tcp = conn->tcp;
+#ifdef WITH_SSL
+    client->ssl = conn->ssl;
+#endif
+    client->http = conn->http;
+    client->reused = true;
+    client->stats.reuses++;
+
+    free(conn);
+
+    client_set_timeouts(client);
+
+    return 0;
 }
 
 int client_request_header (struct client *client, const char *name, const char *fmt, ...)
@@ -291,7 +642,7 @@ int client_request_body (struct client *client, const struct client_request *req
         }
 
         // send; content_length may either be 0 or determined earlier, before sending headers
-        if ((err = http_write_file(client->http, fd, request->content_length)))
+        if ((err = http_write_file(client->http, fd, NULL, request->content_length)))
             return err;
 
     } else if (request->content_string) {
@@ -326,6 +677,12 @@ int client_response_header (struct client *client, struct client_response *respo
             log_debug("explicit connection-close");
 
             response->close = true;
+
+        } else if (strcasecmp(value, "keep-alive") == 0) {
+            log_debug("explicit connection-keep-alive");
+
+            response->keepalive = true;
+
         } else {
             log_debug("unknown Connection: %s", value);
         }
@@ -387,6 +744,7 @@ int client_response (struct client *client, struct client_request *request, stru
 {
     int err;
     const char *reason, *version;
+    bool http11;
 
     if ((err = http_read_response(client->http, &version, &response->status, &reason))) {
         log_error("error reading response line");
@@ -395,6 +753,9 @@ int client_response (struct client *client, struct client_request *request, stru
     
     log_info("%s %u %s", version, response->status, reason);
 
+    // the version is not kept across reading the headers
+    http11 = strcmp(version, "HTTP/1.1") == 0;
+
     // headers
     {
         const char *header, *value;
@@ -436,6 +797,8 @@ int client_response (struct client *client, struct client_request *request, stru
 
         if ((err = client_response_file(client, response, response->content_length)))
             return err;
+
+        client->stats.bytes += response->content_length;
         
         // more requests
         err = 0;
@@ -459,6 +822,11 @@ int client_response (struct client *client, struct client_request *request, stru
     if (response->close) {
         log_debug("explicit close-response");
 
+        err = 1;
+
+    } else if (!client->request_http11 || (!http11 && !response->keepalive)) {
+        log_debug("non-persistent HTTP/1.0 connection");
+
         err = 1;
     }
     
@@ -468,15 +836,14 @@ int client_response (struct client *client, struct client_request *request, stru
 }
 
 /*
- * Send one request, read and process the response.
+ * Write one request into the connection's write buffer, without flushing it yet.
  *
- * Returns 0 on success with a persistent connection, 1 on success with a non-persistent connection, <0 on error.
+ * Returns <0 on error.
  */
-static int client_request (struct client *client, struct client_request *request, struct client_response *response)
+static int client_request_write (struct client *client, struct client_request *request)
 {
     int err;
-    
-    // request
+
     {
         const char *version = client->request_http11 ? "HTTP/1.1" : "HTTP/1.0";
 
@@ -537,46 +904,193 @@ static int client_request (struct client *client, struct client_request *request
             log_error("error sending request body");
             return -1;
         }
+    }
+
+    return 0;
+}
+
+/*
+ * Send one request, read and process the response.
+ *
+ * Returns 0 on success with a persistent connection, 1 on success with a non-persistent connection, <0 on error.
+ */
+static int client_request (struct client *client, struct client_request *request, struct client_response *response)
+{
+    int err;
+    
+    if ((err = client_request_write(client, request)))
+        return err;
 
-        log_info("%s", "");
+    // send buffered request
+    if ((err = http_flush(client->http))) {
+        log_error("error sending request");
+        return -1;
     }
 
+    log_info("%s", "");
+
     // response
     return client_response(client, request, response);
 }
 
-int client_get (struct client *client, const struct url *url)
+/*
+ * Open a connection if needed, send the request and read the response, closing the connection unless persistent.
+ *
+ * A request on a re-used connection that fails without any response is retried once on a new connection, as the server
+ * may have closed the connection while it was idle.
+ *
+ * Returns 0 on success, <0 on error, >0 if the connection could not be opened.
+ */
+static int client_send (struct client *client, struct client_request *request, struct client_response *response)
 {
     int err;
 
-    // open connection if needed
-    if (!client->http && (err = client_open(client, url)))
+    if (!client->http && (err = client_open(client, request->url)))
         return err;
 
-    struct client_request request = {
-        .url    = url,
-        .method    = "GET",
-    };
+    if ((err = client_request(client, request, response)) && client->reused && !response->status) {
+        log_info("re-used connection closed, retrying on a new connection: %s", client->pool_key);
 
-    struct client_response response = {
-        .content_file    = client->response_file,
-    };
-    
-    if ((err = client_request(client, &request, &response)) < 0) {
+        client->persistent = false;
+        client_close(client);
+
+        if (request->content_file && fseek(request->content_file, 0, SEEK_SET)) {
+            log_perror("fseek");
+            return -1;
+        }
+
+        if ((err = client_connect(client, request->url)))
+            return err;
+
+        err = client_request(client, request, response);
+    }
+
+    if (err < 0) {
         log_error("client_request");
     }
 
+    client->persistent = !err;
+
     // close if not persistent, or error
     if (err) {
        if (client_close(client))
             log_warning("client_close");
     }
 
-    if (err < 0) {
+    return err < 0 ? err : 0;
+}
+
+int client_get (struct client *client, const struct url *url)
+{
+    int err;
+
+    struct client_request request = {
+        .url    = url,
+        .method    = "GET",
+    };
+
+    struct client_response response = {
+        .content_file    = client->response_file,
+    };
+    
+    if ((err = client_send(client, &request, &response)))
         return err;
-    } else {
-        return response.status;
+
+    return response.status;
+}
+
+int client_get_pipeline (struct client *client, const struct url **urls, unsigned count, unsigned depth, unsigned *statuses)
+{
+    // requests sent and responses received, in total and on the current connection
+    unsigned sent = 0, received = 0, responses = 0;
+    int err;
+
+    if (!depth)
+        depth = 1;
+
+    while (received < count) {
+        if (!client->http) {
+            if ((err = client_open(client, urls[received])))
+                return err;
+
+            responses = 0;
+        }
+
+        // keep up to depth requests ahead of the responses
+        if (sent < count && sent - received < depth) {
+            for (; sent < count && sent - received < depth; sent++) {
+                struct client_request request = {
+                    .url    = urls[sent],
+                    .method = "GET",
+                };
+
+                if ((err = client_request_write(client, &request)))
+                    goto error;
+            }
+
+            if ((err = http_flush(client->http))) {
+                log_error("error sending requests");
+                err = -1;
+                goto error;
+            }
+
+            log_info("%s", "");
+        }
+
+        // responses are in request order
+        struct client_request request = {
+            .url    = urls[received],
+            .method = "GET",
+        };
+
+        struct client_response response = {
+            .content_file   = client->response_file,
+        };
+
+        err = client_response(client, &request, &response);
+
+        if (err && client->reused && !responses && !response.status) {
+            log_info("re-used connection closed, retrying on a new connection: %s", client->pool_key);
+
+            client->persistent = false;
+            client_close(client);
+
+            if ((err = client_connect(client, urls[received])))
+                return err;
+
+            sent = received;
+
+            continue;
+
+        } else if (err < 0) {
+            log_error("client_response");
+            goto error;
+        }
+
+        statuses[received++] = response.status;
+        responses++;
+
+        // any further requests sent on this connection were dropped by the server, and are sent again on a new one
+        if (err) {
+            if (sent > received)
+                log_info("connection closed with %u pipelined requests pending", sent - received);
+
+            client->persistent = false;
+            client_close(client);
+
+            sent = received;
+        }
     }
+
+    client->persistent = client->http != NULL;
+
+    return 0;
+
+error:
+    client->persistent = false;
+    client_close(client);
+
+    return err;
 }
 
 int client_put (struct client *client, const struct url *url, FILE *file)
@@ -601,10 +1115,6 @@ int client_put (struct client *client, const struct url *url, FILE *file)
         return -1;
     }
     
-    // open connection if needed
-    if (!client->http && (err = client_open(client, url)))
-        return err;
-
     // request
     struct client_request request = {
         .url            = url,
@@ -618,31 +1128,16 @@ int client_put (struct client *client, const struct url *url, FILE *file)
         .content_file    = client->response_file,
     };
 
-    if ((err = client_request(client, &request, &response)) < 0) {
-        log_error("client_request");
-    }
-
-    // close if not persistent, or error
-    if (err) {
-       if (client_close(client))
-            log_warning("client_close");
-    }
-
-    if (err < 0) {
+    if ((err = client_send(client, &request, &response)))
         return err;
-    } else {
-        return response.status;
-    }
+
+    return response.status;
 }
 
 int client_post (struct client *client, const struct url *url, const char *data, const char *content_type)
 {
     int err;
 
-    // open connection if needed
-    if (!client->http && (err = client_open(client, url)))
-        return err;
-
     // request
     struct client_request request = {
         .url            = url,
@@ -657,27 +1152,302 @@ int client_post (struct client *client, const struct url *url, const char *data,
         .content_file   = client->response_file,
     };
 
-    if ((err = client_request(client, &request, &response)) < 0) {
-        log_error("client_request");
+    if ((err = client_send(client, &request, &response)))
+        return err;
+
+    return response.status;
+}
+
+int client_stream_request (struct client *client, const char *method, const struct url *url)
+{
+    const char *version = client->request_http11 ? "HTTP/1.1" : "HTTP/1.0";
+    int err;
+
+    if (!client->http && (err = client_open(client, url)))
+        return err;
+
+    client->persistent = false;
+    client->stream = (struct client_stream) {
+        .url    = url,
+        .head   = strcasecmp(method, "HEAD") == 0,
+    };
+
+    if (url->query && *url->query) {
+        log_info("%s /%s?%s %s", method, url->path, url->query, version);
+
+        err = http_write_request(client->http, version, method, "/%s?%s", url->path, url->query);
+
+    } else {
+        log_info("%s /%s %s", method, url->path, version);
+
+        err = http_write_request(client->http, version, method, "/%s", url->path);
     }
 
-    // close if not persistent, or error
     if (err) {
-       if (client_close(client))
-            log_warning("client_close");
+        log_error("error sending request line");
+        return -1;
+    }
+
+    return 0;
+}
+
+int client_stream_header (struct client *client, const char *name, const char *fmt, ...)
+{
+    va_list args;
+    int err;
+
+    if (strcasecmp(name, "Host") == 0)
+        client->stream.host = true;
+
+    va_start(args, fmt);
+    err = http_write_headerv(client->http, name, fmt, args);
+    va_end(args);
+
+    return err;
+}
+
+int client_stream_headers (struct client *client, size_t content_length, bool chunked)
+{
+    struct client_header *header;
+    int err = 0;
+
+    if (!client->stream.host)
+        err |= client_request_header(client, "Host", "%s", client->stream.url->host);
+
+    if (chunked) {
+        client->stream.chunked = true;
+
+        err |= client_request_header(client, "Transfer-Encoding", "chunked");
+
+    } else if (content_length) {
+        err |= client_request_header(client, "Content-Length", "%zu", content_length);
+    }
+
+    TAILQ_FOREACH(header, &client->headers, client_headers) {
+        err |= client_request_header(client, header->name, "%s", header->value);
+    }
+
+    if (err) {
+        log_error("error sending request headers");
+        return -1;
+    }
+
+    if ((err = http_write_headers(client->http))) {
+        log_error("error sending request end-of-headers");
+        return -1;
+    }
+
+    return 0;
+}
+
+int client_stream_write (struct client *client, const char *buf, size_t size)
+{
+    if (!size)
+        return 0;
+    else if (client->stream.chunked)
+        return http_write_chunk(client->http, buf, size);
+    else
+        return http_write(client->http, buf, size);
+}
+
+int client_stream_response (struct client *client, struct client_stream_response *response)
+{
+    struct client_stream *stream = &client->stream;
+    struct http_head_line line;
+    const char *head;
+    size_t len;
+    bool keepalive = false;
+    int err;
+
+    if (stream->chunked && (err = http_write_chunks(client->http))) {
+        log_error("error ending request chunks");
+        return -1;
+    }
+
+    if ((err = http_flush(client->http))) {
+        log_error("error sending request");
+        return -1;
+    }
+
+    // skip any interim 1xx responses, other than a 101 Switching Protocols
+    do {
+        *response = (struct client_stream_response) { };
+
+        if ((err = http_read_response_head(client->http, &response->version, &response->status, &response->reason, &response->head, &response->head_len)) < 0) {
+            log_error("http_read_response_head");
+            return err;
+
+        } else if (err) {
+            log_info("connection closed without response");
+            return 1;
+        }
+
+        log_info("%u %s", response->status, response->reason);
+
+    } while (response->status >= 100 && response->status <= 199 && response->status != 101);
+
+    // framing and persistence
+    for (head = response->head, len = response->head_len; !(err = http_head_next(&head, &len, &line)); ) {
+        if (!line.name_len) {
+            continue;
+
+        } else if (line.name_len == 14 && strncasecmp(line.name, "Content-Length", 14) == 0) {
+            char buf[32], *end;
+
+            if (line.value_len >= sizeof(buf)) {
+                log_warning("invalid content-length: %.*s", (int) line.value_len, line.value);
+                return -1;
+            }
+
+            memcpy(buf, line.value, line.value_len);
+            buf[line.value_len] = '\0';
+
+            response->content_length = strtoull(buf, &end, 10);
+
+            if (!*buf || *end || *buf == '-') {
+                log_warning("invalid content-length: %s", buf);
+                return -1;
+            }
+
+            response->has_length = true;
+
+        } else if (line.name_len == 17 && strncasecmp(line.name, "Transfer-Encoding", 17) == 0) {
+            response->chunked = http_header_token(line.value, line.value_len, "chunked", 7);
+
+        } else if (line.name_len == 10 && strncasecmp(line.name, "Connection", 10) == 0) {
+            if (http_header_token(line.value, line.value_len, "close", 5))
+                stream->close = true;
+            if (http_header_token(line.value, line.value_len, "keep-alive", 10))
+                keepalive = true;
+        }
     }
 
     if (err < 0) {
-        return err;
+        log_warning("invalid response headers");
+        return -1;
+    }
+
+    if (!client->request_http11 || (response->version != HTTP_11 && !keepalive)) {
+        log_debug("non-persistent HTTP/1.0 connection");
+
+        stream->close = true;
+    }
+
+    if (stream->head || (response->status >= 100 && response->status <= 199) || response->status == 204 || response->status == 304) {
+        response->empty = true;
+        response->has_length = false;
+        response->chunked = false;
+
+    } else if (response->chunked) {
+        // takes precedence over any Content-Length
+        response->has_length = false;
+
+    } else if (!response->has_length) {
+        // until EOF
+        stream->close = true;
+    }
+
+    stream->empty = response->empty || (response->has_length && !response->content_length);
+    stream->has_length = response->has_length;
+    stream->remaining = response->content_length;
+
+    // the body is read using http_read_chunked()
+    stream->chunked = response->chunked;
+
+    return 0;
+}
+
+int client_stream_read (struct client *client, char **bufp, size_t *sizep)
+{
+    struct client_stream *stream = &client->stream;
+    int err;
+
+    if (stream->empty) {
+        *sizep = 0;
+
+        // further requests
+        client->persistent = !stream->close;
+
+        return 1;
+
+    } else if (stream->chunked) {
+        if ((err = http_read_chunked(client->http, bufp, sizep)) < 0) {
+            log_warning("http_read_chunked");
+            return err;
+        }
+
+    } else if (stream->has_length) {
+        if (!*sizep || *sizep > stream->remaining)
+            *sizep = stream->remaining;
+
+        if ((err = http_read(client->http, bufp, sizep)) < 0) {
+            log_warning("http_read");
+            return err;
+
+        } else if (err) {
+            log_warning("premature end of response body with %zu remaining", stream->remaining);
+            return -1;
+        }
+
+        stream->remaining -= *sizep;
+        client->stats.bytes += *sizep;
+
+        if (!stream->remaining)
+            stream->empty = true;
+
+        return 0;
+
     } else {
-        return response.status;
+        if ((err = http_read(client->http, bufp, sizep)) < 0) {
+            log_warning("http_read");
+            return err;
+        }
     }
+
+    if (err) {
+        stream->empty = true;
+
+        client->persistent = !stream->close;
+    }
+
+    return err;
+}
+
+bool client_is_reused (struct client *client)
+{
+    return client->reused;
+}
+
+int client_reconnect (struct client *client, const struct url *url)
+{
+    client->persistent = false;
+
+    if (client->http)
+        client_close(client);
+
+    return client_connect(client, url);
+}
+
+void client_get_stats (struct client *client, struct client_stats *stats)
+{
+    *stats = client->stats;
 }
 
 int client_close (struct client *client)
 {
+    int err;
+
     log_info("%s", "");
 
+    if (client->persistent && client->pool) {
+        client->persistent = false;
+
+        if (!(err = client_pool_put(client->pool, client)))
+            return 0;
+        else if (err < 0)
+            log_warning("client_pool_put");
+    }
+
     http_destroy(client->http); client->http = NULL;
 
 #ifdef WITH_SSL
@@ -708,7 +1478,7 @@ void client_destroy (struct client *client)
     }
 
     if (client->http)
-        http_destroy(client->http);
+        client_close(client);
 
     if (client->response_file && client->response_file_close)
         fclose(client->response_file);
@@ -10,12 +10,79 @@
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+/* Default limits on idle connections kept by a client_pool, per scheme://host:port and in total */
+#define CLIENT_POOL_HOST 4
+#define CLIENT_POOL_MAX 64
+
+/* Default time in seconds to keep idle connections */
+#define CLIENT_POOL_IDLE 30
 
 /*
  * HTTP Client.
  */
 struct client;
 
+/* Async DNS resolver, see dns.h */
+struct dns;
+
+/*
+ * Client statistics, counted since client_create().
+ */
+struct client_stats {
+    /* New connections opened, and failed attempts */
+    unsigned connects, connect_errors;
+
+    /* Connections re-used from the pool */
+    unsigned reuses;
+
+    /* Response body bytes read, for responses with a Content-Length */
+    uint64_t bytes;
+};
+
+/*
+ * Response to a streamed request, see client_stream_response().
+ */
+struct client_stream_response {
+    enum http_version version;
+    unsigned status;
+    const char *reason;
+
+    /* Raw response header lines following the status line, see http_head_next() */
+    const char *head;
+    size_t head_len;
+
+    /* No response body, for HEAD requests and 1xx/204/304 responses */
+    bool empty;
+
+    /* Response body of a known Content-Length, or else chunked or until EOF */
+    bool has_length;
+    size_t content_length;
+    bool chunked;
+};
+
+/*
+ * Idle persistent connections, shared across clients for re-use by later requests to the same scheme://host:port.
+ */
+struct client_pool;
+
+/*
+ * Create a new connection pool, keeping up to host_max idle connections per scheme://host:port, and max in total, for
+ * up to the given idle timeout.
+ *
+ * The least recently used idle connections are closed once either limit is reached.
+ */
+int client_pool_create (struct client_pool **poolp, unsigned host_max, unsigned max, const struct timeval *idle_timeout);
+
+/*
+ * Close all idle connections, and release resources.
+ *
+ * Any clients using the pool must be destroyed first.
+ */
+void client_pool_destroy (struct client_pool *pool);
+
 /*
  * Create a new client.
  */
@@ -28,6 +95,27 @@ int client_create (struct event_main *event_main, struct client **clientp);
 int client_set_ssl (struct client *client, struct ssl_main *ssl_main);
 #endif
 
+/*
+ * Re-use idle connections from the given pool for client_open(), and return persistent connections to the pool on
+ * client_close().
+ *
+ * Connections are persistent after a HTTP/1.1 response whose body length is known, without a Connection: close.
+ */
+int client_set_pool (struct client *client, struct client_pool *pool);
+
+/*
+ * Resolve host names using the given async resolver and its cache, instead of blocking in getaddrinfo(), racing the
+ * connects to the resolved IPv6 and IPv4 addresses, see tcp_connect_addrs().
+ *
+ * Literal addresses and localhost are still resolved using getaddrinfo(), without any network lookups.
+ */
+int client_set_resolver (struct client *client, struct dns *dns);
+
+/*
+ * Fail reads and writes on plain http:// connections that remain idle past the given timeout.
+ */
+int client_set_timeout (struct client *client, const struct timeval *timeout);
+
 /*
  * Write response data to FILE, or NULL to bitbucket.
  *
@@ -48,7 +136,7 @@ int client_set_request_version (struct client *client, enum http_version version
 int client_add_header (struct client *client, const char *header, const char *value);
 
 /*
- * Open a client for the given scheme://host:port.
+ * Open a client for the given scheme://host:port, taking any idle connection from the pool.
  *
  * The connection will be used for any subsequent GET/PUT request.
  */
@@ -61,6 +149,17 @@ int client_open (struct client *client, const struct url *url);
  */
 int client_get (struct client *client, const struct url *url);
 
+/*
+ * Perform GET requests for each of the given URLs on the same scheme://host:port, pipelining up to depth requests
+ * ahead of the responses on a persistent connection.
+ *
+ * The responses are written to the response file in request order, with each HTTP response status returned in
+ * statuses[]. Requests that were pending when the server closed the connection are sent again on a new connection.
+ *
+ * Returns <0 on error, >0 if a connection could not be opened.
+ */
+int client_get_pipeline (struct client *client, const struct url **urls, unsigned count, unsigned depth, unsigned *statuses);
+
 /*
  * Perform a PUT request for the given file and URL /path.
  *
@@ -76,7 +175,63 @@ int client_put (struct client *client, const struct url *url, FILE *file);
 int client_post (struct client *client, const struct url *url, const char *data, const char *content_type);
 
 /*
- * Close any open connection.
+ * Start a streamed request for the given URL /path and ?query, opening a connection if needed, with the given request
+ * headers and body being written using client_stream_header() and client_stream_write(), without buffering the body.
+ *
+ * Only the request line is written. The Host header is written once the headers end, unless given.
+ */
+int client_stream_request (struct client *client, const char *method, const struct url *url);
+
+/*
+ * Write one request header, as-is.
+ */
+int client_stream_header (struct client *client, const char *name, const char *fmt, ...)
+    __attribute((format (printf, 3, 4)));
+
+/*
+ * End the request headers, using a Content-Length request body if given, or the chunked transfer-encoding for a
+ * request body of unknown length, along with the Host header and any custom headers.
+ */
+int client_stream_headers (struct client *client, size_t content_length, bool chunked);
+
+/*
+ * Write a span of the request body.
+ */
+int client_stream_write (struct client *client, const char *buf, size_t size);
+
+/*
+ * End the request, and read the response status and headers, determining the response body framing.
+ *
+ * The returned head remains valid until client_stream_read().
+ *
+ * Returns 1 if the connection was closed without any response, <0 on error.
+ */
+int client_stream_response (struct client *client, struct client_stream_response *response);
+
+/*
+ * Read the next span of the response body, as with stream_read().
+ *
+ * Returns 1 on end-of-body, once the connection may be returned to the pool, or <0 on error or premature EOF.
+ */
+int client_stream_read (struct client *client, char **bufp, size_t *sizep);
+
+/*
+ * The open connection was re-used from the pool, and may have been closed by the server while idle.
+ */
+bool client_is_reused (struct client *client);
+
+/*
+ * Close any open connection without returning it to the pool, and open a new connection, bypassing the pool.
+ */
+int client_reconnect (struct client *client, const struct url *url);
+
+/*
+ * Read out the client statistics.
+ */
+void client_get_stats (struct client *client, struct client_stats *stats);
+
+/*
+ * Close any open connection, or return it to the pool if persistent.
  */
 int client_close (struct client *client);
 
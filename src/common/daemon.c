@@ -1,22 +1,142 @@
+#ifdef __linux__
+// sched_setaffinity()
+#define _GNU_SOURCE
+#endif
+
 #include "common/daemon.h"
 
 #include "common/log.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+/* Worker process exit codes */
+enum daemon_worker_exit {
+    DAEMON_WORKER_EXIT      = 0,
+    DAEMON_WORKER_ERROR     = 1,
+    DAEMON_WORKER_STARTUP   = 2,
+};
+
+/* Minimum interval between restarts of the same worker */
+#define DAEMON_WORKER_RESTART 1
+
+struct daemon_worker {
+    pid_t pid;
+
+    /* Last fork() */
+    time_t start;
+};
+
+/* Set by SIGINT/SIGTERM/SIGQUIT within the supervisor */
+static volatile sig_atomic_t daemon_stop;
+
+/* Set by SIGHUP/SIGUSR2 within the supervisor */
+static volatile sig_atomic_t daemon_reload_signal;
+
+/* Write end of the daemon_signals() pipe */
+static int daemon_signal_fd = -1;
+
+/* Passed from the previous process, see daemon_inherit() */
+static int *daemon_inherit_fds;
+static unsigned daemon_inherit_count;
+static int daemon_ready_fd = -1;
+
+/* Set by daemon_set_reload() */
+static char **daemon_reload_argv;
+static const int *daemon_reload_fds;
+static unsigned daemon_reload_count;
+
+/* Started by daemon_reload() */
+static pid_t daemon_reload_pid;
+
+/*
+ * Parse the comma-separated list of fds passed by daemon_reload().
+ */
+static int daemon_init_fds (const char *env)
+{
+    unsigned count = 1;
+
+    for (const char *c = env; *c; c++) {
+        if (*c == ',')
+            count++;
+    }
+
+    if (!(daemon_inherit_fds = calloc(count, sizeof(*daemon_inherit_fds)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    for (const char *c = env; *c; ) {
+        char *end;
+        long fd = strtol(c, &end, 10);
+
+        if (end == c || fd < 0 || (*end && *end != ',')) {
+            log_error("invalid %s=%s", DAEMON_FDS_ENV, env);
+            return -1;
+        }
+
+        // do not leak into any further re-exec
+        if (fcntl(fd, F_SETFD, FD_CLOEXEC)) {
+            log_perror("fcntl %ld", fd);
+            return -1;
+        }
+
+        daemon_inherit_fds[daemon_inherit_count++] = fd;
+
+        c = *end ? end + 1 : end;
+    }
+
+    return 0;
+}
+
 int daemon_init ()
 {
+    const char *env;
+
     if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
         log_perror("signal");
         return -1;
     }
 
+    if ((env = getenv(DAEMON_FDS_ENV))) {
+        if (daemon_init_fds(env))
+            return -1;
+
+        log_info("inherit %u fds", daemon_inherit_count);
+
+        unsetenv(DAEMON_FDS_ENV);
+    }
+
+    if ((env = getenv(DAEMON_READY_ENV))) {
+        daemon_ready_fd = atoi(env);
+
+        if (fcntl(daemon_ready_fd, F_SETFD, FD_CLOEXEC)) {
+            log_perror("fcntl %d", daemon_ready_fd);
+            return -1;
+        }
+
+        unsetenv(DAEMON_READY_ENV);
+    }
+
     return 0;
 }
 
 int daemon_start ()
 {
+    // any buffered output would be written twice
+    log_flush();
+
     // nochdir, close
     if (daemon(1, 0)) {
         log_perror("daemon");
@@ -25,3 +145,558 @@ int daemon_start ()
 
     return 0;
 }
+
+static void daemon_signal (int sig)
+{
+    daemon_stop = sig;
+}
+
+static void daemon_signal_reload (int sig)
+{
+    daemon_reload_signal = sig;
+}
+
+static void daemon_signal_pipe (int sig)
+{
+    unsigned char c = sig;
+    int errno_save = errno;
+    ssize_t ret;
+
+    // drops the signal if the pipe is full, there are plenty of them pending
+    ret = write(daemon_signal_fd, &c, 1);
+    (void) ret;
+
+    errno = errno_save;
+}
+
+/*
+ * Set O_NONBLOCK and FD_CLOEXEC on the fd.
+ */
+static int daemon_fd_nonblocking (int fd)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL)) < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK)) {
+        log_perror("fcntl");
+        return -1;
+    }
+
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC)) {
+        log_perror("fcntl");
+        return -1;
+    }
+
+    return 0;
+}
+
+int daemon_signals (int *fdp, const int *sigs, unsigned count)
+{
+    struct sigaction sa = { .sa_handler = daemon_signal_pipe, .sa_flags = SA_RESTART };
+    int fds[2];
+
+    if (daemon_signal_fd >= 0) {
+        log_error("already in use");
+        return -1;
+    }
+
+    if (pipe(fds)) {
+        log_perror("pipe");
+        return -1;
+    }
+
+    if (daemon_fd_nonblocking(fds[0]) || daemon_fd_nonblocking(fds[1]))
+        goto error;
+
+    daemon_signal_fd = fds[1];
+
+    sigemptyset(&sa.sa_mask);
+
+    for (unsigned i = 0; i < count; i++) {
+        if (sigaction(sigs[i], &sa, NULL)) {
+            log_perror("sigaction %d", sigs[i]);
+            return -1;
+        }
+    }
+
+    *fdp = fds[0];
+
+    return 0;
+
+error:
+    close(fds[0]);
+    close(fds[1]);
+
+    return -1;
+}
+
+int daemon_inherit (int **fdsp, unsigned *countp)
+{
+    *fdsp = daemon_inherit_fds;
+    *countp = daemon_inherit_count;
+
+    daemon_inherit_fds = NULL;
+    daemon_inherit_count = 0;
+
+    return 0;
+}
+
+void daemon_ready ()
+{
+    char c = 0;
+
+    if (daemon_ready_fd < 0)
+        return;
+
+    if (write(daemon_ready_fd, &c, 1) < 0)
+        log_pwarning("write");
+
+    close(daemon_ready_fd);
+
+    daemon_ready_fd = -1;
+}
+
+void daemon_set_reload (char **argv, const int *fds, unsigned count)
+{
+    daemon_reload_argv = argv;
+    daemon_reload_fds = fds;
+    daemon_reload_count = count;
+}
+
+/*
+ * Within the newly forked process, pass over the fds and exec.
+ */
+static void daemon_reload_exec (int ready)
+{
+    char buf[20];
+    size_t size = daemon_reload_count * 12 + 1;
+    char *fds;
+    size_t len = 0;
+
+    if (!(fds = malloc(size))) {
+        log_perror("malloc");
+        _exit(127);
+    }
+
+    *fds = '\0';
+
+    for (unsigned i = 0; i < daemon_reload_count; i++) {
+        int fd = daemon_reload_fds[i];
+
+        len += snprintf(fds + len, size - len, "%s%d", i ? "," : "", fd);
+
+        if (fcntl(fd, F_SETFD, 0)) {
+            log_perror("fcntl %d", fd);
+            _exit(127);
+        }
+    }
+
+    if (fcntl(ready, F_SETFD, 0)) {
+        log_perror("fcntl %d", ready);
+        _exit(127);
+    }
+
+    snprintf(buf, sizeof(buf), "%d", ready);
+
+    if (setenv(DAEMON_FDS_ENV, fds, 1) || setenv(DAEMON_READY_ENV, buf, 1)) {
+        log_perror("setenv");
+        _exit(127);
+    }
+
+    execvp(daemon_reload_argv[0], daemon_reload_argv);
+
+    log_perror("execvp %s", daemon_reload_argv[0]);
+    _exit(127);
+}
+
+int daemon_reload (int *readyp)
+{
+    int ready[2];
+    pid_t pid;
+
+    if (!daemon_reload_argv) {
+        log_error("daemon_set_reload not called");
+        return -1;
+    }
+
+    if (pipe(ready)) {
+        log_perror("pipe");
+        return -1;
+    }
+
+    if (daemon_fd_nonblocking(ready[0])) {
+        close(ready[0]);
+        close(ready[1]);
+        return -1;
+    }
+
+    // any buffered output would be written twice
+    log_flush();
+
+    if ((pid = fork()) < 0) {
+        log_perror("fork");
+        close(ready[0]);
+        close(ready[1]);
+        return -1;
+
+    } else if (!pid) {
+        close(ready[0]);
+
+        daemon_reload_exec(ready[1]);
+    }
+
+    log_info("reload: pid %d", pid);
+
+    daemon_reload_pid = pid;
+
+    close(ready[1]);
+
+    *readyp = ready[0];
+
+    return 0;
+}
+
+/*
+ * Collect the exit status of a failed daemon_reload(), if it has already exited.
+ */
+static void daemon_reload_reap (void)
+{
+    int status;
+
+    if (daemon_reload_pid <= 0 || waitpid(daemon_reload_pid, &status, WNOHANG) <= 0)
+        return;
+
+    if (WIFEXITED(status))
+        log_warning("reload: pid %d exited with %d", daemon_reload_pid, WEXITSTATUS(status));
+    else if (WIFSIGNALED(status))
+        log_warning("reload: pid %d killed by %s", daemon_reload_pid, strsignal(WTERMSIG(status)));
+
+    daemon_reload_pid = 0;
+}
+
+int daemon_reload_ready (int ready, unsigned *countp)
+{
+    char buf[64];
+    ssize_t ret;
+
+    while (*countp) {
+        if ((ret = read(ready, buf, sizeof(buf))) < 0 && errno == EINTR) {
+            continue;
+
+        } else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 1;
+
+        } else if (ret < 0) {
+            log_perror("read");
+            return 2;
+
+        } else if (!ret) {
+            // all copies of the write end closed without becoming ready
+            daemon_reload_reap();
+
+            return 2;
+        }
+
+        *countp = (size_t) ret >= *countp ? 0 : *countp - ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Pin the calling worker process to the index'th CPU of the set of CPUs available to us.
+ */
+static void daemon_worker_pin (const void *cpus, unsigned index)
+{
+#ifdef __linux__
+    const cpu_set_t *cpuset = cpus;
+    int count = CPU_COUNT(cpuset);
+    cpu_set_t pin;
+
+    if (!count)
+        return;
+
+    index %= count;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, cpuset))
+            continue;
+
+        if (index--)
+            continue;
+
+        CPU_ZERO(&pin);
+        CPU_SET(cpu, &pin);
+
+        if (sched_setaffinity(0, sizeof(pin), &pin)) {
+            log_pwarning("sched_setaffinity %d", cpu);
+        } else {
+            log_info("cpu %d", cpu);
+        }
+
+        break;
+    }
+#endif
+}
+
+/*
+ * Fork off a new worker process.
+ */
+static int daemon_worker_start (struct daemon_worker *worker, unsigned index, const void *cpus, daemon_worker_func *func, void *ctx)
+{
+    pid_t pid;
+    int err;
+
+    // any buffered output would be written twice
+    log_flush();
+
+    if ((pid = fork()) < 0) {
+        log_perror("fork");
+        return -1;
+
+    } else if (pid) {
+        log_info("worker %u: pid %d", index, pid);
+
+        worker->pid = pid;
+        worker->start = time(NULL);
+
+        return 0;
+    }
+
+    // worker process
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
+
+    daemon_worker_pin(cpus, index);
+
+    if ((err = func(ctx, index)) > 0)
+        _exit(DAEMON_WORKER_STARTUP);
+    else if (err < 0)
+        _exit(DAEMON_WORKER_ERROR);
+    else
+        _exit(DAEMON_WORKER_EXIT);
+}
+
+/*
+ * Signal all running workers.
+ */
+static void daemon_workers_kill (struct daemon_worker *workers, unsigned count, int sig)
+{
+    for (unsigned i = 0; i < count; i++) {
+        if (workers[i].pid > 0 && kill(workers[i].pid, sig))
+            log_pwarning("kill %d", workers[i].pid);
+    }
+}
+
+/*
+ * Start a new process, and wait for count workers to become ready.
+ *
+ * Returns 0 once ready, >0 if the new process failed, <0 on errors.
+ */
+static int daemon_workers_reload (unsigned count)
+{
+    time_t deadline = time(NULL) + DAEMON_RELOAD_TIMEOUT;
+    struct pollfd pfd = { .events = POLLIN };
+    int err, ret;
+
+    if ((err = daemon_reload(&pfd.fd)))
+        return err;
+
+    while ((err = daemon_reload_ready(pfd.fd, &count)) == 1) {
+        time_t now = time(NULL);
+
+        if (now >= deadline) {
+            log_error("reload: timeout waiting for %u workers", count);
+            break;
+        }
+
+        if ((ret = poll(&pfd, 1, (deadline - now) * 1000)) < 0 && errno != EINTR) {
+            log_perror("poll");
+            err = -1;
+            break;
+        }
+    }
+
+    close(pfd.fd);
+
+    if (err == 2)
+        log_error("reload: failed to start");
+
+    return err;
+}
+
+int daemon_workers (unsigned count, daemon_worker_func *func, void *ctx)
+{
+    struct daemon_worker *workers;
+    struct sigaction sa = { .sa_handler = daemon_signal };
+    struct sigaction reload_sa = { .sa_handler = daemon_signal_reload };
+    unsigned running = 0;
+    int err = 0;
+#ifdef __linux__
+    cpu_set_t cpus;
+
+    if (sched_getaffinity(0, sizeof(cpus), &cpus)) {
+        log_pwarning("sched_getaffinity");
+        CPU_ZERO(&cpus);
+    }
+#else
+    int cpus;
+#endif
+
+    if (!(workers = calloc(count, sizeof(*workers)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    // no SA_RESTART, to interrupt waitpid()
+    sigemptyset(&sa.sa_mask);
+    sigemptyset(&reload_sa.sa_mask);
+
+    if (sigaction(SIGINT, &sa, NULL) || sigaction(SIGTERM, &sa, NULL) || sigaction(SIGQUIT, &sa, NULL)) {
+        log_perror("sigaction");
+        err = -1;
+        goto exit;
+    }
+
+    if (sigaction(SIGHUP, &reload_sa, NULL) || sigaction(SIGUSR2, &reload_sa, NULL)) {
+        log_perror("sigaction");
+        err = -1;
+        goto exit;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        if ((err = daemon_worker_start(&workers[i], i, &cpus, func, ctx))) {
+            log_error("daemon_worker_start %u", i);
+            daemon_stop = SIGTERM;
+            break;
+        }
+
+        running++;
+    }
+
+    // only the workers notify the previous process
+    if (daemon_ready_fd >= 0) {
+        close(daemon_ready_fd);
+        daemon_ready_fd = -1;
+    }
+
+    while (running) {
+        struct daemon_worker *worker = NULL;
+        unsigned index;
+        int status;
+        pid_t pid;
+
+        if (daemon_reload_signal && !daemon_stop) {
+            log_info("reload: %s", strsignal(daemon_reload_signal));
+
+            daemon_reload_signal = 0;
+
+            // keep running on failure
+            if (!daemon_workers_reload(count))
+                daemon_stop = SIGQUIT;
+        }
+
+        if (daemon_stop) {
+            log_info("stop: %s", strsignal(daemon_stop));
+
+            // SIGQUIT lets the workers finish any requests in progress
+            daemon_workers_kill(workers, count, daemon_stop == SIGQUIT ? SIGQUIT : SIGTERM);
+
+            // the workers have been signaled once, ignore further interrupts
+            daemon_stop = 0;
+            sa.sa_handler = SIG_IGN;
+            sigaction(SIGINT, &sa, NULL);
+            sigaction(SIGTERM, &sa, NULL);
+            sigaction(SIGQUIT, &sa, NULL);
+            sigaction(SIGHUP, &sa, NULL);
+            sigaction(SIGUSR2, &sa, NULL);
+
+            for (unsigned i = 0; i < count; i++) {
+                if (workers[i].pid > 0)
+                    workers[i].pid = -workers[i].pid;
+            }
+        }
+
+        if ((pid = waitpid(-1, &status, 0)) < 0 && errno == EINTR) {
+            continue;
+
+        } else if (pid < 0) {
+            log_perror("waitpid");
+            err = -1;
+            break;
+        }
+
+        for (index = 0; index < count; index++) {
+            if (workers[index].pid == pid || workers[index].pid == -pid) {
+                worker = &workers[index];
+                break;
+            }
+        }
+
+        if (!worker) {
+            log_warning("unknown child %d", pid);
+            continue;
+        }
+
+        running--;
+
+        if (worker->pid < 0) {
+            // stopping
+            log_info("worker %u: pid %d stopped", index, pid);
+
+            worker->pid = 0;
+            continue;
+        }
+
+        worker->pid = 0;
+
+        if (WIFEXITED(status) && WEXITSTATUS(status) == DAEMON_WORKER_EXIT) {
+            log_info("worker %u: pid %d exited", index, pid);
+            continue;
+
+        } else if (WIFEXITED(status) && WEXITSTATUS(status) == DAEMON_WORKER_STARTUP) {
+            log_error("worker %u: pid %d failed to start", index, pid);
+            err = 1;
+            daemon_stop = SIGTERM;
+            continue;
+
+        } else if (daemon_stop) {
+            // died while we were being stopped
+            log_info("worker %u: pid %d stopped", index, pid);
+            continue;
+
+        } else if (WIFEXITED(status)) {
+            log_warning("worker %u: pid %d exited with %d, restarting", index, pid, WEXITSTATUS(status));
+
+        } else if (WIFSIGNALED(status)) {
+            log_warning("worker %u: pid %d killed by %s, restarting", index, pid, strsignal(WTERMSIG(status)));
+
+        } else {
+            log_warning("worker %u: pid %d exited with status %#x, restarting", index, pid, status);
+        }
+
+        if (time(NULL) - worker->start < DAEMON_WORKER_RESTART) {
+            // avoid spinning on a crashing worker; interrupted by SIGINT/SIGTERM
+            sleep(DAEMON_WORKER_RESTART);
+        }
+
+        if (daemon_stop)
+            continue;
+
+        if (daemon_worker_start(worker, index, &cpus, func, ctx)) {
+            log_error("daemon_worker_start %u", index);
+            err = -1;
+            daemon_stop = SIGTERM;
+            continue;
+        }
+
+        running++;
+    }
+
+exit:
+    free(workers);
+
+    return err;
+}
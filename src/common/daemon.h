@@ -1,8 +1,17 @@
 #ifndef DAEMON_H
 #define DAEMON_H
 
+/* Environment variables used to pass state to the process started by daemon_reload() */
+#define DAEMON_FDS_ENV "DAEMON_FDS"
+#define DAEMON_READY_ENV "DAEMON_READY_FD"
+
+/* Seconds for daemon_workers() to wait for the new process to start up on reload */
+#define DAEMON_RELOAD_TIMEOUT 30
+
 /*
  * Become a daemon.
+ *
+ * This also picks up any fds passed from a previous process using daemon_reload(), see daemon_inherit().
  */
 int daemon_init ();
 
@@ -11,4 +20,68 @@ int daemon_init ();
  */
 int daemon_start ();
 
+/*
+ * Deliver the given signals as one byte per signal received, containing the signal number, to a nonblocking pipe,
+ * returning the read end for use within an event loop.
+ */
+int daemon_signals (int *fdp, const int *sigs, unsigned count);
+
+/*
+ * Return any fds passed from the previous process by daemon_reload(), in the same order, taking ownership of them.
+ *
+ * Returns 0 with *countp = 0 if there were none.
+ */
+int daemon_inherit (int **fdsp, unsigned *countp);
+
+/*
+ * Notify the previous process waiting within daemon_reload_ready(), if any, that this process has started up.
+ *
+ * Each worker process should call this once, or the process itself, if not using daemon_workers().
+ */
+void daemon_ready (void);
+
+/*
+ * Set the argv used to re-exec the running program, and the fds to pass over, for daemon_reload().
+ *
+ * The argv and fds must remain valid.
+ */
+void daemon_set_reload (char **argv, const int *fds, unsigned count);
+
+/*
+ * Start a new process running the same program, passing the fds from daemon_set_reload(), returning a nonblocking
+ * read fd for daemon_reload_ready().
+ */
+int daemon_reload (int *readyp);
+
+/*
+ * Read startup notifications from the new process, decrementing *countp for each daemon_ready().
+ *
+ * Returns 0 once *countp reaches zero, 1 if still pending, or 2 if the new process has failed to start up.
+ */
+int daemon_reload_ready (int ready, unsigned *countp);
+
+/*
+ * Worker process main function, given the worker index 0..count-1.
+ *
+ * Return 0 on clean exit, <0 on runtime errors, or >0 on startup errors.
+ */
+typedef int (daemon_worker_func)(void *ctx, unsigned index);
+
+/*
+ * Fork count worker processes to run the given func, and supervise them.
+ *
+ * Each worker is pinned to a separate CPU, where supported. Workers that die or fail at runtime
+ * are restarted, at most once per second, whereas workers that exit cleanly are left alone.
+ *
+ * Returns 0 once all workers have exited cleanly, or after a SIGINT/SIGTERM, which is forwarded
+ * to the workers. A SIGQUIT is forwarded as-is, for the workers to exit gracefully. Returns >0 if
+ * any worker fails on startup, after stopping the other workers, or <0 on internal errors.
+ *
+ * On SIGHUP/SIGUSR2, a new process is started using daemon_reload(), and once all of its workers
+ * are ready, the workers are stopped using SIGQUIT. The workers ignore SIGHUP/SIGUSR2.
+ *
+ * This only returns within the supervising parent process.
+ */
+int daemon_workers (unsigned count, daemon_worker_func *func, void *ctx);
+
 #endif
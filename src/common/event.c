@@ -1,14 +1,21 @@
 #include "event.h"
+#include "event_poll.h"
 
 #include "common/log.h"
+#include "common/pool.h"
+#include "common/stats.h"
 #include "common/util.h"
 
 #include <pcl.h>
 
 #include <assert.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/queue.h>
+#include <unistd.h>
 
 #ifdef VALGRIND
 #include <valgrind/valgrind.h>
@@ -26,6 +33,54 @@ struct event_main {
      * events have any tasks associated.
      */
     TAILQ_HEAD(event_main_events, event) events;
+
+    /*
+     * Events that have been event_destroy()'d from within a task, pending cleanup by event_main().
+     */
+    TAILQ_HEAD(event_main_destroys, event) destroys;
+
+    /*
+     * Number of events with a task pending on them.
+     */
+    int registered;
+
+    /*
+     * Binary min-heap of events pending with EVENT_TIMEOUT, ordered by their absolute timeout.
+     */
+    struct event **timers;
+    unsigned timers_count, timers_size;
+
+    /*
+     * IO readiness backend.
+     */
+    const struct event_poll_type *poll;
+    void *poll_ctx;
+
+    /*
+     * Stack size for new tasks, excluding the guard page.
+     */
+    size_t task_size;
+
+    /*
+     * Exited tasks kept for re-use by _event_start(), up to tasks_max.
+     */
+    TAILQ_HEAD(event_main_tasks, event_task) tasks;
+    unsigned tasks_count, tasks_max;
+
+    /*
+     * Wall-clock time, updated once per loop iteration after polling.
+     */
+    struct timeval now;
+
+    /*
+     * CLOCK_MONOTONIC time, updated around each poll, used for all timers.
+     */
+    struct timeval clock;
+
+    /*
+     * Set by event_main_stop().
+     */
+    bool stop;
 };
 
 struct event {
@@ -46,6 +101,11 @@ struct event {
      */
     struct timeval timeout;
 
+    /*
+     * Position in the event_main timers heap + 1, or 0 if not queued.
+     */
+    unsigned timer;
+
     /*
      * The task that has yielded on this event.
      * Only one task may be yielding on an event at any time!
@@ -54,6 +114,26 @@ struct event {
      */
     struct event_task *task;
 
+    /*
+     * The EVENT_READ|EVENT_WRITE interest currently registered with the poll backend.
+     *
+     * This is left registered after the task wakes up, and only updated once the next event_register()
+     * asks for something different, or the fd becomes ready without any task pending on it.
+     */
+    int poll_flags;
+
+    /*
+     * The task to start once this event_park()'d event happens, in place of any pending task.
+     */
+    const char *park_name;
+    event_task_func *park_func;
+    void *park_ctx;
+
+    /*
+     * The flags that last started a task for an event_park()'d event.
+     */
+    int parked;
+
     /*
      * Delayed event_destroy() while within event_main()
      */
@@ -98,14 +178,153 @@ struct event_task {
     coroutine_t co;
     void *co_stack;
 
+    /*
+     * Usable size of co_stack, which is preceded by an inaccessible guard page.
+     */
+    size_t co_size;
+
 #ifdef VALGRIND
     int co_valgrind;
 #endif
+
+    /*
+     * Queued in event_main->tasks for re-use after exiting.
+     */
+    TAILQ_ENTRY(event_task) event_main_tasks;
 };
 
-int event_main_create (struct event_main **event_mainp)
+/*
+ * Page size, used to round up stack sizes and for the stack guard pages.
+ */
+static size_t event_page_size (void)
+{
+    static size_t page_size;
+
+    if (!page_size) {
+        long ret = sysconf(_SC_PAGESIZE);
+
+        page_size = ret > 0 ? ret : 4096;
+    }
+
+    return page_size;
+}
+
+/*
+ * Timer heap maintenance.
+ */
+static inline bool event_timer_before (const struct event *a, const struct event *b)
+{
+    return timercmp(&a->timeout, &b->timeout, <);
+}
+
+static inline void event_timer_place (struct event_main *event_main, unsigned i, struct event *event)
+{
+    event_main->timers[i] = event;
+    event->timer = i + 1;
+}
+
+static void event_timer_up (struct event_main *event_main, unsigned i)
+{
+    struct event *event = event_main->timers[i];
+
+    while (i > 0) {
+        unsigned parent = (i - 1) / 2;
+
+        if (!event_timer_before(event, event_main->timers[parent]))
+            break;
+
+        event_timer_place(event_main, i, event_main->timers[parent]);
+        i = parent;
+    }
+
+    event_timer_place(event_main, i, event);
+}
+
+static void event_timer_down (struct event_main *event_main, unsigned i)
+{
+    struct event *event = event_main->timers[i];
+    unsigned count = event_main->timers_count;
+
+    while (2 * i + 1 < count) {
+        unsigned child = 2 * i + 1;
+
+        if (child + 1 < count && event_timer_before(event_main->timers[child + 1], event_main->timers[child]))
+            child++;
+
+        if (!event_timer_before(event_main->timers[child], event))
+            break;
+
+        event_timer_place(event_main, i, event_main->timers[child]);
+        i = child;
+    }
+
+    event_timer_place(event_main, i, event);
+}
+
+static int event_timer_insert (struct event_main *event_main, struct event *event)
+{
+    if (event_main->timers_count >= event_main->timers_size) {
+        unsigned size = event_main->timers_size ? event_main->timers_size * 2 : 64;
+        struct event **timers;
+
+        if (!(timers = realloc(event_main->timers, size * sizeof(*timers)))) {
+            log_perror("realloc");
+            return -1;
+        }
+
+        event_main->timers = timers;
+        event_main->timers_size = size;
+    }
+
+    event_main->timers[event_main->timers_count] = event;
+    event_timer_up(event_main, event_main->timers_count++);
+
+    return 0;
+}
+
+static void event_timer_remove (struct event_main *event_main, struct event *event)
+{
+    unsigned i = event->timer - 1;
+    struct event *last = event_main->timers[--event_main->timers_count];
+
+    event->timer = 0;
+
+    if (last == event)
+        return;
+
+    // move the last timer into the hole, and restore heap order in whichever direction it is out of place
+    event_main->timers[i] = last;
+
+    if (i > 0 && event_timer_before(last, event_main->timers[(i - 1) / 2]))
+        event_timer_up(event_main, i);
+    else
+        event_timer_down(event_main, i);
+}
+
+static struct pool event_pool = POOL_INIT("event", sizeof(struct event));
+
+/*
+ * Supported poll backends, in order of preference.
+ */
+static const struct event_poll_type *event_polls[] = {
+#ifdef EVENT_POLL_EPOLL
+    &event_poll_epoll,
+#endif
+#ifdef EVENT_POLL_URING
+    // only used if asked for by name, unless epoll is unavailable
+    &event_poll_uring,
+#endif
+#ifdef EVENT_POLL_KQUEUE
+    &event_poll_kqueue,
+#endif
+    &event_poll_select,
+    NULL
+};
+
+int event_main_create_poll (struct event_main **event_mainp, const char *poll)
 {
     struct event_main *event_main;
+    const struct event_poll_type **type;
 
     if (!(event_main = calloc(1, sizeof(*event_main)))) {
         log_perror("calloc");
@@ -113,29 +332,133 @@ int event_main_create (struct event_main **event_mainp)
     }
 
     TAILQ_INIT(&event_main->events);
+    TAILQ_INIT(&event_main->destroys);
+    TAILQ_INIT(&event_main->tasks);
+
+    event_main->task_size = EVENT_TASK_SIZE;
+    event_main->tasks_max = EVENT_TASK_POOL;
+
+    if (timestamp_now(&event_main->now)) {
+        log_error("timestamp_now");
+        free(event_main);
+        return -1;
+    }
+
+    if (timestamp_clock(&event_main->clock)) {
+        log_error("timestamp_clock");
+        free(event_main);
+        return -1;
+    }
+
+    for (type = event_polls; *type; type++) {
+        if (poll && strcmp((*type)->name, poll))
+            continue;
+
+        if ((*type)->create(&event_main->poll_ctx)) {
+            log_warning("%s: create failed, falling back", (*type)->name);
+            continue;
+        }
+
+        event_main->poll = *type;
+        break;
+    }
+
+    if (!event_main->poll) {
+        log_error("no usable poll backend: %s", poll ? poll : "*");
+        free(event_main);
+        return -1;
+    }
+
+    log_info("%s", event_main->poll->name);
 
     *event_mainp = event_main;
     return 0;
 }
 
+int event_main_create (struct event_main **event_mainp)
+{
+    return event_main_create_poll(event_mainp, NULL);
+}
+
+static void event_task_free (struct event_task *task);
+
+int event_main_set_tasks (struct event_main *event_main, size_t size, unsigned pool)
+{
+    size_t page_size = event_page_size();
+    struct event_task *task;
+
+    if (size < EVENT_TASK_SIZE_MIN) {
+        log_error("task stack size is too small: %zu < %d", size, EVENT_TASK_SIZE_MIN);
+        return -1;
+    }
+
+    // round up to page size
+    size = (size + page_size - 1) & ~(page_size - 1);
+
+    event_main->task_size = size;
+    event_main->tasks_max = pool;
+
+    // drop any cached tasks in excess of the new limits
+    while ((task = TAILQ_FIRST(&event_main->tasks)) && (event_main->tasks_count > pool || task->co_size != size)) {
+        TAILQ_REMOVE(&event_main->tasks, task, event_main_tasks);
+        event_main->tasks_count--;
+
+        event_task_free(task);
+    }
+
+    log_info("stack=%zu pool=%u", size, pool);
+
+    return 0;
+}
+
+const struct timeval *event_main_now (struct event_main *event_main)
+{
+    return &event_main->now;
+}
+
+const struct timeval *event_main_clock (struct event_main *event_main)
+{
+    return &event_main->clock;
+}
+
+uint64_t event_main_usec (struct event_main *event_main)
+{
+    return (uint64_t) event_main->clock.tv_sec * 1000000 + event_main->clock.tv_usec;
+}
+
+/*
+ * Refresh the cached event_main_clock(), returning it in microseconds.
+ */
+static uint64_t event_main_tick (struct event_main *event_main)
+{
+    if (timestamp_clock(&event_main->clock))
+        log_warning("timestamp_clock");
+
+    return event_main_usec(event_main);
+}
+
+void event_main_stop (struct event_main *event_main)
+{
+    event_main->stop = true;
+}
+
 int event_get_max (struct event_main *event_main)
 {
-    // TODO: switch to something better than select()
-    return FD_SETSIZE;
+    return event_main->poll->max(event_main->poll_ctx);
 }
 
 int event_create (struct event_main *event_main, struct event **eventp, int fd)
 {
     struct event *event;
+    int max = event_get_max(event_main);
 
-    // TODO: switch to something better than select()
-    if (fd >= event_get_max(event_main)) {
-        log_error("given fd is too large: %d > %d", fd, event_get_max(event_main));
+    if (max && fd >= max) {
+        log_error("given fd is too large for %s: %d > %d", event_main->poll->name, fd, max);
         return -1;
     }
 
-    if (!(event = calloc(1, sizeof(*event)))) {
-        log_perror("calloc");
+    if (!(event = pool_calloc(&event_pool))) {
+        log_error("pool_calloc");
         return -1;
     }
     
@@ -150,6 +473,103 @@ int event_create (struct event_main *event_main, struct event **eventp, int fd)
     return 0;
 }
 
+/*
+ * Release task and stack memory.
+ */
+static void event_task_free (struct event_task *task)
+{
+    if (task->co_stack) {
+#ifdef VALGRIND
+        VALGRIND_STACK_DEREGISTER(task->co_valgrind);
+#endif
+
+        if (munmap(task->co_stack - event_page_size(), event_page_size() + task->co_size))
+            log_pwarning("munmap");
+
+        stats->event_stacks--;
+    }
+
+    free(task);
+}
+
+/*
+ * Get a task with an unused stack, either re-using an exited task, or allocating a new one.
+ */
+static struct event_task *event_task_alloc (struct event_main *event_main)
+{
+    size_t page_size = event_page_size();
+    struct event_task *task;
+    void *map;
+
+    if ((task = TAILQ_FIRST(&event_main->tasks))) {
+        TAILQ_REMOVE(&event_main->tasks, task, event_main_tasks);
+        event_main->tasks_count--;
+        stats->event_tasks++;
+
+        return task;
+    }
+
+    if (!(task = calloc(1, sizeof(*task)))) {
+        log_perror("calloc");
+        return NULL;
+    }
+
+    // the stack grows down towards the guard page, which will catch any overflow with a SIGSEGV
+    if ((map = mmap(NULL, page_size + event_main->task_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        log_perror("mmap co_stack");
+        free(task);
+        return NULL;
+    }
+
+    task->co_stack = map + page_size;
+    task->co_size = event_main->task_size;
+
+    stats->event_stacks++;
+    stats->event_tasks++;
+
+    if (mprotect(map, page_size, PROT_NONE)) {
+        log_perror("mprotect co_stack guard");
+        event_task_free(task);
+        return NULL;
+    }
+
+#ifdef VALGRIND
+    task->co_valgrind = VALGRIND_STACK_REGISTER(task->co_stack, task->co_stack + task->co_size);
+    log_info("VALGRIND_STACK_REGISTER(%p, %p) = %d",
+            task->co_stack, 
+            task->co_stack + task->co_size,
+            task->co_valgrind
+    );
+#endif
+
+    return task;
+}
+
+/*
+ * Return an exited task for re-use, or free it if the pool is full.
+ */
+static void event_task_release (struct event_main *event_main, struct event_task *task)
+{
+    stats->event_tasks--;
+
+    if (event_main->tasks_count >= event_main->tasks_max || task->co_size != event_main->task_size) {
+        event_task_free(task);
+        return;
+    }
+
+    // reset everything except the stack
+    *task = (struct event_task) {
+        .co_stack       = task->co_stack,
+        .co_size        = task->co_size,
+#ifdef VALGRIND
+        .co_valgrind    = task->co_valgrind,
+#endif
+    };
+
+    TAILQ_INSERT_HEAD(&event_main->tasks, task, event_main_tasks);
+    event_main->tasks_count++;
+}
+
 /*
  * This function is responsible for going further down into the task stack, and maintaining the
  * event_main->task state.
@@ -178,8 +598,7 @@ static void event_switch (struct event_main *event_main, struct event_task **tas
         // notify caller as well - we might also be deleting ourself!?
         *taskp = NULL;
 
-        free(task->co_stack);
-        free(task);
+        event_task_release(event_main, task);
 
     } else {
         log_debug("%s[%p] <- %s[%p]", main_name, main_task, task->name, task);
@@ -209,35 +628,21 @@ int _event_start (struct event_main *event_main, const char *name, event_task_fu
 {
     struct event_task *task;
 
-    if (!(task = calloc(1, sizeof(*task)))) {
-        log_perror("calloc");
+    if (!(task = event_task_alloc(event_main))) {
+        log_error("event_task_alloc");
         return -1;
     }
 
     task->name = name;
-
-    if (!(task->co_stack = malloc(EVENT_TASK_SIZE))) {
-        log_perror("malloc co_stack");
-        goto error;
-    }
-
     task->func = func;
     task->ctx = ctx;
 
-    if (!(task->co = co_create(event_task, task, task->co_stack, EVENT_TASK_SIZE))) {
+    // (re-)initialize the coroutine on the stack
+    if (!(task->co = co_create(event_task, task, task->co_stack, task->co_size))) {
         log_perror("co_create");
         goto error;
     }
 
-#ifdef VALGRIND
-    task->co_valgrind = VALGRIND_STACK_REGISTER(task->co_stack, task->co_stack + EVENT_TASK_SIZE);
-    log_info("VALGRIND_STACK_REGISTER(%p, %p) = %d",
-            task->co_stack, 
-            task->co_stack + EVENT_TASK_SIZE,
-            task->co_valgrind
-    );
-#endif
-
     log_debug("-> %s[%p]", task->name, task);
 
     event_switch(event_main, &task);
@@ -249,8 +654,7 @@ int _event_start (struct event_main *event_main, const char *name, event_task_fu
     return 0;
 
 error:
-    free(task->co_stack);
-    free(task);
+    event_task_release(event_main, task);
 
     return -1;
 }
@@ -263,6 +667,44 @@ int event_pending (struct event *event)
     return 0;
 }
 
+/*
+ * Update poll interest and timer for the given pending event.
+ */
+static int event_arm (struct event *event, int flags, const struct timeval *timeout)
+{
+    // update poll backend interest, if changed, leaving it as-is while waiting for an event_io() completion
+    int poll_flags = flags & (EVENT_READ | EVENT_WRITE);
+
+    if (event->fd >= 0 && !(flags & EVENT_IO) && poll_flags != event->poll_flags) {
+        if (event->event_main->poll->set(event->event_main->poll_ctx, event->fd, event->poll_flags, poll_flags, event)) {
+            log_error("%d: poll set %x -> %x", event->fd, event->poll_flags, poll_flags);
+            return -1;
+        }
+
+        event->poll_flags = poll_flags;
+    }
+
+    event->flags = flags;
+
+    if (timeout) {
+        event->flags |= EVENT_TIMEOUT;
+
+        // set timeout in future
+        timeradd(&event->event_main->clock, timeout, &event->timeout);
+
+    } else if (event->flags & EVENT_TIMEOUT) {
+        // set immediate timeout
+        event->timeout = event->event_main->clock;
+    }
+
+    if ((event->flags & EVENT_TIMEOUT) && event_timer_insert(event->event_main, event)) {
+        log_error("event_timer_insert");
+        return -1;
+    }
+
+    return 0;
+}
+
 int event_register (struct event *event, int flags, const struct timeval *timeout)
 {
     struct event_task *task = event->event_main->task;
@@ -281,27 +723,17 @@ int event_register (struct event *event, int flags, const struct timeval *timeou
         log_fatal("Task %s[%p] attempted to override event %d[%p] task %s[%p]", task->name, task, event->fd, event, event->task->name, event->task);
         return -1;
     }
-    
-    event->task = task;
-    event->flags = flags;
-
-    if (timeout) {
-        event->flags |= EVENT_TIMEOUT;
 
-        // set timeout in future
-        if (timestamp_from_timeout(&event->timeout, timeout)) {
-            log_error("timestamp_from_timeout");
-            return -1;
-        }
-        
-    } else if (event->flags & EVENT_TIMEOUT) {
-        // set immediate timeout
-        if (timestamp_now(&event->timeout)) {
-            log_error("timestamp_now");
-            return -1;
-        }
+    if (event->park_func) {
+        log_fatal("Task %s[%p] attempted to override event %d[%p] parked for %s", task->name, task, event->fd, event, event->park_name);
+        return -1;
     }
 
+    event->task = task;
+
+    if (event_arm(event, flags, timeout))
+        return -1;
+
     log_debug("%s[%p] %d(%s%s%s)", task->name, task, event->fd,
             event->flags & EVENT_READ ? "R" : "",
             event->flags & EVENT_WRITE ? "W" : "",
@@ -310,10 +742,99 @@ int event_register (struct event *event, int flags, const struct timeval *timeou
 
     // mark
     task->registered++;
+    event->event_main->registered++;
+
+    return 0;
+}
+
+int _event_park (struct event *event, int flags, const struct timeval *timeout, const char *name, event_task_func *func, void *ctx)
+{
+    if (!flags) {
+        log_fatal("attempted to park event %d[%p] without flags", event->fd, event);
+        return -1;
+    }
+
+    if (event->task || event->park_func) {
+        log_fatal("attempted to park already pending event %d[%p]", event->fd, event);
+        return -1;
+    }
+
+    event->park_name = name;
+    event->park_func = func;
+    event->park_ctx = ctx;
+
+    if (event_arm(event, flags, timeout))
+        return -1;
+
+    log_debug("%d(%s%s%s) -> %s", event->fd,
+            event->flags & EVENT_READ ? "R" : "",
+            event->flags & EVENT_WRITE ? "W" : "",
+            event->flags & EVENT_TIMEOUT ? "T" : "",
+            name
+    );
+
+    event->event_main->registered++;
+
+    return 0;
+}
+
+int event_parked (struct event *event)
+{
+    return event->parked;
+}
+
+int event_cancel (struct event *event)
+{
+    if (!event->task && !event->park_func)
+        return 1;
+
+    if (event->timer)
+        event_timer_remove(event->event_main, event);
+
+    // expire on the next iteration
+    event->flags |= EVENT_TIMEOUT;
+    event->timeout = event->event_main->clock;
+
+    if (event_timer_insert(event->event_main, event)) {
+        log_error("event_timer_insert");
+        return -1;
+    }
 
     return 0;
 }
 
+/*
+ * Clear yield state after wakeup.
+ */
+static void event_clear (struct event *event)
+{
+    if (event->task || event->park_func)
+        event->event_main->registered--;
+
+    if (event->timer)
+        event_timer_remove(event->event_main, event);
+
+    event->flags = 0;
+    event->task = NULL;
+    event->park_func = NULL;
+    event->park_ctx = NULL;
+}
+
+/*
+ * Drop any poll backend interest for the event.
+ */
+static void event_unpoll (struct event *event)
+{
+    if (event->fd < 0 || !event->poll_flags)
+        return;
+
+    if (event->event_main->poll->set(event->event_main->poll_ctx, event->fd, event->poll_flags, 0, event)) {
+        log_warning("%d: poll set %x -> 0", event->fd, event->poll_flags);
+    }
+
+    event->poll_flags = 0;
+}
+
 /*
  * Internal wait-for-event_switch()-from-event_main() mechaism.
  *
@@ -365,7 +886,6 @@ static int _event_yield (struct event_main *event_main, struct event **eventp)
 
 int event_main_yield (struct event_main *event_main, struct event **eventp)
 {
-    struct event_task *task = event_main->task;
     struct event *event = NULL;
 
     if (_event_yield(event_main, &event)) {
@@ -373,12 +893,8 @@ int event_main_yield (struct event_main *event_main, struct event **eventp)
         return -1;
     }
     
-    // read event state, TODO: timeouts
-    int flags = event->flags;
-    
-    // clear yield state
-    event->flags = 0;
-    event->task = NULL;
+    // clear yield state, TODO: timeouts
+    event_clear(event);
     
     // ok
     *eventp = event;
@@ -398,8 +914,7 @@ int event_yield (struct event *event, int flags, const struct timeval *timeout)
     flags = event->flags;
     
     // clear yield state
-    event->flags = 0;
-    event->task = NULL;
+    event_clear(event);
 
     if (flags & EVENT_TIMEOUT)
         return 1;
@@ -407,6 +922,66 @@ int event_yield (struct event *event, int flags, const struct timeval *timeout)
         return 0;
 }
 
+int event_main_io (struct event_main *event_main)
+{
+    return event_main->poll->submit != NULL;
+}
+
+int event_io (struct event *event, struct event_io *io, const struct timeval *timeout)
+{
+    struct event_main *event_main = event->event_main;
+    bool cancelled = false;
+    int flags;
+
+    if (!event_main->poll->submit) {
+        log_fatal("%d[%p] %s does not support event_io()", event->fd, event, event_main->poll->name);
+        return -1;
+    }
+
+    io->event = event;
+
+    if (event_register(event, EVENT_IO, timeout))
+        return -1;
+
+    if (event_main->poll->submit(event_main->poll_ctx, event->fd, io)) {
+        log_error("%s submit %d: %d", event_main->poll->name, event->fd, io->type);
+
+        event_main->task->registered--;
+        event_clear(event);
+
+        return -1;
+    }
+
+    do {
+        if (_event_yield(event_main, &event))
+            return -1;
+
+        // read event state
+        flags = event->flags;
+
+        // clear yield state
+        event_clear(event);
+
+        if (flags & EVENT_TIMEOUT) {
+            // the kernel may still be using the io buffers until it completes
+            if (!cancelled && event_main->poll->cancel(event_main->poll_ctx, io)) {
+                log_fatal("%s cancel %d: %d", event_main->poll->name, event->fd, io->type);
+                return -1;
+            }
+
+            cancelled = true;
+
+            if (event_register(event, EVENT_IO, NULL))
+                return -1;
+        }
+    } while (!(flags & EVENT_IO));
+
+    if (cancelled && io->result == -ECANCELED)
+        return 1;
+    else
+        return 0;
+}
+
 int event_sleep (struct event *event, const struct timeval *timeout)
 {
     if (event_register(event, EVENT_TIMEOUT, timeout))
@@ -420,8 +995,7 @@ int event_sleep (struct event *event, const struct timeval *timeout)
     int flags = event->flags;
 
     // clear yield state
-    event->flags = 0;
-    event->task = NULL;
+    event_clear(event);
 
     if (flags != EVENT_TIMEOUT) {
         struct event_task *task = event->event_main->task;
@@ -508,7 +1082,16 @@ int event_notify (struct event *event, struct event_task **notifyp)
 
 void event_destroy (struct event *event)
 {
-    if (event->task && event->task->registered) {
+    struct event_main *event_main = event->event_main;
+
+    if (event->task && (event->flags & EVENT_IO)) {
+        // the completion would still be returned for this event
+        log_fatal("%d[%p] with pending event_io() from task %s[%p]",
+                event->fd, event,
+                event->task->name, event->task
+        );
+
+    } else if (event->task && event->task->registered) {
         log_debug("%d[%p] unregistering from task %s[%p]",
                 event->fd, event,
                 event->task->name, event->task
@@ -520,157 +1103,185 @@ void event_destroy (struct event *event)
                 event->fd, event,
                 event->task->name, event->task
         );
+
+    } else if (event->park_func) {
+        log_debug("%d[%p] dropping parked %s", event->fd, event, event->park_name);
     }
 
-    event->task = NULL;
+    event_clear(event);
+
+    // the fd is likely to be close()'d right after this, and may then be re-used for a different event
+    event_unpoll(event);
+
+    TAILQ_REMOVE(&event_main->events, event, event_main_events);
 
-    if (event->event_main->task) {
+    if (event_main->task) {
         log_debug("%d[%p] delaying destroy() from task %s[%p]",
                 event->fd, event,
-                event->event_main->task->name, event->event_main->task
+                event_main->task->name, event_main->task
         );
 
+        // may still be referenced from the current event_main_run() iteration
         event->destroy = true;
 
+        TAILQ_INSERT_TAIL(&event_main->destroys, event, event_main_events);
+
     } else {
         log_debug("%d[%p]", event->fd, event);
 
-        TAILQ_REMOVE(&event->event_main->events, event, event_main_events);
-
-        free(event);
+        pool_free(&event_pool, event);
     }
 }
 
-int event_main_run (struct event_main *event_main)
+/*
+ * Wake up the task pending on the given event, with the given flags.
+ */
+static void event_main_wakeup (struct event_main *event_main, struct event *event, int flags)
 {
-    fd_set read, write;
-    int err;
+    struct event_task *task = event->task;
 
-    while (true) {
-        int nfds = 0, ret;
-        struct event *event;
-        struct timeval event_timeout = { 0, 0 };
-        struct event *timeout_event = NULL;
+    event->flags = flags;
+    task->event = event;
+
+    // this may event_destroy(event)
+    event_switch(event_main, &task);
+}
 
-        FD_ZERO(&read);
-        FD_ZERO(&write);
+/*
+ * Start a new task for a parked event.
+ */
+static void event_main_unpark (struct event_main *event_main, struct event *event, int flags)
+{
+    const char *name = event->park_name;
+    event_task_func *func = event->park_func;
+    void *ctx = event->park_ctx;
+    int park_flags = event->flags & ~EVENT_TIMEOUT;
 
-        // event_destroy -safe loop...
-        struct event *event_next;
+    event_clear(event);
 
-        for (event = TAILQ_FIRST(&event_main->events); event; event = event_next) {
-            event_next = TAILQ_NEXT(event, event_main_events);
+    event->parked = flags;
 
-            // ...delayed GC
-            if (event->destroy) {
-                event_destroy(event);
-                continue;
-            }
+    // this may event_destroy(event)
+    if (_event_start(event_main, name, func, ctx)) {
+        log_error("%d[%p] failed to start %s, retrying", event->fd, event, name);
 
-            // select's FD_SET only supports fd's under a certain limit (e.g. 1k), larger ones invoke undefined behaviour.
-            assert(event->fd < FD_SETSIZE);
-                
-            if (event->flags & EVENT_READ)
-                FD_SET(event->fd, &read);
-            
-            if (event->flags & EVENT_WRITE)
-                FD_SET(event->fd, &write);
-
-            if (event->flags & EVENT_TIMEOUT) {
-                if (!event_timeout.tv_sec || event->timeout.tv_sec < event_timeout.tv_sec || (   
-                        event->timeout.tv_sec == event_timeout.tv_sec 
-                    &&  event->timeout.tv_usec < event_timeout.tv_usec
-                )) {
-                    event_timeout = event->timeout;
-                    timeout_event = event;
-                }
-            }
+        // retry on the next iteration
+        event->park_name = name;
+        event->park_func = func;
+        event->park_ctx = ctx;
 
-            // mark as active event
-            if (event->flags && event->fd >= nfds)
-                nfds = event->fd + 1;
+        if (event_arm(event, park_flags | EVENT_TIMEOUT, NULL)) {
+            log_fatal("%d[%p] event_arm", event->fd, event);
+        } else {
+            event_main->registered++;
         }
+    }
+}
 
-        if (!nfds) {
+int event_main_run (struct event_main *event_main)
+{
+    struct event_poll_ready ready[EVENT_POLL_MAX];
+    struct event *event;
+    uint64_t poll_start, poll_end = 0;
+
+    while (true) {
+        int ret;
+
+        // delayed GC
+        while ((event = TAILQ_FIRST(&event_main->destroys))) {
+            TAILQ_REMOVE(&event_main->destroys, event, event_main_events);
+
+            pool_free(&event_pool, event);
+        }
+
+        if (!event_main->registered) {
             log_info("exit");
             return 0;
         }
 
-        // select, with timeout?
-        if (timeout_event) {
-            struct timeval select_timeout;
+        if (event_main->stop) {
+            log_info("stop");
+            return 0;
+        }
+
+        // write out any buffered log output from this iteration, before blocking
+        log_flush();
 
-            // convert event_timeout timestamp -> select timeout
-            // if the event_timeout is in the past, we sill simply poll select and notify the timeout on this iteration..
-            //  XXX: select() may return nonzero even with a zero timeout, meaning that we don't service this timeout
-            //       until we are otherwise idle on IO..
-            if ((err = timeout_from_timestamp(&select_timeout, &event_timeout)) < 0) {
-                log_warning("timestamp_timeout");
-                return -1;
-            } else if (err) {
-                log_warning("event[%p] timeout in past", timeout_event);
-            }
+        poll_start = event_main_tick(event_main);
 
-            log_debug("select: %d timeout=%ld:%ld", nfds, select_timeout.tv_sec, select_timeout.tv_usec);
-            
-            ret = select(nfds, &read, &write, NULL, &select_timeout);
+        if (poll_end)
+            stats->event_run_usec += poll_start - poll_end;
 
-        } else {
-            log_debug("select: %d", nfds);
+        // poll, with timeout for the earliest timer?
+        if (event_main->timers_count) {
+            struct timeval poll_timeout;
 
-            ret = select(nfds, &read, &write, NULL, NULL);
+            // if the earliest timeout is already in the past, this will just poll for any IO before expiring timers
+            timeout_between(&poll_timeout, &event_main->clock, &event_main->timers[0]->timeout);
+
+            ret = event_main->poll->wait(event_main->poll_ctx, &poll_timeout, ready, EVENT_POLL_MAX);
+
+        } else {
+            ret = event_main->poll->wait(event_main->poll_ctx, NULL, ready, EVENT_POLL_MAX);
         }
         
         if (ret < 0) {
-            log_perror("select");
+            log_error("%s", event_main->poll->name);
             return -1; 
         }
-        
-        if (!ret) {
-            // timed out
-            if (!timeout_event) {
-                log_error("select timeout without event?!");
+
+        poll_end = event_main_tick(event_main);
+
+        stats->event_poll_usec += poll_end - poll_start;
+        stats->event_iterations++;
+        stats_histogram_add(&stats->event_ready, ret);
+
+        if (timestamp_now(&event_main->now)) {
+            log_warning("timestamp_now");
+            return -1;
+        }
+
+        // only ready events; any event_destroy()'d events remain valid until the next iteration
+        for (int i = 0; i < ret; i++) {
+            event = ready[i].ptr;
+
+            int flags = ready[i].flags & event->flags;
+
+            if (event->destroy) {
+                log_debug("ignore destroyed event %d[%p] activation", event->fd, event);
+
+            } else if (flags && event->task) {
+                // the task will event_clear() any pending timer
+                event_main_wakeup(event_main, event, flags);
+
+            } else if (flags && event->park_func) {
+                event_main_unpark(event_main, event, flags);
+
+            } else if (!event->task && !event->park_func) {
+                // left registered after the previous wakeup, but nobody is interested anymore
+                log_debug("unpoll idle event %d[%p] activation", event->fd, event);
+
+                event_unpoll(event);
+
             } else {
-                struct event_task *task = timeout_event->task;
-
-                // notify
-                timeout_event->flags = EVENT_TIMEOUT;
-                task->event = timeout_event;
-                
-                // NOTE: this may event_destroy(timeout_event)
-                event_switch(event_main, &task);
+                log_debug("ignore event %d[%p] activation %x for %x", event->fd, event, ready[i].flags, event->flags);
             }
-        } else {
-            // event_destroy -safe loop...
-            struct event *event_next;
-
-            for (event = TAILQ_FIRST(&event_main->events); event; event = event_next) {
-                event_next = TAILQ_NEXT(event, event_main_events);
-
-                int flags = 0;
-
-                if (FD_ISSET(event->fd, &read) && (event->flags & EVENT_READ))
-                    flags |= EVENT_READ;
-                
-                if (FD_ISSET(event->fd, &write) && (event->flags & EVENT_WRITE))
-                    flags |= EVENT_WRITE;
-
-                if (!flags) {
-                    // maybe next time!
-                
-                } else if (event->task) {
-                    struct event_task *task = event->task;
-
-                    event->flags = flags;
-                    task->event = event;
-                    
-                    // this may event_destroy(event)
-                    event_switch(event_main, &task);
-                } else if (event->destroy) {
-                    log_debug("ignore destroyed event %d[%p] activation", event->fd, event);
-                } else {
-                    log_fatal("spurious event %d[%p] activation", event->fd, event);
-                }
+        }
+
+        // expire all timers, regardless of any IO
+        // immediate timeouts are set to the current clock, so strictly before it excludes any timers (re-)armed during
+        // this iteration, which only expire on the next iteration, after polling for IO
+        if (event_main->timers_count) {
+            while (event_main->timers_count && timercmp(&event_main->timers[0]->timeout, &event_main->clock, <)) {
+                event = event_main->timers[0];
+
+                event_timer_remove(event_main, event);
+
+                // NOTE: this may event_destroy(event), or re-register a new timer
+                if (event->task)
+                    event_main_wakeup(event_main, event, EVENT_TIMEOUT);
+                else
+                    event_main_unpark(event_main, event, EVENT_TIMEOUT);
             }
         }
     }
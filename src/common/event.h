@@ -1,23 +1,38 @@
 #ifndef EVENT_H
 #define EVENT_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 enum event_flag {
     EVENT_READ      = 0x01,
     EVENT_WRITE     = 0x02,
+    EVENT_IO        = 0x04,
 
     EVENT_TIMEOUT   = 0x08,
 };
 
 /*
- * Maximum stack size for event_task's.
+ * Default stack size for event_task's, see event_main_set_tasks().
  *
- * This is allocated by event_start using malloc(), and will never grow.
- * However, perhaps we can rely on Linux's lazy malloc() page allocation..
+ * This is allocated by event_start using mmap(), and will never grow.
+ * However, the pages are only allocated once touched by the task.
  */
 #define EVENT_TASK_SIZE 65536
 
+/*
+ * Minimum stack size for event_task's.
+ */
+#define EVENT_TASK_SIZE_MIN 16384
+
+/*
+ * Default number of exited event_task's and their stacks to keep for re-use.
+ */
+#define EVENT_TASK_POOL 64
+
 
 /*
  * IO reactor.
@@ -30,9 +45,51 @@ typedef void (event_task_func)(void *ctx);
 
 /*
  * Prepare a new event_main for use; initially empty.
+ *
+ * Uses the best available IO poll backend: epoll or kqueue, with select as fallback.
  */
 int event_main_create (struct event_main **event_mainp);
 
+/*
+ * Prepare a new event_main using the named IO poll backend: "epoll", "io_uring", "kqueue" or "select".
+ *
+ * Passing poll as NULL is the same as event_main_create().
+ */
+int event_main_create_poll (struct event_main **event_mainp, const char *poll);
+
+/*
+ * Configure the stack size for new tasks, rounded up to the page size, and the number of exited tasks
+ * to keep for re-use.
+ *
+ * Each stack is preceded by a guard page, such that a stack overflow will crash the process.
+ */
+int event_main_set_tasks (struct event_main *event_main, size_t size, unsigned pool);
+
+/*
+ * Return the cached wall-clock time for the current event_main loop iteration.
+ *
+ * This is updated after each poll, and may lag behind slightly for tasks that run for a long time.
+ */
+const struct timeval *event_main_now (struct event_main *event_main);
+
+/*
+ * Return the cached CLOCK_MONOTONIC time for the current event_main loop iteration, as used for all event timeouts.
+ *
+ * This is updated around each poll, without any clock calls for each event timeout, and is unaffected by any changes to
+ * the wall-clock time. As with event_main_now(), timeouts registered by tasks that run for a long time may expire early.
+ */
+const struct timeval *event_main_clock (struct event_main *event_main);
+
+/*
+ * Return event_main_clock() in microseconds, comparable with monotonic_usec().
+ */
+uint64_t event_main_usec (struct event_main *event_main);
+
+/*
+ * Return from event_main_run() before the next event loop iteration, regardless of any pending tasks.
+ */
+void event_main_stop (struct event_main *event_main);
+
 /*
  * Return the limit on acceptable fd's for use with event_create.
  * The returned value is the number of acceptable FDs, i.e. fd == max is invalid.
@@ -66,6 +123,32 @@ int event_pending (struct event *event);
  */
 int event_register (struct event *event, int flags, const struct timeval *timeout);
 
+/*
+ * Park the given event without any task: once the event happens, a new task is started to run func(ctx).
+ *
+ * This allows a task to exit while waiting on an event that may not happen for some time, releasing its stack.
+ *
+ *  flags:          some combination of EVENT_READ|EVENT_WRITE.
+ *  timeout:        relative timeout, after which the task is started regardless.
+ *
+ * Use event_parked() within the new task to check which event happened.
+ */
+int _event_park (struct event *event, int flags, const struct timeval *timeout, const char *name, event_task_func *func, void *ctx);
+#define event_park(event, flags, timeout, func, ctx) _event_park(event, flags, timeout, #func, func, ctx)
+
+/*
+ * Return the flags that started the current task for an event_park()'d event, i.e. EVENT_TIMEOUT on timeout.
+ */
+int event_parked (struct event *event);
+
+/*
+ * Wake up the task pending on the event, or start the parked task, on the next event loop iteration, as if the event
+ * had timed out.
+ *
+ * Returns 1 if there is nothing pending on the event.
+ */
+int event_cancel (struct event *event);
+
 /*
  * Yield execution on registered events.
  *
@@ -85,6 +168,56 @@ int event_main_yield (struct event_main *event_main, struct event **eventp);
  */
 int event_yield (struct event *event, int flags, const struct timeval *timeout);
 
+/*
+ * Completion-based IO operations for event_io().
+ */
+enum event_io_type {
+    EVENT_IO_READ,          // read(fd, buf, len)
+    EVENT_IO_WRITE,         // write(fd, buf, len)
+    EVENT_IO_WRITEV,        // writev(fd, iov, iovcnt)
+    EVENT_IO_SPLICE,        // splice(file, NULL, fd, NULL, len), from a pipe
+    EVENT_IO_SENDFILE,      // splice(file, &offset, pipe[1], NULL, len), and then splice(pipe[0], NULL, fd, NULL, len)
+};
+
+struct event_io {
+    enum event_io_type type;
+
+    char *buf;
+    size_t len;
+
+    const struct iovec *iov;
+    int iovcnt;
+
+    int file;
+    off_t offset;
+    int pipe[2];
+
+    /* Result of the operation on the event's fd, as the return value, or -errno */
+    int result;
+
+    /* Result of splicing the file into the pipe for EVENT_IO_SENDFILE, as the return value, or -errno */
+    int spliced;
+
+    /* Internal state for the poll backend */
+    struct event *event;
+    int pending;
+};
+
+/*
+ * Test if the event_main poll backend supports event_io(), i.e. io_uring.
+ */
+int event_main_io (struct event_main *event_main);
+
+/*
+ * Start the given operation on the event's fd, and yield until it completes.
+ *
+ * The io, and any buffers it refers to, must remain valid until this returns. On timeout, the operation is cancelled,
+ * waiting for it to complete before returning; an operation that completes regardless is returned as success.
+ *
+ * Returns 0 on completion, with io->result set, 1 on timeout (cancelled), <0 on error.
+ */
+int event_io (struct event *event, struct event_io *io, const struct timeval *timeout);
+
 /*
  * Pause execution until the next event-loop iteration.
  */
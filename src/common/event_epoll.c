@@ -0,0 +1,134 @@
+/*
+ * Linux epoll() backend for event_main.
+ */
+#include "common/event_poll.h"
+
+#ifdef EVENT_POLL_EPOLL
+
+#include "common/log.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+struct event_epoll {
+    int fd;
+
+    struct epoll_event events[EVENT_POLL_MAX];
+};
+
+static int event_epoll_create (void **ctxp)
+{
+    struct event_epoll *e;
+
+    if (!(e = calloc(1, sizeof(*e)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    if ((e->fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        log_pwarning("epoll_create1");
+        free(e);
+        return -1;
+    }
+
+    *ctxp = e;
+
+    return 0;
+}
+
+static int event_epoll_max (void *ctx)
+{
+    return 0;
+}
+
+static int event_epoll_set (void *ctx, int fd, int old_flags, int new_flags, void *ptr)
+{
+    struct event_epoll *e = ctx;
+    struct epoll_event event = {
+        .events     = (new_flags & EVENT_READ ? EPOLLIN : 0) | (new_flags & EVENT_WRITE ? EPOLLOUT : 0),
+        .data.ptr   = ptr,
+    };
+    int op;
+
+    if (!old_flags)
+        op = EPOLL_CTL_ADD;
+    else if (!new_flags)
+        op = EPOLL_CTL_DEL;
+    else
+        op = EPOLL_CTL_MOD;
+
+    if (epoll_ctl(e->fd, op, fd, &event)) {
+        log_perror("epoll_ctl %d: %d", op, fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int event_epoll_wait (void *ctx, const struct timeval *timeout, struct event_poll_ready *ready, int size)
+{
+    struct event_epoll *e = ctx;
+    int ms = -1;
+    int ret;
+
+    if (size > EVENT_POLL_MAX)
+        size = EVENT_POLL_MAX;
+
+    if (timeout) {
+        // round up, to avoid spinning on sub-millisecond timeouts
+        ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+    }
+
+    log_debug("epoll_wait: timeout=%d", ms);
+
+    if ((ret = epoll_wait(e->fd, e->events, size, ms)) < 0 && errno == EINTR) {
+        log_debug("epoll_wait: interrupted");
+        return 0;
+
+    } else if (ret < 0) {
+        log_perror("epoll_wait");
+        return -1;
+    }
+
+    for (int i = 0; i < ret; i++) {
+        uint32_t events = e->events[i].events;
+        int flags = 0;
+
+        // errors and hangups wake up both readers and writers, which will see the error from read()/write()
+        if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            flags |= EVENT_READ;
+
+        if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            flags |= EVENT_WRITE;
+
+        ready[i] = (struct event_poll_ready) {
+            .ptr    = e->events[i].data.ptr,
+            .flags  = flags,
+        };
+    }
+
+    return ret;
+}
+
+static void event_epoll_destroy (void *ctx)
+{
+    struct event_epoll *e = ctx;
+
+    if (close(e->fd))
+        log_pwarning("close");
+
+    free(e);
+}
+
+const struct event_poll_type event_poll_epoll = {
+    .name       = "epoll",
+    .create     = event_epoll_create,
+    .max        = event_epoll_max,
+    .set        = event_epoll_set,
+    .wait       = event_epoll_wait,
+    .destroy    = event_epoll_destroy,
+};
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * BSD kqueue() backend for event_main.
+ */
+#include "common/event_poll.h"
+
+#ifdef EVENT_POLL_KQUEUE
+
+#include "common/log.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+struct event_kqueue {
+    int fd;
+
+    struct kevent events[EVENT_POLL_MAX];
+};
+
+static int event_kqueue_create (void **ctxp)
+{
+    struct event_kqueue *k;
+
+    if (!(k = calloc(1, sizeof(*k)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    if ((k->fd = kqueue()) < 0) {
+        log_pwarning("kqueue");
+        free(k);
+        return -1;
+    }
+
+    *ctxp = k;
+
+    return 0;
+}
+
+static int event_kqueue_max (void *ctx)
+{
+    return 0;
+}
+
+static int event_kqueue_set (void *ctx, int fd, int old_flags, int new_flags, void *ptr)
+{
+    struct event_kqueue *k = ctx;
+    struct kevent changes[2];
+    int count = 0;
+
+    // kqueue uses separate filters for read/write; only apply the differences
+    if ((old_flags ^ new_flags) & EVENT_READ)
+        EV_SET(&changes[count++], fd, EVFILT_READ, (new_flags & EVENT_READ) ? EV_ADD : EV_DELETE, 0, 0, ptr);
+
+    if ((old_flags ^ new_flags) & EVENT_WRITE)
+        EV_SET(&changes[count++], fd, EVFILT_WRITE, (new_flags & EVENT_WRITE) ? EV_ADD : EV_DELETE, 0, 0, ptr);
+
+    if (count && kevent(k->fd, changes, count, NULL, 0, NULL) < 0) {
+        log_perror("kevent %d", fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int event_kqueue_wait (void *ctx, const struct timeval *timeout, struct event_poll_ready *ready, int size)
+{
+    struct event_kqueue *k = ctx;
+    struct timespec ts;
+    int ret, count = 0;
+
+    if (size > EVENT_POLL_MAX)
+        size = EVENT_POLL_MAX;
+
+    if (timeout) {
+        ts.tv_sec = timeout->tv_sec;
+        ts.tv_nsec = timeout->tv_usec * 1000;
+    }
+
+    if ((ret = kevent(k->fd, NULL, 0, k->events, size, timeout ? &ts : NULL)) < 0 && errno == EINTR) {
+        log_debug("kevent: interrupted");
+        return 0;
+
+    } else if (ret < 0) {
+        log_perror("kevent");
+        return -1;
+    }
+
+    // the same fd may be returned twice, for separate read/write filters
+    for (int i = 0; i < ret; i++) {
+        int flags = k->events[i].filter == EVFILT_WRITE ? EVENT_WRITE : EVENT_READ;
+
+        if (k->events[i].flags & (EV_EOF | EV_ERROR))
+            flags = EVENT_READ | EVENT_WRITE;
+
+        if (count && ready[count - 1].ptr == k->events[i].udata) {
+            ready[count - 1].flags |= flags;
+        } else {
+            ready[count++] = (struct event_poll_ready) {
+                .ptr    = k->events[i].udata,
+                .flags  = flags,
+            };
+        }
+    }
+
+    return count;
+}
+
+static void event_kqueue_destroy (void *ctx)
+{
+    struct event_kqueue *k = ctx;
+
+    if (close(k->fd))
+        log_pwarning("close");
+
+    free(k);
+}
+
+const struct event_poll_type event_poll_kqueue = {
+    .name       = "kqueue",
+    .create     = event_kqueue_create,
+    .max        = event_kqueue_max,
+    .set        = event_kqueue_set,
+    .wait       = event_kqueue_wait,
+    .destroy    = event_kqueue_destroy,
+};
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef EVENT_POLL_H
+#define EVENT_POLL_H
+
+/*
+ * Internal interface between event_main and the OS-specific IO readiness mechanism.
+ */
+#include "common/event.h"
+
+#if defined(__linux__)
+#   define EVENT_POLL_EPOLL
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#   if __has_include(<linux/io_uring.h>)
+#       define EVENT_POLL_URING
+#   endif
+#endif
+
+#if defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__APPLE__)
+#   define EVENT_POLL_KQUEUE
+#endif
+
+/* Maximum number of ready events returned from one poll wait() */
+#define EVENT_POLL_MAX 256
+
+/*
+ * One ready fd returned by wait().
+ */
+struct event_poll_ready {
+    /* As given to set() */
+    void *ptr;
+
+    /* Some combination of EVENT_READ|EVENT_WRITE, or EVENT_IO for a completed submit() */
+    int flags;
+};
+
+struct event_poll_type {
+    const char *name;
+
+    /*
+     * Initialize backend state.
+     */
+    int (*create)(void **ctxp);
+
+    /*
+     * Return the limit on acceptable fd's, or 0 if unlimited.
+     */
+    int (*max)(void *ctx);
+
+    /*
+     * Change the registered interest for the given fd from old to new EVENT_READ|EVENT_WRITE flags.
+     *
+     * old == 0 adds a new fd, new == 0 removes the fd.
+     */
+    int (*set)(void *ctx, int fd, int old_flags, int new_flags, void *ptr);
+
+    /*
+     * Wait for registered fds to become ready, up to the given timeout, or indefinitely if NULL.
+     *
+     * Returns the number of ready items stored, 0 on timeout or interrupt, <0 on error.
+     */
+    int (*wait)(void *ctx, const struct timeval *timeout, struct event_poll_ready *ready, int size);
+
+    /*
+     * Optional completion-based IO: queue the io operation on the given fd, to be started by the next wait(), which
+     * returns io->event with EVENT_IO once the operation has completed, with io->result set.
+     */
+    int (*submit)(void *ctx, int fd, struct event_io *io);
+
+    /*
+     * Request cancellation of a submit()'d io, which still completes as usual, with io->result = -ECANCELED if it was
+     * cancelled before completing.
+     */
+    int (*cancel)(void *ctx, struct event_io *io);
+
+    /*
+     * Release backend state.
+     */
+    void (*destroy)(void *ctx);
+};
+
+extern const struct event_poll_type event_poll_select;
+
+#ifdef EVENT_POLL_EPOLL
+extern const struct event_poll_type event_poll_epoll;
+#endif
+
+#ifdef EVENT_POLL_URING
+extern const struct event_poll_type event_poll_uring;
+#endif
+
+#ifdef EVENT_POLL_KQUEUE
+extern const struct event_poll_type event_poll_kqueue;
+#endif
+
+#endif
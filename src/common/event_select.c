@@ -0,0 +1,143 @@
+/*
+ * Portable select() fallback for event_main.
+ */
+#include "common/event_poll.h"
+
+#include "common/log.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/select.h>
+
+struct event_select {
+    /* Registered interest */
+    fd_set read, write;
+
+    /* Highest registered fd + 1 */
+    int nfds;
+
+    /* Registered ptr for each fd */
+    void *ptrs[FD_SETSIZE];
+};
+
+static int event_select_create (void **ctxp)
+{
+    struct event_select *s;
+
+    if (!(s = calloc(1, sizeof(*s)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    FD_ZERO(&s->read);
+    FD_ZERO(&s->write);
+
+    *ctxp = s;
+
+    return 0;
+}
+
+static int event_select_max (void *ctx)
+{
+    return FD_SETSIZE;
+}
+
+static int event_select_set (void *ctx, int fd, int old_flags, int new_flags, void *ptr)
+{
+    struct event_select *s = ctx;
+
+    // select's FD_SET only supports fd's under a certain limit (e.g. 1k), larger ones invoke undefined behaviour.
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        log_error("fd out of range for select(): %d", fd);
+        return -1;
+    }
+
+    if (new_flags & EVENT_READ)
+        FD_SET(fd, &s->read);
+    else
+        FD_CLR(fd, &s->read);
+
+    if (new_flags & EVENT_WRITE)
+        FD_SET(fd, &s->write);
+    else
+        FD_CLR(fd, &s->write);
+
+    if (new_flags) {
+        s->ptrs[fd] = ptr;
+
+        if (fd >= s->nfds)
+            s->nfds = fd + 1;
+
+    } else {
+        s->ptrs[fd] = NULL;
+
+        // shrink
+        while (s->nfds > 0 && !s->ptrs[s->nfds - 1])
+            s->nfds--;
+    }
+
+    return 0;
+}
+
+static int event_select_wait (void *ctx, const struct timeval *timeout, struct event_poll_ready *ready, int size)
+{
+    struct event_select *s = ctx;
+    fd_set read = s->read, write = s->write;
+    struct timeval select_timeout;
+    int ret, count = 0;
+
+    if (timeout) {
+        // select() may modify the timeout
+        select_timeout = *timeout;
+    }
+
+    log_debug("select: %d timeout=%ld:%ld", s->nfds,
+            timeout ? timeout->tv_sec : -1,
+            timeout ? timeout->tv_usec : -1
+    );
+
+    if ((ret = select(s->nfds, &read, &write, NULL, timeout ? &select_timeout : NULL)) < 0 && errno == EINTR) {
+        log_debug("select: interrupted");
+        return 0;
+
+    } else if (ret < 0) {
+        log_perror("select");
+        return -1;
+    }
+
+    for (int fd = 0; fd < s->nfds && ret > 0 && count < size; fd++) {
+        int flags = 0;
+
+        if (FD_ISSET(fd, &read))
+            flags |= EVENT_READ;
+
+        if (FD_ISSET(fd, &write))
+            flags |= EVENT_WRITE;
+
+        if (!flags)
+            continue;
+
+        ready[count++] = (struct event_poll_ready) {
+            .ptr    = s->ptrs[fd],
+            .flags  = flags,
+        };
+
+        ret--;
+    }
+
+    return count;
+}
+
+static void event_select_destroy (void *ctx)
+{
+    free(ctx);
+}
+
+const struct event_poll_type event_poll_select = {
+    .name       = "select",
+    .create     = event_select_create,
+    .max        = event_select_max,
+    .set        = event_select_set,
+    .wait       = event_select_wait,
+    .destroy    = event_select_destroy,
+};
@@ -0,0 +1,525 @@
+/*
+ * Linux io_uring backend for event_main, using the raw syscalls.
+ *
+ * IO readiness uses an epoll fd, which is itself polled through the ring, such that set() behaves the same as with the
+ * epoll backend. The completion-based submit() operations are queued as SQEs, and submitted in one batch by the next
+ * wait(), which also waits for their completions.
+ */
+// SPLICE_F_MOVE
+#define _GNU_SOURCE
+
+#include "common/event_poll.h"
+
+#ifdef EVENT_POLL_URING
+
+#include "common/log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Submission queue size, the completion queue is twice this */
+#define EVENT_URING_ENTRIES 1024
+
+/*
+ * CQE user_data for internal operations, or the low bit of an event_io pointer.
+ */
+enum event_uring_data {
+    EVENT_URING_EPOLL   = 1,    // poll on the epoll fd
+    EVENT_URING_CANCEL  = 2,    // async cancel, ignored
+
+    EVENT_URING_LINK    = 1,    // io | EVENT_URING_LINK: first splice of an EVENT_IO_SENDFILE
+};
+
+struct event_uring {
+    int fd;
+
+    /* Mapped rings */
+    void *ring;
+    size_t ring_size;
+
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    unsigned sq_entries;
+
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* Tail of queued SQEs, not yet visible to the kernel */
+    unsigned sq_queued;
+
+    /* io_uring_enter() flags for waiting */
+    unsigned enter_flags;
+
+    /* IO readiness */
+    int epoll_fd;
+
+    /* The epoll fd poll is queued or pending on the ring */
+    bool epoll_polled;
+
+    struct epoll_event events[EVENT_POLL_MAX];
+};
+
+static int event_uring_create (void **ctxp)
+{
+    struct event_uring *u;
+    struct io_uring_params params = {
+        .flags  = IORING_SETUP_SUBMIT_ALL,
+    };
+
+    if (!(u = calloc(1, sizeof(*u)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    u->epoll_fd = -1;
+    u->ring = u->sqes = MAP_FAILED;
+
+#ifdef IORING_SETUP_DEFER_TASKRUN
+    // completions are only processed within wait(), from the single event_main thread
+    params.flags |= IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+#endif
+
+    if ((u->fd = syscall(__NR_io_uring_setup, EVENT_URING_ENTRIES, &params)) < 0 && errno == EINVAL) {
+        // older kernel
+        params = (struct io_uring_params) { };
+
+        u->fd = syscall(__NR_io_uring_setup, EVENT_URING_ENTRIES, &params);
+    }
+
+    if (u->fd < 0) {
+        log_pwarning("io_uring_setup");
+        goto error;
+    }
+
+    // also implies the IORING_OP_* used here
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        log_warning("io_uring_setup: unsupported features: %#x", params.features);
+        goto error;
+    }
+
+    u->ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+
+    if (u->ring_size < params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe))
+        u->ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if ((u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+        log_pwarning("mmap IORING_OFF_SQ_RING");
+        goto error;
+    }
+
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if ((u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+        log_pwarning("mmap IORING_OFF_SQES");
+        goto error;
+    }
+
+    u->sq_head = u->ring + params.sq_off.head;
+    u->sq_tail = u->ring + params.sq_off.tail;
+    u->sq_mask = u->ring + params.sq_off.ring_mask;
+    u->sq_entries = params.sq_entries;
+    u->sq_queued = *u->sq_tail;
+
+    u->cq_head = u->ring + params.cq_off.head;
+    u->cq_tail = u->ring + params.cq_off.tail;
+    u->cq_mask = u->ring + params.cq_off.ring_mask;
+    u->cqes = u->ring + params.cq_off.cqes;
+
+    // each SQE is always queued in the same slot of the indirection array
+    unsigned *sq_array = u->ring + params.sq_off.array;
+
+    for (unsigned i = 0; i < params.sq_entries; i++)
+        sq_array[i] = i;
+
+    u->enter_flags = IORING_ENTER_GETEVENTS;
+
+    if ((u->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        log_pwarning("epoll_create1");
+        goto error;
+    }
+
+    log_info("io_uring: entries=%u/%u features=%#x flags=%#x", params.sq_entries, params.cq_entries, params.features, params.flags);
+
+    *ctxp = u;
+
+    return 0;
+
+error:
+    if (u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_size);
+
+    if (u->ring != MAP_FAILED)
+        munmap(u->ring, u->ring_size);
+
+    if (u->fd >= 0)
+        close(u->fd);
+
+    free(u);
+
+    return -1;
+}
+
+static int event_uring_max (void *ctx)
+{
+    return 0;
+}
+
+/*
+ * Submit the queued SQEs, and wait for min_complete completions, up to the given timeout, or indefinitely if NULL.
+ *
+ * Returns 0 on success, 1 on timeout or interrupt, <0 on error.
+ */
+static int event_uring_enter (struct event_uring *u, unsigned min_complete, unsigned flags, const struct timeval *timeout)
+{
+    unsigned submit = u->sq_queued - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = {
+        .sigmask_sz = _NSIG / 8,
+    };
+
+    __atomic_store_n(u->sq_tail, u->sq_queued, __ATOMIC_RELEASE);
+
+    if (timeout) {
+        ts.tv_sec = timeout->tv_sec;
+        ts.tv_nsec = timeout->tv_usec * 1000;
+
+        arg.ts = (uintptr_t) &ts;
+    }
+
+    log_debug("io_uring_enter: submit=%u min_complete=%u timeout=%s", submit, min_complete, timeout ? "*" : "-");
+
+    if (syscall(__NR_io_uring_enter, u->fd, submit, min_complete, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) >= 0) {
+        return 0;
+
+    } else if (errno == ETIME || errno == EINTR) {
+        log_debug("io_uring_enter: %s", strerror(errno));
+        return 1;
+
+    } else if (errno == EBUSY || errno == EAGAIN) {
+        // completion queue overflow, or out of memory for the submit; retried after processing completions
+        log_debug("io_uring_enter: %s", strerror(errno));
+        return 1;
+
+    } else {
+        log_perror("io_uring_enter");
+        return -1;
+    }
+}
+
+/*
+ * Return a cleared SQE for the next n SQEs, submitting the queued SQEs to make room if needed.
+ */
+static struct io_uring_sqe *event_uring_sqe (struct event_uring *u, unsigned n)
+{
+    struct io_uring_sqe *sqe;
+
+    if (u->sq_queued + n - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > u->sq_entries) {
+        if (event_uring_enter(u, 0, 0, NULL) < 0)
+            return NULL;
+
+        if (u->sq_queued + n - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > u->sq_entries) {
+            log_warning("io_uring: submission queue full");
+            errno = EAGAIN;
+            return NULL;
+        }
+    }
+
+    sqe = &u->sqes[u->sq_queued & *u->sq_mask];
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+/*
+ * Queue the SQE returned by event_uring_sqe().
+ */
+static void event_uring_queue (struct event_uring *u, struct io_uring_sqe *sqe, uint8_t opcode, int fd, uint64_t user_data)
+{
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+
+    u->sq_queued++;
+}
+
+static int event_uring_set (void *ctx, int fd, int old_flags, int new_flags, void *ptr)
+{
+    struct event_uring *u = ctx;
+    struct epoll_event event = {
+        .events     = (new_flags & EVENT_READ ? EPOLLIN : 0) | (new_flags & EVENT_WRITE ? EPOLLOUT : 0),
+        .data.ptr   = ptr,
+    };
+    int op;
+
+    if (!old_flags)
+        op = EPOLL_CTL_ADD;
+    else if (!new_flags)
+        op = EPOLL_CTL_DEL;
+    else
+        op = EPOLL_CTL_MOD;
+
+    if (epoll_ctl(u->epoll_fd, op, fd, &event)) {
+        log_perror("epoll_ctl %d: %d", op, fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int event_uring_submit (void *ctx, int fd, struct event_io *io)
+{
+    struct event_uring *u = ctx;
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = event_uring_sqe(u, io->type == EVENT_IO_SENDFILE ? 2 : 1)))
+        return -1;
+
+    io->pending = 1;
+
+    switch (io->type) {
+        case EVENT_IO_READ:
+        case EVENT_IO_WRITE:
+            // use the current file position, if any
+            sqe->addr = (uintptr_t) io->buf;
+            sqe->len = io->len;
+            sqe->off = (uint64_t) -1;
+
+            event_uring_queue(u, sqe, io->type == EVENT_IO_READ ? IORING_OP_READ : IORING_OP_WRITE, fd, (uintptr_t) io);
+
+            break;
+
+        case EVENT_IO_WRITEV:
+            sqe->addr = (uintptr_t) io->iov;
+            sqe->len = io->iovcnt;
+            sqe->off = (uint64_t) -1;
+
+            event_uring_queue(u, sqe, IORING_OP_WRITEV, fd, (uintptr_t) io);
+
+            break;
+
+        case EVENT_IO_SPLICE:
+            sqe->splice_fd_in = io->file;
+            sqe->splice_off_in = (uint64_t) -1;
+            sqe->off = (uint64_t) -1;
+            sqe->len = io->len;
+            sqe->splice_flags = SPLICE_F_MOVE;
+
+            event_uring_queue(u, sqe, IORING_OP_SPLICE, fd, (uintptr_t) io);
+
+            break;
+
+        case EVENT_IO_SENDFILE:
+            // a short splice into the pipe breaks the link, cancelling the splice out of the pipe
+            sqe->splice_fd_in = io->file;
+            sqe->splice_off_in = io->offset;
+            sqe->off = (uint64_t) -1;
+            sqe->len = io->len;
+            sqe->splice_flags = SPLICE_F_MOVE;
+            sqe->flags = IOSQE_IO_LINK;
+
+            event_uring_queue(u, sqe, IORING_OP_SPLICE, io->pipe[1], (uintptr_t) io | EVENT_URING_LINK);
+
+            sqe = event_uring_sqe(u, 1);
+
+            sqe->splice_fd_in = io->pipe[0];
+            sqe->splice_off_in = (uint64_t) -1;
+            sqe->off = (uint64_t) -1;
+            sqe->len = io->len;
+            sqe->splice_flags = SPLICE_F_MOVE;
+
+            event_uring_queue(u, sqe, IORING_OP_SPLICE, fd, (uintptr_t) io);
+
+            io->pending = 2;
+
+            break;
+
+        default:
+            log_fatal("unknown event_io type: %d", io->type);
+            errno = EINVAL;
+            return -1;
+    }
+
+    return 0;
+}
+
+static int event_uring_cancel (void *ctx, struct event_io *io)
+{
+    struct event_uring *u = ctx;
+    struct io_uring_sqe *sqe;
+
+    if (io->type == EVENT_IO_SENDFILE) {
+        // the splice out of the pipe is not yet started if the splice into it is still pending
+        if (!(sqe = event_uring_sqe(u, 1)))
+            return -1;
+
+        sqe->addr = (uintptr_t) io | EVENT_URING_LINK;
+
+        event_uring_queue(u, sqe, IORING_OP_ASYNC_CANCEL, -1, EVENT_URING_CANCEL);
+    }
+
+    if (!(sqe = event_uring_sqe(u, 1)))
+        return -1;
+
+    sqe->addr = (uintptr_t) io;
+
+    event_uring_queue(u, sqe, IORING_OP_ASYNC_CANCEL, -1, EVENT_URING_CANCEL);
+
+    return 0;
+}
+
+/*
+ * Collect ready fds from the epoll fd, without blocking.
+ *
+ * Returns the number of ready items stored, <0 on error.
+ */
+static int event_uring_epoll (struct event_uring *u, struct event_poll_ready *ready, int size)
+{
+    int ret;
+
+    if ((ret = epoll_wait(u->epoll_fd, u->events, size, 0)) < 0 && errno == EINTR) {
+        return 0;
+
+    } else if (ret < 0) {
+        log_perror("epoll_wait");
+        return -1;
+    }
+
+    for (int i = 0; i < ret; i++) {
+        uint32_t events = u->events[i].events;
+        int flags = 0;
+
+        // errors and hangups wake up both readers and writers, which will see the error from read()/write()
+        if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            flags |= EVENT_READ;
+
+        if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            flags |= EVENT_WRITE;
+
+        ready[i] = (struct event_poll_ready) {
+            .ptr    = u->events[i].data.ptr,
+            .flags  = flags,
+        };
+    }
+
+    return ret;
+}
+
+static int event_uring_wait (void *ctx, const struct timeval *timeout, struct event_poll_ready *ready, int size)
+{
+    struct event_uring *u = ctx;
+    unsigned head = *u->cq_head;
+    int count = 0;
+    int err;
+
+    if (size > EVENT_POLL_MAX)
+        size = EVENT_POLL_MAX;
+
+    // one-shot poll on the epoll fd, which completes at once if it is still readable, as with level-triggered epoll
+    if (!u->epoll_polled) {
+        struct io_uring_sqe *sqe;
+
+        if (!(sqe = event_uring_sqe(u, 1)))
+            return -1;
+
+        sqe->poll32_events = POLLIN;
+
+        event_uring_queue(u, sqe, IORING_OP_POLL_ADD, u->epoll_fd, EVENT_URING_EPOLL);
+
+        u->epoll_polled = true;
+    }
+
+    // only block if there are no completions left over from the previous wait()
+    if ((err = event_uring_enter(u, head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) ? 1 : 0, u->enter_flags, timeout)) < 0)
+        return -1;
+
+    for (unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE); head != tail && count < size; head++) {
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        uint64_t user_data = cqe->user_data;
+        struct event_io *io;
+
+        if (user_data == EVENT_URING_EPOLL) {
+            int ret;
+
+            if (cqe->res < 0) {
+                errno = -cqe->res;
+                log_pwarning("io_uring poll epoll");
+            }
+
+            if ((ret = event_uring_epoll(u, ready + count, size - count)) < 0)
+                return -1;
+
+            count += ret;
+
+            u->epoll_polled = false;
+
+            continue;
+
+        } else if (user_data == EVENT_URING_CANCEL) {
+            log_debug("io_uring cancel: %d", cqe->res);
+
+            continue;
+
+        } else if (user_data & EVENT_URING_LINK) {
+            io = (struct event_io *)(uintptr_t) (user_data & ~(uint64_t) EVENT_URING_LINK);
+            io->spliced = cqe->res;
+
+        } else {
+            io = (struct event_io *)(uintptr_t) user_data;
+            io->result = cqe->res;
+        }
+
+        if (--io->pending)
+            continue;
+
+        ready[count++] = (struct event_poll_ready) {
+            .ptr    = io->event,
+            .flags  = EVENT_IO,
+        };
+    }
+
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+    return count;
+}
+
+static void event_uring_destroy (void *ctx)
+{
+    struct event_uring *u = ctx;
+
+    if (close(u->epoll_fd))
+        log_pwarning("close");
+
+    munmap(u->sqes, u->sqes_size);
+    munmap(u->ring, u->ring_size);
+
+    if (close(u->fd))
+        log_pwarning("close");
+
+    free(u);
+}
+
+const struct event_poll_type event_poll_uring = {
+    .name       = "io_uring",
+    .create     = event_uring_create,
+    .max        = event_uring_max,
+    .set        = event_uring_set,
+    .wait       = event_uring_wait,
+    .submit     = event_uring_submit,
+    .cancel     = event_uring_cancel,
+    .destroy    = event_uring_destroy,
+};
+
+#endif
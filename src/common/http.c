@@ -2,31 +2,42 @@
 #define _POSIX_C_SOURCE 200112L
 
 #include "common/http.h"
+#include "common/http_test.h"
 
 #include "common/log.h"
 #include "common/parse.h"
+#include "common/pool.h"
 #include "common/util.h"
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 struct http {
     /* Stream IO */
     struct stream *read, *write;
 
     size_t chunk_size;
+
+    /* The chunk data was consumed, but not yet the CRLF following it */
+    bool chunk_footer;
 };
 
+static struct pool http_pool = POOL_INIT("http", sizeof(struct http));
+
 const char * http_status_str (enum http_status status)
 {
     switch (status) {
         case 200:    return "OK";
         case 201:   return "Created";
+        case 206:   return "Partial Content";
 
         case 301:   return "Found";
+        case 304:   return "Not Modified";
 
         case 400:    return "Bad Request";
         case 403:   return "Forbidden";
@@ -36,20 +47,229 @@ const char * http_status_str (enum http_status status)
         case 413:   return "Request Entity Too Large";
         case 414:   return "Request-URI Too Long";
         case 415:   return "Unsupported Media Type";
+        case 416:   return "Range Not Satisfiable";
 
         case 500:    return "Internal Server Error";
+        case 501:   return "Not Implemented";
+        case 502:   return "Bad Gateway";
+        case 503:   return "Service Unavailable";
 
         // hrhr
         default:    return "Unknown Response Status";
     }
 }
 
+int http_format_date (char *buf, size_t size, time_t time)
+{
+    struct tm tm;
+
+    if (!gmtime_r(&time, &tm)) {
+        log_perror("gmtime_r");
+        return -1;
+    }
+
+    if (!strftime(buf, size, HTTP_DATE_FORMAT, &tm)) {
+        log_error("strftime: buffer too small");
+        return -1;
+    }
+
+    return 0;
+}
+
+int http_parse_date (const char *str, time_t *timep)
+{
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char wday[4], mon[4];
+    int day, year, hour, min, sec;
+    const char *m;
+
+    // IMF-fixdate, e.g. Sun, 06 Nov 1994 08:49:37 GMT
+    if (sscanf(str, "%3s, %2d %3s %4d %2d:%2d:%2d GMT", wday, &day, mon, &year, &hour, &min, &sec) != 7)
+        return 1;
+
+    if (strlen(mon) != 3 || !(m = strstr(months, mon)) || (m - months) % 3)
+        return 1;
+
+    if (day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60)
+        return 1;
+
+    // days since epoch for the proleptic Gregorian calendar, with years starting in March
+    int month = (m - months) / 3 + 1;
+    int y = year - (month <= 2);
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    long days = era * 146097L + doe - 719468;
+
+    *timep = days * 86400 + hour * 3600 + min * 60 + sec;
+
+    return 0;
+}
+
+/*
+ * Parse a non-negative decimal number from *strp, advancing it.
+ *
+ * Returns 1 if there are no digits, or on overflow.
+ */
+static int http_parse_offset (const char **strp, off_t *offsetp)
+{
+    const char *str = *strp;
+    uintmax_t value = 0;
+
+    if (*str < '0' || *str > '9')
+        return 1;
+
+    for (; *str >= '0' && *str <= '9'; str++) {
+        unsigned digit = *str - '0';
+
+        // off_t is signed
+        if (value > (INTMAX_MAX - digit) / 10)
+            return 1;
+
+        value = value * 10 + digit;
+    }
+
+    *strp = str;
+    *offsetp = value;
+
+    return 0;
+}
+
+int http_parse_range (const char *str, off_t size, struct http_range *ranges, unsigned *countp)
+{
+    unsigned count = 0, total = 0;
+
+    if (strncasecmp(str, "bytes=", 6))
+        return 1;
+
+    for (str += 6; *str; ) {
+        off_t start, end;
+
+        // skip separators, also allowing empty list elements
+        if (*str == ' ' || *str == '\t' || *str == ',') {
+            str++;
+            continue;
+        }
+
+        if (*str == '-') {
+            // suffix-byte-range-spec
+            off_t suffix;
+
+            str++;
+
+            if (http_parse_offset(&str, &suffix))
+                return 1;
+
+            start = suffix < size ? size - suffix : 0;
+            end = suffix ? size - 1 : -1;
+
+        } else {
+            // byte-range-spec
+            if (http_parse_offset(&str, &start))
+                return 1;
+
+            if (*str++ != '-')
+                return 1;
+
+            if (*str >= '0' && *str <= '9') {
+                if (http_parse_offset(&str, &end))
+                    return 1;
+
+                if (end < start)
+                    return 1;
+
+                if (end >= size)
+                    end = size - 1;
+            } else {
+                end = size - 1;
+            }
+        }
+
+        if (*str && *str != ',' && *str != ' ' && *str != '\t')
+            return 1;
+
+        // bound the number of ranges, including unsatisfiable ones
+        if (++total > HTTP_RANGES_MAX) {
+            log_debug("too many ranges: %u", total);
+            return 1;
+        }
+
+        if (start >= size || end < start) {
+            log_debug("unsatisfiable range: %jd-%jd/%jd", (intmax_t) start, (intmax_t) end, (intmax_t) size);
+            continue;
+        }
+
+        ranges[count++] = (struct http_range) {
+            .start  = start,
+            .length = end - start + 1,
+        };
+    }
+
+    if (!total)
+        return 1;
+
+    *countp = count;
+
+    return 0;
+}
+
+int http_parse_accept (const char *str, const char *token)
+{
+    size_t token_len = strlen(token);
+    int match = -1, wildcard = -1;
+
+    while (*str) {
+        const char *name;
+        size_t len;
+        int q = 1;
+
+        // skip separators
+        if (*str == ' ' || *str == '\t' || *str == ',') {
+            str++;
+            continue;
+        }
+
+        name = str;
+        len = strcspn(str, " \t,;");
+        str += len;
+
+        // parameters, only the qvalue is relevant
+        while (*str && *str != ',') {
+            if (*str == ';' || *str == ' ' || *str == '\t') {
+                str++;
+
+            } else if ((*str == 'q' || *str == 'Q') && str[1] == '=') {
+                // q=0, q=0.0, q=0.000 are all zero; anything else is non-zero
+                str += 2;
+                q = strspn(str, "0.") < strcspn(str, " \t,;");
+                str += strcspn(str, " \t,;");
+
+            } else {
+                str += strcspn(str, " \t,;");
+            }
+        }
+
+        if (len == token_len && !strncasecmp(name, token, len))
+            match = q;
+        else if (len == 1 && *name == '*')
+            wildcard = q;
+    }
+
+    if (match >= 0)
+        return match;
+    else if (wildcard >= 0)
+        return wildcard;
+    else
+        return 0;
+}
+
 int http_create (struct http **httpp, struct stream *read, struct stream *write)
 {
     struct http *http = NULL;
 
-    if (!(http = calloc(1, sizeof(*http)))) {
-        log_perror("calloc");
+    if (!(http = pool_calloc(&http_pool))) {
+        log_error("pool_calloc");
         goto error;
     }
 
@@ -63,7 +283,7 @@ int http_create (struct http **httpp, struct stream *read, struct stream *write)
 
 error:
     if (http)
-        free(http);
+        pool_free(&http_pool, http);
 
     return -1;
 }
@@ -75,6 +295,21 @@ int http_write (struct http *http, const char *buf, size_t size)
     return stream_write(http->write, buf, size);
 }
 
+int http_writev (struct http *http, const struct iovec *iov, int iovcnt)
+{
+    return stream_writev(http->write, iov, iovcnt);
+}
+
+int http_flush (struct http *http)
+{
+    return stream_flush(http->write);
+}
+
+int http_read_pending (struct http *http)
+{
+    return stream_pending_head(http->read);
+}
+
 int http_vwrite (struct http *http, const char *fmt, va_list args)
 {
     return stream_vprintf(http->write, fmt, args);
@@ -240,7 +475,7 @@ int http_write_headers (struct http *http)
     return http_write_line(http, "");
 }
 
-int http_write_file (struct http *http, int fd, size_t content_length)
+int http_write_file (struct http *http, int fd, off_t *offset, size_t content_length)
 {
     bool readall = !content_length;
     int err;
@@ -248,7 +483,7 @@ int http_write_file (struct http *http, int fd, size_t content_length)
     while (content_length || readall) {
         size_t size = content_length;
 
-        if ((err = stream_write_file(http->write, fd, &size)) < 0) {
+        if ((err = stream_write_file(http->write, fd, offset, &size)) < 0) {
             log_warning("stream_write_file %zu", size);
             return err;
         }
@@ -282,20 +517,24 @@ int http_write_file (struct http *http, int fd, size_t content_length)
 // 3.6.1 Chunked Transfer Coding
 int http_write_chunk (struct http *http, const char *buf, size_t size)
 {
-    int err;
+    char header[32];
+    int ret;
 
     log_debug("%zu", size);
 
-    if ((err = http_writef(http, "%zx\r\n", size)))
-        return err;
-
-    if ((err = stream_write(http->write, buf, size)))
-        return err;
+    if ((ret = snprintf(header, sizeof(header), "%zx\r\n", size)) < 0) {
+        log_perror("snprintf");
+        return -1;
+    }
 
-    if ((err = http_writef(http, "\r\n")))
-        return err;
+    // chunk header, data and trailer in one go
+    struct iovec iov[] = {
+        { header,           ret     },
+        { (char *) buf,     size    },
+        { "\r\n",           2       },
+    };
 
-    return 0;
+    return stream_writev(http->write, iov, 3);
 }
 
 int http_vprint_chunk (struct http *http, const char *fmt, va_list inargs)
@@ -421,6 +660,292 @@ int http_read_request (struct http *http, const char **methodp, const char **pat
     return 0;
 }
 
+enum http_header_id http_header_id (const char *name)
+{
+    // switch on length, to compare against at most two names
+    switch (strlen(name)) {
+        case 4:
+            if (!strcasecmp(name, "Host"))                  return HTTP_HEADER_HOST;
+            break;
+
+        case 5:
+            if (!strcasecmp(name, "Range"))                 return HTTP_HEADER_RANGE;
+            break;
+
+        case 8:
+            if (!strcasecmp(name, "If-Range"))              return HTTP_HEADER_IF_RANGE;
+            break;
+
+        case 10:
+            if (!strcasecmp(name, "Connection"))            return HTTP_HEADER_CONNECTION;
+            break;
+
+        case 12:
+            if (!strcasecmp(name, "Content-Type"))          return HTTP_HEADER_CONTENT_TYPE;
+            break;
+
+        case 13:
+            if (!strcasecmp(name, "If-None-Match"))         return HTTP_HEADER_IF_NONE_MATCH;
+            break;
+
+        case 14:
+            if (!strcasecmp(name, "Content-Length"))        return HTTP_HEADER_CONTENT_LENGTH;
+            break;
+
+        case 15:
+            if (!strcasecmp(name, "Accept-Encoding"))       return HTTP_HEADER_ACCEPT_ENCODING;
+            break;
+
+        case 17:
+            if (!strcasecmp(name, "Transfer-Encoding"))     return HTTP_HEADER_TRANSFER_ENCODING;
+            if (!strcasecmp(name, "If-Modified-Since"))     return HTTP_HEADER_IF_MODIFIED_SINCE;
+            break;
+    }
+
+    return HTTP_HEADER_OTHER;
+}
+
+const char * http_headers_get (const struct http_headers *headers, enum http_header_id id)
+{
+    return headers->known[id];
+}
+
+int http_parse_head (char *buf, size_t size, char **linep, struct http_headers *headers)
+{
+    char *end = buf + size, *line, *c;
+    const char *name = NULL, *value;
+
+    *linep = NULL;
+
+    headers->count = 0;
+    memset(headers->known, 0, sizeof(headers->known));
+
+    for (line = buf; line < end && (c = memchr(line, '\n', end - line)); line = c + 1) {
+        // strip \r\n
+        *c = '\0';
+
+        if (c > line && *(c - 1) == '\r')
+            *(c - 1) = '\0';
+
+        log_debug("%s", line);
+
+        if (!*linep) {
+            // request/response line
+            *linep = line;
+            continue;
+        }
+
+        if (!*line) {
+            // end of headers
+            break;
+        }
+
+        if (http_parse_header(line, &name, &value) || !name) {
+            log_warning("invalid header: %s", line);
+            return 400;
+        }
+
+        if (headers->count >= HTTP_HEADERS_MAX) {
+            log_warning("too many headers: %u", headers->count);
+            return 400;
+        }
+
+        struct http_header *header = &headers->headers[headers->count++];
+
+        header->name = name;
+        header->value = value;
+        header->id = http_header_id(name);
+
+        if (header->id && !headers->known[header->id])
+            headers->known[header->id] = value;
+    }
+
+    if (!*linep) {
+        log_warning("empty head");
+        return 400;
+    }
+
+    return 0;
+}
+
+int http_read_request_headers (struct http *http, const char **methodp, const char **pathp, const char **versionp,
+        struct http_headers *headers)
+{
+    char *buf, *line;
+    size_t size;
+    int err;
+
+    if ((err = stream_read_head(http->read, &buf, &size)) < 0) {
+        log_warning("stream_read_head");
+        return err;
+
+    } else if (err) {
+        // EOF
+        return err;
+    }
+
+    if ((err = http_parse_head(buf, size, &line, headers))) {
+        log_warning("http_parse_head");
+        return err;
+    }
+
+    if ((err = http_parse_request(line, methodp, pathp, versionp))) {
+        log_warning("http_parse_request");
+        return err;
+    }
+
+    return 0;
+}
+
+/*
+ * Parse the raw "HTTP/1.x NNN reason" response line, without modifying it.
+ */
+static int http_parse_status (const char *line, size_t len, enum http_version *versionp, unsigned *statusp)
+{
+    if (len < 12 || memcmp(line, "HTTP/1.", 7) || (line[7] != '0' && line[7] != '1') || line[8] != ' ') {
+        log_warning("invalid response line: %.*s", (int) len, line);
+        return -1;
+    }
+
+    for (int i = 9; i < 12; i++) {
+        if (line[i] < '0' || line[i] > '9') {
+            log_warning("invalid response status: %.*s", (int) len, line);
+            return -1;
+        }
+    }
+
+    if (len > 12 && line[12] != ' ' && line[12] != '\r' && line[12] != '\n') {
+        log_warning("invalid response status: %.*s", (int) len, line);
+        return -1;
+    }
+
+    *versionp = line[7] == '1' ? HTTP_11 : HTTP_10;
+    *statusp = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+
+    return 0;
+}
+
+int http_read_response_head (struct http *http, enum http_version *versionp, unsigned *statusp, const char **reasonp,
+        const char **headp, size_t *lenp)
+{
+    char *buf, *c, *reason;
+    size_t size, len;
+    int err;
+
+    if ((err = stream_read_head(http->read, &buf, &size)) < 0) {
+        log_warning("stream_read_head");
+        return err;
+
+    } else if (err) {
+        // EOF
+        return err;
+    }
+
+    if (!(c = memchr(buf, '\n', size))) {
+        log_warning("empty head");
+        return -1;
+    }
+
+    len = c - buf + 1;
+
+    if ((err = http_parse_status(buf, len, versionp, statusp)))
+        return err;
+
+    // the status line is not passed on as-is
+    reason = len > 13 ? buf + 13 : c;
+
+    if (c > reason && c[-1] == '\r')
+        c[-1] = '\0';
+    else
+        c[0] = '\0';
+
+    log_debug("%u %s", *statusp, reason);
+
+    *reasonp = reason;
+
+    // strip the final empty line
+    size -= (size >= len + 2 && buf[size - 2] == '\r') ? 2 : 1;
+
+    *headp = buf + len;
+    *lenp = size > len ? size - len : 0;
+
+    return 0;
+}
+
+int http_head_next (const char **headp, size_t *lenp, struct http_head_line *line)
+{
+    const char *buf = *headp, *end, *c, *sep;
+
+    if (!*lenp)
+        return 1;
+
+    if (!(c = memchr(buf, '\n', *lenp))) {
+        log_warning("unterminated header line");
+        return -1;
+    }
+
+    line->line = buf;
+    line->len = c - buf + 1;
+
+    *headp += line->len;
+    *lenp -= line->len;
+
+    // strip line ending
+    end = c;
+
+    if (end > buf && end[-1] == '\r')
+        end--;
+
+    if (*buf == ' ' || *buf == '\t') {
+        // folded continuation
+        line->name = NULL;
+        line->name_len = 0;
+        sep = buf;
+
+    } else if (!(sep = memchr(buf, ':', end - buf)) || sep == buf) {
+        log_warning("invalid header line: %.*s", (int) (end - buf), buf);
+        return -1;
+
+    } else {
+        line->name = buf;
+        line->name_len = sep - buf;
+        sep++;
+    }
+
+    while (sep < end && (*sep == ' ' || *sep == '\t'))
+        sep++;
+
+    while (end > sep && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+
+    line->value = sep;
+    line->value_len = end - sep;
+
+    return 0;
+}
+
+bool http_header_token (const char *value, size_t len, const char *token, size_t token_len)
+{
+    const char *end = value + len, *next;
+
+    for (const char *c = value; c < end; c = next + 1) {
+        const char *e;
+
+        if (!(next = memchr(c, ',', end - c)))
+            next = end;
+
+        for (e = next; e > c && (e[-1] == ' ' || e[-1] == '\t'); e--)
+            ;
+        while (c < e && (*c == ' ' || *c == '\t'))
+            c++;
+
+        if (e - c == token_len && strncasecmp(c, token, token_len) == 0)
+            return true;
+    }
+
+    return false;
+}
+
 int http_read_response (struct http *http, const char **versionp, unsigned *statusp, const char **reasonp)
 {
     char *line;
@@ -454,6 +979,11 @@ int http_read_header (struct http *http, const char **headerp, const char **valu
     return http_parse_header(line, headerp, valuep);
 }
 
+int http_read (struct http *http, char **bufp, size_t *sizep)
+{
+    return stream_read_some(http->read, bufp, sizep);
+}
+
 int http_read_string (struct http *http, char **bufp, size_t len)
 {
     return stream_read_string(http->read, bufp, len);
@@ -477,8 +1007,9 @@ int http_read_file (struct http *http, int fd, size_t content_length)
         } else {
             char *ignore;
 
-            if ((err = stream_read(http->read, &ignore, &size)) < 0) {
-                log_warning("stream_read %zu", size);
+            // discard whatever is buffered, regardless of the buffer size
+            if ((err = stream_read_some(http->read, &ignore, &size)) < 0) {
+                log_warning("stream_read_some %zu", size);
                 return err;
             }
         }
@@ -514,9 +1045,14 @@ int http_read_chunk_header (struct http *http, size_t *sizep)
     int err;
 
     // chunk header
-    if ((err = http_read_line(http, &line)))
+    if ((err = http_read_line(http, &line)) < 0) {
         return err;
 
+    } else if (err) {
+        log_warning("eof before last-chunk");
+        return -1;
+    }
+
     if (sscanf(line, "%zx", sizep) != 1) {
         log_perror("sscanf: %s", line);
         return -1;
@@ -548,28 +1084,44 @@ int http_read_chunk_footer (struct http *http)
     return 0;
 }
 
+/*
+ * Read end-of-chunks trailer.
+ */
+int http_read_chunks (struct http *http);
+
 /*
  * Read in a chunked response.
  *
  * Note that this does not necessarily read in an entire chunk at a time, but will return partial chunks.
- *
- * Returns 0 on success with *sizep updated, 1 on end-of-chunks, -1 on error or invalid chunk.
  */
 int http_read_chunked (struct http *http, char **bufp, size_t *sizep)
 {
     int err;
 
+    // deferred from the end of the previous chunk, as reading it may move the span returned for the chunk data
+    if (http->chunk_footer) {
+        if ((err = http_read_chunk_footer(http)))
+            return err;
+
+        http->chunk_footer = false;
+    }
+
     // continue to next chunk if current one is consumed, or just starting
     if (!http->chunk_size) {
-        if ((err = http_read_chunk_header(http, &http->chunk_size)))
+        if ((err = http_read_chunk_header(http, &http->chunk_size)) < 0) {
             return err;
+
+        } else if (err) {
+            return http_read_chunks(http) ? -1 : 1;
+        }
     }
 
     // reading in at most chunk_size..
-    *sizep = http->chunk_size;
+    if (!*sizep || *sizep > http->chunk_size)
+        *sizep = http->chunk_size;
 
-    if ((err = stream_read(http->read, bufp, sizep)) < 0) {
-        log_warning("stream_read");
+    if ((err = stream_read_some(http->read, bufp, sizep)) < 0) {
+        log_warning("stream_read_some");
         return err;
 
     } else if (err) {
@@ -585,11 +1137,10 @@ int http_read_chunked (struct http *http, char **bufp, size_t *sizep)
         log_debug("%zu+%zu", *sizep, http->chunk_size);
 
     } else {
-        // end of chunk
+        // end of chunk, with the footer read on the next call
         log_debug("%zu", *sizep);
 
-        if ((err = http_read_chunk_footer(http)))
-            return err;
+        http->chunk_footer = true;
     }
 
     return 0;
@@ -620,6 +1171,14 @@ int http_read_chunked_file (struct http *http, int fd)
 {
     int err;
 
+    // continuing after http_read_chunked()
+    if (http->chunk_footer) {
+        if ((err = http_read_chunk_footer(http)))
+            return err;
+
+        http->chunk_footer = false;
+    }
+
     // continue until http_read_chunk_header returns 1 for the last chunk
     while (http->chunk_size || !(err = http_read_chunk_header(http, &http->chunk_size))) {
         // maximum size to read
@@ -633,8 +1192,9 @@ int http_read_chunked_file (struct http *http, int fd)
         } else {
             char *ignore;
 
-            if ((err = stream_read(http->read, &ignore, &size)) < 0) {
-                log_warning("stream_read %zu", size);
+            // discard whatever is buffered, regardless of the buffer size
+            if ((err = stream_read_some(http->read, &ignore, &size)) < 0) {
+                log_warning("stream_read_some %zu", size);
                 return err;
             }
         }
@@ -671,5 +1231,5 @@ int http_read_chunked_file (struct http *http, int fd)
 
 void http_destroy (struct http *http)
 {
-    free(http);
+    pool_free(&http_pool, http);
 }
@@ -3,8 +3,10 @@
 
 #include "common/stream.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <time.h>
 
 struct http;
 
@@ -22,6 +24,18 @@ struct http;
 /* Maximum Host: header length */
 #define HTTP_HOST_MAX 256
 
+/* Maximum number of request headers */
+#define HTTP_HEADERS_MAX 64
+
+/* strftime() format for HTTP-date, in GMT */
+#define HTTP_DATE_FORMAT "%a, %d %b %Y %H:%M:%S GMT"
+
+/* Maximum length of a formatted HTTP-date, including NUL */
+#define HTTP_DATE_MAX 32
+
+/* Maximum number of byte ranges accepted in a Range header */
+#define HTTP_RANGES_MAX 8
+
 enum http_version {
     HTTP_10         = 0,    // default
     HTTP_11,
@@ -30,7 +44,9 @@ enum http_version {
 enum http_status {
     HTTP_OK                        = 200,
     HTTP_CREATED                = 201,
+    HTTP_PARTIAL_CONTENT        = 206,
     HTTP_FOUND                  = 301,
+    HTTP_NOT_MODIFIED           = 304,
     HTTP_BAD_REQUEST            = 400,
     HTTP_FORBIDDEN              = 403,
     HTTP_NOT_FOUND                = 404,
@@ -39,7 +55,70 @@ enum http_status {
     HTTP_REQUEST_ENTITY_TOO_LARGE = 413,
     HTTP_REQUEST_URI_TOO_LONG   = 414,
     HTTP_UNSUPPORTED_MEDIA_TYPE = 415,
+    HTTP_RANGE_NOT_SATISFIABLE  = 416,
     HTTP_INTERNAL_SERVER_ERROR    = 500,
+    HTTP_NOT_IMPLEMENTED        = 501,
+    HTTP_BAD_GATEWAY            = 502,
+    HTTP_SERVICE_UNAVAILABLE    = 503,
+};
+
+/*
+ * Well-known headers, classified when parsing.
+ */
+enum http_header_id {
+    HTTP_HEADER_OTHER           = 0,
+    HTTP_HEADER_HOST,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_CONTENT_TYPE,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_TRANSFER_ENCODING,
+    HTTP_HEADER_IF_MODIFIED_SINCE,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_IF_RANGE,
+    HTTP_HEADER_RANGE,
+    HTTP_HEADER_ACCEPT_ENCODING,
+
+    HTTP_HEADER_COUNT
+};
+
+struct http_header {
+    const char *name;
+    const char *value;
+
+    enum http_header_id id;
+};
+
+/*
+ * Table of headers, parsed in-place within the stream buffer.
+ */
+struct http_headers {
+    /* All headers, in order */
+    struct http_header headers[HTTP_HEADERS_MAX];
+    unsigned count;
+
+    /* Value of the first header of each known type, or NULL */
+    const char *known[HTTP_HEADER_COUNT];
+};
+
+/*
+ * One raw header line within a message head, see http_head_next().
+ */
+struct http_head_line {
+    /* Entire line, including the line ending */
+    const char *line;
+    size_t len;
+
+    /* Header name and value within the line, without any surrounding whitespace */
+    const char *name, *value;
+    size_t name_len, value_len;
+};
+
+/*
+ * One byte range within a resource.
+ */
+struct http_range {
+    off_t start;
+    off_t length;
 };
 
 /*
@@ -47,6 +126,37 @@ enum http_status {
  */
 const char * http_status_str (enum http_status status);
 
+/*
+ * Format the given time as a HTTP-date into buf, which should be at least HTTP_DATE_MAX long.
+ */
+int http_format_date (char *buf, size_t size, time_t time);
+
+/*
+ * Parse a HTTP-date in the preferred IMF-fixdate format.
+ *
+ * Returns 1 if the date is not valid.
+ */
+int http_parse_date (const char *str, time_t *timep);
+
+/*
+ * Parse a Range header value against a resource of the given size, into at most HTTP_RANGES_MAX ranges.
+ *
+ * Unsatisfiable ranges are skipped, and the remaining ranges are clamped to the resource size; a count of zero means
+ * that none of the ranges could be satisfied.
+ *
+ * Returns 1 if the header is invalid or not supported, and should be ignored.
+ */
+int http_parse_range (const char *str, off_t size, struct http_range *ranges, unsigned *countp);
+
+/*
+ * Check if the given token, e.g. a content-coding, is acceptable in an Accept-* style header value.
+ *
+ * The token is acceptable if it is listed, or matches a * wildcard, with a non-zero qvalue.
+ *
+ * Returns 1 if acceptable, 0 if not.
+ */
+int http_parse_accept (const char *str, const char *token);
+
 /*
  * Create a new HTTP connect using the given IO streams.
  *
@@ -57,10 +167,15 @@ int http_create (struct http **httpp, struct stream *read, struct stream *write)
 /*
  * Write data from memory, as part of the message body.
  *
- * XXX: ensure that the use of stream_write does not place limits on maximum length.
+ * Small writes are buffered, larger writes are sent directly together with any buffered output.
  */
 int http_write (struct http *http, const char *buf, size_t size);
 
+/*
+ * Write data from multiple buffers, as part of the message, see stream_writev().
+ */
+int http_writev (struct http *http, const struct iovec *iov, int iovcnt);
+
 // XXX: should be http_print
 /*
  * Write formatted data, as part of the message body.
@@ -99,9 +214,12 @@ int http_write_headers (struct http *http);
  *
  * content_length, if given, indicates the expected maximum size of the file to send, or until EOF otherwise.
  *
+ * offset, if given, is the file offset to send from, see stream_write_file(). Otherwise the file is sent from the
+ * current file position.
+ *
  * Returns 1 on (unexpected) EOF, <0 on error.
  */
-int http_write_file (struct http *http, int fd, size_t content_length);
+int http_write_file (struct http *http, int fd, off_t *offset, size_t content_length);
 
 /*
  * Send a HTTP/1.1 'Transfer-Encoding: chunked' entity chunk.
@@ -120,6 +238,23 @@ int http_print_chunk (struct http *http, const char *fmt, ...)
  */
 int http_write_chunks (struct http *http);
 
+/*
+ * Send any buffered output.
+ *
+ * The request/response line, headers and formatted output are buffered, and must be flushed once the message is
+ * complete, before waiting for a reply.
+ */
+int http_flush (struct http *http);
+
+/*
+ * Test if the next message head has already been received, and can be read without blocking.
+ *
+ * Returns 1 if pending, 0 otherwise.
+ *
+ * Used to defer http_flush() for pipelined requests.
+ */
+int http_read_pending (struct http *http);
+
 
 
 
@@ -128,6 +263,52 @@ int http_write_chunks (struct http *http);
  */
 int http_read_request (struct http *http, const char **methodp, const char **pathp, const char **versionp);
 
+/*
+ * Read a HTTP request line and all headers in one pass, parsing them in-place within the stream buffer.
+ *
+ * The returned strings remain valid until the message body is read.
+ *
+ * Returns 0 on success, <0 on error, 1 on EOF, http 4xx on invalid request.
+ */
+int http_read_request_headers (struct http *http, const char **methodp, const char **pathp, const char **versionp,
+        struct http_headers *headers);
+
+/*
+ * Classify a header name.
+ */
+enum http_header_id http_header_id (const char *name);
+
+/*
+ * Return the value of the first known header of the given type, or NULL.
+ */
+const char * http_headers_get (const struct http_headers *headers, enum http_header_id id);
+
+/*
+ * Read a HTTP response line and all headers in one pass, leaving the header lines as-is within the stream buffer.
+ *
+ * The reason phrase is NUL-terminated in place. The raw header lines following the response line are returned in *headp,
+ * excluding the final empty line, and remain valid until the message body is read. Use http_head_next() to iterate
+ * over them.
+ *
+ * Returns 0 on success, <0 on error or invalid response, 1 on EOF.
+ */
+int http_read_response_head (struct http *http, enum http_version *versionp, unsigned *statusp, const char **reasonp,
+        const char **headp, size_t *lenp);
+
+/*
+ * Return the next header line from a raw head, advancing *headp and *lenp.
+ *
+ * Obsolete folded continuation lines are returned with a zero name_len.
+ *
+ * Returns 1 at the end of the head, or <0 on an invalid header line.
+ */
+int http_head_next (const char **headp, size_t *lenp, struct http_head_line *line);
+
+/*
+ * Look for the given token within a comma-separated header value of the given length, case-insensitively.
+ */
+bool http_header_token (const char *value, size_t len, const char *token, size_t token_len);
+
 /*
  * Read a HTTP response.
  */
@@ -142,6 +323,23 @@ int http_read_response (struct http *http, const char **versionp, unsigned *stat
  */
 int http_read_header (struct http *http, const char **headerp, const char **valuep);
 
+/*
+ * Read the next span of the message body, at most *sizep bytes, or as much as is available for 0, see stream_read_some().
+ *
+ * The returned data points into the read buffer, and remains valid until the next read.
+ *
+ * Returns 1 on EOF, <0 on error.
+ */
+int http_read (struct http *http, char **bufp, size_t *sizep);
+
+/*
+ * Read the next span of a chunked message body, at most *sizep bytes, or as much as is available for 0, within the
+ * current chunk.
+ *
+ * Returns 1 once the last-chunk and trailer have been read, <0 on error, including an invalid chunk or unexpected EOF.
+ */
+int http_read_chunked (struct http *http, char **bufp, size_t *sizep);
+
 /*
  * Read the response body as a NUL-terminated string.
  *
@@ -15,4 +15,10 @@ int http_parse_response (char *line, const char **versionp, unsigned *statusp, c
  */
 int http_parse_header (char *line, const char **headerp, const char **valuep);
 
+/*
+ * Parse the first line and following headers from a block of lines ending in an empty line, as returned by
+ * stream_read_head().
+ */
+int http_parse_head (char *buf, size_t size, char **linep, struct http_headers *headers);
+
 #endif
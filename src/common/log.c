@@ -2,12 +2,23 @@
 
 #include <errno.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-static enum log_level _log_level = LOG_LEVEL;
+enum log_level _log_level = LOG_LEVEL;
 static FILE *_log_file = NULL;
 
+/*
+ * Buffered log output, see log_set_buffer().
+ */
+static struct log_buffer {
+    char *buf;
+    size_t size, len;
+} _log_buffer;
+
 static const char * log_level_str (enum log_level level) {
     switch (level) {
         case LOG_FATAL:        return "FATAL";
@@ -19,29 +30,110 @@ static const char * log_level_str (enum log_level level) {
     }
 }
 
-void _logv (const char *prefix, enum log_level level, int flags, const char *fmt, va_list args)
+static FILE * log_file ()
+{
+    if (_log_file)
+        return _log_file;
+    else
+        return stderr;
+}
+
+/*
+ * Format the message into the buffer, using snprintf() to append each part.
+ *
+ * Returns 1 if the message does not fit.
+ */
+static int log_buffer_format (struct log_buffer *b, const char *prefix, enum log_level level, int flags, const char *fmt, va_list args, int errnum)
+{
+    size_t len = b->len;
+    int ret;
+
+    if (!(flags & LOG_NOPRE)) {
+        if ((ret = snprintf(b->buf + len, b->size - len, "%-8s %30s: ", log_level_str(level), prefix)) < 0 || ret >= b->size - len)
+            return 1;
+
+        len += ret;
+    }
+
+    if ((ret = vsnprintf(b->buf + len, b->size - len, fmt, args)) < 0 || ret >= b->size - len)
+        return 1;
+
+    len += ret;
+
+    if (flags & LOG_ERRNO) {
+        if ((ret = snprintf(b->buf + len, b->size - len, ": %s", strerror(errnum))) < 0 || ret >= b->size - len)
+            return 1;
+
+        len += ret;
+    }
+
+    if (!(flags & LOG_NOLN)) {
+        if (len + 1 >= b->size)
+            return 1;
+
+        b->buf[len++] = '\n';
+    }
+
+    b->len = len;
+
+    return 0;
+}
+
+/*
+ * Append the message to the log buffer, flushing it as needed.
+ *
+ * Returns 1 if the message is larger than the buffer, which has been flushed.
+ */
+static int log_buffer_append (struct log_buffer *b, const char *prefix, enum log_level level, int flags, const char *fmt, va_list args, int errnum)
 {
-    FILE *log_file = stderr;
+    va_list copy;
+    int err;
 
-    if (_log_file) 
-        log_file = _log_file;
+    for (int retry = 0; retry < 2; retry++) {
+        va_copy(copy, args);
+        err = log_buffer_format(b, prefix, level, flags, fmt, copy, errnum);
+        va_end(copy);
+
+        if (!err)
+            break;
+
+        // make room
+        log_flush();
+    }
+
+    if (err)
+        return 1;
+
+    if (level <= LOG_ERROR)
+        log_flush();
+
+    return 0;
+}
+
+void _logv (const char *prefix, enum log_level level, int flags, const char *fmt, va_list args)
+{
+    FILE *file = log_file();
+    int errnum = errno;
 
     // supress below configured log level
     if (level > _log_level)
         return;
-    
+
+    if (_log_buffer.buf && !log_buffer_append(&_log_buffer, prefix, level, flags, fmt, args, errnum))
+        return;
+
     if (!(flags & LOG_NOPRE))
-        fprintf(log_file, "%-8s %30s: ", log_level_str(level), prefix);
+        fprintf(file, "%-8s %30s: ", log_level_str(level), prefix);
+
+    vfprintf(file, fmt, args);
 
-    vfprintf(log_file, fmt, args);
-    
     if (flags & LOG_ERRNO)
-        fprintf(log_file, ": %s", strerror(errno));
+        fprintf(file, ": %s", strerror(errnum));
 
     if (!(flags & LOG_NOLN))
-        fprintf(log_file, "\n");
+        fprintf(file, "\n");
 
-    fflush(log_file);
+    fflush(file);
 }
 
 void _log (const char *prefix, enum log_level level, int flags, const char *fmt, ...)
@@ -60,5 +152,69 @@ void log_set_level (enum log_level level)
 
 void log_set_file (FILE *file)
 {
+    // buffered output goes to the previous file
+    log_flush();
+
     _log_file = file;
 }
+
+int log_set_buffer (size_t size)
+{
+    static bool registered;
+    char *buf = NULL;
+
+    log_flush();
+
+    if (size && !(buf = malloc(size))) {
+        log_perror("malloc");
+        return -1;
+    }
+
+    if (size && !registered) {
+        if (atexit(log_flush)) {
+            log_error("atexit");
+            free(buf);
+            return -1;
+        }
+
+        registered = true;
+    }
+
+    free(_log_buffer.buf);
+
+    _log_buffer = (struct log_buffer) {
+        .buf    = buf,
+        .size   = size,
+    };
+
+    return 0;
+}
+
+void log_flush ()
+{
+    struct log_buffer *b = &_log_buffer;
+    FILE *file = log_file();
+    int fd = fileno(file);
+    size_t off = 0;
+    ssize_t ret;
+
+    if (!b->len)
+        return;
+
+    // any previous unbuffered output
+    fflush(file);
+
+    while (off < b->len) {
+        if ((ret = write(fd, b->buf + off, b->len - off)) < 0 && errno == EINTR) {
+            continue;
+
+        } else if (ret <= 0) {
+            // nowhere to report this
+            break;
+        }
+
+        off += ret;
+    }
+
+    b->len = 0;
+}
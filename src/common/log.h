@@ -14,30 +14,47 @@ enum log_level {
 
 #define LOG_LEVEL LOG_WARNING
 
+/*
+ * Compile out all log calls above the given level, e.g. make LOG_MAX=LOG_INFO.
+ */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_DEBUG
+#endif
+
 enum log_flag {
     LOG_ERRNO    = 0x01,     // suffix with errno
     LOG_NOLN    = 0x02,     // omit newline for continuation
     LOG_NOPRE   = 0x04,     // omit prefix
 };
 
+/* Current maximum log level, see log_set_level() */
+extern enum log_level _log_level;
+
+/*
+ * Test if messages at the given level are logged, before evaluating any arguments.
+ */
+#define log_enabled(level)      ((level) <= LOG_LEVEL_MAX && (level) <= _log_level)
+
 void _logv (const char *prefix, enum log_level level, int flags, const char *fmt, va_list args);
 void _log (const char *prefix, enum log_level level, int flags, const char *fmt, ...)
     __attribute((format (printf, 4, 5)));
 
-#define log_debug(fmt, ...)     _log(__func__, LOG_DEBUG,    0,            fmt, ##__VA_ARGS__)
-#define log_pdebug(fmt, ...)     _log(__func__, LOG_DEBUG,    LOG_ERRNO,    fmt, ##__VA_ARGS__)
-#define log_ndebug(fmt, ...)    _log(__func__, LOG_DEBUG,    LOG_NOLN,   fmt, ##__VA_ARGS__)
-#define log_qdebug(fmt, ...)    _log(__func__, LOG_DEBUG,    LOG_NOPRE,  fmt, ##__VA_ARGS__)
-#define log_info(fmt, ...)         _log(__func__, LOG_INFO,    0,            fmt, ##__VA_ARGS__)
-#define log_ninfo(fmt, ...)     _log(__func__, LOG_INFO,    LOG_NOLN,   fmt, ##__VA_ARGS__)
-#define logv_qinfo(fmt, args)   _logv(__func__, LOG_INFO,    LOG_NOPRE,  fmt, args)
-#define log_qinfo(fmt, ...)     _log(__func__, LOG_INFO,    LOG_NOPRE,  fmt, ##__VA_ARGS__)
-#define log_warning(fmt, ...)     _log(__func__, LOG_WARNING,    0,            fmt, ##__VA_ARGS__)
-#define log_pwarning(fmt, ...)    _log(__func__, LOG_WARNING,    LOG_ERRNO,    fmt, ##__VA_ARGS__)
-#define log_error(fmt, ...)     _log(__func__, LOG_ERROR,    0,            fmt, ##__VA_ARGS__)
-#define log_perror(fmt, ...)     _log(__func__, LOG_ERROR,    LOG_ERRNO,    fmt, ##__VA_ARGS__)
-#define log_fatal(fmt, ...)     _log(__func__, LOG_FATAL,    0,            fmt, ##__VA_ARGS__)
-#define log_pfatal(fmt, ...)     _log(__func__, LOG_FATAL,    LOG_ERRNO,    fmt, ##__VA_ARGS__)
+#define _log_if(level, flags, fmt, ...) (log_enabled(level) ? _log(__func__, level, flags, fmt, ##__VA_ARGS__) : (void) 0)
+
+#define log_debug(fmt, ...)     _log_if(LOG_DEBUG,    0,            fmt, ##__VA_ARGS__)
+#define log_pdebug(fmt, ...)     _log_if(LOG_DEBUG,    LOG_ERRNO,    fmt, ##__VA_ARGS__)
+#define log_ndebug(fmt, ...)    _log_if(LOG_DEBUG,    LOG_NOLN,   fmt, ##__VA_ARGS__)
+#define log_qdebug(fmt, ...)    _log_if(LOG_DEBUG,    LOG_NOPRE,  fmt, ##__VA_ARGS__)
+#define log_info(fmt, ...)         _log_if(LOG_INFO,    0,            fmt, ##__VA_ARGS__)
+#define log_ninfo(fmt, ...)     _log_if(LOG_INFO,    LOG_NOLN,   fmt, ##__VA_ARGS__)
+#define logv_qinfo(fmt, args)   (log_enabled(LOG_INFO) ? _logv(__func__, LOG_INFO,    LOG_NOPRE,  fmt, args) : (void) 0)
+#define log_qinfo(fmt, ...)     _log_if(LOG_INFO,    LOG_NOPRE,  fmt, ##__VA_ARGS__)
+#define log_warning(fmt, ...)     _log_if(LOG_WARNING,    0,            fmt, ##__VA_ARGS__)
+#define log_pwarning(fmt, ...)    _log_if(LOG_WARNING,    LOG_ERRNO,    fmt, ##__VA_ARGS__)
+#define log_error(fmt, ...)     _log_if(LOG_ERROR,    0,            fmt, ##__VA_ARGS__)
+#define log_perror(fmt, ...)     _log_if(LOG_ERROR,    LOG_ERRNO,    fmt, ##__VA_ARGS__)
+#define log_fatal(fmt, ...)     _log_if(LOG_FATAL,    0,            fmt, ##__VA_ARGS__)
+#define log_pfatal(fmt, ...)     _log_if(LOG_FATAL,    LOG_ERRNO,    fmt, ##__VA_ARGS__)
 
 /*
  * Set the maximum log level.
@@ -49,4 +66,19 @@ void log_set_level (enum log_level level);
  */
 void log_set_file (FILE *file);
 
+/*
+ * Buffer up to size bytes of log output in memory, written out in batches by log_flush(), or 0 to write each message
+ * immediately.
+ *
+ * Errors are always flushed immediately, and any buffered output is flushed at exit.
+ */
+int log_set_buffer (size_t size);
+
+/*
+ * Write out any buffered log output.
+ *
+ * Called by the event_main before waiting for events, and before fork().
+ */
+void log_flush (void);
+
 #endif
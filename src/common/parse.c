@@ -1,10 +1,39 @@
 #include "common/parse.h"
+#include "common/parse_test.h"
 
 #include "common/log.h"
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+/*
+ * The parts of one transition which are compiled into the table.
+ */
+struct parse_key {
+    int state;
+    char c;
+    int next_state;
+    enum parse_type type;
+};
+
+struct parse_table {
+    /* Compiled transitions, to match against */
+    struct parse_key keys[PARSE_TRANSITIONS];
+    unsigned count;
+    uint32_t hash;
+
+    /* Index + 1 of the matching transition, or 0 for none */
+    uint8_t steps[PARSE_STATES][256];
+};
+
+static struct parse_table *parse_tables[PARSE_TABLES];
+static unsigned parse_tables_next;
+
+/* Disabled by parse_set_compile() */
+static bool parse_compile_disabled;
+
 /* Lookup parse state for given state/char */
 const struct parse * parse_step (const struct parse *parsing, int state, char c)
 {
@@ -24,6 +53,121 @@ const struct parse * parse_step (const struct parse *parsing, int state, char c)
     return NULL;
 }
 
+void parse_set_compile (bool enable)
+{
+    parse_compile_disabled = !enable;
+}
+
+static bool parse_key_equal (const struct parse_key *key, const struct parse *p)
+{
+    return key->state == p->state && key->c == p->c && key->next_state == p->next_state && key->type == p->type;
+}
+
+/*
+ * Fill in the transition table from the keys.
+ */
+static void parse_compile (struct parse_table *table)
+{
+    for (int state = 0; state < PARSE_STATES; state++) {
+        for (unsigned c = 0; c < 256; c++) {
+            uint8_t step = 0;
+
+            // first match wins, as in parse_step()
+            for (unsigned i = 0; i < table->count; i++) {
+                const struct parse_key *key = &table->keys[i];
+
+                if (key->state == state && (key->c == (char) c || key->c == -1)) {
+                    step = i + 1;
+                    break;
+                }
+            }
+
+            table->steps[state][c] = step;
+        }
+    }
+}
+
+/*
+ * Return the compiled table for the state machine, compiling it on first use.
+ *
+ * Returns NULL if not compiled, to use parse_step() instead.
+ */
+static const struct parse_table * parse_table (const struct parse *parsing)
+{
+    struct parse_table *table;
+    uint32_t hash = 2166136261u;
+    unsigned count = 0;
+    const struct parse *p;
+
+    if (parse_compile_disabled)
+        return NULL;
+
+    // FNV-1a over the transitions, to find any existing table
+    for (p = parsing; p->state || p->c || p->next_state; p++) {
+        int fields[] = { p->state, p->c, p->next_state, p->type };
+
+        if (++count > PARSE_TRANSITIONS)
+            return NULL;
+
+        for (unsigned i = 0; i < sizeof(fields) / sizeof(*fields); i++)
+            hash = (hash ^ (uint32_t) fields[i]) * 16777619u;
+    }
+
+    for (unsigned i = 0; i < PARSE_TABLES; i++) {
+        bool equal = true;
+
+        if (!(table = parse_tables[i]) || table->count != count || table->hash != hash)
+            continue;
+
+        for (unsigned j = 0; j < count && equal; j++)
+            equal = parse_key_equal(&table->keys[j], &parsing[j]);
+
+        if (equal)
+            return table;
+    }
+
+    // compile into a new table, or re-use the oldest
+    if (!(table = parse_tables[parse_tables_next]) && !(table = malloc(sizeof(*table)))) {
+        log_perror("malloc");
+        return NULL;
+    }
+
+    parse_tables[parse_tables_next] = table;
+    parse_tables_next = (parse_tables_next + 1) % PARSE_TABLES;
+
+    for (unsigned i = 0; i < count; i++) {
+        table->keys[i] = (struct parse_key) {
+            .state      = parsing[i].state,
+            .c          = parsing[i].c,
+            .next_state = parsing[i].next_state,
+            .type       = parsing[i].type,
+        };
+    }
+
+    table->count = count;
+    table->hash = hash;
+
+    parse_compile(table);
+
+    log_debug("compiled %u transitions", count);
+
+    return table;
+}
+
+/* Lookup parse state for given state/char, using the compiled table if possible */
+static const struct parse * parse_table_step (const struct parse_table *table, const struct parse *parsing, int state, char c)
+{
+    uint8_t step;
+
+    if (!table || state < 0 || state >= PARSE_STATES)
+        return parse_step(parsing, state, c);
+
+    if (!(step = table->steps[state][(unsigned char) c]))
+        return NULL;
+
+    return &parsing[step - 1];
+}
+
 /* Write out a parsed token */
 int parse_store (const struct parse *parse, char *token)
 {
@@ -61,12 +205,13 @@ int parse_store (const struct parse *parse, char *token)
 
 int parse (const struct parse *parsing, char *str, int state)
 {
+    const struct parse_table *table = parse_table(parsing);
     char c, *strp = str, *token = str;
     const struct parse *p;
     int err;
     
     while ((c = *strp)) {
-        if (!(p = parse_step(parsing, state, c))) {
+        if (!(p = parse_table_step(table, parsing, state, c))) {
             // token continues
             strp++;
             continue;
@@ -103,7 +248,7 @@ int parse (const struct parse *parsing, char *str, int state)
     }
 
     // terminate
-    if ((p = parse_step(parsing, state, *strp))) {
+    if ((p = parse_table_step(table, parsing, state, *strp))) {
         log_debug("%d <-     %d = %s", p->next_state, state, token);
 
         state = p->next_state;
@@ -117,12 +262,13 @@ int parse (const struct parse *parsing, char *str, int state)
 
 int tokenize (char *buf, size_t bufsize, const struct parse *parsing, const char **strp, int state)
 {
+    const struct parse_table *table = parse_table(parsing);
     char *out = buf, c;
     const char *str = *strp;
     const struct parse *p;
 
     while ((c = *str++)) {
-        p = parse_step(parsing, state, c);
+        p = parse_table_step(table, parsing, state, c);
 
         if (p) {
             state = p->next_state;
@@ -46,6 +46,19 @@ struct parse {
     };
 };
 
+/*
+ * Each distinct state machine is compiled into a [state][char] transition table on first use, for states from 0 up to
+ * PARSE_STATES, with other states falling back to scanning the transitions. Equal state machines share the same table,
+ * based on their states, chars and types, regardless of where the tokens are stored.
+ *
+ * State machines with more than PARSE_TRANSITIONS transitions are not compiled.
+ */
+#define PARSE_STATES 32
+#define PARSE_TRANSITIONS 255
+
+/* Maximum number of compiled state machines kept, re-using the oldest one once full */
+#define PARSE_TABLES 16
+
 /*
  * Parse a string in-place, per given parse state machine.
  */
@@ -0,0 +1,18 @@
+#ifndef PARSE_TEST_H
+#define PARSE_TEST_H
+
+#include "common/parse.h"
+
+#include <stdbool.h>
+
+/*
+ * Lookup the first matching transition for the given state/char, by scanning the transitions.
+ */
+const struct parse * parse_step (const struct parse *parsing, int state, char c);
+
+/*
+ * Enable or disable compiling the state machines, to compare against scanning the transitions.
+ */
+void parse_set_compile (bool enable);
+
+#endif
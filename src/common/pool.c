@@ -0,0 +1,83 @@
+#include "common/pool.h"
+
+#include "common/log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct pool_item {
+    struct pool_item *next;
+};
+
+/* All registered pools */
+static struct pool *pools;
+
+void *pool_alloc (struct pool *pool)
+{
+    struct pool_item *item;
+
+    if (!pool->registered) {
+        pool->next = pools;
+        pool->registered = 1;
+        pools = pool;
+    }
+
+    if ((item = pool->items)) {
+        pool->items = item->next;
+        pool->cached--;
+
+    } else if (!(item = malloc(pool->size < sizeof(*item) ? sizeof(*item) : pool->size))) {
+        log_perror("malloc %s: %zu", pool->name, pool->size);
+        return NULL;
+    }
+
+    pool->live++;
+
+    return item;
+}
+
+void *pool_calloc (struct pool *pool)
+{
+    void *ptr;
+
+    if ((ptr = pool_alloc(pool)))
+        memset(ptr, 0, pool->size);
+
+    return ptr;
+}
+
+void pool_free (struct pool *pool, void *ptr)
+{
+    struct pool_item *item = ptr;
+
+    if (!ptr)
+        return;
+
+    pool->live--;
+
+    if (pool->cached >= pool->max) {
+        free(item);
+        return;
+    }
+
+    item->next = pool->items;
+    pool->items = item;
+    pool->cached++;
+}
+
+void pool_each (pool_func *func, void *ctx)
+{
+    for (struct pool *pool = pools; pool; pool = pool->next) {
+        func(pool, ctx);
+    }
+}
+
+static void pool_log_func (const struct pool *pool, void *ctx)
+{
+    log_info("%s[%zu]: live=%u cached=%u", pool->name, pool->size, pool->live, pool->cached);
+}
+
+void pool_log ()
+{
+    pool_each(pool_log_func, NULL);
+}
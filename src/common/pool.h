@@ -0,0 +1,71 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/*
+ * Default maximum number of freed objects to cache in each pool.
+ */
+#define POOL_MAX 1024
+
+/*
+ * Free-list allocator for fixed-size objects.
+ *
+ * Freed objects are cached for re-use by the next allocation from the same pool, up to the max, instead of being
+ * returned to malloc().
+ *
+ * Pools are intended to be statically initialized using POOL_INIT(), and are not thread-safe.
+ */
+struct pool {
+    const char *name;
+
+    /* Object size */
+    size_t size;
+
+    /* Maximum number of cached objects */
+    unsigned max;
+
+    /* Number of allocated objects currently in use */
+    unsigned live;
+
+    /* Number of freed objects cached for re-use */
+    unsigned cached;
+
+    /* Cached objects, linked in-place */
+    struct pool_item *items;
+
+    /* Registered for pool_each() on first use */
+    struct pool *next;
+    int registered;
+};
+
+#define POOL_INIT(pool_name, pool_size) { .name = (pool_name), .size = (pool_size), .max = POOL_MAX }
+
+/*
+ * Allocate an object from the pool, with undefined contents.
+ */
+void *pool_alloc (struct pool *pool);
+
+/*
+ * Allocate a zero-initialized object from the pool.
+ */
+void *pool_calloc (struct pool *pool);
+
+/*
+ * Release an object back to the pool it was allocated from.
+ */
+void pool_free (struct pool *pool, void *ptr);
+
+/*
+ * Call the given func for each pool that has been used.
+ */
+typedef void (pool_func)(const struct pool *pool, void *ctx);
+
+void pool_each (pool_func *func, void *ctx);
+
+/*
+ * Log live/cached counters for each pool at LOG_INFO.
+ */
+void pool_log ();
+
+#endif
@@ -1,3 +1,6 @@
+// splice
+#define _GNU_SOURCE
+
 #include "common/sock.h"
 
 #include "common/log.h"
@@ -9,6 +12,7 @@
 #include <stdio.h>
 #include <sys/socket.h>
 #include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 int sockaddr_buf (char *buf, size_t buflen, const struct sockaddr *sa, socklen_t salen)
@@ -136,7 +140,17 @@ int sock_accept (int ssock, int *sockp)
 {
     int sock;
 
+#ifdef SOCK_NONBLOCK
+    sock = accept4(ssock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
     sock = accept(ssock, NULL, NULL);
+
+    if (sock >= 0 && (sock_nonblocking(sock) || fcntl(sock, F_SETFD, FD_CLOEXEC))) {
+        log_perror("fcntl");
+        close(sock);
+        return -1;
+    }
+#endif
     
     if (sock >= 0) {
         *sockp = sock;
@@ -185,9 +199,48 @@ int sock_write (int sock, const char *buf, size_t *sizep)
     }
 }
 
-int sock_sendfile (int sock, int fd, size_t *sizep)
+int sock_writev (int sock, const struct iovec *iov, int iovcnt, size_t *sizep)
+{
+    ssize_t ret = writev(sock, iov, iovcnt);
+
+    if (ret >= 0) {
+        *sizep = ret;
+        return 0;
+
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 1;
+
+    } else {
+        log_perror("writev");
+        return -1;
+    }
+}
+
+int sock_splice (int sock, int pipe, size_t *sizep)
+{
+    ssize_t ret = splice(sock, NULL, pipe, NULL, *sizep, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if (ret > 0) {
+        *sizep = ret;
+        return 0;
+
+    } else if (!ret) {
+        log_debug("eof");
+        *sizep = 0;
+        return 0;
+
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 1;
+
+    } else {
+        log_perror("splice");
+        return -1;
+    }
+}
+
+int sock_sendfile (int sock, int fd, off_t *offset, size_t *sizep)
 {
-    int ret = sendfile(sock, fd, NULL, *sizep);
+    ssize_t ret = sendfile(sock, fd, offset, *sizep);
 
     if (ret > 0) {
         *sizep = ret;
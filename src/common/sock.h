@@ -2,6 +2,7 @@
 #define SOCK_H
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #define SOCKADDR_MAX 1024
 
@@ -47,6 +48,8 @@ int sock_error (int sock);
 /*
  * Accept a new socket connection on a listen() socket.
  *
+ * The new socket is nonblocking and close-on-exec, using a single accept4() where available.
+ *
  * Returns 1 on nonblocking, 0 on success, <0 on error.
  */
 int sock_accept (int ssock, int *sockp);
@@ -69,13 +72,34 @@ int sock_read (int sock, char *buf, size_t *sizep);
  */
 int sock_write (int sock, const char *buf, size_t *sizep);
 
+/*
+ * Write from multiple buffers to a socket, in a single syscall.
+ *
+ * Returns *sizep == 0 on EOF, or the total number of bytes written, which may be less than the total iov length.
+ *
+ * Returns 1 on nonblocking, 0 on success, <0 on error.
+ */
+int sock_writev (int sock, const struct iovec *iov, int iovcnt, size_t *sizep);
+
 /*
  * Copy from file to socket.
  *
+ * If offset is given, the file is read from *offset, which is updated, and the file position is not changed.
+ * Otherwise, the file is read from the current file position.
+ *
+ * Returns *sizep == 0 on EOF.
+ *
+ * Returns 1 on nonblocking, 0 on success, <0 on error.
+ */
+int sock_sendfile (int sock, int fd, off_t *offset, size_t *sizep);
+
+/*
+ * Move up to *sizep bytes from the socket into the write end of a pipe, without copying into userspace.
+ *
  * Returns *sizep == 0 on EOF.
  *
  * Returns 1 on nonblocking, 0 on success, <0 on error.
  */
-int sock_sendfile (int sock, int fd, size_t *sizep);
+int sock_splice (int sock, int pipe, size_t *sizep);
 
 #endif
@@ -1,30 +1,53 @@
 /*
- * Experimental SSL client support.
+ * Experimental SSL client and server support.
  *
  * XXX:
  *      no server cert validation
- *
- * TODO:
- *      event/non-blocking support
- *      ssl_server support
  */
 
 #include "common/ssl.h"
 
 #include "common/log.h"
+#include "common/sock.h"
 #include "common/stream.h"
-#include "common/tcp.h"
+#include "common/tcp_internal.h"
 
 #include <openssl/err.h>
 #include <openssl/ssl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
 #include <unistd.h>
 
 #ifndef WITH_SSL
 #error XXX: building common/ssl.o without WITH_SSL
 #endif
 
+/* Maximum length of a host:port session cache key */
+#define SSL_SESSION_KEY 512
+
+/*
+ * Client session for resumption by later connections to the same host:port.
+ */
+struct ssl_session {
+    char key[SSL_SESSION_KEY];
+
+    SSL_SESSION *session;
+
+    TAILQ_ENTRY(ssl_session) main_sessions;
+};
+
 struct ssl_main {
     SSL_CTX *ssl_ctx;
+
+    /* Client sessions, most recently used first */
+    TAILQ_HEAD(ssl_sessions, ssl_session) sessions;
+    unsigned session_count;
+
+    /* Statistics */
+    unsigned resumed, handshakes;
 };
 
 struct ssl {
@@ -32,7 +55,22 @@ struct ssl {
 
     int sock;
     SSL *SSL;
-    
+
+    /* Used for event_yield() on SSL_ERROR_WANT_READ/WRITE, if non-blocking */
+    struct event *event;
+
+    /* Server connection layered over the tcp connection, which owns the sock/event and timeouts */
+    struct tcp *tcp;
+
+    /* Session cache key */
+    char session_key[SSL_SESSION_KEY];
+
+    /* Failed with a protocol or socket error, and the session must not be resumed */
+    bool error;
+
+    /* Closed by the peer, as opposed to a timeout */
+    bool eof;
+
     struct stream *read, *write;
 };
 
@@ -46,6 +84,65 @@ static const char * ssl_error_str ()
     return ERR_error_string(ERR_get_error(), NULL);
 }
 
+/*
+ * Find the cached session for the key.
+ */
+static struct ssl_session * ssl_session_find (struct ssl_main *ssl_main, const char *key)
+{
+    struct ssl_session *session;
+
+    TAILQ_FOREACH(session, &ssl_main->sessions, main_sessions) {
+        if (strcmp(session->key, key) == 0)
+            return session;
+    }
+
+    return NULL;
+}
+
+/*
+ * SSL_CTX_sess_set_new_cb(), called once the server has issued a session; for TLS 1.3, after the handshake.
+ *
+ * Returns 1 to take the reference to the session, 0 to leave it to OpenSSL.
+ */
+static int ssl_session_new (SSL *SSL, SSL_SESSION *sess)
+{
+    struct ssl *ssl = SSL_get_app_data(SSL);
+    struct ssl_main *ssl_main = ssl->ssl_main;
+    struct ssl_session *session;
+
+    if ((session = ssl_session_find(ssl_main, ssl->session_key))) {
+        SSL_SESSION_free(session->session);
+
+        TAILQ_REMOVE(&ssl_main->sessions, session, main_sessions);
+
+    } else if (ssl_main->session_count >= SSL_SESSION_MAX) {
+        // re-use the least recently used
+        session = TAILQ_LAST(&ssl_main->sessions, ssl_sessions);
+
+        log_debug("evict %s", session->key);
+
+        SSL_SESSION_free(session->session);
+
+        TAILQ_REMOVE(&ssl_main->sessions, session, main_sessions);
+
+    } else if ((session = calloc(1, sizeof(*session)))) {
+        ssl_main->session_count++;
+
+    } else {
+        log_perror("calloc");
+        return 0;
+    }
+
+    log_debug("%s", ssl->session_key);
+
+    strcpy(session->key, ssl->session_key);
+    session->session = sess;
+
+    TAILQ_INSERT_HEAD(&ssl_main->sessions, session, main_sessions);
+
+    return 1;
+}
+
 int ssl_main_create (struct ssl_main **ssl_mainp)
 {
     struct ssl_main *ssl_main;
@@ -62,11 +159,22 @@ int ssl_main_create (struct ssl_main **ssl_mainp)
         return -1;
     }
 
+    TAILQ_INIT(&ssl_main->sessions);
+
     if (!(ssl_main->ssl_ctx = SSL_CTX_new(ssl_method))) {
         log_error("SSL_CTX_new: %s", ssl_error_str());
         goto error;
     }
 
+    // sessions are kept by host:port, as the internal cache is only used for servers
+    SSL_CTX_set_session_cache_mode(ssl_main->ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ssl_main->ssl_ctx, ssl_session_new);
+
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // treat a close without close_notify as EOF, as many HTTP servers do
+    SSL_CTX_set_options(ssl_main->ssl_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
     *ssl_mainp = ssl_main;
 
     return 0;
@@ -76,20 +184,92 @@ error:
     return -1;
 }
 
+/*
+ * Handle a failed SSL_* operation, waiting for the socket if it would block.
+ *
+ * Returns 0 to retry the operation, 1 on EOF, <0 on error.
+ */
+static int ssl_wait (struct ssl *ssl, int ret, const char *func)
+{
+    int err;
+
+    switch (SSL_get_error(ssl->SSL, ret)) {
+        case SSL_ERROR_ZERO_RETURN:
+            log_debug("%s: closed", func);
+            ssl->eof = true;
+            return 1;
+
+        case SSL_ERROR_WANT_READ:
+            if (!ssl->event) {
+                log_error("%s: nonblocking", func);
+                return -1;
+            }
+
+            if ((err = event_yield(ssl->event, EVENT_READ, ssl->tcp ? maybe_timeout(&ssl->tcp->read_timeout) : NULL)) < 0) {
+                log_error("event_yield");
+                return -1;
+
+            } else if (err) {
+                log_debug("%s: read timeout", func);
+                return 1;
+            }
+
+            return 0;
+
+        case SSL_ERROR_WANT_WRITE:
+            if (!ssl->event) {
+                log_error("%s: nonblocking", func);
+                return -1;
+            }
+
+            if ((err = event_yield(ssl->event, EVENT_WRITE, ssl->tcp ? maybe_timeout(&ssl->tcp->write_timeout) : NULL)) < 0) {
+                log_error("event_yield");
+                return -1;
+
+            } else if (err) {
+                log_debug("%s: write timeout", func);
+                return 1;
+            }
+
+            return 0;
+
+        case SSL_ERROR_SYSCALL:
+            if (ret) {
+                log_perror("%s", func);
+                ssl->error = true;
+                return -1;
+            } else {
+                log_warning("%s: eof", func);
+                ssl->eof = true;
+                return 1;
+            }
+
+        case SSL_ERROR_SSL:
+            log_error("%s: %s", func, ssl_error_str());
+            ssl->error = true;
+            return -1;
+
+        default:
+            log_error("%s: unknown error", func);
+            return -1;
+    }
+}
+
 /* Stream support */
 int ssl_stream_read (char *buf, size_t *sizep, void *ctx)
 {
     struct ssl *ssl = ctx;
-    int ret;
-    
-    if ((ret = SSL_read(ssl->SSL, buf, *sizep)) < 0) {
-        log_error("SSL_read: XXX");
-        return -1;
-    }
+    int ret, err;
 
-    if (!ret) {
-        log_debug("eof: XXX");
-        return 1;
+    while ((ret = SSL_read(ssl->SSL, buf, *sizep)) <= 0) {
+        if ((err = ssl_wait(ssl, ret, "SSL_read")) > 0 && ssl->eof) {
+            // EOF, rather than timeout
+            *sizep = 0;
+            return 1;
+
+        } else if (err) {
+            return err;
+        }
     }
 
     *sizep = ret;
@@ -100,18 +280,49 @@ int ssl_stream_read (char *buf, size_t *sizep, void *ctx)
 int ssl_stream_write (const char *buf, size_t *sizep, void *ctx)
 {
     struct ssl *ssl = ctx;
-    int ret;
-    
-    if ((ret = SSL_write(ssl->SSL, buf, *sizep)) < 0) {
-        log_error("SSL_write: XXX");
+    int ret, err;
+
+    // retried with the same arguments, as required by SSL_write()
+    while ((ret = SSL_write(ssl->SSL, buf, *sizep)) <= 0) {
+        if ((err = ssl_wait(ssl, ret, "SSL_write")))
+            return err;
+    }
+
+    *sizep = ret;
+
+    return 0;
+}
+
+/*
+ * Send file data using kTLS, with the kernel encrypting the records.
+ */
+static int ssl_stream_sendfile (int fd, off_t *offset, size_t *sizep, void *ctx)
+{
+    struct ssl *ssl = ctx;
+    ossl_ssize_t ret;
+    int err;
+
+    if (!offset) {
+        log_fatal("SSL_sendfile without offset");
         return -1;
     }
 
+    if (!*sizep) {
+        // send in large chunks, there is no buffer involved
+        *sizep = SSL_STREAM_MAX;
+    }
+
+    while ((ret = SSL_sendfile(ssl->SSL, fd, *offset, *sizep, 0)) < 0) {
+        if ((err = ssl_wait(ssl, ret, "SSL_sendfile")))
+            return err;
+    }
+
     if (!ret) {
-        log_debug("eof: XXX");
+        log_debug("eof");
         return 1;
     }
 
+    *offset += ret;
     *sizep = ret;
 
     return 0;
@@ -122,73 +333,108 @@ struct stream_type ssl_stream_type = {
     .write  = ssl_stream_write,
 };
 
-int ssl_connect (struct ssl *ssl, const char *host, const char *port)
+static const struct stream_type ssl_ktls_stream_type = {
+    .read       = ssl_stream_read,
+    .write      = ssl_stream_write,
+    .sendfile   = ssl_stream_sendfile,
+};
+
+static int ssl_layer_pending (void *ctx)
 {
-    int err;
+    struct ssl *ssl = ctx;
 
-    // TODO: event_main
-    if ((err = tcp_connect(NULL, &ssl->sock, host, port))) {
-        log_perror("tcp_connect %s:%s", host, port);
-        return err;
-    }
+    return SSL_has_pending(ssl->SSL);
+}
+
+static void ssl_layer_destroy (void *ctx)
+{
+    ssl_destroy(ctx);
+}
+
+static const struct tcp_layer ssl_layer = {
+    .stream_type    = &ssl_stream_type,
+    .pending        = ssl_layer_pending,
+    .destroy        = ssl_layer_destroy,
+};
+
+static const struct tcp_layer ssl_ktls_layer = {
+    .stream_type    = &ssl_ktls_stream_type,
+    .pending        = ssl_layer_pending,
+    .destroy        = ssl_layer_destroy,
+};
+
+int ssl_connect (struct ssl *ssl, const char *host, const char *port)
+{
+    struct ssl_session *session;
+    int ret, err;
 
     if (SSL_set_fd(ssl->SSL, ssl->sock) != 1) {
         log_error("SSL_set_fd: %s", ssl_error_str());
         return -1;
     }
 
-    if ((err = SSL_connect(ssl->SSL)) != 1) {
-        switch (SSL_get_error(ssl->SSL, err)) {
-            case SSL_ERROR_ZERO_RETURN:
-                log_warning("SSL_connect: closed");
-                return 1;
-
-            case SSL_ERROR_WANT_READ:
-            case SSL_ERROR_WANT_WRITE:
-            case SSL_ERROR_WANT_CONNECT:
-            case SSL_ERROR_WANT_ACCEPT:
-            case SSL_ERROR_WANT_X509_LOOKUP:
-                log_error("SSL_connect: nonblocking");
-                return -1;
+    // SNI
+    if (SSL_set_tlsext_host_name(ssl->SSL, host) != 1) {
+        log_warning("SSL_set_tlsext_host_name: %s", ssl_error_str());
+    }
 
-            case SSL_ERROR_SYSCALL:
-                if (err) {
-                    log_perror("SSL_connect");
-                    return -1;
-                } else {
-                    log_warning("SSL_connect: eof");
-                    return 1;
-                }
-
-            case SSL_ERROR_SSL:
-                log_error("SSL_connect: %s", ssl_error_str());
-                return -1;
-        }
+    if ((session = ssl_session_find(ssl->ssl_main, ssl->session_key)) && SSL_set_session(ssl->SSL, session->session) != 1) {
+        log_warning("SSL_set_session: %s", ssl_error_str());
+    }
 
-        log_error("SSL_connect: unknown error");
-        return -1;
+    while ((ret = SSL_connect(ssl->SSL)) != 1) {
+        if ((err = ssl_wait(ssl, ret, "SSL_connect")))
+            return err;
     }
 
     // log
     const char *ssl_version = SSL_get_version(ssl->SSL);
     const char *ssl_cipher = SSL_get_cipher_name(ssl->SSL);
 
-    log_info("connected %s:%s (%s %s)", host, port, ssl_version, ssl_cipher);
+    ssl->ssl_main->handshakes++;
+
+    if (SSL_session_reused(ssl->SSL)) {
+        ssl->ssl_main->resumed++;
+
+        log_info("resumed %s:%s (%s %s)", host, port, ssl_version, ssl_cipher);
+    } else {
+        log_info("connected %s:%s (%s %s)", host, port, ssl_version, ssl_cipher);
+    }
 
     return 0;
 }
 
-int ssl_client (struct ssl_main *ssl_main, struct ssl **sslp, const char *host, const char *port)
+int ssl_client (struct ssl_main *ssl_main, struct event_main *event_main, struct ssl **sslp, int sock, const char *host, const char *port)
 {
     struct ssl *ssl = NULL;
     int err;
 
     if (!(ssl = calloc(1, sizeof(*ssl)))) {
         log_perror("calloc");
+        close(sock);
         return -1;
     }
 
     ssl->ssl_main = ssl_main;
+    ssl->sock = sock;
+
+    if (snprintf(ssl->session_key, sizeof(ssl->session_key), "%s:%s", host, port) >= (int) sizeof(ssl->session_key)) {
+        log_error("host too long: %s", host);
+        err = 1;
+        goto error;
+    }
+
+    if (event_main) {
+        if ((err = sock_nonblocking(sock))) {
+            log_error("sock_nonblocking");
+            goto error;
+        }
+
+        if ((err = event_create(event_main, &ssl->event, sock))) {
+            log_error("event_create");
+            goto error;
+        }
+    }
 
     if (!(ssl->SSL = SSL_new(ssl_main->ssl_ctx))) {
         log_error("SSL_new: %s", ssl_error_str());
@@ -196,20 +442,22 @@ int ssl_client (struct ssl_main *ssl_main, struct ssl **sslp, const char *host,
         goto error;
     }
 
-    // network connect + handshake
+    SSL_set_app_data(ssl->SSL, ssl);
+
+    // handshake
     if ((err = ssl_connect(ssl, host, port)))
         goto error;
 
-    if ((err = stream_create(&ssl_stream_type, &ssl->read, SSL_STREAM_SIZE, ssl))) {
+    if ((err = stream_create(&ssl_stream_type, &ssl->read, SSL_STREAM_SIZE, SSL_STREAM_MAX, ssl))) {
         log_error("stream_create read");
         goto error;
     }
-    
-    if ((err = stream_create(&ssl_stream_type, &ssl->write, SSL_STREAM_SIZE, ssl))) {
+
+    if ((err = stream_create(&ssl_stream_type, &ssl->write, SSL_STREAM_SIZE, SSL_STREAM_MAX, ssl))) {
         log_error("stream_create write");
         goto error;
     }
-    
+
     *sslp = ssl;
 
     return 0;
@@ -217,7 +465,113 @@ int ssl_client (struct ssl_main *ssl_main, struct ssl **sslp, const char *host,
 error:
     ssl_destroy(ssl);
 
-    return err; 
+    return err;
+}
+
+int ssl_server_create (struct ssl_main **ssl_mainp, const char *cert, const char *key)
+{
+    struct ssl_main *ssl_main;
+    int err;
+
+    if ((err = ssl_main_create(&ssl_main)))
+        return err;
+
+    if (SSL_CTX_use_certificate_chain_file(ssl_main->ssl_ctx, cert) != 1) {
+        log_error("SSL_CTX_use_certificate_chain_file %s: %s", cert, ssl_error_str());
+        goto error;
+    }
+
+    if (SSL_CTX_use_PrivateKey_file(ssl_main->ssl_ctx, key ? key : cert, SSL_FILETYPE_PEM) != 1) {
+        log_error("SSL_CTX_use_PrivateKey_file %s: %s", key ? key : cert, ssl_error_str());
+        goto error;
+    }
+
+    // the internal session cache for session IDs, alongside the default session tickets
+    SSL_CTX_set_session_cache_mode(ssl_main->ssl_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ssl_main->ssl_ctx, SSL_SERVER_SESSIONS);
+    SSL_CTX_sess_set_new_cb(ssl_main->ssl_ctx, NULL);
+
+    if (SSL_CTX_set_session_id_context(ssl_main->ssl_ctx, (const unsigned char *) SSL_SESSION_CONTEXT, sizeof(SSL_SESSION_CONTEXT) - 1) != 1) {
+        log_error("SSL_CTX_set_session_id_context: %s", ssl_error_str());
+        goto error;
+    }
+
+    // idle connections do not need the read/write buffers
+    SSL_CTX_set_mode(ssl_main->ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
+
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ssl_main->ssl_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    *ssl_mainp = ssl_main;
+
+    return 0;
+
+error:
+    ssl_main_destroy(ssl_main);
+
+    return -1;
+}
+
+int ssl_server_accept (struct ssl_main *ssl_main, struct tcp *tcp)
+{
+    struct ssl *ssl;
+    int ret, err;
+
+    if (!(ssl = calloc(1, sizeof(*ssl)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    ssl->ssl_main = ssl_main;
+    ssl->tcp = tcp;
+    ssl->sock = tcp->sock;
+    ssl->event = tcp->event;
+
+    if (!(ssl->SSL = SSL_new(ssl_main->ssl_ctx))) {
+        log_error("SSL_new: %s", ssl_error_str());
+        err = -1;
+        goto error;
+    }
+
+    if (SSL_set_fd(ssl->SSL, ssl->sock) != 1) {
+        log_error("SSL_set_fd: %s", ssl_error_str());
+        err = -1;
+        goto error;
+    }
+
+    while ((ret = SSL_accept(ssl->SSL)) != 1) {
+        if ((err = ssl_wait(ssl, ret, "SSL_accept")))
+            goto error;
+    }
+
+    ssl_main->handshakes++;
+
+    if (SSL_session_reused(ssl->SSL))
+        ssl_main->resumed++;
+
+    log_info("%s (%s %s%s)", sockpeer_str(ssl->sock), SSL_get_version(ssl->SSL), SSL_get_cipher_name(ssl->SSL),
+            SSL_session_reused(ssl->SSL) ? " resumed" : ""
+    );
+
+    // sendfile() bypasses the streams, which only works for records encrypted by the kernel
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl->SSL))) {
+        log_debug("kTLS");
+
+        tcp_set_layer(tcp, &ssl_ktls_layer, ssl);
+    } else {
+        tcp_set_layer(tcp, &ssl_layer, ssl);
+    }
+
+    return 0;
+
+error:
+    // the session of a failed handshake is not resumable
+    ssl->error = true;
+
+    ssl_destroy(ssl);
+
+    return err;
 }
 
 int ssl_sock (struct ssl *ssl)
@@ -237,11 +591,46 @@ struct stream * ssl_write_stream (struct ssl *ssl)
 
 void ssl_destroy (struct ssl *ssl)
 {
-    if (ssl->sock)
-        close(ssl->sock);
+    if (ssl->read)
+        stream_destroy(ssl->read);
+
+    if (ssl->write)
+        stream_destroy(ssl->write);
+
+    if (ssl->SSL && !ssl->error) {
+        // OpenSSL invalidates the session unless shut down, but the peer may already have closed without reading
+        SSL_set_quiet_shutdown(ssl->SSL, 1);
+        SSL_shutdown(ssl->SSL);
+    }
 
     if (ssl->SSL)
         SSL_free(ssl->SSL);
 
+    // a server connection is released by tcp_destroy()
+    if (ssl->event && !ssl->tcp)
+        event_destroy(ssl->event);
+
+    if (ssl->sock >= 0 && !ssl->tcp)
+        close(ssl->sock);
+
     free(ssl);
 }
+
+void ssl_main_destroy (struct ssl_main *ssl_main)
+{
+    struct ssl_session *session;
+
+    if (ssl_main->handshakes)
+        log_info("handshakes=%u resumed=%u", ssl_main->handshakes, ssl_main->resumed);
+
+    while ((session = TAILQ_FIRST(&ssl_main->sessions))) {
+        TAILQ_REMOVE(&ssl_main->sessions, session, main_sessions);
+
+        SSL_SESSION_free(session->session);
+        free(session);
+    }
+
+    SSL_CTX_free(ssl_main->ssl_ctx);
+
+    free(ssl_main);
+}
@@ -5,14 +5,26 @@
 #ifndef SSL_H
 #define SSL_H
 
+#include "common/event.h"
+
 /*
  * SSL connection support *g*
  */
 struct ssl_main;
 struct ssl;
 
-// XXX
-#define SSL_STREAM_SIZE 1024
+/* Initial and maximum stream buffer sizes; one full TLS record of plaintext per SSL_read() */
+#define SSL_STREAM_SIZE (16 * 1024)
+#define SSL_STREAM_MAX 65536
+
+/* Maximum number of client sessions kept for resumption */
+#define SSL_SESSION_MAX 64
+
+/* Maximum number of server sessions kept for resumption by session ID, on top of stateless session tickets */
+#define SSL_SERVER_SESSIONS 1024
+
+/* Server session ID context */
+#define SSL_SESSION_CONTEXT "server"
 
 /*
  * Initialize context for SSL connections.
@@ -20,9 +32,37 @@ struct ssl;
 int ssl_main_create (struct ssl_main **mainp);
 
 /*
- * Open a new SSL client connection to a SSL server adressed by host:port.
+ * Open a new SSL client connection on the connected sock, taking ownership of it, to the SSL server addressed by
+ * host:port.
+ *
+ * The host is sent for SNI, and the session is kept by host:port for resumption by later connections.
+ *
+ * Passing in an event_main will perform a non-blocking handshake and reads/writes, yielding the current task.
+ */
+int ssl_client (struct ssl_main *ssl_main, struct event_main *event_main, struct ssl **sslp, int sock, const char *host, const char *port);
+
+/*
+ * Initialize context for SSL server connections, using the given PEM certificate chain and private key files.
+ *
+ * The key may be NULL if included in the cert file.
+ *
+ * Sessions are resumable using session tickets, whose keys are shared by any processes forked after creation.
+ * kTLS is enabled if supported, for sendfile().
  */
-int ssl_client (struct ssl_main *ssl_main, struct ssl **sslp, const char *host, const char *port);
+int ssl_server_create (struct ssl_main **mainp, const char *cert, const char *key);
+
+struct tcp;
+
+/*
+ * Perform the SSL server handshake on the accepted tcp connection, yielding the current task, using the tcp
+ * read/write timeouts.
+ *
+ * On success, all further tcp_read_stream()/tcp_write_stream() IO is encrypted, and the SSL connection is released by
+ * tcp_destroy(). On errors, the tcp connection remains for the caller to destroy.
+ *
+ * Returns 1 on a handshake timeout, <0 on error.
+ */
+int ssl_server_accept (struct ssl_main *ssl_main, struct tcp *tcp);
 
 /*
  * IO streams.
@@ -36,4 +76,9 @@ struct stream * ssl_write_stream (struct ssl *ssl);
  */
 void ssl_destroy (struct ssl *ssl);
 
+/*
+ * Release the context and any cached sessions, once all connections have been destroyed.
+ */
+void ssl_main_destroy (struct ssl_main *ssl_main);
+
 #endif
@@ -0,0 +1,111 @@
+#include "common/stats.h"
+
+#include "common/log.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+/* Used until stats_share() */
+static struct stats stats_local;
+
+static struct stats *stats_slots = &stats_local;
+static unsigned stats_slots_count = 1;
+
+struct stats *stats = &stats_local;
+
+int stats_share (unsigned count)
+{
+    struct stats *slots;
+
+    if (!count)
+        count = 1;
+
+    // zero-filled, and shared with any children
+    if ((slots = mmap(NULL, count * sizeof(*slots), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        log_perror("mmap");
+        return -1;
+    }
+
+    // keep any handlers already added
+    slots[0] = *stats;
+
+    if (!slots[0].start)
+        slots[0].start = time(NULL);
+
+    stats_slots = slots;
+    stats_slots_count = count;
+    stats = &slots[0];
+
+    return 0;
+}
+
+int stats_select (unsigned index)
+{
+    if (index >= stats_slots_count) {
+        log_fatal("index %u out of range: %u", index, stats_slots_count);
+        return -1;
+    }
+
+    // a restarted worker starts over
+    stats_slots[index] = (struct stats) {
+        .start  = time(NULL),
+    };
+
+    stats = &stats_slots[index];
+
+    return 0;
+}
+
+unsigned stats_count ()
+{
+    return stats_slots_count;
+}
+
+const struct stats * stats_slot (unsigned index)
+{
+    return &stats_slots[index];
+}
+
+unsigned stats_handler (const char *name)
+{
+    unsigned index;
+
+    if (!name)
+        return 0;
+
+    // the first handler is for requests without any handler
+    if (!stats->server_handler_count)
+        stats->server_handler_count = 1;
+
+    for (index = 1; index < stats->server_handler_count; index++) {
+        if (strcmp(stats->server_handlers[index].name, name) == 0)
+            return index;
+    }
+
+    if (index >= STATS_HANDLERS) {
+        log_warning("too many handlers: %s", name);
+        return 0;
+    }
+
+    strncpy(stats->server_handlers[index].name, name, STATS_HANDLER_NAME - 1);
+    stats->server_handler_count++;
+
+    return index;
+}
+
+void stats_histogram_add (struct stats_histogram *histogram, uint64_t value)
+{
+    unsigned bucket = value ? 64 - __builtin_clzll(value) : 0;
+
+    if (bucket >= STATS_HISTOGRAM_BUCKETS)
+        bucket = STATS_HISTOGRAM_BUCKETS - 1;
+
+    histogram->count++;
+    histogram->sum += value;
+    histogram->buckets[bucket]++;
+}
+
+uint64_t stats_histogram_bound (unsigned bucket)
+{
+    return bucket ? (UINT64_C(1) << bucket) - 1 : 0;
+}
@@ -0,0 +1,112 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Runtime counters for the current process, updated in place by each module.
+ *
+ * Each worker process uses its own slot within a shared mapping, so that any process can read the slots of all the
+ * workers, see stats_share().
+ */
+
+/* Power-of-two buckets: 0, 1, 2-3, 4-7, ..., and everything larger in the last bucket */
+#define STATS_HISTOGRAM_BUCKETS 32
+
+struct stats_histogram {
+    uint64_t count, sum;
+    uint64_t buckets[STATS_HISTOGRAM_BUCKETS];
+};
+
+/* Maximum number of distinct request handlers counted separately */
+#define STATS_HANDLERS 16
+#define STATS_HANDLER_NAME 32
+
+/* Indexes into stats_handler.status: 0 for aborted requests, or the 1xx-5xx status class */
+#define STATS_STATUS_CLASSES 6
+
+struct stats_handler {
+    char name[STATS_HANDLER_NAME];
+
+    uint64_t requests;
+    uint64_t status[STATS_STATUS_CLASSES];
+};
+
+struct stats {
+    /* Process start, or 0 if the slot is unused */
+    time_t start;
+
+    /* event_main_run() iterations, ready events per iteration, and microseconds spent polling vs running tasks */
+    uint64_t event_iterations;
+    struct stats_histogram event_ready;
+    uint64_t event_poll_usec, event_run_usec;
+
+    /* Tasks currently running or waiting, and allocated task stacks, including ones kept for re-use */
+    int64_t event_tasks, event_stacks;
+
+    /* Accepted connections, and currently open connections */
+    uint64_t tcp_accepts;
+    int64_t tcp_connections;
+
+    /* Bytes written using sendfile(), and using write()/writev() from memory */
+    uint64_t stream_sendfile_bytes, stream_write_bytes;
+
+    /* DNS cache lookups */
+    uint64_t dns_cache_hits, dns_cache_misses;
+
+    /* Static file in-memory cache lookups */
+    uint64_t static_memory_hits, static_memory_misses;
+
+    /* Connections refused with a 503 response, once over the connection limit or out of fds */
+    uint64_t server_refused;
+
+    /* Requests by handler, with the first handler used for requests without any handler */
+    struct stats_handler server_handlers[STATS_HANDLERS];
+    unsigned server_handler_count;
+
+    /* Request latency, in microseconds */
+    struct stats_histogram server_latency;
+};
+
+/*
+ * The stats for this process.
+ */
+extern struct stats *stats;
+
+/*
+ * Allocate a shared mapping of count stats slots, to be inherited by any fork()'d worker processes.
+ *
+ * The current process uses the first slot, until stats_select().
+ */
+int stats_share (unsigned count);
+
+/*
+ * Use the given shared slot for this process, after fork().
+ */
+int stats_select (unsigned index);
+
+/*
+ * Return the number of slots, and the given slot, for reading.
+ */
+unsigned stats_count (void);
+const struct stats * stats_slot (unsigned index);
+
+/*
+ * Return the index of the counters for the given handler name within server_handlers, adding it if needed.
+ *
+ * Returns 0 for NULL or once full.
+ */
+unsigned stats_handler (const char *name);
+
+/*
+ * Count the value in the histogram.
+ */
+void stats_histogram_add (struct stats_histogram *histogram, uint64_t value);
+
+/*
+ * Upper bound of the given histogram bucket, inclusive.
+ */
+uint64_t stats_histogram_bound (unsigned bucket);
+
+#endif
@@ -1,6 +1,8 @@
 #include "common/stream.h"
 
 #include "common/log.h"
+#include "common/pool.h"
+#include "common/stats.h"
 
 #include <stdbool.h>
 #include <stdio.h>
@@ -8,6 +10,72 @@
 #include <string.h>
 #include <unistd.h>
 
+/* Number of different stream buffer sizes to keep pools for */
+#define STREAM_BUF_POOLS 8
+
+/* Maximum amount of memory to cache in each buffer pool */
+#define STREAM_BUF_CACHE (4 * 1024 * 1024)
+
+/* Maximum number of iovecs to pass to stream_type writev, including the buffered data */
+#define STREAM_WRITEV_MAX 16
+
+static struct pool stream_pool = POOL_INIT("stream", sizeof(struct stream));
+
+/* Buffer pools by size, allocated on demand */
+static struct pool stream_buf_pools[STREAM_BUF_POOLS];
+
+/*
+ * Find or setup a pool for stream buffers of the given size.
+ *
+ * Returns NULL if there are too many different sizes in use, which will use malloc() instead.
+ */
+static struct pool *stream_buf_pool (size_t size)
+{
+    for (int i = 0; i < STREAM_BUF_POOLS; i++) {
+        struct pool *pool = &stream_buf_pools[i];
+
+        if (pool->size == size) {
+            return pool;
+
+        } else if (!pool->size) {
+            *pool = (struct pool) POOL_INIT("stream-buf", size);
+
+            if (size * pool->max > STREAM_BUF_CACHE)
+                pool->max = STREAM_BUF_CACHE / size;
+
+            return pool;
+        }
+    }
+
+    return NULL;
+}
+
+static char *stream_buf_alloc (size_t size)
+{
+    struct pool *pool = stream_buf_pool(size);
+    char *buf;
+
+    if (pool)
+        buf = pool_alloc(pool);
+    else
+        buf = malloc(size);
+
+    if (!buf)
+        log_perror("malloc %zu", size);
+
+    return buf;
+}
+
+static void stream_buf_free (char *buf, size_t size)
+{
+    struct pool *pool = stream_buf_pool(size);
+
+    if (pool)
+        pool_free(pool, buf);
+    else
+        free(buf);
+}
+
 /*
  * Read buffer start, for reading new data into the stream.
  */
@@ -48,40 +116,43 @@ static inline char * stream_writebuf_end (struct stream *stream)
     return stream->buf + stream->length;
 }
 
-static int stream_init (const struct stream_type *type, struct stream *stream, size_t size, void *ctx)
+static int stream_init (const struct stream_type *type, struct stream *stream, size_t size, size_t max, void *ctx)
 {
     // buffer
-    if (!(stream->buf = malloc(size))) {
-        log_perror("malloc %zu", size);
+    if (!(stream->buf = stream_buf_alloc(size))) {
         return -1;
     }
 
     stream->type = type;
     stream->size = size;
+    stream->base = size;
+    stream->max = max > size ? max : size;
     stream->length = 0;
     stream->offset = 0;
+    stream->scan = 0;
+    stream->total = 0;
     stream->ctx = ctx;
 
     return 0;
 }
 
-int stream_create (const struct stream_type *type, struct stream **streamp, size_t size, void *ctx)
+int stream_create (const struct stream_type *type, struct stream **streamp, size_t size, size_t max, void *ctx)
 {
     struct stream *stream;
 
-    if (!(stream = calloc(1, sizeof(*stream)))) {
-        log_perror("calloc");
+    if (!(stream = pool_calloc(&stream_pool))) {
+        log_error("pool_calloc");
         return -1;
     }
 
-    if (stream_init(type, stream, size, ctx))
+    if (stream_init(type, stream, size, max, ctx))
         goto error;
 
     *streamp = stream;
     return 0;
 
 error:
-    free(stream);
+    pool_free(&stream_pool, stream);
     return -1;
 }
 
@@ -101,6 +172,7 @@ inline static void stream_write_mark (struct stream *stream, size_t size)
 {
     // XXX: assert offset < length
     stream->offset += size;
+    stream->scan = 0;
 }
 
 /*
@@ -109,28 +181,89 @@ inline static void stream_write_mark (struct stream *stream, size_t size)
 inline static void stream_write_consume (struct stream *stream)
 {
     stream->offset = stream->length;
+    stream->scan = 0;
 }
 
 /*
- * Clean out marked write buffer, making more room for the read buffer.
- *
- * Returns -1 if the stream buffer is full.
+ * Replace the stream buffer with a larger one, retaining any unconsumed data.
  */
-int _stream_clear (struct stream *stream)
+static int stream_grow (struct stream *stream, size_t size)
 {
-    if (!(stream->offset || stream->length < stream->size)) {
-        log_warning("stream write buffer is full, no room for read");
+    size_t length = stream_writebuf_size(stream);
+    char *buf;
+
+    if (!(buf = stream_buf_alloc(size)))
         return -1;
-    }
 
-    memmove(stream->buf, stream->buf + stream->offset, stream->length - stream->offset);
+    log_debug("%zu -> %zu", stream->size, size);
+
+    memcpy(buf, stream_writebuf_ptr(stream), length);
 
-    stream->length -= stream->offset;
+    stream_buf_free(stream->buf, stream->size);
+
+    stream->buf = buf;
+    stream->size = size;
     stream->offset = 0;
+    stream->length = length;
 
     return 0;
 }
 
+/*
+ * Ensure that there is room for at least the given number of bytes in the read buffer.
+ *
+ * Consumed data is only dropped from the start of the buffer once we run out of room at the end, and the buffer is
+ * only grown if compacting it would not leave enough room.
+ *
+ * Returns -1 if the stream buffer is full.
+ */
+static int stream_room (struct stream *stream, size_t room)
+{
+    size_t length = stream_writebuf_size(stream);
+
+    if (!length) {
+        // cheap reset
+        stream->offset = stream->length = 0;
+    }
+
+    if (stream_readbuf_size(stream) >= room) {
+        return 0;
+
+    } else if (stream->size - length >= room) {
+        memmove(stream->buf, stream_writebuf_ptr(stream), length);
+
+        stream->length = length;
+        stream->offset = 0;
+
+        return 0;
+
+    } else if (length + room <= stream->max) {
+        size_t size = stream->size * 2;
+
+        while (size < length + room)
+            size *= 2;
+
+        if (size > stream->max)
+            size = stream->max;
+
+        return stream_grow(stream, size);
+
+    } else {
+        log_warning("stream buffer is full at %zu bytes, no room for read", stream->max);
+        return -1;
+    }
+}
+
+/*
+ * Make some more room for the read buffer.
+ *
+ * Returns -1 if the stream buffer is full.
+ */
+int _stream_clear (struct stream *stream)
+{
+    return stream_room(stream, 1);
+}
+
 /*
  * Read into stream from fd. There must be room available for the read buffer.
  *
@@ -143,7 +276,10 @@ int _stream_clear (struct stream *stream)
 int _stream_read (struct stream *stream)
 {
     int err;
- 
+
+    if (!stream_readbuf_size(stream) && (err = _stream_clear(stream)))
+        return err;
+
     // fill up
     size_t size = stream_readbuf_size(stream);
 
@@ -162,6 +298,7 @@ int _stream_read (struct stream *stream)
         return -1;
     }
 
+    stream->total += size;
     stream_read_mark(stream, size);
 
     return 0;
@@ -172,7 +309,7 @@ int _stream_read (struct stream *stream)
  */
 int _stream_append (struct stream *stream, char c)
 {
-    if (!stream_readbuf_size(stream))
+    if (!stream_readbuf_size(stream) && _stream_clear(stream))
         return -1;
 
     *stream_readbuf_ptr(stream) = c;
@@ -192,7 +329,7 @@ int _stream_insert (struct stream *stream, char c, size_t i)
         return -1;
     }
 
-    if (!stream_readbuf_size(stream)) {
+    if (!stream_readbuf_size(stream) && _stream_clear(stream)) {
         log_debug("insert into full buffer");
         return -1;
     }
@@ -238,6 +375,8 @@ int _stream_write_direct (struct stream *stream, const char *buf, size_t size)
             return -1;
         }
 
+        stream->total += len;
+        stats->stream_write_bytes += len;
         buf += len;
         size -= len;
     }
@@ -263,7 +402,7 @@ int _stream_write (struct stream *stream)
         return 0;
     }
 
-    if ((err = stream->type->write(stream_writebuf_ptr(stream), &size, stream->ctx) < 0)) {
+    if ((err = stream->type->write(stream_writebuf_ptr(stream), &size, stream->ctx)) < 0) {
         return err;
     }
 
@@ -277,11 +416,79 @@ int _stream_write (struct stream *stream)
         return -1;
     }
 
+    stream->total += size;
+    stats->stream_write_bytes += size;
     stream_write_mark(stream, size);
 
     return 0;
 }
 
+/*
+ * Write out the buffered data, followed by the given external buffers, using the stream_type writev.
+ *
+ * Guaranteed to write the entire contents on success.
+ *
+ * Returns 0 on success, 1 on EOF, <0 on error.
+ */
+int _stream_writev (struct stream *stream, const struct iovec *iov, int iovcnt)
+{
+    struct iovec vec[STREAM_WRITEV_MAX], *v = vec;
+    bool buffered = false;
+    int count = 0;
+    int err;
+
+    if (stream_writebuf_size(stream)) {
+        vec[count++] = (struct iovec) { stream_writebuf_ptr(stream), stream_writebuf_size(stream) };
+        buffered = true;
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len)
+            vec[count++] = iov[i];
+    }
+
+    while (count) {
+        size_t size;
+
+        if ((err = stream->type->writev(v, count, &size, stream->ctx)) < 0) {
+            log_pwarning("stream-writev");
+            return err;
+        }
+
+        if (!size) {
+            log_debug("eof");
+            return 1;
+        }
+
+        if (err) {
+            log_debug("timeout");
+            return -1;
+        }
+
+        stream->total += size;
+        stats->stream_write_bytes += size;
+
+        // skip over written iovecs, and any partially written iovec
+        while (size) {
+            size_t len = size < v->iov_len ? size : v->iov_len;
+
+            if (buffered && v == vec)
+                stream_write_mark(stream, len);
+
+            v->iov_base = (char *) v->iov_base + len;
+            v->iov_len -= len;
+            size -= len;
+
+            if (!v->iov_len) {
+                v++;
+                count--;
+            }
+        }
+    }
+
+    return 0;
+}
+
 int stream_read (struct stream *stream, char **bufp, size_t *sizep)
 {
     int err;
@@ -313,7 +520,32 @@ int stream_read (struct stream *stream, char **bufp, size_t *sizep)
     }
 
     // consumed
-    stream->offset += *sizep;
+    stream_write_mark(stream, *sizep);
+
+    return 0;
+}
+
+int stream_read_some (struct stream *stream, char **bufp, size_t *sizep)
+{
+    int err;
+
+    // make room if needed
+    if ((err = _stream_clear(stream)))
+        return err;
+
+    if (stream->length <= stream->offset && (err = _stream_read(stream)))
+        return err;
+
+    if (stream->length <= stream->offset)
+        return 1;
+
+    *bufp = stream->buf + stream->offset;
+
+    if (!*sizep || *sizep > stream->length - stream->offset)
+        *sizep = stream->length - stream->offset;
+
+    // consumed
+    stream_write_mark(stream, *sizep);
 
     return 0;
 }
@@ -328,15 +560,11 @@ int stream_read_line (struct stream *stream, char **linep)
         return err;
 
     while (true) {
-        // scan for \r\n
-        for (c = stream_writebuf_ptr(stream); c < stream_writebuf_end(stream); c++) {
-            if (*c == '\r') {
-                *c = '\0';
-            } else if (*c == '\n') {
-                *c = '\0';
-                goto out;
-            }
-        }
+        // scan for \n, continuing past any data that was already scanned
+        if ((c = memchr(stream_writebuf_ptr(stream) + stream->scan, '\n', stream_writebuf_size(stream) - stream->scan)))
+            break;
+
+        stream->scan = stream_writebuf_size(stream);
 
         // needs moar bytez in mah buffers
         // XXX: should we return the last line on EOF, or expect a trailing \r\n?
@@ -344,16 +572,97 @@ int stream_read_line (struct stream *stream, char **linep)
             return err;
     }
 
-out:
     // start of line
     *linep = stream_writebuf_ptr(stream);
 
+    // strip \r\n
+    *c = '\0';
+
+    if (c > *linep && *(c - 1) == '\r')
+        *(c - 1) = '\0';
+
     // past end of line
     stream_write_mark(stream, c - stream_writebuf_ptr(stream) + 1);
 
     return 0;
 }
 
+int stream_read_head (struct stream *stream, char **bufp, size_t *sizep)
+{
+    size_t size;
+    char *buf, *c;
+    int err;
+
+    // make room if needed
+    if ((err = _stream_clear(stream)))
+        return err;
+
+    while (true) {
+        buf = stream_writebuf_ptr(stream);
+        size = stream_writebuf_size(stream);
+
+        if (!stream->scan || buf[stream->scan - 1] == '\n') {
+            // at the start of a line, look for the empty line
+            char *line = buf + stream->scan;
+            size_t rest = size - stream->scan;
+
+            if (rest >= 1 && line[0] == '\n') {
+                size = stream->scan + 1;
+                break;
+
+            } else if (rest >= 2 && line[0] == '\r' && line[1] == '\n') {
+                size = stream->scan + 2;
+                break;
+
+            } else if (rest == 0 || (rest == 1 && line[0] == '\r')) {
+                // need to see more of the line
+                goto read;
+            }
+        }
+
+        // skip to the start of the next line
+        if ((c = memchr(buf + stream->scan, '\n', size - stream->scan))) {
+            stream->scan = c - buf + 1;
+            continue;
+        }
+
+        stream->scan = size;
+
+read:
+        if ((err = _stream_read(stream)))
+            return err;
+    }
+
+    *bufp = buf;
+    *sizep = size;
+
+    stream_write_mark(stream, size);
+
+    return 0;
+}
+
+int stream_pending_head (struct stream *stream)
+{
+    const char *buf = stream_writebuf_ptr(stream), *end = stream_writebuf_end(stream);
+    const char *c = buf;
+
+    if (!stream->buf)
+        return 0;
+
+    // look for an empty line following any non-empty line, as stream_read_head() would
+    while (c < end && (c = memchr(c, '\n', end - c))) {
+        c++;
+
+        if (c < end && *c == '\n')
+            return 1;
+
+        if (c + 1 < end && c[0] == '\r' && c[1] == '\n')
+            return 1;
+    }
+
+    return 0;
+}
+
 int stream_read_string (struct stream *stream, char **strp, size_t len)
 {
     int err;
@@ -367,11 +676,6 @@ int stream_read_string (struct stream *stream, char **strp, size_t len)
     // fill 'er up
     while (!len || stream_writebuf_size(stream) < len) {
         // needs moar bytez in mah buffers
-        if (!stream_readbuf_size(stream)) {
-            log_debug("buffer became full while reading %zu of %zu", stream_writebuf_size(stream), len);
-            return -1;
-        }
-
         if ((err = _stream_read(stream)) < 0)
             return err;
 
@@ -422,6 +726,16 @@ int stream_read_file (struct stream *stream, int fd, size_t *sizep)
     int err;
     ssize_t ret;
 
+    // bypass the empty buffer, without reading past the given size
+    if (!stream_writebuf_size(stream) && *sizep && stream->type->splice) {
+        if ((err = stream->type->splice(fd, sizep, stream->ctx)))
+            return err;
+
+        stream->total += *sizep;
+
+        return 0;
+    }
+
     // read() more if buffer empty; we should not block on read() while we still have data to process
     if (!stream_writebuf_size(stream)) {
         // make room if needed
@@ -441,6 +755,14 @@ int stream_read_file (struct stream *stream, int fd, size_t *sizep)
 
     size_t size = stream_writebuf_size(stream);
 
+    // bulk transfer filled the entire buffer, read more at a time
+    if (size == stream->size && size < stream->max && (!*sizep || *sizep > size)) {
+        size_t grow = size * 2 < stream->max ? size * 2 : stream->max;
+
+        if ((err = stream_grow(stream, grow)))
+            return err;
+    }
+
     if (*sizep && *sizep < size)
         // limit
         size = *sizep;
@@ -489,33 +811,91 @@ int stream_flush (struct stream *stream)
 
 int stream_write (struct stream *stream, const char *buf, size_t size)
 {
+    struct iovec iov = { (char *) buf, size };
+
+    return stream_writev(stream, &iov, 1);
+}
+
+int stream_writev (struct stream *stream, const struct iovec *iov, int iovcnt)
+{
+    size_t size = 0;
     int err;
 
-    // our write buffer must be empty, since _stream_write_direct will bypass it
-    if ((err = stream_flush(stream)))
-        return err;
+    for (int i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+
+    if (size <= stream->size - stream_writebuf_size(stream)) {
+        // small enough to buffer without growing
+        if ((err = stream_room(stream, size)))
+            return err;
+
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(stream_readbuf_ptr(stream), iov[i].iov_base, iov[i].iov_len);
+            stream_read_mark(stream, iov[i].iov_len);
+        }
+
+        return 0;
+
+    } else if (stream->type->writev && iovcnt < STREAM_WRITEV_MAX) {
+        // send together with the buffered data
+        if ((err = _stream_writev(stream, iov, iovcnt)))
+            return err;
+
+        // drop consumed data from write buffer
+        if ((err = _stream_clear(stream)) < 0)
+            return err;
+
+        return 0;
+
+    } else {
+        // our write buffer must be empty, since _stream_write_direct will bypass it
+        if ((err = stream_flush(stream)))
+            return err;
 
-    return _stream_write_direct(stream, buf, size);
+        for (int i = 0; i < iovcnt; i++) {
+            if ((err = _stream_write_direct(stream, iov[i].iov_base, iov[i].iov_len)))
+                return err;
+        }
+
+        return 0;
+    }
 }
 
 int stream_vprintf (struct stream *stream, const char *fmt, va_list args)
 {
+    va_list copy;
     int ret, err;
 
-    if ((ret = vsnprintf(stream_readbuf_ptr(stream), stream_readbuf_size(stream), fmt, args)) < 0) {
-        log_perror("snprintf");
-        return -1;
+    while (true) {
+        va_copy(copy, args);
+        ret = vsnprintf(stream_readbuf_ptr(stream), stream_readbuf_size(stream), fmt, copy);
+        va_end(copy);
+
+        if (ret < 0) {
+            log_perror("snprintf");
+            return -1;
+        }
+
+        if (ret < stream_readbuf_size(stream))
+            break;
+
+        if (stream->size - stream_writebuf_size(stream) > ret) {
+            // compact
+            stream_room(stream, ret + 1);
+
+        } else if (stream_writebuf_size(stream)) {
+            // send out buffered data to make room, rather than growing the buffer
+            if ((err = stream_flush(stream)))
+                return err;
+
+        } else if (stream_room(stream, ret + 1)) {
+            // full
+            return 1;
+        }
     }
     
-    if (ret >= stream_readbuf_size(stream))
-        // full
-        return 1;
-    
     stream_read_mark(stream, ret);
-    
-    // TODO: write buffering
-    if ((err = stream_flush(stream)))
-        return err;
 
     return 0;
 }
@@ -535,7 +915,7 @@ int stream_printf (struct stream *stream, const char *fmt, ...)
 /*
  * Fallback for sendfile.
  */
-int _stream_write_file (struct stream *stream, int fd, size_t *sizep)
+int _stream_write_file (struct stream *stream, int fd, off_t *offset, size_t *sizep)
 {
     int err;
     ssize_t ret;
@@ -550,7 +930,12 @@ int _stream_write_file (struct stream *stream, int fd, size_t *sizep)
         // limit
         size = *sizep;
 
-    if ((ret = read(fd, stream_readbuf_ptr(stream), size)) < 0) {
+    if (offset)
+        ret = pread(fd, stream_readbuf_ptr(stream), size, *offset);
+    else
+        ret = read(fd, stream_readbuf_ptr(stream), size);
+
+    if (ret < 0) {
         log_perror("read");
         return -1;
     }
@@ -562,6 +947,9 @@ int _stream_write_file (struct stream *stream, int fd, size_t *sizep)
 
     stream_read_mark(stream, ret);
 
+    if (offset)
+        *offset += ret;
+
     // update
     *sizep = ret;
 
@@ -572,26 +960,58 @@ int _stream_write_file (struct stream *stream, int fd, size_t *sizep)
     return 0;
 }
 
-int stream_write_file (struct stream *stream, int fd, size_t *sizep)
+int stream_write_file (struct stream *stream, int fd, off_t *offset, size_t *sizep)
 {
     int err;
 
     if (!stream->type->sendfile)
         // fallback
-        return _stream_write_file(stream, fd, sizep);
+        return _stream_write_file(stream, fd, offset, sizep);
 
     // our write buffer must be empty, since sendfile will bypass it
     if ((err = stream_flush(stream)))
         return err;
 
-    if ((err = stream->type->sendfile(fd, sizep, stream->ctx)))
+    if ((err = stream->type->sendfile(fd, offset, sizep, stream->ctx)))
         return err;
 
+    stream->total += *sizep;
+    stats->stream_sendfile_bytes += *sizep;
+
+    return 0;
+}
+
+int stream_release (struct stream *stream)
+{
+    if (stream->offset < stream->length)
+        return 1;
+
+    stream_buf_free(stream->buf, stream->size);
+
+    stream->buf = NULL;
+    stream->size = stream->base;
+    stream->length = 0;
+    stream->offset = 0;
+
+    return 0;
+}
+
+int stream_reserve (struct stream *stream)
+{
+    if (stream->buf)
+        return 0;
+
+    if (!(stream->buf = stream_buf_alloc(stream->size))) {
+        return -1;
+    }
+
     return 0;
 }
 
 void stream_destroy (struct stream *stream)
 {
-    free(stream->buf);
-    free(stream);
+    if (stream->buf)
+        stream_buf_free(stream->buf, stream->size);
+
+    pool_free(&stream_pool, stream);
 }
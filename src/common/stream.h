@@ -3,6 +3,8 @@
 
 #include <stdlib.h>
 #include <stdarg.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 /*
  * Blocking SOCK_STREAM interface.
@@ -17,7 +19,13 @@
 struct stream_type {
     int (*read)(char *buf, size_t *sizep, void *ctx);
     int (*write)(const char *buf, size_t *sizep, void *ctx);
-    int (*sendfile)(int fd, size_t *sizep, void *ctx);
+
+    /* Optional: write from multiple buffers at once, returning the total amount written in *sizep */
+    int (*writev)(const struct iovec *iov, int iovcnt, size_t *sizep, void *ctx);
+    int (*sendfile)(int fd, off_t *offset, size_t *sizep, void *ctx);
+
+    /* Optional: read up to *sizep bytes directly into the given file, at the current file position */
+    int (*splice)(int fd, size_t *sizep, void *ctx);
 };
 
 struct stream {
@@ -25,7 +33,7 @@ struct stream {
 
     char *buf;
 
-    // note that offset <= length <= size at all times
+    // note that offset <= length <= size <= max at all times
     /* The amount of leading data in the buffer that has already been consumed */
     size_t offset;
 
@@ -35,15 +43,30 @@ struct stream {
     /* The total length of the buffer */
     size_t size;
 
+    /* The initial length of the buffer, restored by stream_release() */
+    size_t base;
+
+    /* The maximum length the buffer may grow to */
+    size_t max;
+
+    /* The amount of unconsumed data already scanned by stream_read_line()/stream_read_head() */
+    size_t scan;
+
+    /* The total amount of data read/written using the stream_type */
+    unsigned long long total;
+
     void *ctx;
 };
 
 /*
  * Construct a new stream, using the given implementation.
  *
- * `size` determines the fixed buffer allocated for the stream, which determines the maximum read/write size.
+ * `size` determines the initial buffer allocated for the stream, which grows as needed up to `max`.
+ * The `max` size limits the maximum line length, and the maximum read/write size.
+ *
+ * Passing max as 0 uses a fixed-size buffer.
  */
-int stream_create (const struct stream_type *type, struct stream **streamp, size_t size, void *ctx);
+int stream_create (const struct stream_type *type, struct stream **streamp, size_t size, size_t max, void *ctx);
 
 /*
  * Read binary data from the stream.
@@ -56,6 +79,14 @@ int stream_create (const struct stream_type *type, struct stream **streamp, size
  */
 int stream_read (struct stream *stream, char **bufp, size_t *sizep);
 
+/*
+ * Read up to *sizep bytes of binary data from the stream, or as much as available for 0, only waiting for more data
+ * once the buffered data has been consumed, regardless of the buffer size.
+ *
+ * Returns 1 on EOF, <0 on error.
+ */
+int stream_read_some (struct stream *stream, char **bufp, size_t *sizep);
+
 /*
  * Read one line from the stream, returning a pointer to the NUL-terminated line.
  *
@@ -63,6 +94,23 @@ int stream_read (struct stream *stream, char **bufp, size_t *sizep);
  */
 int stream_read_line (struct stream *stream, char **linep);
 
+/*
+ * Read a block of lines terminated by an empty line, returning a pointer to the raw data in the buffer,
+ * including the final empty line.
+ *
+ * The returned data is not NUL-terminated, and remains valid until the stream buffer is read into again.
+ *
+ * Returns 1 on EOF, <0 on error, or if the block does not fit into the maximum buffer size.
+ */
+int stream_read_head (struct stream *stream, char **bufp, size_t *sizep);
+
+/*
+ * Test if the buffered data already contains a complete block for stream_read_head(), without reading any more.
+ *
+ * Returns 1 if a complete block is buffered, 0 otherwise.
+ */
+int stream_pending_head (struct stream *stream);
+
 /*
  * Read stream as a string, returning a pointer to the NUL-terminated data.
  *
@@ -78,30 +126,67 @@ int stream_read_string (struct stream *stream, char **strp, size_t len);
  * *sizep is the number of bytes to read from stream, or zero to read until EOF.
  * *sizep is updated on return to reflect the amount of bytes copied, which may be less than *sizep.
  *
+ * Once any buffered data has been copied, a known number of bytes is read directly into the file where supported by
+ * the stream_type.
+ *
  * Returns <0 on error, 0 on success, >0 on EOF.
  */
 int stream_read_file (struct stream *stream, int fd, size_t *sizep);
 
 /*
  * Write out the full contents of the given buffer to the stream.
+ *
+ * Small writes are buffered, larger writes are sent directly together with any buffered data.
  */
 int stream_write (struct stream *stream, const char *buf, size_t size);
 
+/*
+ * Write out the full contents of the given buffers to the stream.
+ *
+ * Any buffered data and the given buffers are sent using a single writev() where supported by the stream_type,
+ * or buffered if small enough.
+ */
+int stream_writev (struct stream *stream, const struct iovec *iov, int iovcnt);
+
 /*
  * Write arbitrary formatted output to the stream.
+ *
+ * The output is buffered, use stream_flush() to send it.
  */
 int stream_vprintf (struct stream *stream, const char *fmt, va_list args);
 int stream_printf (struct stream *stream, const char *fmt, ...);
 
+/*
+ * Write out any buffered data.
+ */
+int stream_flush (struct stream *stream);
+
 /*
  * Copy to stream from a file, bypassing the buffer if the stream_type implements it.
  *
  * *sizep is the number of bytes to be sent from fd, or zero to send until EOF.
  * *sizep is updated on return to reflect the amount of bytes copied, which may be less then *sizep.
  *
+ * If offset is given, the file is read from *offset, which is updated, without using or changing the file position.
+ * This allows the same fd to be shared by concurrent writers.
+ *
  * Returns <0 on error, 0 on success, >0 on EOF.
  */
-int stream_write_file (struct stream *stream, int fd, size_t *sizep);
+int stream_write_file (struct stream *stream, int fd, off_t *offset, size_t *sizep);
+
+/*
+ * Release the stream buffer while idle, if empty. Any grown buffer is reset to its initial size.
+ *
+ * The buffer must be re-allocated using stream_reserve() before using the stream again.
+ *
+ * Returns 1 if the stream buffer still contains data, and was not released.
+ */
+int stream_release (struct stream *stream);
+
+/*
+ * Re-allocate the stream buffer after stream_release(), if needed.
+ */
+int stream_reserve (struct stream *stream);
 
 /*
  * Release all resources.
@@ -1,12 +1,32 @@
+// splice, pipe2
+#define _GNU_SOURCE
+
 #include "common/tcp.h"
 #include "common/tcp_internal.h"
 
 #include "common/log.h"
+#include "common/pool.h"
 #include "common/sock.h"
+#include "common/stats.h"
 #include "common/stream.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 
+static struct pool tcp_pool = POOL_INIT("tcp", sizeof(struct tcp));
+
+/* Pipe capacity for the splice() chunks of tcp_stream_sendfile() using event_io(), as far as the pipe limits allow */
+#define TCP_SPLICE_SIZE (1024 * 1024)
+
+/* Default pipe capacity on Linux */
+#define TCP_PIPE_SIZE 65536
+
+/* Stream buffer sizes for new connections */
+static size_t tcp_read_size = TCP_READ_SIZE;
+static size_t tcp_write_size = TCP_WRITE_SIZE;
+static size_t tcp_stream_max = TCP_STREAM_MAX;
+
 const struct timeval * maybe_timeout (const struct timeval *timeout)
 {
     if (timeout->tv_sec || timeout->tv_usec) 
@@ -15,23 +35,67 @@ const struct timeval * maybe_timeout (const struct timeval *timeout)
         return NULL;
 }
 
-int tcp_stream_read (char *buf, size_t *sizep, void *ctx)
+/*
+ * Perform the io operation on the socket using event_io(), falling back to waiting for the flags if the kernel returns
+ * EAGAIN for the nonblocking socket.
+ *
+ * Returns 0 on success, with io->result set, 1 on timeout, <0 on error.
+ */
+static int tcp_io (struct tcp *tcp, struct event_io *io, int flags, const struct timeval *timeout)
 {
-    struct tcp *tcp = ctx;
     int err;
-    
-    while ((err = sock_read(tcp->sock, buf, sizep)) > 0 && tcp->event) {
-        if ((err = event_yield(tcp->event, EVENT_READ, maybe_timeout(&tcp->read_timeout)))) {
+
+    while (true) {
+        if ((err = event_io(tcp->event, io, timeout))) {
+            log_error("event_io");
+            return err;
+        }
+
+        if (io->result != -EAGAIN)
+            break;
+
+        if ((err = event_yield(tcp->event, flags, timeout))) {
             log_error("event_yield");
             return err;
         }
     }
 
-    if (err) {
-        log_error("sock_read");
+    if (io->result < 0) {
+        errno = -io->result;
+        log_perror("event_io %d", io->type);
         return -1;
     }
 
+    return 0;
+}
+
+int tcp_stream_read (char *buf, size_t *sizep, void *ctx)
+{
+    struct tcp *tcp = ctx;
+    int err;
+
+    if (tcp->io) {
+        struct event_io io = { .type = EVENT_IO_READ, .buf = buf, .len = *sizep };
+
+        if ((err = tcp_io(tcp, &io, EVENT_READ, maybe_timeout(&tcp->read_timeout))))
+            return err;
+
+        *sizep = io.result;
+
+    } else {
+        while ((err = sock_read(tcp->sock, buf, sizep)) > 0 && tcp->event) {
+            if ((err = event_yield(tcp->event, EVENT_READ, maybe_timeout(&tcp->read_timeout)))) {
+                log_error("event_yield");
+                return err;
+            }
+        }
+
+        if (err) {
+            log_error("sock_read");
+            return -1;
+        }
+    }
+
     if (!*sizep) {
         log_debug("eof");
         return 1;
@@ -45,16 +109,61 @@ int tcp_stream_write (const char *buf, size_t *sizep, void *ctx)
     struct tcp *tcp = ctx;
     int err;
 
-    while ((err = sock_write(tcp->sock, buf, sizep)) > 0 && tcp->event) {
-        if (event_yield(tcp->event, EVENT_WRITE, maybe_timeout(&tcp->write_timeout))) {
-            log_error("event_yield");
+    if (tcp->io) {
+        struct event_io io = { .type = EVENT_IO_WRITE, .buf = (char *) buf, .len = *sizep };
+
+        if ((err = tcp_io(tcp, &io, EVENT_WRITE, maybe_timeout(&tcp->write_timeout))))
             return err;
+
+        *sizep = io.result;
+
+    } else {
+        while ((err = sock_write(tcp->sock, buf, sizep)) > 0 && tcp->event) {
+            if (event_yield(tcp->event, EVENT_WRITE, maybe_timeout(&tcp->write_timeout))) {
+                log_error("event_yield");
+                return err;
+            }
+        }
+
+        if (err) {
+            log_error("sock_write");
+            return -1;
         }
     }
 
-    if (err) {
-        log_error("sock_write");
-        return -1;
+    if (!*sizep) {
+        log_debug("eof");
+        return 1;
+    }
+
+    return 0;
+}
+
+int tcp_stream_writev (const struct iovec *iov, int iovcnt, size_t *sizep, void *ctx)
+{
+    struct tcp *tcp = ctx;
+    int err;
+
+    if (tcp->io) {
+        struct event_io io = { .type = EVENT_IO_WRITEV, .iov = iov, .iovcnt = iovcnt };
+
+        if ((err = tcp_io(tcp, &io, EVENT_WRITE, maybe_timeout(&tcp->write_timeout))))
+            return err;
+
+        *sizep = io.result;
+
+    } else {
+        while ((err = sock_writev(tcp->sock, iov, iovcnt, sizep)) > 0 && tcp->event) {
+            if (event_yield(tcp->event, EVENT_WRITE, maybe_timeout(&tcp->write_timeout))) {
+                log_error("event_yield");
+                return err;
+            }
+        }
+
+        if (err) {
+            log_error("sock_writev");
+            return -1;
+        }
     }
 
     if (!*sizep) {
@@ -65,17 +174,143 @@ int tcp_stream_write (const char *buf, size_t *sizep, void *ctx)
     return 0;
 }
 
-int tcp_stream_sendfile (int fd, size_t *sizep, void *ctx)
+/*
+ * Open the splice() pipe, if not yet opened.
+ */
+static int tcp_pipe_open (struct tcp *tcp)
+{
+    int size;
+
+    if (tcp->pipe[0] >= 0)
+        return 0;
+
+    if (pipe2(tcp->pipe, O_CLOEXEC | O_NONBLOCK)) {
+        log_perror("pipe2");
+        return -1;
+    }
+
+    if (tcp->io) {
+        // a short splice into a smaller pipe is still handled, at the cost of an extra splice out of it
+        if ((size = fcntl(tcp->pipe[1], F_SETPIPE_SZ, TCP_SPLICE_SIZE)) < 0) {
+            log_pdebug("fcntl F_SETPIPE_SZ %d", TCP_SPLICE_SIZE);
+
+            size = TCP_PIPE_SIZE;
+        }
+
+        tcp->pipe_size = size;
+    }
+
+    return 0;
+}
+
+/*
+ * Close the splice() pipe, if opened.
+ */
+static void tcp_pipe_close (struct tcp *tcp)
+{
+    if (tcp->pipe[0] >= 0) {
+        close(tcp->pipe[0]);
+        close(tcp->pipe[1]);
+    }
+
+    tcp->pipe[0] = tcp->pipe[1] = -1;
+}
+
+/*
+ * Send a chunk of the file using linked splice() operations through the pipe, leaving the pipe empty.
+ */
+static int tcp_io_sendfile (struct tcp *tcp, int fd, off_t *offset, size_t *sizep)
+{
+    const struct timeval *timeout = maybe_timeout(&tcp->write_timeout);
+    struct event_io io = {
+        .type   = EVENT_IO_SENDFILE,
+        .file   = fd,
+        .offset = *offset,
+    };
+    size_t size, sent;
+    int err;
+
+    if (tcp_pipe_open(tcp))
+        return -1;
+
+    io.pipe[0] = tcp->pipe[0];
+    io.pipe[1] = tcp->pipe[1];
+    io.len = *sizep < tcp->pipe_size ? *sizep : tcp->pipe_size;
+
+    if ((err = event_io(tcp->event, &io, timeout))) {
+        log_error("event_io");
+        goto error;
+    }
+
+    if (io.spliced < 0) {
+        errno = -io.spliced;
+        log_perror("splice %d", fd);
+        err = -1;
+        goto error;
+
+    } else if (!io.spliced) {
+        log_debug("eof");
+        *sizep = 0;
+        return 1;
+    }
+
+    size = io.spliced;
+
+    // the splice out of the pipe is cancelled by a short splice into it, or may be short itself
+    if (io.result >= 0) {
+        sent = io.result;
+
+    } else if (io.result == -ECANCELED || io.result == -EAGAIN) {
+        sent = 0;
+
+    } else {
+        errno = -io.result;
+        log_perror("splice");
+        err = -1;
+        goto error;
+    }
+
+    while (sent < size) {
+        struct event_io drain = { .type = EVENT_IO_SPLICE, .file = tcp->pipe[0], .len = size - sent };
+
+        if ((err = tcp_io(tcp, &drain, EVENT_WRITE, timeout)))
+            goto error;
+
+        if (!drain.result) {
+            log_error("splice: eof");
+            err = -1;
+            goto error;
+        }
+
+        sent += drain.result;
+    }
+
+    *offset += size;
+    *sizep = size;
+
+    return 0;
+
+error:
+    // any data left in the pipe is lost
+    tcp_pipe_close(tcp);
+
+    return err;
+}
+
+int tcp_stream_sendfile (int fd, off_t *offset, size_t *sizep, void *ctx)
 {
     struct tcp *tcp = ctx;
     int err;
 
     if (!*sizep) {
-        // XXX: choose a random default
-        *sizep = TCP_STREAM_SIZE;
+        // send in large chunks, there is no buffer involved
+        *sizep = tcp_stream_max;
     }
 
-    while ((err = sock_sendfile(tcp->sock, fd, sizep)) > 0 && tcp->event) {
+    if (tcp->io)
+        return tcp_io_sendfile(tcp, fd, offset, sizep);
+
+    while ((err = sock_sendfile(tcp->sock, fd, offset, sizep)) > 0 && tcp->event) {
         if (event_yield(tcp->event, EVENT_WRITE, maybe_timeout(&tcp->write_timeout))) {
             log_error("event_yield");
             return err;
@@ -96,41 +331,107 @@ int tcp_stream_sendfile (int fd, size_t *sizep, void *ctx)
 
 }
 
+/*
+ * Move data from the pipe into the file, falling back to read/write if the file does not support splice().
+ */
+static int tcp_pipe_drain (struct tcp *tcp, int fd, size_t size)
+{
+    while (size) {
+        ssize_t ret = splice(tcp->pipe[0], NULL, fd, NULL, size, SPLICE_F_MOVE);
+
+        if (ret < 0 && errno == EINVAL) {
+            char buf[4096];
+
+            if ((ret = read(tcp->pipe[0], buf, size < sizeof(buf) ? size : sizeof(buf))) < 0) {
+                log_perror("read pipe");
+                return -1;
+            }
+
+            if (write(fd, buf, ret) != ret) {
+                log_perror("write %d", fd);
+                return -1;
+            }
+
+        } else if (ret < 0) {
+            log_perror("splice %d", fd);
+            return -1;
+
+        } else if (!ret) {
+            log_error("splice %d: eof", fd);
+            return -1;
+        }
+
+        size -= ret;
+    }
+
+    return 0;
+}
+
+int tcp_stream_splice (int fd, size_t *sizep, void *ctx)
+{
+    struct tcp *tcp = ctx;
+    int err;
+
+    if (tcp_pipe_open(tcp))
+        return -1;
+
+    while ((err = sock_splice(tcp->sock, tcp->pipe[1], sizep)) > 0 && tcp->event) {
+        if ((err = event_yield(tcp->event, EVENT_READ, maybe_timeout(&tcp->read_timeout)))) {
+            log_error("event_yield");
+            return err;
+        }
+    }
+
+    if (err) {
+        log_error("sock_splice");
+        return -1;
+    }
+
+    if (!*sizep) {
+        log_debug("eof");
+        return 1;
+    }
+
+    return tcp_pipe_drain(tcp, fd, *sizep);
+}
+
 static const struct stream_type tcp_stream_type = {
     .read       = tcp_stream_read,
     .write      = tcp_stream_write,
+    .writev     = tcp_stream_writev,
     .sendfile   = tcp_stream_sendfile,
+    .splice     = tcp_stream_splice,
 };
 
 int tcp_create (struct event_main *event_main, struct tcp **tcpp, int sock)
 {
     struct tcp *tcp = NULL;
 
-    if (!(tcp = calloc(1, sizeof(*tcp)))) {
-        log_perror("calloc");
+    if (!(tcp = pool_calloc(&tcp_pool))) {
+        log_error("pool_calloc");
         goto error;
     }
 
     tcp->sock = sock;
+    tcp->pipe[0] = tcp->pipe[1] = -1;
+
+    stats->tcp_connections++;
     
     if (event_main) {
-        if (sock_nonblocking(sock)) {
-            log_error("sock_nonblocking");
-            goto error;
-        }
-
         if (event_create(event_main, &tcp->event, sock)) {
             log_error("event_create");
             goto error;
         }
+
+        tcp->io = event_main_io(event_main);
     }
 
-    if (stream_create(&tcp_stream_type, &tcp->read, TCP_STREAM_SIZE, tcp)) {
+    if (stream_create(&tcp_stream_type, &tcp->read, tcp_read_size, tcp_stream_max, tcp)) {
         log_error("stream_create read");
         goto error;
     }
     
-    if (stream_create(&tcp_stream_type, &tcp->write, TCP_STREAM_SIZE, tcp)) {
+    if (stream_create(&tcp_stream_type, &tcp->write, tcp_write_size, tcp_stream_max, tcp)) {
         log_error("stream_create write");
         goto error;
     }
@@ -149,6 +450,25 @@ error:
     return -1;
 }
 
+int tcp_set_buffers (size_t read_size, size_t write_size, size_t max)
+{
+    if (!read_size || !write_size) {
+        log_error("invalid zero buffer size");
+        return -1;
+    }
+
+    if (max < read_size || max < write_size) {
+        log_error("maximum buffer size %zu is smaller than read=%zu write=%zu", max, read_size, write_size);
+        return -1;
+    }
+
+    tcp_read_size = read_size;
+    tcp_write_size = write_size;
+    tcp_stream_max = max;
+
+    return 0;
+}
+
 int tcp_sock (struct tcp *tcp)
 {
     return tcp->sock;
@@ -174,6 +494,63 @@ void tcp_write_timeout (struct tcp *tcp, const struct timeval *timeout)
     tcp->write_timeout = *timeout;
 }
 
+void tcp_set_layer (struct tcp *tcp, const struct tcp_layer *layer, void *ctx)
+{
+    tcp->layer = layer;
+    tcp->layer_ctx = ctx;
+
+    tcp->read->type = tcp->write->type = layer->stream_type;
+    tcp->read->ctx = tcp->write->ctx = ctx;
+}
+
+int _tcp_park (struct tcp *tcp, const char *name, event_task_func *func, void *ctx)
+{
+    if (!tcp->event) {
+        log_fatal("parking tcp connection without event_main");
+        return -1;
+    }
+
+    if (tcp->layer && tcp->layer->pending && tcp->layer->pending(tcp->layer_ctx)) {
+        log_debug("layer input pending");
+        return 1;
+    }
+
+    if (stream_release(tcp->read)) {
+        log_debug("read buffer not empty");
+        return 1;
+    }
+
+    if (stream_release(tcp->write)) {
+        log_debug("write buffer not empty");
+        return stream_reserve(tcp->read) ? -1 : 1;
+    }
+
+    // idle connections do not need the extra fds
+    tcp_pipe_close(tcp);
+
+    return _event_park(tcp->event, EVENT_READ, maybe_timeout(&tcp->read_timeout), name, func, ctx);
+}
+
+int tcp_unpark (struct tcp *tcp)
+{
+    if (stream_reserve(tcp->read) || stream_reserve(tcp->write)) {
+        log_error("stream_reserve");
+        return -1;
+    }
+
+    if (event_parked(tcp->event) & EVENT_TIMEOUT) {
+        log_debug("timeout");
+        return 1;
+    }
+
+    return 0;
+}
+
+int tcp_cancel (struct tcp *tcp)
+{
+    return event_cancel(tcp->event);
+}
+
 void tcp_destroy (struct tcp *tcp)
 {
     if (tcp->event)
@@ -185,8 +562,15 @@ void tcp_destroy (struct tcp *tcp)
     if (tcp->read)
         stream_destroy(tcp->read);
 
+    tcp_pipe_close(tcp);
+
+    if (tcp->layer)
+        tcp->layer->destroy(tcp->layer_ctx);
+
     if (tcp->sock >= 0)
         close(tcp->sock);
 
-    free(tcp);
+    stats->tcp_connections--;
+
+    pool_free(&tcp_pool, tcp);
 }
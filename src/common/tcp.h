@@ -3,11 +3,29 @@
 
 #include "common/event.h"
 
-/* This is a number with far too low a level of entropy to be used as a random number */
-#define TCP_LISTEN_BACKLOG 10
+/* Default listen() backlog, also used for the TCP_FASTOPEN queue; the kernel caps this at its somaxconn limit */
+#define TCP_LISTEN_BACKLOG 1024
 
-// XXX: bad
-#define TCP_STREAM_SIZE 1024
+/* Seconds to wait for the request data with TCP_LISTEN_DEFER_ACCEPT, before accepting the connection regardless */
+#define TCP_LISTEN_DEFER_TIMEOUT 10
+
+/* Maximum number of connections accepted per wakeup, before letting other tasks run */
+#define TCP_ACCEPT_BATCH 64
+
+/* Delay before retrying accept() once out of fds, without any reserve fd left to release */
+#define TCP_ACCEPT_BACKOFF ((struct timeval) { .tv_usec = 100000 })
+
+/* Default initial read/write stream buffer sizes */
+#define TCP_READ_SIZE 4096
+#define TCP_WRITE_SIZE 4096
+
+/* Default maximum stream buffer size, which limits the maximum line length */
+#define TCP_STREAM_MAX 65536
+
+/* Connection attempt delay in milliseconds for tcp_connect_addrs(), per RFC 8305 */
+#define TCP_CONNECT_DELAY 250
+
+struct addrinfo;
 
 struct tcp;
 struct tcp_server;
@@ -15,12 +33,28 @@ struct tcp_client;
 
 typedef void (tcp_server_handler)(struct tcp_server *server, struct tcp *tcp, void *ctx);
 
+enum tcp_listen_flags {
+    /* Allow multiple processes to bind the same host/port, with the kernel balancing connections between them */
+    TCP_LISTEN_REUSEPORT    = 0x01,
+
+    /* Only wake up once the client has sent some data, using TCP_DEFER_ACCEPT on Linux, or the "dataready" accept filter */
+    TCP_LISTEN_DEFER_ACCEPT = 0x02,
+
+    /* Accept TCP_FASTOPEN data in the SYN, using a queue of backlog pending connections */
+    TCP_LISTEN_FASTOPEN     = 0x04,
+
+    /* Disable Nagle's algorithm on accepted connections; TCP_NODELAY is set on the listen socket, and inherited */
+    TCP_LISTEN_NODELAY      = 0x08,
+};
+
 /*
  * Open a TCP server socket, listening on the given host/port.
  *
  * host may be given as NULL to listen on all addresses.
+ *
+ * flags is some combination of enum tcp_listen_flags.
  */
-int tcp_listen (int *sockp, const char *host, const char *port, int backlog);
+int tcp_listen (int *sockp, const char *host, const char *port, int backlog, int flags);
 
 /*
  * Open a TCP client socket, connected to the given host/port.
@@ -29,30 +63,70 @@ int tcp_listen (int *sockp, const char *host, const char *port, int backlog);
  */
 int tcp_connect (struct event_main *event_main, int *sockp, const char *host, const char *port);
 
+/*
+ * Open a TCP client socket connected to the first of the given addresses to accept the connection, racing them per
+ * RFC 8305 "Happy Eyeballs": the address families are interleaved, and the next attempt is started once the pending
+ * ones have failed, or after TCP_CONNECT_DELAY. The losing attempts are abandoned.
+ *
+ * Without an event_main, the addresses are tried in turn using blocking connects.
+ *
+ * Returns 1 if no address could be connected, <0 on error.
+ */
+int tcp_connect_addrs (struct event_main *event_main, int *sockp, const struct addrinfo *addrs);
+
 /*
  * Run a server for accepting connections..
+ *
+ * backlog may be given as 0 for TCP_LISTEN_BACKLOG.
  */
-int tcp_server (struct event_main *event_main, struct tcp_server **serverp, const char *host, const char *port);
+int tcp_server (struct event_main *event_main, struct tcp_server **serverp, const char *host, const char *port, int backlog, int flags);
+
+/*
+ * Run a server for accepting connections on a socket already listening from tcp_listen(), e.g. inherited from a
+ * previous process, taking ownership of it.
+ */
+int tcp_server_sock (struct event_main *event_main, struct tcp_server **serverp, int sock);
 
 /*
  * Accept a new incoming request.
  *
- * This will event_yield on the server socket..
- * 
- * TODO: Return >0 on temporary per-client errors?
+ * This will event_yield on the server socket once there are no more pending connections, or after accepting
+ * TCP_ACCEPT_BATCH connections in a row.
+ *
+ * Once out of fds, a reserve fd is released to accept the pending connection anyways, returning 1. The caller should
+ * refuse the connection and tcp_destroy() it right away, to let the reserve fd be restored on the next call.
+ *
+ * Returns 2 if woken up by tcp_server_cancel(), <0 on error.
  */
 int tcp_server_accept (struct tcp_server *server, struct tcp **tcpp);
 
+/*
+ * Wake up the task waiting within tcp_server_accept().
+ *
+ * Returns 1 if no task is waiting.
+ */
+int tcp_server_cancel (struct tcp_server *server);
+
 /*
  * Release all resources.
  */ 
 void tcp_server_destroy (struct tcp_server *server);
 
+/*
+ * Set the initial read/write stream buffer sizes, and the maximum buffer size, for new connections.
+ */
+int tcp_set_buffers (size_t read_size, size_t write_size, size_t max);
+
 /*
  * Connect to a server..
  */
 int tcp_client (struct event_main *event_main, struct tcp **tcpp, const char *host, const char *port);
 
+/*
+ * Use a socket connected using tcp_connect() or tcp_connect_addrs(), taking ownership of it.
+ */
+int tcp_client_sock (struct event_main *event_main, struct tcp **tcpp, int sock);
+
 /*
  * TCP connection interface.
  */ 
@@ -66,6 +140,30 @@ struct stream * tcp_write_stream (struct tcp *tcp);
 void tcp_read_timeout (struct tcp *tcp, const struct timeval *timeout);
 void tcp_write_timeout (struct tcp *tcp, const struct timeval *timeout);
 
+/*
+ * Park an idle connection without any task, releasing the stream buffers until the connection is readable.
+ *
+ * Once readable, or after the read timeout, a new task is started to run func(ctx), which must tcp_unpark().
+ *
+ * Returns 1 if the connection still has buffered data, and was not parked, <0 on error.
+ */
+int _tcp_park (struct tcp *tcp, const char *name, event_task_func *func, void *ctx);
+#define tcp_park(tcp, func, ctx) _tcp_park(tcp, #func, func, ctx)
+
+/*
+ * Resume a parked connection within the new task.
+ *
+ * Returns 0 if readable, 1 on read timeout, <0 on error.
+ */
+int tcp_unpark (struct tcp *tcp);
+
+/*
+ * Wake up the task waiting on the connection, or resume the parked connection, as if it had timed out.
+ *
+ * Returns 1 if nothing is waiting on the connection.
+ */
+int tcp_cancel (struct tcp *tcp);
+
 void tcp_destroy (struct tcp *tcp);
 
 #endif
@@ -5,14 +5,30 @@
 #include "common/sock.h"
 
 #include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+/* Delay before racing the next address while an attempt is still pending */
+static const struct timeval tcp_connect_delay = { 0, TCP_CONNECT_DELAY * 1000 };
+
+/*
+ * One connection attempt in tcp_connect_addrs().
+ */
+struct tcp_attempt {
+    const struct addrinfo *addr;
+
+    /* Pending connect, or -1 */
+    int sock;
+    struct event *event;
+};
+
 /*
  * Open a TCP socket connected to the given addr.
  */
-int tcp_connect_async (struct event_main *event_main, int *sockp, struct addrinfo *addr)
+int tcp_connect_async (struct event_main *event_main, int *sockp, const struct addrinfo *addr)
 {
     struct event *event = NULL;
     int sock;
@@ -65,6 +81,227 @@ error:
     return err;
 }
 
+/*
+ * Order the addresses for connection attempts per RFC 8305 section 4, alternating between address families, starting
+ * with the family of the first address.
+ */
+static void tcp_connect_order (const struct addrinfo *addrs, struct tcp_attempt *attempts, unsigned count)
+{
+    const struct addrinfo *first = addrs, *other = addrs, **next;
+    int family = addrs->ai_family;
+
+    for (unsigned i = 0; i < count; i++) {
+        while (first && first->ai_family != family)
+            first = first->ai_next;
+
+        while (other && other->ai_family == family)
+            other = other->ai_next;
+
+        next = ((i % 2 == 0 && first) || !other) ? &first : &other;
+
+        attempts[i].addr = *next;
+        attempts[i].sock = -1;
+
+        *next = (*next)->ai_next;
+    }
+}
+
+/*
+ * Start a non-blocking connect for the attempt, registering for the result.
+ *
+ * Returns 0 if connected immediately, 1 if pending, <0 if failed.
+ */
+static int tcp_attempt_start (struct event_main *event_main, struct tcp_attempt *attempt)
+{
+    const struct addrinfo *addr = attempt->addr;
+    int err;
+
+    log_info("%s...", sockaddr_str(addr->ai_addr, addr->ai_addrlen));
+
+    if ((attempt->sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) < 0) {
+        log_pwarning("socket(%d, %d, %d)", addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        return -1;
+    }
+
+    if ((err = sock_nonblocking(attempt->sock))) {
+        log_warning("sock_nonblocking");
+        return -1;
+    }
+
+    if ((err = sock_connect(attempt->sock, addr->ai_addr, addr->ai_addrlen)) < 0) {
+        log_pwarning("sock_connect %s", sockaddr_str(addr->ai_addr, addr->ai_addrlen));
+        return -1;
+
+    } else if (!err) {
+        return 0;
+    }
+
+    if ((err = event_create(event_main, &attempt->event, attempt->sock))) {
+        log_warning("event_create");
+        return -1;
+    }
+
+    if ((err = event_register(attempt->event, EVENT_WRITE, NULL))) {
+        log_warning("event_register");
+        return -1;
+    }
+
+    return 1;
+}
+
+/*
+ * Abandon the attempt, unregistering any pending event.
+ */
+static void tcp_attempt_close (struct tcp_attempt *attempt)
+{
+    if (attempt->event)
+        event_destroy(attempt->event);
+
+    if (attempt->sock >= 0)
+        close(attempt->sock);
+
+    attempt->event = NULL;
+    attempt->sock = -1;
+}
+
+/*
+ * Cancel any pending attempt delay, so that the next attempt starts right away.
+ */
+static int tcp_connect_reset (struct event_main *event_main, struct event **timerp)
+{
+    if (*timerp)
+        event_destroy(*timerp);
+
+    return event_create(event_main, timerp, -1);
+}
+
+int tcp_connect_addrs (struct event_main *event_main, int *sockp, const struct addrinfo *addrs)
+{
+    const struct addrinfo *addr;
+    struct tcp_attempt *attempts = NULL;
+    struct event *timer = NULL, *event;
+    unsigned count = 0, next = 0, pending = 0;
+    int sock = -1, err = 0;
+
+    if (!event_main) {
+        // blocking connects, in turn
+        for (addr = addrs; addr; addr = addr->ai_next) {
+            log_info("%s...", sockaddr_str(addr->ai_addr, addr->ai_addrlen));
+
+            if (!tcp_connect_async(NULL, sockp, addr))
+                return 0;
+        }
+
+        return 1;
+    }
+
+    for (addr = addrs; addr; addr = addr->ai_next)
+        count++;
+
+    if (!count)
+        return 1;
+
+    if (!(attempts = calloc(count, sizeof(*attempts)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    tcp_connect_order(addrs, attempts, count);
+
+    if ((err = tcp_connect_reset(event_main, &timer))) {
+        log_error("event_create");
+        goto error;
+    }
+
+    while (sock < 0) {
+        // start the next attempt if none are pending, or once the delay has passed
+        if (next < count && !event_pending(timer)) {
+            struct tcp_attempt *attempt = &attempts[next++];
+
+            if ((err = tcp_attempt_start(event_main, attempt)) < 0) {
+                tcp_attempt_close(attempt);
+
+                if ((err = tcp_connect_reset(event_main, &timer))) {
+                    log_error("event_create");
+                    goto error;
+                }
+
+                continue;
+
+            } else if (!err) {
+                sock = attempt->sock;
+                attempt->sock = -1;
+                break;
+            }
+
+            pending++;
+
+            if (next < count && (err = event_register(timer, EVENT_TIMEOUT, &tcp_connect_delay))) {
+                log_error("event_register");
+                goto error;
+            }
+        }
+
+        if (!pending && next < count) {
+            continue;
+
+        } else if (!pending) {
+            log_warning("no address could be connected");
+            err = 1;
+            goto error;
+        }
+
+        if ((err = event_main_yield(event_main, &event))) {
+            log_error("event_main_yield");
+            goto error;
+        }
+
+        if (event == timer)
+            continue;
+
+        for (unsigned i = 0; i < next; i++) {
+            struct tcp_attempt *attempt = &attempts[i];
+
+            if (attempt->event != event)
+                continue;
+
+            if (!(err = sock_error(attempt->sock))) {
+                sock = attempt->sock;
+                attempt->sock = -1;
+
+            } else {
+                log_warning("%s: %s", sockaddr_str(attempt->addr->ai_addr, attempt->addr->ai_addrlen), err > 0 ? strerror(err) : "sock_error");
+
+                pending--;
+
+                if ((err = tcp_connect_reset(event_main, &timer))) {
+                    log_error("event_create");
+                    goto error;
+                }
+            }
+
+            tcp_attempt_close(attempt);
+
+            break;
+        }
+    }
+
+    *sockp = sock;
+    err = 0;
+
+error:
+    // abandon the attempts that lost the race
+    for (unsigned i = 0; i < next; i++)
+        tcp_attempt_close(&attempts[i]);
+
+    if (timer)
+        event_destroy(timer);
+
+    free(attempts);
+
+    return err;
+}
+
 int tcp_connect (struct event_main *event_main, int *sockp, const char *host, const char *port)
 {
     int err;
@@ -74,27 +311,17 @@ int tcp_connect (struct event_main *event_main, int *sockp, const char *host, co
         .ai_socktype    = SOCK_STREAM,
         .ai_protocol    = 0,
     };
-    struct addrinfo *addrs, *addr;
+    struct addrinfo *addrs;
 
     if ((err = getaddrinfo(host, port, &hints, &addrs))) {
         log_perror("getaddrinfo %s:%s: %s", host, port, gai_strerror(err));
         return -1;
     }
 
-    // pre-set err in case of empty addrs
-    err = 1;
-
-    for (addr = addrs; addr; addr = addr->ai_next) {
-        log_info("%s:%s: %s...", host, port, sockaddr_str(addr->ai_addr, addr->ai_addrlen));
-
-        if ((err = tcp_connect_async(event_main, sockp, addr))) {
-            log_perror("%s:%s: %s", host, port, sockaddr_str(addr->ai_addr, addr->ai_addrlen));
-            continue;
-        }
-    
+    if ((err = tcp_connect_addrs(event_main, sockp, addrs))) {
+        log_warning("%s:%s: tcp_connect_addrs", host, port);
+    } else {
         log_info("%s:%s: %s <- %s", host, port, sockpeer_str(*sockp), sockname_str(*sockp));
-
-        break;
     }
 
     freeaddrinfo(addrs);
@@ -115,3 +342,10 @@ int tcp_client (struct event_main *event_main, struct tcp **tcpp, const char *ho
             
     return tcp_create(event_main, tcpp, sock);
 }
+
+int tcp_client_sock (struct event_main *event_main, struct tcp **tcpp, int sock)
+{
+    log_debug("%d", sock);
+
+    return tcp_create(event_main, tcpp, sock);
+}
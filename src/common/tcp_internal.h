@@ -4,21 +4,62 @@
 #include "common/event.h"
 #include "common/stream.h"
 
+#include <stdbool.h>
+
+/*
+ * Transport layer over the socket, such as TLS, used for both read/write streams.
+ */
+struct tcp_layer {
+    const struct stream_type *stream_type;
+
+    /* Optional: returns nonzero if the layer has buffered input, which the socket will not poll readable for */
+    int (*pending)(void *ctx);
+
+    /* Release the layer, before the socket is closed */
+    void (*destroy)(void *ctx);
+};
+
 struct tcp {
     int sock;
     
     struct event *event;
+
+    /* Use completion-based event_io() for reads/writes */
+    bool io;
     
     struct timeval read_timeout, write_timeout;
 
     struct stream *read, *write;
+
+    /* Pipe for splice(), opened on first use, or -1 */
+    int pipe[2];
+
+    /* Capacity of the pipe, when opened for event_io() */
+    size_t pipe_size;
+
+    /* Optional transport layer, see tcp_set_layer() */
+    const struct tcp_layer *layer;
+    void *layer_ctx;
 };
 
+/*
+ * Return the timeout, or NULL if zero.
+ */
+const struct timeval * maybe_timeout (const struct timeval *timeout);
+
 /*
  * Initialize a new TCP connection for use with its read/write streams.
  *
- * event_main is optional, and if given, used for event/task based nonblocking reads/writes.
+ * event_main is optional, and if given, used for event/task based nonblocking reads/writes, in which case the sock must
+ * already be nonblocking.
  */
 int tcp_create (struct event_main *event_main, struct tcp **tcpp, int sock);
 
+/*
+ * Perform all further reads/writes on the connection through the layer, calling its functions with the given ctx.
+ *
+ * The layer is released by tcp_destroy().
+ */
+void tcp_set_layer (struct tcp *tcp, const struct tcp_layer *layer, void *ctx);
+
 #endif
@@ -3,11 +3,16 @@
 
 #include "common/log.h"
 #include "common/sock.h"
+#include "common/stats.h"
 #include "common/stream.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -16,12 +21,19 @@ struct tcp_server {
     int sock;
 
     struct event *event;
+
+    /* Connections accepted since last yielding on the listen socket */
+    unsigned batch;
+
+    /* Spare fd, released to accept a connection for refusing once out of fds, or -1 while released */
+    int reserve;
+    bool reserved;
     
     /* Used for tcp connections */
     struct event_main *event_main;
 };
 
-int tcp_listen (int *sockp, const char *host, const char *port, int backlog)
+int tcp_listen (int *sockp, const char *host, const char *port, int backlog, int flags)
 {
     int err;
     struct addrinfo hints = {
@@ -49,6 +61,38 @@ int tcp_listen (int *sockp, const char *host, const char *port, int backlog)
         }
 
         log_info("%s...", sockaddr_str(addr->ai_addr, addr->ai_addrlen));
+
+        // allow re-binding while connections from a previous server are still in TIME_WAIT
+        int reuse = 1;
+
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse))) {
+            log_perror("setsockopt SO_REUSEADDR");
+            close(sock);
+            freeaddrinfo(addrs);
+            return -1;
+        }
+
+        if (flags & TCP_LISTEN_REUSEPORT) {
+            int opt = 1;
+
+            if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+                log_perror("setsockopt SO_REUSEPORT");
+                close(sock);
+                freeaddrinfo(addrs);
+                return -1;
+            }
+        }
+
+        if (flags & TCP_LISTEN_NODELAY) {
+            int opt = 1;
+
+            if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt))) {
+                log_perror("setsockopt TCP_NODELAY");
+                close(sock);
+                freeaddrinfo(addrs);
+                return -1;
+            }
+        }
         
         // bind to listen address/port
         if ((err = bind(sock, addr->ai_addr, addr->ai_addrlen)) < 0) {
@@ -77,27 +121,70 @@ int tcp_listen (int *sockp, const char *host, const char *port, int backlog)
 
     if (sock < 0)
         return -1;
+
+    // optional, the listen socket works without these
+    if (flags & TCP_LISTEN_DEFER_ACCEPT) {
+#if defined(TCP_DEFER_ACCEPT)
+        int timeout = TCP_LISTEN_DEFER_TIMEOUT;
+
+        if (setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &timeout, sizeof(timeout)))
+            log_pwarning("setsockopt TCP_DEFER_ACCEPT");
+#elif defined(SO_ACCEPTFILTER)
+        struct accept_filter_arg filter = { .af_name = "dataready" };
+
+        if (setsockopt(sock, SOL_SOCKET, SO_ACCEPTFILTER, &filter, sizeof(filter)))
+            log_pwarning("setsockopt SO_ACCEPTFILTER dataready");
+#else
+        log_warning("TCP_LISTEN_DEFER_ACCEPT is not supported");
+#endif
+    }
+
+    if (flags & TCP_LISTEN_FASTOPEN) {
+#if defined(TCP_FASTOPEN)
+        int qlen = backlog;
+
+        if (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)))
+            log_pwarning("setsockopt TCP_FASTOPEN");
+#else
+        log_warning("TCP_LISTEN_FASTOPEN is not supported");
+#endif
+    }
     
     *sockp = sock;
 
     return 0;
 }
 
-int tcp_server (struct event_main *event_main, struct tcp_server **serverp, const char *host, const char *port)
+int tcp_server (struct event_main *event_main, struct tcp_server **serverp, const char *host, const char *port, int backlog, int flags)
+{
+    int sock;
+
+    if (tcp_listen(&sock, host, port, backlog ? backlog : TCP_LISTEN_BACKLOG, flags)) {
+        log_perror("tcp_listen %s:%s", host, port);
+        return -1;
+    }
+
+    return tcp_server_sock(event_main, serverp, sock);
+}
+
+int tcp_server_sock (struct event_main *event_main, struct tcp_server **serverp, int sock)
 {
     struct tcp_server *server;
     int err;
 
     if (!(server = calloc(1, sizeof(*server)))) {
         log_perror("calloc");
+        close(sock);
         return -1;
     }
 
     server->event_main = event_main;
-    
-    if ((err = tcp_listen(&server->sock, host, port, TCP_LISTEN_BACKLOG))) {
-        log_perror("tcp_listen %s:%s", host, port);
-        goto error;
+    server->sock = sock;
+
+    if ((server->reserve = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+        log_pwarning("open /dev/null: no reserve fd");
+    } else {
+        server->reserved = true;
     }
 
     if ((err = sock_nonblocking(server->sock))) {
@@ -115,22 +202,52 @@ int tcp_server (struct event_main *event_main, struct tcp_server **serverp, cons
     return 0;
 
 error:
-    free(server);
+    tcp_server_destroy(server);
     return err;
 }
 
 int tcp_server_accept (struct tcp_server *server, struct tcp **tcpp)
 {
+    bool refuse = false;
     int err;
     int sock;
 
+    // restore the reserve fd, once any refused connection has been closed
+    if (server->reserved && server->reserve < 0) {
+        if ((server->reserve = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+            log_pdebug("open /dev/null");
+    }
+
+    // let the accepted connections and other tasks run, before accepting any more
+    if (server->batch >= TCP_ACCEPT_BATCH) {
+        server->batch = 0;
+
+        if ((err = event_yield(server->event, EVENT_READ, NULL)) < 0) {
+            log_error("event_yield");
+            return err;
+
+        } else if (err) {
+            log_debug("cancelled");
+            return 2;
+        }
+    }
+
     while ((err = sock_accept(server->sock, &sock)) != 0) {
         // handle various error cases
-        if (err < 0 && (errno == EMFILE || errno == ENFILE)) {
-            log_pwarning("temporary accept failure: retrying");
+        if (err < 0 && (errno == EMFILE || errno == ENFILE) && server->reserve >= 0) {
+            log_pwarning("out of fds: refusing connection");
 
-            // TODO: some kind of backoff or failure limit, in case all tasks are somehow stuck
-            if ((err = event_sleep(server->event, NULL))) {
+            // let the kernel re-use the reserve fd for the pending connection
+            close(server->reserve);
+            server->reserve = -1;
+            refuse = true;
+
+            continue;
+
+        } else if (err < 0 && (errno == EMFILE || errno == ENFILE)) {
+            log_pwarning("temporary accept failure: backing off");
+
+            if ((err = event_sleep(server->event, &TCP_ACCEPT_BACKOFF))) {
                 log_error("event_sleep");
                 return err;
             }
@@ -143,21 +260,36 @@ int tcp_server_accept (struct tcp_server *server, struct tcp **tcpp)
 
         } else {
             // schedule
-            if ((err = event_yield(server->event, EVENT_READ, NULL))) {
+            server->batch = 0;
+
+            if ((err = event_yield(server->event, EVENT_READ, NULL)) < 0) {
                 log_error("event_yield");
                 return err;
+
+            } else if (err) {
+                log_debug("cancelled");
+                return 2;
             }
         }
     }
 
     log_info("%s accept %s", sockname_str(sock), sockpeer_str(sock));
 
+    stats->tcp_accepts++;
+    server->batch++;
+
     if (tcp_create(server->event_main, tcpp, sock)) {
         log_error("tcp_create");
+        close(sock);
         return -1;
     }
 
-    return 0;
+    return refuse ? 1 : 0;
+}
+
+int tcp_server_cancel (struct tcp_server *server)
+{
+    return event_cancel(server->event);
 }
 
 void tcp_server_destroy (struct tcp_server *server)
@@ -168,5 +300,8 @@ void tcp_server_destroy (struct tcp_server *server)
     if (server->sock >= 0)
         close(server->sock);
 
+    if (server->reserve >= 0)
+        close(server->reserve);
+
     free(server);
 }
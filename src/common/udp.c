@@ -1,8 +1,15 @@
+#ifdef __linux__
+// recvmmsg(), sendmmsg()
+#define _GNU_SOURCE
+#define UDP_MMSG
+#endif
+
 #include "common/udp.h"
 
 #include "common/log.h"
 #include "common/sock.h"
 
+#include <errno.h>
 #include <netdb.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -105,6 +112,61 @@ int udp_connect (struct event_main *event_main, struct udp **udpp, const char *h
     return 0;
 }
 
+int udp_listen (struct event_main *event_main, struct udp **udpp, const char *host, const char *port)
+{
+    int err;
+    struct addrinfo hints = {
+        .ai_flags        = AI_PASSIVE,
+        .ai_family        = AF_UNSPEC,
+        .ai_socktype    = SOCK_DGRAM,
+        .ai_protocol    = 0,
+    };
+    struct addrinfo *addrs, *addr;
+    int sock = -1;
+
+    // translate empty string to NULL
+    if (!host || !*host)
+        host = NULL;
+
+    if ((err = getaddrinfo(host, port, &hints, &addrs))) {
+        log_perror("getaddrinfo %s:%s: %s", host, port, gai_strerror(err));
+        return -1;
+    }
+
+    for (addr = addrs; addr; addr = addr->ai_next) {
+        if ((sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) < 0) {
+            log_pwarning("socket(%d, %d, %d)", addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+            continue;
+        }
+
+        log_info("%s...", sockaddr_str(addr->ai_addr, addr->ai_addrlen));
+
+        if ((err = bind(sock, addr->ai_addr, addr->ai_addrlen)) < 0) {
+            log_pwarning("bind");
+            close(sock);
+            sock = -1;
+            continue;
+        }
+
+        log_info("%s", sockname_str(sock));
+
+        break;
+    }
+
+    freeaddrinfo(addrs);
+
+    if (sock < 0)
+        return -1;
+
+    // create
+    if ((err = udp_create(event_main, udpp, sock))) {
+        log_error("udp_create: %d", sock);
+        return -1;
+    }
+
+    return 0;
+}
+
 int udp_read (struct udp *udp, void *buf, size_t *sizep, const struct timeval *timeout)
 {
     int err;
@@ -148,6 +210,154 @@ int udp_write (struct udp *udp, void *buf, size_t size)
     return 0;
 }
 
+/*
+ * Receive any available datagrams, without waiting.
+ *
+ * Returns 1 if none are available, <0 on error.
+ */
+static int udp_recv_batch (struct udp *udp, struct udp_msg *msgs, unsigned *countp)
+{
+#ifdef UDP_MMSG
+    struct mmsghdr hdrs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    unsigned count = *countp < UDP_BATCH ? *countp : UDP_BATCH;
+    int ret;
+
+    for (unsigned i = 0; i < count; i++) {
+        iovs[i] = (struct iovec) { msgs[i].buf, msgs[i].size };
+        hdrs[i] = (struct mmsghdr) { .msg_hdr = {
+            .msg_name       = msgs[i].addr,
+            .msg_namelen    = msgs[i].addr ? msgs[i].addrlen : 0,
+            .msg_iov        = &iovs[i],
+            .msg_iovlen     = 1,
+        } };
+    }
+
+    if ((ret = recvmmsg(udp->sock, hdrs, count, MSG_DONTWAIT, NULL)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 1;
+    } else if (ret < 0) {
+        log_perror("recvmmsg");
+        return -1;
+    }
+
+    for (int i = 0; i < ret; i++) {
+        msgs[i].size = hdrs[i].msg_len;
+        msgs[i].addrlen = hdrs[i].msg_hdr.msg_namelen;
+    }
+
+    *countp = ret;
+#else
+    unsigned count = 0;
+    ssize_t ret;
+
+    // the first read may block on a socket without an event
+    while (count < *countp && (count == 0 || udp->event)) {
+        if ((ret = recvfrom(udp->sock, msgs[count].buf, msgs[count].size, 0, msgs[count].addr, msgs[count].addr ? &msgs[count].addrlen : NULL)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (ret < 0) {
+            log_perror("recvfrom");
+            return -1;
+        }
+
+        msgs[count++].size = ret;
+    }
+
+    if (!count)
+        return 1;
+
+    *countp = count;
+#endif
+
+    return 0;
+}
+
+int udp_read_batch (struct udp *udp, struct udp_msg *msgs, unsigned *countp, const struct timeval *timeout)
+{
+    int err;
+
+    while ((err = udp_recv_batch(udp, msgs, countp)) > 0) {
+        if (!udp->event) {
+            // blocking socket, wait for a single datagram
+            if ((err = udp_read(udp, msgs[0].buf, &msgs[0].size, timeout)))
+                return err;
+
+            *countp = 1;
+
+            return 0;
+        }
+
+        if ((err = event_yield(udp->event, EVENT_READ, timeout)) < 0) {
+            log_error("event_yield");
+            return err;
+        }
+
+        if (err) {
+            log_debug("timeout");
+            return 1;
+        }
+    }
+
+    if (err) {
+        log_error("udp_recv_batch");
+        return -1;
+    }
+
+    log_debug("%u", *countp);
+
+    return 0;
+}
+
+int udp_write_batch (struct udp *udp, const struct udp_msg *msgs, unsigned count)
+{
+#ifdef UDP_MMSG
+    struct mmsghdr hdrs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+
+    while (count) {
+        unsigned batch = count < UDP_BATCH ? count : UDP_BATCH;
+        int ret;
+
+        for (unsigned i = 0; i < batch; i++) {
+            iovs[i] = (struct iovec) { msgs[i].buf, msgs[i].size };
+            hdrs[i] = (struct mmsghdr) { .msg_hdr = {
+                .msg_name       = msgs[i].addr,
+                .msg_namelen    = msgs[i].addr ? msgs[i].addrlen : 0,
+                .msg_iov        = &iovs[i],
+                .msg_iovlen     = 1,
+            } };
+        }
+
+        if ((ret = sendmmsg(udp->sock, hdrs, batch, 0)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            log_warning("sendmmsg: socket buffer full, %u unsent", count);
+            return 1;
+
+        } else if (ret < 0) {
+            log_perror("sendmmsg");
+            return -1;
+        }
+
+        log_debug("%d", ret);
+
+        msgs += ret;
+        count -= ret;
+    }
+#else
+    for (unsigned i = 0; i < count; i++) {
+        if (sendto(udp->sock, msgs[i].buf, msgs[i].size, 0, msgs[i].addr, msgs[i].addr ? msgs[i].addrlen : 0) >= 0) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            log_warning("sendto: socket buffer full, %u unsent", count - i);
+            return 1;
+        } else {
+            log_perror("sendto");
+            return -1;
+        }
+    }
+#endif
+
+    return 0;
+}
+
 struct event * udp_event (struct udp *udp)
 {
     return udp->event;
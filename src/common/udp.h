@@ -4,14 +4,40 @@
 #include "common/event.h"
 
 #include <stddef.h>
+#include <sys/socket.h>
+
+/* Maximum number of datagrams moved per syscall by udp_read_batch()/udp_write_batch() */
+#define UDP_BATCH 64
 
 struct udp;
 
+/*
+ * One datagram buffer for udp_read_batch()/udp_write_batch().
+ */
+struct udp_msg {
+    void *buf;
+
+    /* Size of buf on read, updated to the datagram length; datagram length on write */
+    size_t size;
+
+    /* Peer address on an unconnected socket, or NULL; addrlen is the size of addr on read, updated to the length */
+    struct sockaddr *addr;
+    socklen_t addrlen;
+};
+
 /**
  * Create a new UDP socket, connected to the given remote host:port.
  */
 int udp_connect (struct event_main *event_main, struct udp **udpp, const char *host, const char *port);
 
+/**
+ * Create a new UDP socket, bound to the given local host:port, for use with udp_read_batch()/udp_write_batch() with
+ * peer addresses.
+ *
+ * host may be NULL or empty to bind to any address.
+ */
+int udp_listen (struct event_main *event_main, struct udp **udpp, const char *host, const char *port);
+
 /*
  * Receive a UDP datagram on a connected socket.
  *
@@ -24,6 +50,24 @@ int udp_read (struct udp *udp, void *buf, size_t *sizep, const struct timeval *t
  */
 int udp_write (struct udp *udp, void *buf, size_t size);
 
+/*
+ * Receive up to *countp datagrams, waiting until at least one is available, but not for more.
+ *
+ * Uses recvmmsg() where available, reading up to UDP_BATCH datagrams per syscall.
+ *
+ * Returns 0 on success with *countp updated, 1 on timeout, <0 on error.
+ */
+int udp_read_batch (struct udp *udp, struct udp_msg *msgs, unsigned *countp, const struct timeval *timeout);
+
+/*
+ * Send all of the given datagrams, to their given addresses or the connected endpoint.
+ *
+ * Uses sendmmsg() where available, sending up to UDP_BATCH datagrams per syscall.
+ *
+ * Returns 1 if the socket buffer is full, with the remaining datagrams unsent, <0 on error.
+ */
+int udp_write_batch (struct udp *udp, const struct udp_msg *msgs, unsigned count);
+
 /*
  * The internal event used by the UDP socket.
  *
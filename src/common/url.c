@@ -3,10 +3,16 @@
 #include "common/log.h"
 #include "common/parse.h"
 
+#include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <strings.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 int urlbuf_parse (struct urlbuf *urlbuf, const char *url_string)
 {
     bzero(urlbuf, sizeof(*urlbuf));
@@ -95,94 +101,120 @@ int url_parse (struct url *url, char *buf)
     return 0;
 }
 
+/*
+ * Value of a hex digit, or -1.
+ */
+static int url_hex_value (char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    else if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    else
+        return -1;
+}
+
 int url_unquote_hex (const char **inp, char **outp)
 {
-    // read in first two chars of hh, with the short-circuited && taking care of any NULs
-    char buf[3] = { };
+    int hi, lo;
 
-    if (!((buf[0] = *(*inp)++) && (buf[1] = *(*inp)++))) {
-        // premature end-of-string
+    // the NUL of a premature end-of-string is not a hex digit, so this never reads past it
+    if ((hi = url_hex_value((*inp)[0])) < 0 || (lo = url_hex_value((*inp)[1])) < 0)
+        // non-hex escape
         return 1;
-    }
 
-    // decode
-    unsigned int value;
+    *inp += 2;
 
-    if (sscanf(buf, "%x", &value) != 1)
-        // non-hex escape
-        return 1;
-    
-    if (!value)
+    if (!(hi || lo))
         // inserting NUL?
         return 1;
 
-    *(*outp)++ = value;
+    *(*outp)++ = hi << 4 | lo;
 
     return 0;
 }
 
+/*
+ * Length of the leading run of str without any '%' or '+', up to the terminating NUL.
+ */
+static size_t url_unquote_span (const char *str)
+{
+#ifdef __SSE2__
+    // aligned loads never cross a page boundary, so reading past the NUL within the last block is safe
+    const char *block = (const char *) ((uintptr_t) str & ~(uintptr_t) 15);
+    const __m128i nul = _mm_setzero_si128(), percent = _mm_set1_epi8('%'), plus = _mm_set1_epi8('+');
+    unsigned mask = ~0u << (str - block);
+
+    for (;; block += 16, mask = ~0u) {
+        __m128i v = _mm_load_si128((const __m128i *) block);
+        __m128i match = _mm_or_si128(_mm_cmpeq_epi8(v, nul), _mm_or_si128(_mm_cmpeq_epi8(v, percent), _mm_cmpeq_epi8(v, plus)));
+        unsigned bits = _mm_movemask_epi8(match) & mask;
+
+        if (bits)
+            return block + __builtin_ctz(bits) - str;
+    }
+#else
+    return strcspn(str, "%+");
+#endif
+}
+
 int url_unquote (char *str)
 {
     const char *in = str;
     char *out = str;
-    char c;
-    
-    while ((c = *in++)) {
-        switch (c) {
+    size_t len;
+
+    for (;;) {
+        // copy any run of plain chars at once, which is a no-op until the first escape
+        len = url_unquote_span(in);
+
+        if (out != in)
+            memmove(out, in, len);
+
+        in += len;
+        out += len;
+
+        switch (*in++) {
             case '+':
                 *out++ = ' ';
                 break;
-            
+
             case '%':
                 if (url_unquote_hex(&in, &out))
                     return -1;
                 break;
 
             default:
-                *out++ = c;
-                break;
+                // terminate
+                *out = '\0';
+
+                return 0;
         }
     }
-
-    // terminate
-    *out = '\0';
-
-    return 0;
 }
 
 int url_decode (char **queryp, const char **namep, const char **valuep)
 {
     char *query;
-    char *name = NULL, *value = NULL, *next = NULL;
+    char *name, *value, *next;
 
     if (!(query = *queryp) || !(*query))
         // set to NULL on last token
         return 1;
 
-    enum {
-        NAME,
-        VALUE,
-        NEXT,
-        END,
-    } state;
-    struct parse parsing[] = {
-        { NAME,         '=',        VALUE,      PARSE_STRING,               .parse_string = &name               },
-        { NAME,         '&',        NEXT,       PARSE_STRING,               .parse_string = &name               },
-        { NAME,         0,          END,        PARSE_STRING,               .parse_string = &name               },
-
-        { VALUE,        '&',        NEXT,       PARSE_STRING,               .parse_string = &value              },
-        { VALUE,        0,          END,        PARSE_STRING,               .parse_string = &value              },
+    // split off this name=value pair, without scanning any of the following pairs
+    name = query;
 
-        { NEXT,         0,          NEXT,       PARSE_STRING,               .parse_string = &next               },
+    if ((next = strchr(query, '&')))
+        *next++ = '\0';
 
-        { }
-    };
+    if ((value = strchr(name, '=')))
+        *value++ = '\0';
 
-    state = parse(parsing, query, NAME);
-    
     // unquote?
-    if (name)
-        url_unquote(name);
+    url_unquote(name);
 
     if (value)
         url_unquote(value);
@@ -192,17 +224,127 @@ int url_decode (char **queryp, const char **namep, const char **valuep)
     *namep = name;
     *valuep = value;
 
-    switch (state) {
-        case NEXT:
-            return 0;
+    return 0;
+}
 
-        case END:
-            // we already know that there is no following token.. but this is more convenient
+/*
+ * Case-insensitive FNV-1a hash of a param name.
+ */
+static unsigned url_params_hash (const char *name)
+{
+    uint32_t hash = 2166136261u;
+
+    for (; *name; name++)
+        hash = (hash ^ (unsigned char) tolower((unsigned char) *name)) * 16777619u;
+
+    return hash % URL_PARAMS_INDEX;
+}
+
+int url_params_parse (struct url_params *params, char *query)
+{
+    const char *name, *value;
+    int err;
+
+    params->count = 0;
+    memset(params->index, 0, sizeof(params->index));
+
+    while (!(err = url_decode(&query, &name, &value))) {
+        if (params->count >= URL_PARAMS_MAX) {
+            log_warning("too many params, ignoring any past %u: %s", params->count, name);
             return 0;
+        }
 
-        default:
-            return -1;
+        unsigned i = params->count++, slot = url_params_hash(name);
+
+        params->params[i] = (struct url_param) { name, value };
+
+        // linear probing, keeping the first param of each name
+        for (; params->index[slot]; slot = (slot + 1) % URL_PARAMS_INDEX) {
+            if (!strcasecmp(params->params[params->index[slot] - 1].name, name))
+                break;
+        }
+
+        if (!params->index[slot])
+            params->index[slot] = i + 1;
+    }
+
+    return err < 0 ? err : 0;
+}
+
+const struct url_param * url_params_find (const struct url_params *params, const char *name)
+{
+    for (unsigned slot = url_params_hash(name); params->index[slot]; slot = (slot + 1) % URL_PARAMS_INDEX) {
+        const struct url_param *param = &params->params[params->index[slot] - 1];
+
+        if (!strcasecmp(param->name, name))
+            return param;
+    }
+
+    return NULL;
+}
+
+const char * url_params_get (const struct url_params *params, const char *name)
+{
+    const struct url_param *param = url_params_find(params, name);
+
+    return param ? param->value : NULL;
+}
+
+/*
+ * Value of a base64url character, or -1.
+ */
+static int base64url_value (char c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    else if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    else if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    else if (c == '-')
+        return 62;
+    else if (c == '_')
+        return 63;
+    else
+        return -1;
+}
+
+int base64url_decode (char *buf, size_t *sizep, const char *str)
+{
+    size_t len = 0;
+    unsigned bits = 0, count = 0;
+    int value;
+
+    for (; *str && *str != '='; str++) {
+        if ((value = base64url_value(*str)) < 0)
+            return 1;
+
+        bits = bits << 6 | value;
+        count += 6;
+
+        if (count >= 8) {
+            count -= 8;
+
+            if (len >= *sizep)
+                return 1;
+
+            buf[len++] = bits >> count;
+        }
     }
+
+    // a single leftover character cannot encode a full byte
+    if (count >= 6)
+        return 1;
+
+    while (*str == '=')
+        str++;
+
+    if (*str)
+        return 1;
+
+    *sizep = len;
+
+    return 0;
 }
 
 void url_dump (const struct url *url, FILE *f)
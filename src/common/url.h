@@ -18,6 +18,28 @@ struct url {
 /* Maximum supported url length */
 #define URL_MAX 1024
 
+/* Maximum number of decoded name=value params, and size of their open-addressed index */
+#define URL_PARAMS_MAX 32
+#define URL_PARAMS_INDEX 64
+
+struct url_param {
+    const char *name;
+
+    /* NULL for a name without any =value */
+    const char *value;
+};
+
+/*
+ * All decoded name=value params of a query string or form body, in order, indexed by name.
+ */
+struct url_params {
+    struct url_param params[URL_PARAMS_MAX];
+    unsigned count;
+
+    /* Index + 1 into params of the first param for each name hash, or 0 */
+    unsigned char index[URL_PARAMS_INDEX];
+};
+
 struct urlbuf {
     char buf[URL_MAX];
 
@@ -50,6 +72,33 @@ int url_unquote (char *str);
  */
 int url_decode (char **queryp, const char **namep, const char **valuep);
 
+/*
+ * Decode all urlencoded name=value pairs of the given query string (in-place) in one pass, indexing them by name.
+ *
+ * Only the first URL_PARAMS_MAX params are kept, ignoring any further params.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int url_params_parse (struct url_params *params, char *query);
+
+/*
+ * Lookup the first param with the given name, case-insensitively, or NULL.
+ */
+const struct url_param * url_params_find (const struct url_params *params, const char *name);
+
+/*
+ * Return the value of the first param with the given name, or NULL if missing or without any =value.
+ */
+const char * url_params_get (const struct url_params *params, const char *name);
+
+/*
+ * Decode an unpadded base64url string, per RFC 4648 section 5, into the given buffer of *sizep bytes.
+ *
+ * Any trailing '=' padding is accepted. Returns 1 on invalid input or overflow, with *sizep updated to the decoded length
+ * on success.
+ */
+int base64url_decode (char *buf, size_t *sizep, const char *str);
+
 /*
  * Write out URL to stream.
  */
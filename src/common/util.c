@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 const char *strdump (const char *str)
 {
@@ -113,32 +114,29 @@ int timestamp_from_timeout (struct timeval *timestamp, const struct timeval *tim
         return -1;
     }
     
-    // set timeout in future
-    // XXX: tv_usec overflow?
-    timestamp->tv_sec += timeout->tv_sec;
-    timestamp->tv_usec += timeout->tv_usec;
+    // set timeout in future, keeping tv_usec normalized for timercmp()
+    timeradd(timestamp, timeout, timestamp);
 
     return 0;
 }
 
 int timeout_from_timestamp (struct timeval *timeout, const struct timeval *timestamp)
 {
-    if (gettimeofday(timeout, NULL)) {
+    struct timeval now;
+
+    if (gettimeofday(&now, NULL)) {
         log_pwarning("gettimeofday");
         return -1;
     }
-    
-    if (timestamp->tv_sec >= timeout->tv_sec && timestamp->tv_usec >= timeout->tv_usec) {
-        timeout->tv_sec = timestamp->tv_sec - timeout->tv_sec;
-        timeout->tv_usec = timestamp->tv_usec - timeout->tv_usec;
 
-    } else if (timestamp->tv_sec > timeout->tv_sec && timestamp->tv_usec < timeout->tv_usec) {
-        timeout->tv_sec = timestamp->tv_sec - timeout->tv_sec - 1;
-        timeout->tv_usec = 1000000 + timestamp->tv_usec - timeout->tv_usec;
+    return timeout_between(timeout, &now, timestamp);
+}
 
-    } else {
+int timeout_between (struct timeval *timeout, const struct timeval *now, const struct timeval *timestamp)
+{
+    if (!timercmp(timestamp, now, >)) {
         log_info("timestamp in past: %ld:%ld < %ld:%ld",
-                timeout->tv_sec, timeout->tv_usec,
+                now->tv_sec, now->tv_usec,
                 timestamp->tv_sec, timestamp->tv_usec
         );
         timeout->tv_sec = 0;
@@ -147,7 +145,36 @@ int timeout_from_timestamp (struct timeval *timeout, const struct timeval *times
         return 1;
     }
 
+    timersub(timestamp, now, timeout);
+
     log_debug("%ld:%ld <- %ld:%ld", timestamp->tv_sec, timestamp->tv_usec, timeout->tv_sec, timeout->tv_usec);
 
     return 0;
 }
+
+int timestamp_clock (struct timeval *timestamp)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        log_perror("clock_gettime");
+        return -1;
+    }
+
+    timestamp->tv_sec = ts.tv_sec;
+    timestamp->tv_usec = ts.tv_nsec / 1000;
+
+    return 0;
+}
+
+uint64_t monotonic_usec (void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        log_pwarning("clock_gettime");
+        return 0;
+    }
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
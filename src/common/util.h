@@ -2,6 +2,7 @@
 #define UTIL_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/time.h>
 
 /* Maximum length of output */
@@ -48,4 +49,21 @@ int timestamp_from_timeout (struct timeval *timestamp, const struct timeval *tim
  */
 int timeout_from_timestamp (struct timeval *timeout, const struct timeval *timestamp);
 
+/*
+ * Convert the given future timestamp into a timeout value from the given present timestamp.
+ *
+ * Sets timeout to (0, 0) and returns 1 if timestamp is not after now, 0 otherwise.
+ */
+int timeout_between (struct timeval *timeout, const struct timeval *now, const struct timeval *timestamp);
+
+/*
+ * Set given timestamp to the current CLOCK_MONOTONIC time, unaffected by changes to the wall-clock time.
+ */
+int timestamp_clock (struct timeval *timestamp);
+
+/*
+ * Return the current CLOCK_MONOTONIC time in microseconds, for measuring intervals.
+ */
+uint64_t monotonic_usec (void);
+
 #endif
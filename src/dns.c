@@ -1,4 +1,5 @@
 #include "dns/dns.h"
+#include "dns/server.h"
 #include "common/event.h"
 #include "common/log.h"
 #include "common/util.h"
@@ -6,13 +7,27 @@
 #include <arpa/inet.h>
 #include <getopt.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
 #include <unistd.h>
 
+/* Default number of queries kept in flight by --bench */
+#define DNS_BENCH_CONCURRENCY 100
+
 struct options {
     const char *resolver;
+    unsigned edns;
+    unsigned cache;
+    char *listen;
+    const char *zone;
+    const char *bench;
+    unsigned bench_concurrency;
 
     struct dns *dns;
+    struct dns_server *server;
 };
 
 enum opts {
@@ -26,6 +41,14 @@ static const struct option long_options[] = {
     { "debug",        0,    NULL,        'd'    },
 
     { "resolver",   1,  NULL,       'R' },
+    { "edns-size",  1,  NULL,       'E' },
+    { "cache",      1,  NULL,       'C' },
+
+    { "listen",     1,  NULL,       'l' },
+    { "zone",       1,  NULL,       'Z' },
+
+    { "bench",              1,  NULL,   'B' },
+    { "bench-concurrency",  1,  NULL,   'N' },
     { }
 };
 
@@ -35,6 +58,34 @@ struct dns_task {
     const char *arg;
 };
 
+struct dns_bench_query {
+    char *name;
+    enum dns_type type;
+};
+
+/*
+ * Load generator for --bench, running a task per query in flight.
+ */
+struct dns_bench {
+    const struct options *options;
+
+    struct dns_bench_query *queries;
+    unsigned count, size;
+
+    // next query to send, and tasks still running
+    unsigned next, running;
+
+    // latency of each response, in microseconds
+    unsigned *latencies;
+    unsigned responses;
+
+    // responses by rcode, and queries without any response
+    unsigned rcodes[16];
+    unsigned timeouts, errors;
+
+    struct timeval start, end;
+};
+
 void help (const char *argv0) {
     printf(
             "Usage: %s [options] <host> [<host>] [...]\n"
@@ -44,14 +95,24 @@ void help (const char *argv0) {
             "   -v --verbose       More output\n"
             "   -d --debug         Debug output\n"
             "\n"
-            "   -R --resolver       DNS resolver address\n"
+            "   -R --resolver       DNS resolver addresses, comma-separated\n"
+            "   -E --edns-size      Advertised EDNS0 UDP payload size, or 0 to disable\n"
+            "   -C --cache          Total size of cached responses, in bytes, or 0 to disable\n"
+            "\n"
+            "   -l --listen         Serve UDP and TCP queries on [host:]port, forwarding to the resolver\n"
+            "   -Z --zone           Answer queries for names in the given zone file locally\n"
+            "\n"
+            "   -B --bench          Resolve each \"name [type]\" line in the given file, and report the QPS and latency\n"
+            "   -N --bench-concurrency  Number of --bench queries kept in flight\n"
             "\n"
             "Examples:\n"
             "\n"
             "   %s example.com\n"
             "   %s example.com example.net\n"
+            "   %s -R 192.0.2.1 -l 127.0.0.1:53 -Z local.zone\n"
+            "   %s -R 192.0.2.1 -C 0 -B queries.txt -N 1000\n"
             "\n"
-    , argv0, argv0);
+    , argv0, argv0, argv0, argv0, argv0);
 }
 
 void dns (void *ctx)
@@ -118,6 +179,257 @@ void dns (void *ctx)
     return 0;
 }
 
+/*
+ * Start a server on the given [host:]port, or [host]:port for IPv6.
+ */
+int main_listen (struct options *options, struct event_main *event_main)
+{
+    char *host = NULL, *port = options->listen, *sep;
+    int err;
+
+    if ((sep = strrchr(options->listen, ':'))) {
+        *sep = '\0';
+
+        host = options->listen;
+        port = sep + 1;
+
+        if (*host == '[' && host[strlen(host) - 1] == ']') {
+            host[strlen(host) - 1] = '\0';
+            host++;
+        }
+    }
+
+    if ((err = dns_server_create(event_main, &options->server, options->dns))) {
+        log_fatal("dns_server_create");
+        return err;
+    }
+
+    if (options->zone && (err = dns_server_load_zone(options->server, options->zone))) {
+        log_fatal("invalid --zone: %s", options->zone);
+        return err;
+    }
+
+    if ((err = dns_server_listen(options->server, host, *port ? port : DNS_SERVER_SERVICE))) {
+        log_fatal("dns_server_listen %s:%s", host ? host : "", port);
+        return err;
+    }
+
+    return 0;
+}
+
+/*
+ * Load the --bench query list, with one name per line, followed by an optional type, defaulting to A.
+ *
+ * Returns 1 on syntax errors, <0 on error.
+ */
+int dns_bench_load (struct dns_bench *bench, const char *path)
+{
+    char line[1024];
+    unsigned lineno = 0;
+    FILE *file;
+    int err = 0;
+
+    if (!(file = fopen(path, "r"))) {
+        log_perror("fopen %s", path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        struct dns_bench_query query = { .type = DNS_A };
+        char *tokens, *name, *type;
+
+        lineno++;
+
+        if (!(name = strtok_r(line, " \t\r\n", &tokens)) || *name == '#')
+            continue;
+
+        if ((type = strtok_r(NULL, " \t\r\n", &tokens)) && dns_type_parse(&query.type, type)) {
+            log_error("%s:%u: invalid type: %s", path, lineno, type);
+            err = 1;
+            break;
+        }
+
+        if (bench->count >= bench->size) {
+            unsigned size = bench->size ? bench->size * 2 : 1024;
+            struct dns_bench_query *queries;
+
+            if (!(queries = realloc(bench->queries, size * sizeof(*queries)))) {
+                log_perror("realloc");
+                err = -1;
+                break;
+            }
+
+            bench->queries = queries;
+            bench->size = size;
+        }
+
+        if (!(query.name = strdup(name))) {
+            log_perror("strdup");
+            err = -1;
+            break;
+        }
+
+        bench->queries[bench->count++] = query;
+    }
+
+    if (!err && ferror(file)) {
+        log_perror("fgets %s", path);
+        err = -1;
+    }
+
+    fclose(file);
+
+    return err;
+}
+
+/*
+ * Resolve queries from the list until all have been sent.
+ */
+void dns_bench_task (void *ctx)
+{
+    struct dns_bench *bench = ctx;
+    struct dns *dns = bench->options->dns;
+
+    while (bench->next < bench->count) {
+        struct dns_bench_query *query = &bench->queries[bench->next++];
+        struct dns_resolve *resolve;
+        struct timeval start, end;
+        int err;
+
+        if (timestamp_clock(&start))
+            break;
+
+        if ((err = dns_resolve(dns, &resolve, query->name, query->type)) == -2) {
+            bench->timeouts++;
+            continue;
+
+        } else if (err < 0) {
+            log_warning("dns_resolve: %s %s", query->name, dns_type_str(query->type));
+            bench->errors++;
+            continue;
+        }
+
+        dns_close(resolve);
+
+        if (timestamp_clock(&end))
+            break;
+
+        timersub(&end, &start, &end);
+
+        bench->latencies[bench->responses++] = end.tv_sec * 1000000 + end.tv_usec;
+        bench->rcodes[err & 0xf]++;
+    }
+
+    if (!--bench->running)
+        timestamp_clock(&bench->end);
+}
+
+/*
+ * Start the --bench tasks, running until all queries have been answered.
+ */
+int main_bench (struct options *options, struct event_main *event_main, struct dns_bench *bench)
+{
+    unsigned concurrency = options->bench_concurrency;
+    int err;
+
+    bench->options = options;
+
+    if ((err = dns_bench_load(bench, options->bench))) {
+        log_fatal("invalid --bench: %s", options->bench);
+        return err;
+    }
+
+    if (!(bench->latencies = calloc(bench->count, sizeof(*bench->latencies)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    if (concurrency > bench->count)
+        concurrency = bench->count;
+
+    log_info("%u queries from %s, %u in flight", bench->count, options->bench, concurrency);
+
+    if (timestamp_clock(&bench->start))
+        return -1;
+
+    // counted up front, as started tasks run until their first query blocks
+    bench->running = concurrency;
+
+    for (unsigned i = 0; i < concurrency; i++) {
+        if ((err = event_start(event_main, dns_bench_task, bench))) {
+            log_fatal("event_start");
+            bench->running -= concurrency - i;
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static int dns_bench_cmp (const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *) a, y = *(const unsigned *) b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Response latency at the given per-mille rank, in milliseconds.
+ */
+static double dns_bench_percentile (const struct dns_bench *bench, unsigned permille)
+{
+    unsigned rank = ((uint64_t) bench->responses * permille + 999) / 1000;
+
+    return bench->latencies[rank ? rank - 1 : 0] / 1000.0;
+}
+
+void dns_bench_report (struct dns_bench *bench)
+{
+    struct dns_stats stats;
+    struct timeval elapsed;
+    double seconds;
+
+    dns_get_stats(bench->options->dns, &stats);
+
+    timersub(&bench->end, &bench->start, &elapsed);
+
+    seconds = elapsed.tv_sec + elapsed.tv_usec / 1000000.0;
+
+    printf("%u queries in %.3fs: %.1f QPS\n", bench->next, seconds, seconds > 0 ? bench->next / seconds : 0.0);
+    printf("%u responses:", bench->responses);
+
+    for (unsigned rcode = 0; rcode < 16; rcode++) {
+        if (bench->rcodes[rcode])
+            printf(" %s=%u", dns_rcode_str(rcode), bench->rcodes[rcode]);
+    }
+
+    printf("\n");
+    printf("%u timeouts, %u errors\n", bench->timeouts, bench->errors);
+    printf("upstream: %u queries, %u retries, %u timeouts, %u cached\n", stats.queries, stats.retries, stats.timeouts, stats.cached);
+
+    if (bench->responses) {
+        qsort(bench->latencies, bench->responses, sizeof(*bench->latencies), dns_bench_cmp);
+
+        printf("latency: p50=%.3fms p90=%.3fms p99=%.3fms p999=%.3fms max=%.3fms\n",
+            dns_bench_percentile(bench, 500),
+            dns_bench_percentile(bench, 900),
+            dns_bench_percentile(bench, 990),
+            dns_bench_percentile(bench, 999),
+            dns_bench_percentile(bench, 1000)
+        );
+    }
+}
+
+void dns_bench_destroy (struct dns_bench *bench)
+{
+    for (unsigned i = 0; i < bench->count; i++) {
+        free(bench->queries[i].name);
+    }
+
+    free(bench->queries);
+    free(bench->latencies);
+}
+
 int main (int argc, char **argv)
 {
     int opt;
@@ -127,9 +439,13 @@ int main (int argc, char **argv)
     struct event_main *event_main;
     struct options options = {
         .resolver   = "localhost",
+        .edns       = DNS_EDNS_SIZE,
+        .cache      = DNS_CACHE_SIZE,
+        .bench_concurrency  = DNS_BENCH_CONCURRENCY,
     };
+    struct dns_bench bench = { };
 
-    while ((opt = getopt_long(argc, argv, "hqvdR:", long_options, NULL)) >= 0) {
+    while ((opt = getopt_long(argc, argv, "hqvdR:E:C:l:Z:B:N:", long_options, NULL)) >= 0) {
         switch (opt) {
             case 'h':
                 help(argv[0]);
@@ -151,6 +467,39 @@ int main (int argc, char **argv)
                 options.resolver = optarg;
                 break;
 
+            case 'E':
+                if (str_uint(optarg, &options.edns)) {
+                    log_fatal("invalid --edns-size/E: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'C':
+                if (str_uint(optarg, &options.cache)) {
+                    log_fatal("invalid --cache/C: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'l':
+                options.listen = optarg;
+                break;
+
+            case 'Z':
+                options.zone = optarg;
+                break;
+
+            case 'B':
+                options.bench = optarg;
+                break;
+
+            case 'N':
+                if (str_uint(optarg, &options.bench_concurrency) || !options.bench_concurrency) {
+                    log_fatal("invalid --bench-concurrency/N: %s", optarg);
+                    return 1;
+                }
+                break;
+
             default:
                 help(argv[0]);
                 return 1;
@@ -170,6 +519,24 @@ int main (int argc, char **argv)
         goto error;
     }
 
+    if ((err = dns_set_edns(options.dns, options.edns))) {
+        log_fatal("dns_set_edns: %u", options.edns);
+        goto error;
+    }
+
+    if ((err = dns_set_cache(options.dns, options.cache))) {
+        log_fatal("dns_set_cache: %u", options.cache);
+        goto error;
+    }
+
+    if (options.listen && (err = main_listen(&options, event_main))) {
+        goto error;
+    }
+
+    if (options.bench && (err = main_bench(&options, event_main, &bench))) {
+        goto error;
+    }
+
     while (optind < argc && !err) {
         struct dns_task task = {
             .options    = &options,
@@ -187,7 +554,15 @@ int main (int argc, char **argv)
         log_fatal("event_main");
     }
 
+    if (options.bench && !err)
+        dns_bench_report(&bench);
+
 error:
+    dns_bench_destroy(&bench);
+
+    if (options.server)
+        dns_server_destroy(options.server);
+
     if (options.dns)
         dns_destroy(options.dns);
 
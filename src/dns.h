@@ -6,6 +6,8 @@
 #include <netinet/in.h>
 #include <stdint.h>
 
+struct addrinfo;
+
 /* UDP service */
 #define DNS_SERVICE "53"
 
@@ -22,6 +24,15 @@
 /* Default for dns_create(.., resolver=NULL) */
 #define DNS_RESOLVER "localhost"
 
+/* Maximum number of resolvers for dns_create() */
+#define DNS_RESOLVERS 8
+
+/* Default advertised EDNS0 UDP payload size, see dns_set_edns() */
+#define DNS_EDNS_SIZE 1232
+
+/* Default total size of cached responses, see dns_set_cache() */
+#define DNS_CACHE_SIZE (256 * 1024)
+
 enum dns_opcode {
     DNS_QUERY       = 0,
     DNS_IQUERY      = 1,
@@ -50,6 +61,9 @@ enum dns_type {
     // RFC 3596
     DNS_AAAA        = 28,
 
+    // RFC 6891
+    DNS_OPT         = 41,
+
     DNS_QTYPE_AXFR  = 252,
     DNS_QTYPE_ANY   = 255,
 
@@ -155,11 +169,54 @@ struct dns_resolve;
  * Create a new resolver client.
  *
  * resolver:    external resolver host to query, or NULL for default.
+ *              May be a comma-separated list of up to DNS_RESOLVERS hosts, in which case each query is sent to the
+ *              resolver with the lowest smoothed RTT, and hedged to the next one if there is no response within the
+ *              RTT-based timeout. The first response wins.
+ *              Each host may be given as host:port or [host]:port for a resolver on a port other than DNS_SERVICE.
  *
  * XXX: read /etc/resolv.conf... default is just "localhost" for now..
  */
 int dns_create (struct event_main *event_main, struct dns **dnsp, const char *resolver);
 
+/*
+ * Limit the total size of responses cached by dns_resolve(), evicting the least recently used, or 0 to disable.
+ *
+ * Responses are cached for the minimum TTL of their records, and negative NXDOMAIN/NODATA responses using the SOA
+ * per RFC 2308.
+ */
+int dns_set_cache (struct dns *dns, size_t size);
+
+/*
+ * Advertise the given UDP payload size for responses using an EDNS0 OPT record in each query, or 0 to disable.
+ *
+ * Truncated responses are retried over TCP.
+ *
+ * Returns 1 if the size exceeds DNS_PACKET.
+ */
+int dns_set_edns (struct dns *dns, unsigned size);
+
+/*
+ * Resolver statistics, counted since dns_create().
+ */
+struct dns_stats {
+    /* Queries sent upstream, not counting retransmits */
+    unsigned queries;
+
+    /* Retransmits after a per-query timeout, including those hedged to another resolver */
+    unsigned retries;
+
+    /* Queries failed after all retries */
+    unsigned timeouts;
+
+    /* Lookups answered from the cache */
+    unsigned cached;
+};
+
+/*
+ * Read out the resolver statistics.
+ */
+void dns_get_stats (struct dns *dns, struct dns_stats *stats);
+
 /*
  * Perform a DNS lookup, without waiting for a response.
  */
@@ -168,13 +225,29 @@ int dns_resolve_async (struct dns *dns, struct dns_resolve **resolvep, const cha
 /*
  * Perform a DNS lookup, returning the response in *resolvep.
  *
- * Implements 2s retries with a total 10s timeout.
+ * Implements 2s retries with a total 10s timeout. Cached responses are returned immediately, with aged record TTLs.
  *
  * Returns <0 on internal error with *resolvep unset.
  * Returns response dns_rcode; call dns_resolve_header/question/record to read response.
  */
 int dns_resolve (struct dns *dns, struct dns_resolve **resolvep, const char *name, enum dns_type type);
 
+/*
+ * Start a DNS lookup as per dns_resolve(), without waiting for the response, so that several lookups may be pending at
+ * once for the same task.
+ *
+ * Returns <0 on internal error with *resolvep unset.
+ */
+int dns_resolve_start (struct dns *dns, struct dns_resolve **resolvep, const char *name, enum dns_type type);
+
+/*
+ * Wait for the response to a dns_resolve_start() lookup, which must still be dns_close()'d afterwards.
+ *
+ * Returns <0 on internal error, -2 on timeout.
+ * Returns response dns_rcode; call dns_resolve_header/question/record to read response.
+ */
+int dns_resolve_wait (struct dns_resolve *resolve);
+
 /*
  * Perform a DNS lookup with multiple queries for different types of the same name.
  * 
@@ -204,6 +277,18 @@ int dns_resolve_record (struct dns_resolve *resolve, enum dns_section *section,
  */
 void dns_close (struct dns_resolve *resolve);
 
+/*
+ * Resolve the name to its IPv6 and IPv4 addresses for use with tcp_connect_addrs(), sending both the AAAA and A queries
+ * at once, and waiting for both responses.
+ *
+ * The numeric or /etc/services port is taken from service. The IPv6 addresses are listed first, in response order.
+ *
+ * Returns <0 on error, 1 if the name has no addresses. Release the *addrsp using dns_freeaddrinfo().
+ */
+int dns_getaddrinfo (struct dns *dns, const char *name, const char *service, struct addrinfo **addrsp);
+
+void dns_freeaddrinfo (struct addrinfo *addrs);
+
 /*
  * Release all associated resources.
  */
@@ -0,0 +1,177 @@
+#include "dns/dns.h"
+
+#include "common/log.h"
+#include "common/util.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+/*
+ * One address, allocated together with the list.
+ */
+struct dns_addr {
+    struct addrinfo ai;
+    struct sockaddr_in6 sin6;
+    struct sockaddr_in sin;
+};
+
+/*
+ * Parse a numeric port, or lookup an /etc/services port.
+ */
+static int dns_addr_port (const char *service, uint16_t *portp)
+{
+    struct servent *servent;
+    unsigned port;
+
+    if (!str_uint(service, &port)) {
+        if (port > UINT16_MAX)
+            return 1;
+
+        *portp = htons(port);
+
+    } else if ((servent = getservbyname(service, "tcp"))) {
+        *portp = servent->s_port;
+
+    } else {
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Append the answer records of the given type to the list.
+ */
+static int dns_addr_append (struct dns_resolve *resolve, enum dns_type type, uint16_t port, struct dns_addr *addrs, unsigned *countp)
+{
+    enum dns_section section;
+    struct dns_record rr;
+    union dns_rdata rdata;
+    int err;
+
+    while (!(err = dns_resolve_record(resolve, &section, &rr, &rdata)) && section == DNS_AN) {
+        struct dns_addr *addr = &addrs[*countp];
+
+        // any CNAME records preceding the addresses are followed by the resolver
+        if (rr.type != type || rr.class != DNS_IN)
+            continue;
+
+        addr->ai.ai_socktype = SOCK_STREAM;
+        addr->ai.ai_protocol = IPPROTO_TCP;
+
+        if (type == DNS_AAAA) {
+            addr->sin6 = (struct sockaddr_in6) {
+                .sin6_family    = AF_INET6,
+                .sin6_port      = port,
+                .sin6_addr      = rdata.AAAA,
+            };
+
+            addr->ai.ai_family = AF_INET6;
+            addr->ai.ai_addr = (struct sockaddr *) &addr->sin6;
+            addr->ai.ai_addrlen = sizeof(addr->sin6);
+
+        } else {
+            addr->sin = (struct sockaddr_in) {
+                .sin_family     = AF_INET,
+                .sin_port       = port,
+                .sin_addr       = rdata.A,
+            };
+
+            addr->ai.ai_family = AF_INET;
+            addr->ai.ai_addr = (struct sockaddr *) &addr->sin;
+            addr->ai.ai_addrlen = sizeof(addr->sin);
+        }
+
+        if (*countp)
+            addrs[*countp - 1].ai.ai_next = &addr->ai;
+
+        (*countp)++;
+    }
+
+    return err < 0 ? err : 0;
+}
+
+int dns_getaddrinfo (struct dns *dns, const char *name, const char *service, struct addrinfo **addrsp)
+{
+    enum dns_type types[] = { DNS_AAAA, DNS_A };
+    struct dns_resolve *resolves[2] = { };
+    struct dns_addr *addrs = NULL;
+    unsigned size = 0, count = 0;
+    uint16_t port;
+    int err = 0;
+
+    if (dns_addr_port(service, &port)) {
+        log_warning("%s: unknown port: %s", name, service);
+        return 1;
+    }
+
+    // both queries are pending at once, and either may be answered from the cache
+    for (unsigned i = 0; i < 2; i++) {
+        if ((err = dns_resolve_start(dns, &resolves[i], name, types[i]))) {
+            log_error("dns_resolve_start %s %s", name, dns_type_str(types[i]));
+            goto error;
+        }
+    }
+
+    for (unsigned i = 0; i < 2; i++) {
+        struct dns_header header;
+
+        if ((err = dns_resolve_wait(resolves[i])) < 0) {
+            log_warning("%s %s: %s", name, dns_type_str(types[i]), err == -2 ? "timeout" : "error");
+
+            dns_close(resolves[i]);
+            resolves[i] = NULL;
+
+        } else if (err) {
+            log_info("%s %s: %s", name, dns_type_str(types[i]), dns_rcode_str(err));
+
+        } else if (!dns_resolve_header(resolves[i], &header)) {
+            size += header.ancount;
+        }
+    }
+
+    // upper bound on the number of addresses
+    if (size && !(addrs = calloc(size, sizeof(*addrs)))) {
+        log_perror("calloc");
+        err = -1;
+        goto error;
+    }
+
+    for (unsigned i = 0; i < 2 && size; i++) {
+        if (resolves[i] && (err = dns_addr_append(resolves[i], types[i], port, addrs, &count))) {
+            log_warning("%s %s: invalid response", name, dns_type_str(types[i]));
+            goto error;
+        }
+    }
+
+    if (!count) {
+        log_warning("%s: no addresses", name);
+        err = 1;
+        goto error;
+    }
+
+    log_debug("%s: %u addresses", name, count);
+
+    *addrsp = &addrs->ai;
+    addrs = NULL;
+
+    err = 0;
+
+error:
+    free(addrs);
+
+    for (unsigned i = 0; i < 2; i++) {
+        if (resolves[i])
+            dns_close(resolves[i]);
+    }
+
+    return err;
+}
+
+void dns_freeaddrinfo (struct addrinfo *addrs)
+{
+    // the first address is the start of the allocation
+    free(addrs);
+}
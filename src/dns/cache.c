@@ -0,0 +1,390 @@
+#include "dns/dns.h"
+
+#include "common/log.h"
+#include "common/stats.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/queue.h>
+
+/* Number of hash buckets, must be a power of two */
+#define DNS_CACHE_BUCKETS 256
+
+/* Upper bounds on cached TTLs, per RFC 2308 for negative responses */
+#define DNS_CACHE_TTL_MAX (24 * 60 * 60)
+#define DNS_CACHE_NEGATIVE_MAX (3 * 60 * 60)
+
+/*
+ * One cached response packet, followed by the record index and packet data.
+ */
+struct dns_cache_entry {
+    /* Lookup key */
+    struct dns_question question;
+    unsigned hash;
+
+    /* Time of insertion and expiry */
+    time_t time, expire;
+
+    /* Allocated size, counted against the cache size */
+    size_t size;
+
+    /* Offsets of each record TTL within the packet, excluding OPT, for aging on hits */
+    uint16_t *ttls;
+    unsigned count;
+
+    /* Raw response packet */
+    char *buf;
+    size_t len;
+
+    LIST_ENTRY(dns_cache_entry) cache_hash;
+    TAILQ_ENTRY(dns_cache_entry) cache_lru;
+};
+
+struct dns_cache {
+    /* Maximum and current total size of cached entries */
+    size_t max, size;
+
+    /* Statistics */
+    unsigned hits, misses;
+
+    LIST_HEAD(dns_cache_bucket, dns_cache_entry) buckets[DNS_CACHE_BUCKETS];
+
+    /* Most recently used first */
+    TAILQ_HEAD(dns_cache_lru, dns_cache_entry) lru;
+};
+
+int dns_cache_create (struct dns_cache **cachep, size_t size)
+{
+    struct dns_cache *cache;
+
+    if (!(cache = calloc(1, sizeof(*cache)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    cache->max = size;
+
+    for (unsigned i = 0; i < DNS_CACHE_BUCKETS; i++) {
+        LIST_INIT(&cache->buckets[i]);
+    }
+
+    TAILQ_INIT(&cache->lru);
+
+    *cachep = cache;
+
+    return 0;
+}
+
+/*
+ * Case-insensitive FNV-1a hash of the name.
+ */
+unsigned dns_name_hash (const char *name)
+{
+    unsigned hash = 2166136261u;
+
+    for (const char *c = name; *c; c++) {
+        hash ^= (unsigned char) tolower((unsigned char) *c);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * FNV-1a hash of the question, continuing from the name.
+ */
+unsigned dns_question_hash (const struct dns_question *question)
+{
+    unsigned hash = dns_name_hash(question->qname);
+
+    hash ^= question->qtype;
+    hash *= 16777619u;
+    hash ^= question->qclass;
+    hash *= 16777619u;
+
+    return hash;
+}
+
+static bool dns_cache_match (const struct dns_cache_entry *entry, const struct dns_question *question, unsigned hash)
+{
+    return entry->hash == hash
+        && entry->question.qtype == question->qtype
+        && entry->question.qclass == question->qclass
+        && !strcasecmp(entry->question.qname, question->qname)
+    ;
+}
+
+static void dns_cache_remove (struct dns_cache *cache, struct dns_cache_entry *entry)
+{
+    LIST_REMOVE(entry, cache_hash);
+    TAILQ_REMOVE(&cache->lru, entry, cache_lru);
+
+    cache->size -= entry->size;
+
+    free(entry);
+}
+
+/*
+ * Drop least-recently-used entries until the given size fits.
+ *
+ * Returns 1 if the given size does not fit at all.
+ */
+static int dns_cache_reserve (struct dns_cache *cache, size_t size)
+{
+    struct dns_cache_entry *entry;
+
+    if (size > cache->max)
+        return 1;
+
+    while (cache->size + size > cache->max && (entry = TAILQ_LAST(&cache->lru, dns_cache_lru))) {
+        log_debug("evict %s %s", entry->question.qname, dns_type_str(entry->question.qtype));
+
+        dns_cache_remove(cache, entry);
+    }
+
+    return 0;
+}
+
+/*
+ * Index the records of the response packet following the header, returning the TTL used for caching.
+ *
+ * Returns 1 if the response is not cacheable.
+ */
+static int dns_cache_index (struct dns_packet *pkt, const struct dns_header *header, const struct dns_question *question, uint16_t *ttls, unsigned *countp, uint32_t *ttlp)
+{
+    struct dns_question qq;
+    struct dns_record rr;
+    unsigned count = header->ancount + header->nscount + header->arcount;
+    uint32_t ttl = DNS_CACHE_TTL_MAX;
+    bool negative = header->rcode == DNS_NXDOMAIN || !header->ancount, soa = false;
+
+    if (header->qdcount != 1)
+        return 1;
+
+    if (dns_unpack_question(pkt, &qq))
+        return 1;
+
+    if (qq.qtype != question->qtype || qq.qclass != question->qclass || strcasecmp(qq.qname, question->qname)) {
+        log_warning("response question mismatch: %s", qq.qname);
+        return 1;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        if (dns_unpack_record(pkt, &rr))
+            return 1;
+
+        // pseudo-record, whose TTL field is not a TTL
+        if (rr.type == DNS_OPT)
+            continue;
+
+        // the TTL and RDLENGTH fields precede the RDATA
+        ttls[(*countp)++] = ((char *) rr.rdatap - pkt->buf) - 6;
+
+        if (rr.ttl < ttl)
+            ttl = rr.ttl;
+
+        // RFC 2308: negative responses are cached for min(SOA TTL, SOA MINIMUM)
+        if (negative && i >= header->ancount && i < header->ancount + header->nscount && rr.type == DNS_SOA && rr.rdlength > 20) {
+            uint32_t minimum;
+
+            memcpy(&minimum, (char *) rr.rdatap + rr.rdlength - 4, sizeof(minimum));
+            minimum = ntohl(minimum);
+
+            if (minimum < ttl)
+                ttl = minimum;
+
+            soa = true;
+        }
+    }
+
+    if (negative && !soa) {
+        log_debug("negative response without SOA");
+        return 1;
+    }
+
+    if (negative && ttl > DNS_CACHE_NEGATIVE_MAX)
+        ttl = DNS_CACHE_NEGATIVE_MAX;
+
+    *ttlp = ttl;
+
+    return 0;
+}
+
+int dns_cache_insert (struct dns_cache *cache, const struct dns_question *question, struct dns_packet *pkt, time_t now)
+{
+    struct dns_cache_entry *entry;
+    struct dns_header header;
+    unsigned hash = dns_question_hash(question), count;
+    size_t len = pkt->end - pkt->buf, size;
+    char *ptr = pkt->ptr;
+    uint32_t ttl;
+    int err;
+
+    if (!cache->max)
+        return 1;
+
+    pkt->ptr = pkt->buf;
+
+    if ((err = dns_unpack_header(pkt, &header)))
+        goto out;
+
+    if (header.tc || (header.rcode != DNS_NOERROR && header.rcode != DNS_NXDOMAIN)) {
+        log_debug("uncacheable response: %s%s", dns_rcode_str(header.rcode), header.tc ? " TC" : "");
+        err = 1;
+        goto out;
+    }
+
+    count = header.ancount + header.nscount + header.arcount;
+    size = sizeof(*entry) + count * sizeof(*entry->ttls) + len;
+
+    if (size > cache->max) {
+        log_debug("response too large to cache: %zu", size);
+        err = 1;
+        goto out;
+    }
+
+    if (!(entry = malloc(size))) {
+        log_perror("malloc");
+        err = -1;
+        goto out;
+    }
+
+    entry->question = *question;
+    entry->hash = hash;
+    entry->size = size;
+    entry->ttls = (uint16_t *) (entry + 1);
+    entry->count = 0;
+    entry->buf = (char *) (entry->ttls + count);
+    entry->len = len;
+
+    if ((err = dns_cache_index(pkt, &header, question, entry->ttls, &entry->count, &ttl)) || !ttl) {
+        log_debug("uncacheable response: %s %s", question->qname, dns_type_str(question->qtype));
+        free(entry);
+        err = 1;
+        goto out;
+    }
+
+    memcpy(entry->buf, pkt->buf, len);
+
+    entry->time = now;
+    entry->expire = now + ttl;
+
+    // replace any existing entry
+    struct dns_cache_entry *old;
+
+    LIST_FOREACH(old, &cache->buckets[hash % DNS_CACHE_BUCKETS], cache_hash) {
+        if (dns_cache_match(old, question, hash))
+            break;
+    }
+
+    if (old)
+        dns_cache_remove(cache, old);
+
+    dns_cache_reserve(cache, size);
+
+    LIST_INSERT_HEAD(&cache->buckets[hash % DNS_CACHE_BUCKETS], entry, cache_hash);
+    TAILQ_INSERT_HEAD(&cache->lru, entry, cache_lru);
+
+    cache->size += size;
+
+    log_debug("%s %s: ttl=%u size=%zu", question->qname, dns_type_str(question->qtype), ttl, size);
+
+out:
+    pkt->ptr = ptr;
+
+    return err;
+}
+
+int dns_cache_lookup (struct dns_cache *cache, const struct dns_question *question, uint16_t id, struct dns_packet *pkt, struct dns_header *header, time_t now)
+{
+    struct dns_cache_entry *entry;
+    unsigned hash = dns_question_hash(question);
+    uint32_t age;
+    int err;
+
+    LIST_FOREACH(entry, &cache->buckets[hash % DNS_CACHE_BUCKETS], cache_hash) {
+        if (dns_cache_match(entry, question, hash))
+            break;
+    }
+
+    if (entry && entry->expire <= now) {
+        log_debug("expired %s %s", question->qname, dns_type_str(question->qtype));
+
+        dns_cache_remove(cache, entry);
+        entry = NULL;
+    }
+
+    if (!entry) {
+        cache->misses++;
+        stats->dns_cache_misses++;
+        return 1;
+    }
+
+    cache->hits++;
+    stats->dns_cache_hits++;
+
+    // most recently used
+    TAILQ_REMOVE(&cache->lru, entry, cache_lru);
+    TAILQ_INSERT_HEAD(&cache->lru, entry, cache_lru);
+
+    memcpy(pkt->buf, entry->buf, entry->len);
+    pkt->ptr = pkt->buf;
+    pkt->end = pkt->buf + entry->len;
+
+    // answer with the query id
+    id = htons(id);
+    memcpy(pkt->buf, &id, sizeof(id));
+
+    // age record TTLs, which were all at least the time to expiry
+    age = now - entry->time;
+
+    for (unsigned i = 0; i < entry->count; i++) {
+        uint32_t ttl;
+
+        memcpy(&ttl, pkt->buf + entry->ttls[i], sizeof(ttl));
+
+        ttl = ntohl(ttl);
+        ttl = ttl > age ? ttl - age : 0;
+
+        ttl = htonl(ttl);
+
+        memcpy(pkt->buf + entry->ttls[i], &ttl, sizeof(ttl));
+    }
+
+    if ((err = dns_unpack_header(pkt, header))) {
+        log_warning("dns_unpack_header");
+        return -1;
+    }
+
+    log_debug("%s %s: age=%u", question->qname, dns_type_str(question->qtype), age);
+
+    return 0;
+}
+
+int dns_cache_resize (struct dns_cache *cache, size_t size)
+{
+    cache->max = size;
+
+    // evict down to the new size
+    dns_cache_reserve(cache, 0);
+
+    return 0;
+}
+
+void dns_cache_destroy (struct dns_cache *cache)
+{
+    struct dns_cache_entry *entry;
+
+    if (cache->hits || cache->misses)
+        log_info("hits=%u misses=%u", cache->hits, cache->misses);
+
+    while ((entry = TAILQ_FIRST(&cache->lru))) {
+        dns_cache_remove(cache, entry);
+    }
+
+    free(cache);
+}
@@ -2,12 +2,35 @@
 #include "dns/dns.h"
 
 #include "common/log.h"
+#include "common/pool.h"
 #include "common/util.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+static struct pool dns_packet_pool = POOL_INIT("dns_packet", sizeof(struct dns_packet));
+
+struct dns_packet * dns_packet_alloc (void)
+{
+    struct dns_packet *packet;
+
+    if (!(packet = pool_alloc(&dns_packet_pool))) {
+        log_perror("pool_alloc");
+        return NULL;
+    }
+
+    packet->ptr = packet->buf;
+    packet->end = packet->buf + sizeof(packet->buf);
+
+    return packet;
+}
+
+void dns_packet_free (struct dns_packet *packet)
+{
+    pool_free(&dns_packet_pool, packet);
+}
+
 const char * dns_opcode_str (enum dns_opcode opcode)
 {
     switch (opcode) {
@@ -52,6 +75,8 @@ const char *dns_type_strs[DNS_TYPE_MAX] = {
 
     [DNS_AAAA]      = "AAAA",
 
+    [DNS_OPT]       = "OPT",
+
     [DNS_QTYPE_AXFR]    = "AXFR",
     [DNS_QTYPE_ANY]     = "ANY",
 };
@@ -92,6 +117,26 @@ const char * dns_section_str (enum dns_section section)
     }
 }
 
+/*
+ * Split any host:port or [host]:port in the upstream name, in-place, leaving a bare IPv6 address as-is.
+ */
+static void dns_upstream_split (struct dns_upstream *upstream)
+{
+    char *name = (char *) upstream->name, *sep;
+
+    if (*name == '[' && (sep = strstr(name, "]:"))) {
+        *sep = '\0';
+
+        upstream->name = name + 1;
+        upstream->service = sep + 2;
+
+    } else if ((sep = strchr(name, ':')) && !strchr(sep + 1, ':')) {
+        *sep = '\0';
+
+        upstream->service = sep + 1;
+    }
+}
+
 int dns_create (struct event_main *event_main, struct dns **dnsp, const char *resolver)
 {
     struct dns *dns;
@@ -107,13 +152,54 @@ int dns_create (struct event_main *event_main, struct dns **dnsp, const char *re
         return -1;
     }
 
+    dns->event_main = event_main;
+
     TAILQ_INIT(&dns->resolves);
 
-    if ((err = udp_connect(event_main, &dns->udp, resolver, DNS_SERVICE))) {
-        log_error("udp_connect %s:%s", resolver, DNS_SERVICE);
+    if ((err = dns_cache_create(&dns->cache, DNS_CACHE_SIZE))) {
+        log_error("dns_cache_create");
         goto error;
     }
 
+    // split resolver list
+    if (!(dns->resolvers = strdup(resolver))) {
+        log_perror("strdup");
+        goto error;
+    }
+
+    char *tokens;
+
+    for (char *name = strtok_r(dns->resolvers, ",", &tokens); name; name = strtok_r(NULL, ",", &tokens)) {
+        struct dns_upstream *upstream;
+
+        if (dns->upstream_count >= DNS_RESOLVERS) {
+            log_error("too many resolvers: %s", resolver);
+            goto error;
+        }
+
+        upstream = &dns->upstreams[dns->upstream_count];
+
+        upstream->dns = dns;
+        upstream->name = name;
+        upstream->service = DNS_SERVICE;
+
+        dns_upstream_split(upstream);
+
+        if ((err = udp_connect(event_main, &upstream->udp, upstream->name, upstream->service))) {
+            log_error("udp_connect %s:%s", upstream->name, upstream->service);
+            goto error;
+        }
+
+        dns->upstream_count++;
+    }
+
+    if (!dns->upstream_count) {
+        log_error("no resolvers: %s", resolver);
+        goto error;
+    }
+
+    dns->edns = DNS_EDNS_SIZE;
+
     // start id pool
     dns->ids = random() % UINT16_MAX;
 
@@ -127,7 +213,7 @@ error:
     return -1;
 }
 
-int dns_query (struct dns *dns, struct dns_packet *packet, const struct dns_header *header)
+int dns_queue (struct dns_upstream *upstream, struct dns_packet *packet, const struct dns_header *header)
 {
     packet->end = packet->ptr;
     packet->ptr = packet->buf;
@@ -139,7 +225,7 @@ int dns_query (struct dns *dns, struct dns_packet *packet, const struct dns_head
             return 1;
         }
 
-        log_info("[%u] %s%s%s%s%s%s %s", header->id,
+        log_info("%s[%u] %s%s%s%s%s%s %s", upstream->name, header->id,
                 header->qr       ? "QR " : "",
                 dns_opcode_str(header->opcode),
                 header->aa       ? " AA" : "",
@@ -150,58 +236,153 @@ int dns_query (struct dns *dns, struct dns_packet *packet, const struct dns_head
         );
     }
 
+    if (upstream->queue_count >= UDP_BATCH && dns_flush(upstream))
+        return -1;
+
+    upstream->queue[upstream->queue_count++] = (struct udp_msg) {
+        .buf    = packet->buf,
+        .size   = packet->end - packet->buf,
+    };
+
+    return 0;
+}
+
+int dns_flush (struct dns_upstream *upstream)
+{
+    unsigned count = upstream->queue_count;
+
+    if (!count)
+        return 0;
+
+    upstream->queue_count = 0;
+
     // send
-    size_t size = (packet->end - packet->buf);
-    if (udp_write(dns->udp, packet->buf, size)) {
-        log_warning("udp_write: %zu", size);
+    if (udp_write_batch(upstream->udp, upstream->queue, count)) {
+        log_warning("udp_write_batch: %u", count);
         return -1;
     }
 
     return 0;
 }
 
-int dns_response (struct dns *dns, struct dns_packet *packet, struct dns_header *header, const struct timeval *timeout)
+int dns_query (struct dns_upstream *upstream, struct dns_packet *packet, const struct dns_header *header)
 {
     int err;
 
-    // recv
-    size_t size = sizeof(packet->buf);
+    if ((err = dns_queue(upstream, packet, header)))
+        return err;
+
+    return dns_flush(upstream);
+}
+
+int dns_response (struct dns_upstream *upstream, struct dns_packet **packets, struct dns_header *headers, unsigned *countp, const struct timeval *timeout)
+{
+    struct udp_msg msgs[UDP_BATCH];
+    unsigned count = *countp < UDP_BATCH ? *countp : UDP_BATCH, valid = 0;
+    int err;
+
+    for (unsigned i = 0; i < count; i++) {
+        msgs[i] = (struct udp_msg) {
+            .buf    = packets[i]->buf,
+            .size   = sizeof(packets[i]->buf),
+        };
+    }
 
-    if ((err = udp_read(dns->udp, packet->buf, &size, timeout)) < 0) {
-        log_warning("udp_read");
+    // recv
+    if ((err = udp_read_batch(upstream->udp, msgs, &count, timeout)) < 0) {
+        log_warning("udp_read_batch");
         return -1;
 
     } else if (err) {
-        log_warning("timeout");
+        log_debug("timeout");
         return err;
     }
 
-    packet->ptr = packet->buf;
-    packet->end = packet->buf + size;
+    for (unsigned i = 0; i < count; i++) {
+        struct dns_packet *packet = packets[i];
+        struct dns_header *header = &headers[valid];
 
-    // header
-    if ((err = dns_unpack_header(packet, header))) {
-        log_warning("dns_unpack_header");
-        return err;
+        packet->ptr = packet->buf;
+        packet->end = packet->buf + msgs[i].size;
+
+        // header
+        if ((err = dns_unpack_header(packet, header))) {
+            log_warning("dns_unpack_header");
+            continue;
+        }
+
+        log_info("%s[%u] %s%s%s%s%s%s %s", upstream->name, header->id,
+                header->qr      ? "QR " : "",
+                dns_opcode_str(header->opcode),
+                header->aa      ? " AA" : "",
+                header->tc      ? " TC" : "",
+                header->rd      ? " RD" : "",
+                header->ra      ? " RA" : "",
+                dns_rcode_str(header->rcode)
+        );
+
+        // keep valid responses first
+        packets[i] = packets[valid];
+        packets[valid++] = packet;
     }
 
-    log_info("[%u] %s%s%s%s%s%s %s", header->id,
-            header->qr      ? "QR " : "",
-            dns_opcode_str(header->opcode),
-            header->aa      ? " AA" : "",
-            header->tc      ? " TC" : "",
-            header->rd      ? " RD" : "",
-            header->ra      ? " RA" : "",
-            dns_rcode_str(header->rcode)
-    );
+    *countp = valid;
 
     return 0;
 }
 
+int dns_set_cache (struct dns *dns, size_t size)
+{
+    return dns_cache_resize(dns->cache, size);
+}
+
+int dns_set_edns (struct dns *dns, unsigned size)
+{
+    if (size > DNS_PACKET)
+        return 1;
+
+    dns->edns = size;
+
+    return 0;
+}
+
+void dns_get_stats (struct dns *dns, struct dns_stats *stats)
+{
+    *stats = dns->stats;
+}
+
 void dns_destroy (struct dns *dns)
 {
-    if (dns->udp)
-        udp_destroy(dns->udp);
+    if (dns->receivers) {
+        // a receiver task is still running, and may be notifying the calling task
+        log_debug("deferred until receiver exits");
+
+        dns->destroy = true;
+
+        return;
+    }
+
+    free(dns->table);
+    free(dns->timers);
+
+    if (dns->cache)
+        dns_cache_destroy(dns->cache);
+
+    for (unsigned i = 0; i < dns->upstream_count; i++) {
+        struct dns_upstream *upstream = &dns->upstreams[i];
+
+        log_debug("%s: srtt=%uus rttvar=%uus failures=%u", upstream->name, upstream->srtt, upstream->rttvar, upstream->failures);
+
+        for (unsigned j = 0; j < DNS_UPSTREAM_BATCH && upstream->spares[j]; j++)
+            dns_packet_free(upstream->spares[j]);
+
+        for (unsigned j = 0; j < upstream->tcp_count; j++)
+            tcp_destroy(upstream->tcp[j]);
+
+        udp_destroy(upstream->udp);
+    }
+
+    free(dns->resolvers);
 
     free(dns);
 }
@@ -3,29 +3,110 @@
 
 #include "../dns.h"
 
+#include "common/tcp.h"
 #include "common/udp.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <sys/queue.h>
+#include <time.h>
+
+/* Number of idle TCP connections kept per upstream */
+#define DNS_UPSTREAM_TCP 4
+
+/* Number of responses received per upstream at once */
+#define DNS_UPSTREAM_BATCH 16
+
+/*
+ * Upstream resolver, with round-trip time estimates in microseconds, per RFC 6298.
+ */
+struct dns_upstream {
+    struct dns *dns;
+    struct udp *udp;
+
+    // resolver host, for logging, and port
+    const char *name, *service;
+
+    // smoothed RTT and variance, srtt = 0 if not yet measured
+    unsigned srtt, rttvar;
+
+    // consecutive timeouts
+    unsigned failures;
+
+    // packets for receiving the next responses into, swapped with the matching resolve's packet
+    struct dns_packet *spares[DNS_UPSTREAM_BATCH];
+
+    // queries packed by dns_queue(), to be sent by dns_flush()
+    struct udp_msg queue[UDP_BATCH];
+    unsigned queue_count;
+
+    // receiver task running for this upstream
+    bool receiver;
+
+    // idle TCP connections for truncated responses
+    struct tcp *tcp[DNS_UPSTREAM_TCP];
+    unsigned tcp_count;
+};
 
 /*
  * DNS resolver state for multiple dns_reolve's.
  */
 struct dns {
-    struct udp *udp;
+    struct event_main *event_main;
+
+    // copy of the resolver list, as split into upstream names
+    char *resolvers;
+
+    struct dns_upstream upstreams[DNS_RESOLVERS];
+    unsigned upstream_count;
 
     // query id pool
     uint16_t ids;
 
+    // response cache
+    struct dns_cache *cache;
+
+    // advertised EDNS0 UDP payload size, or 0
+    unsigned edns;
+
+    // pending queries, for sharing identical questions
     TAILQ_HEAD(dns_resolves, dns_resolve) resolves;
+
+    // pending queries indexed by id, masked to the power-of-two size
+    struct dns_resolve **table;
+    unsigned table_size, pending;
+
+    // min-heap of pending queries by retransmit timeout
+    struct dns_resolve **timers;
+    unsigned timers_count, timers_size;
+
+    // statistics
+    struct dns_stats stats;
+
+    // receiver tasks running, with dns_destroy() deferred until they exit
+    unsigned receivers;
+    bool destroy;
 };
 
+/* Number of label offsets kept per packet for name compression */
+#define DNS_PACKET_NAMES 64
+
 struct dns_packet {
     char buf[DNS_PACKET];
 
     char *ptr, *end;
+
+    // offsets of labels packed by dns_pack_name(), reset by dns_pack_header() at the start of the packet
+    uint16_t names[DNS_PACKET_NAMES];
+    unsigned names_count;
 };
 
+/*
+ * Allocate packet buffers from a shared pool.
+ */
+struct dns_packet * dns_packet_alloc (void);
+void dns_packet_free (struct dns_packet *packet);
+
 const char * dns_opcode_str (enum dns_opcode opcode);
 const char * dns_rcode_str (enum dns_rcode rcode);
 const char * dns_class_str (enum dns_class class);
@@ -33,10 +114,22 @@ const char * dns_type_str (enum dns_type type);
 const char * dns_section_str (enum dns_section section);
 
 int dns_pack_header (struct dns_packet *pkt, const struct dns_header *header);
+
+/*
+ * Pack a name, compressed using a pointer to the longest matching suffix of any name already packed into the packet.
+ */
 int dns_pack_name (struct dns_packet *pkt, const char *name);
 int dns_pack_question (struct dns_packet *pkt, const struct dns_question *question);
+int dns_pack_opt (struct dns_packet *pkt, uint16_t size);
 int dns_pack_record (struct dns_packet *pkt, const struct dns_record *rr);
 
+/*
+ * Pack a record with the given decoded rdata, instead of rr->rdatap, compressing any names.
+ *
+ * Returns 1 on packet overflow, <0 for unsupported record types.
+ */
+int dns_pack_rdata (struct dns_packet *pkt, const struct dns_record *rr, const union dns_rdata *rdata);
+
 int dns_unpack_header (struct dns_packet *pkt, struct dns_header *header);
 int dns_unpack_name (struct dns_packet *pkt, char *buf, size_t size);
 int dns_unpack_question (struct dns_packet *pkt, struct dns_question *question);
@@ -44,25 +137,116 @@ int dns_unpack_record (struct dns_packet *pkt, struct dns_record *rr);
 int dns_unpack_rdata (struct dns_packet *pkt, struct dns_record *rr, union dns_rdata *rdata);
 
 /*
- * The event used by this DNS resolver.
+ * Case-insensitive hash of the name, or question.
+ */
+unsigned dns_name_hash (const char *name);
+unsigned dns_question_hash (const struct dns_question *question);
+
+/*
+ * Cache of response packets, keyed by question.
+ */
+struct dns_cache;
+
+int dns_cache_create (struct dns_cache **cachep, size_t size);
+
+/*
+ * Store a copy of the response packet to the given question, indexing the records to determine the TTL.
+ *
+ * The packet position is left as-is.
+ *
+ * Returns 1 if the response is not cacheable, <0 on error.
+ */
+int dns_cache_insert (struct dns_cache *cache, const struct dns_question *question, struct dns_packet *packet, time_t now);
+
+/*
+ * Copy out a cached response to the given question, with the given id and aged record TTLs, unpacking the header.
+ *
+ * Returns 1 if not cached, <0 on error.
+ */
+int dns_cache_lookup (struct dns_cache *cache, const struct dns_question *question, uint16_t id, struct dns_packet *packet, struct dns_header *header, time_t now);
+
+/*
+ * Change the maximum size, evicting entries as needed.
+ */
+int dns_cache_resize (struct dns_cache *cache, size_t size);
+
+void dns_cache_destroy (struct dns_cache *cache);
+
+/*
+ * Static records loaded from a zone file, answered locally by dns_server.
+ */
+struct dns_zone;
+
+int dns_zone_create (struct dns_zone **zonep);
+
+/*
+ * Load records from a zone file, with one record per line:
+ *
+ *      <name> [<ttl>] [IN] <type> <rdata>
+ *
+ * Supports A, AAAA, NS, CNAME, PTR and MX records. Names are absolute, with or without the trailing dot. Blank lines,
+ * and anything following a ';', are ignored.
+ *
+ * Returns 1 on syntax errors, <0 on error.
+ */
+int dns_zone_load (struct dns_zone *zone, const char *path);
+
+/*
+ * Pack the answer records matching the question into the packet, along with any CNAME record for the name.
+ *
+ * Returns 1 if the name is not in the zone, <0 on error, 0 with the number of records packed in *countp, which may be
+ * zero for a name without records of the question type.
+ */
+int dns_zone_answer (struct dns_zone *zone, const struct dns_question *question, struct dns_packet *packet, unsigned *countp);
+
+void dns_zone_destroy (struct dns_zone *zone);
+
+/*
+ * Copy out a cached response to the question, as for dns_cache_lookup() on the resolver cache.
+ *
+ * Returns 1 if not cached, <0 on error.
+ */
+int dns_resolve_lookup (struct dns *dns, const struct dns_question *question, uint16_t id, struct dns_packet *packet, struct dns_header *header);
+
+/*
+ * The response packet of a completed dns_resolve(), valid until dns_close().
+ */
+const struct dns_packet * dns_resolve_packet (struct dns_resolve *resolve);
+
+/*
+ * The event used by this DNS resolver, for waiting on responses.
  */
 static inline struct event * dns_event (struct dns *dns)
 {
-    return udp_event(dns->udp);
+    return udp_event(dns->upstreams[0].udp);
 }
 
 /*
- * Send a packed DNS query.
+ * Send a packed DNS query to the upstream, along with any queued queries.
  *
  * If header is given, update the packed header before sending.
  */
-int dns_query (struct dns *dns, struct dns_packet *packet, const struct dns_header *header);
+int dns_query (struct dns_upstream *upstream, struct dns_packet *packet, const struct dns_header *header);
+
+/*
+ * Queue a packed DNS query to the upstream, as for dns_query().
+ *
+ * The packet must remain intact until sent by dns_flush(), or by a dns_queue() that fills the queue.
+ */
+int dns_queue (struct dns_upstream *upstream, struct dns_packet *packet, const struct dns_header *header);
 
 /*
- * Recv a DNS response, unpacking the header.
+ * Send any queued queries to the upstream, using a single syscall per UDP_BATCH.
+ */
+int dns_flush (struct dns_upstream *upstream);
+
+/*
+ * Recv up to *countp DNS responses from the upstream into the given packets, unpacking each header.
+ *
+ * Invalid packets are skipped, and the packets for the valid responses are re-ordered first, with *countp updated.
  *
  * Returns 1 on timeout, <0 on error, 0 on success.
  */
-int dns_response (struct dns *dns, struct dns_packet *packet, struct dns_header *header, const struct timeval *timeout);
+int dns_response (struct dns_upstream *upstream, struct dns_packet **packets, struct dns_header *headers, unsigned *countp, const struct timeval *timeout);
 
 #endif
@@ -3,7 +3,9 @@
 #include "common/log.h"
 
 #include <arpa/inet.h>
+#include <stdbool.h>
 #include <string.h>
+#include <strings.h>
 
 int dns_pack_u8 (struct dns_packet *pkt, uint8_t u8)
 {
@@ -61,6 +63,10 @@ int dns_pack_buf (struct dns_packet *pkt, const void *buf, size_t size)
 
 int dns_pack_header (struct dns_packet *pkt, const struct dns_header *header)
 {
+    // a new packet, without any names to compress against
+    if (pkt->ptr == pkt->buf)
+        pkt->names_count = 0;
+
     return (
             dns_pack_u16(pkt, header->id)
         ||  dns_pack_u16(pkt, (
@@ -80,54 +86,113 @@ int dns_pack_header (struct dns_packet *pkt, const struct dns_header *header)
     );
 }
 
-int dns_pack_name (struct dns_packet *pkt, const char *name)
+/*
+ * Compare the packed name at the given offset, following any pointers, against the given labels.
+ */
+static bool dns_pack_match (const struct dns_packet *pkt, unsigned offset, const char **labels, const uint8_t *lens, unsigned count)
 {
-    char c, label[DNS_LABEL], *labelp = label;
+    unsigned i = 0;
 
-    log_debug("%s", name);
+    // pointers only ever point backwards, but bound the loop regardless
+    for (unsigned hops = 0; hops < DNS_LABELS * 2; hops++) {
+        const uint8_t *p = (const uint8_t *) pkt->buf + offset;
 
-    do {
-        c = *name;
+        if ((const char *) p >= pkt->ptr) {
+            return false;
 
-        if (*name)
-            name++;
+        } else if ((*p & 0xc0) == 0xc0) {
+            offset = (p[0] & 0x3f) << 8 | p[1];
 
-        // accumulate label
-        if (c == '.' || c == '\0') {
-            size_t len = (labelp - label);
+        } else if (!*p) {
+            return i == count;
 
-            if (!len) {
-                log_warning("skip empty label @ %zu:%s", strlen(name), name);
+        } else if (i >= count || *p != lens[i] || strncasecmp((const char *) p + 1, labels[i], *p)) {
+            return false;
 
-            } else {
-                log_debug("%zu:%s @ %zu:%s", len, label, strlen(name), name);
+        } else {
+            offset += 1 + *p;
+            i++;
+        }
+    }
 
-                // 6-bit length
-                if (
-                        dns_pack_u8(pkt, len & 0x3f)
-                    ||  dns_pack_buf(pkt, label, len)
-                )
-                    return 1;
-            }
+    return false;
+}
 
-            labelp = label;
-            *labelp = '\0';
+int dns_pack_name (struct dns_packet *pkt, const char *name)
+{
+    const char *labels[DNS_LABELS];
+    uint8_t lens[DNS_LABELS];
+    unsigned count = 0, suffix;
+    int pointer = -1;
+
+    log_debug("%s", name);
+
+    // split into labels, skipping empty ones
+    for (const char *c = name; *c; ) {
+        size_t len = strcspn(c, ".");
 
-        } else if (labelp + 1 < label + sizeof(label)) {
-            *labelp++ = c;
-            *labelp = '\0';
+        if (!len) {
+            c++;
             continue;
+        }
 
-        } else {
-            log_error("label overflow: %s+%s", label, name);
+        if (len > DNS_LABEL) {
+            log_error("label overflow: %.*s", (int) len, c);
             return 2;
         }
 
-    } while (c);
+        if (count >= DNS_LABELS) {
+            log_error("label count overflow: %s", name);
+            return 2;
+        }
+
+        labels[count] = c;
+        lens[count] = len;
+        count++;
+
+        c += len;
+    }
+
+    // longest suffix already packed
+    for (suffix = 0; suffix < count; suffix++) {
+        for (unsigned i = 0; i < pkt->names_count; i++) {
+            if (dns_pack_match(pkt, pkt->names[i], labels + suffix, lens + suffix, count - suffix)) {
+                pointer = pkt->names[i];
+                break;
+            }
+        }
+
+        if (pointer >= 0)
+            break;
+    }
+
+    for (unsigned i = 0; i < suffix; i++) {
+        unsigned offset = pkt->ptr - pkt->buf;
+
+        log_debug("%u:%.*s @ %u", lens[i], lens[i], labels[i], offset);
+
+        // 6-bit length
+        if (
+                dns_pack_u8(pkt, lens[i])
+            ||  dns_pack_buf(pkt, labels[i], lens[i])
+        )
+            return 1;
+
+        // 14-bit pointers
+        if (offset < 0x4000 && pkt->names_count < DNS_PACKET_NAMES)
+            pkt->names[pkt->names_count++] = offset;
+    }
 
     // end
-    if (dns_pack_u8(pkt, 0x00))
+    if (pointer >= 0) {
+        log_debug("@%d", pointer);
+
+        if (dns_pack_u16(pkt, 0xc000 | pointer))
+            return 1;
+
+    } else if (dns_pack_u8(pkt, 0x00)) {
         return 1;
+    }
 
     return 0;
 }
@@ -141,6 +206,17 @@ int dns_pack_question (struct dns_packet *pkt, const struct dns_question *questi
     );
 }
 
+int dns_pack_opt (struct dns_packet *pkt, uint16_t size)
+{
+    return (
+            dns_pack_u8(pkt, 0x00)      // root name
+        ||  dns_pack_u16(pkt, DNS_OPT)
+        ||  dns_pack_u16(pkt, size)     // class is the UDP payload size
+        ||  dns_pack_u32(pkt, 0)        // ttl is the extended rcode, version and flags
+        ||  dns_pack_u16(pkt, 0)        // no options
+    );
+}
+
 int dns_pack_record (struct dns_packet *pkt, const struct dns_record *rr)
 {
     return (
@@ -152,3 +228,62 @@ int dns_pack_record (struct dns_packet *pkt, const struct dns_record *rr)
         ||  dns_pack_buf(pkt, rr->rdatap, rr->rdlength)
     );
 }
+
+int dns_pack_rdata (struct dns_packet *pkt, const struct dns_record *rr, const union dns_rdata *rdata)
+{
+    char *rdlength;
+    int err = 0;
+
+    if (
+            dns_pack_name(pkt, rr->name)
+        ||  dns_pack_u16(pkt, rr->type)
+        ||  dns_pack_u16(pkt, rr->class)
+        ||  dns_pack_u32(pkt, rr->ttl)
+    )
+        return 1;
+
+    // placeholder, until the length of any compressed names is known
+    rdlength = pkt->ptr;
+
+    if (dns_pack_u16(pkt, 0))
+        return 1;
+
+    switch (rr->type) {
+        case DNS_A:
+            err = dns_pack_buf(pkt, &rdata->A, sizeof(rdata->A));
+            break;
+
+        case DNS_AAAA:
+            err = dns_pack_buf(pkt, &rdata->AAAA, sizeof(rdata->AAAA));
+            break;
+
+        case DNS_NS:
+            err = dns_pack_name(pkt, rdata->NS);
+            break;
+
+        case DNS_CNAME:
+            err = dns_pack_name(pkt, rdata->CNAME);
+            break;
+
+        case DNS_PTR:
+            err = dns_pack_name(pkt, rdata->PTR);
+            break;
+
+        case DNS_MX:
+            err = dns_pack_u16(pkt, rdata->MX.preference) || dns_pack_name(pkt, rdata->MX.exchange);
+            break;
+
+        default:
+            log_warning("unsupported rdata type: %s", dns_type_str(rr->type));
+            return -1;
+    }
+
+    if (err)
+        return 1;
+
+    uint16_t len = htons(pkt->ptr - rdlength - sizeof(len));
+
+    memcpy(rdlength, &len, sizeof(len));
+
+    return 0;
+}
@@ -2,13 +2,17 @@
 #include "dns/dns.h"
 
 #include "common/log.h"
+#include "common/stream.h"
+#include "common/tcp.h"
 #include "common/util.h"
 
 #include <arpa/inet.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/queue.h>
+#include <time.h>
 
 struct dns_resolve {
     struct dns *dns;
@@ -16,11 +20,11 @@ struct dns_resolve {
     // debugging purposes
     const char *name;
 
-    // used for event_wait() on response...
+    // used for event_wait() on response, notified by the receiver
     struct event_task *wait;
 
-    // used for both query and response
-    struct dns_packet packet;
+    // used for both query and response, swapped with the received packet
+    struct dns_packet *packet;
 
     // id for query/response
     uint16_t id;
@@ -28,12 +32,26 @@ struct dns_resolve {
     // query
     struct dns_header query_header;
 
+    // query question, as packed, used as the cache key
+    struct dns_question question;
+    unsigned question_hash;
+
     // query sent and registered
     bool query;
 
-    // time query will timeout
+    // upstream sent to last, and time that query will timeout
+    struct dns_upstream *upstream;
     struct timeval timeout;
 
+    // bitmasks of upstreams sent to, sent to more than once, and tried in the current round of retries
+    unsigned upstreams, retransmits, tried;
+
+    // time of the last send to each upstream, for RTT samples
+    struct timeval sent[DNS_RESOLVERS];
+
+    // position in dns->timers + 1, or 0
+    unsigned timer;
+
     // retransmits
     int retry;
 
@@ -47,11 +65,37 @@ struct dns_resolve {
     int response_questions;
     int response_records;
 
+    // pending resolve for the same question, whose response this resolve shares instead of sending a query
+    struct dns_resolve *leader;
+
+    // answered from the cache, or shared with a leader, and not to be cached again
+    bool cached, shared;
+
+    // other resolves sharing our response
+    TAILQ_HEAD(dns_followers, dns_resolve) followers;
+
     TAILQ_ENTRY(dns_resolve) dns_resolves;
+    TAILQ_ENTRY(dns_resolve) dns_followers;
 };
 
-static const struct timeval dns_resolve_timeout = { 2, 0 }; // 2s
-static const int DNS_RESOLVE_RETRY = 5; // 10s
+static const int DNS_RESOLVE_RETRY = 5;
+
+/* Per-query timeout in microseconds, before any RTT is measured, and bounds on the RTT-based timeout */
+#define DNS_RESOLVE_TIMEOUT 1000000
+#define DNS_RESOLVE_TIMEOUT_MIN 100000
+#define DNS_RESOLVE_TIMEOUT_MAX 2000000
+
+/* Receivers wake up at least this often, to notice earlier timeouts for queries sent while waiting */
+static const struct timeval dns_resolve_poll = { 0, DNS_RESOLVE_TIMEOUT_MIN / 2 };
+
+/* Read/write timeout for TCP queries */
+static const struct timeval dns_resolve_tcp_timeout = { DNS_RESOLVE_TIMEOUT_MAX / 1000000, 0 };
+
+/* Initial size of the id table, kept at most half full */
+#define DNS_RESOLVE_TABLE 64
+
+/* One slot per query id */
+#define DNS_RESOLVE_TABLE_MAX (UINT16_MAX + 1)
 
 int dns_resolve_create (struct dns *dns, struct dns_resolve **resolvep)
 {
@@ -65,9 +109,13 @@ int dns_resolve_create (struct dns *dns, struct dns_resolve **resolvep)
 
     resolve->dns = dns;
 
+    TAILQ_INIT(&resolve->followers);
+
     // start packing out query
-    resolve->packet.ptr = resolve->packet.buf;
-    resolve->packet.end = resolve->packet.buf + sizeof(resolve->packet.buf);
+    if (!(resolve->packet = dns_packet_alloc())) {
+        free(resolve);
+        return -1;
+    }
 
     // pack initial header
     resolve->query_header = (struct dns_header) {
@@ -77,8 +125,9 @@ int dns_resolve_create (struct dns *dns, struct dns_resolve **resolvep)
         .qdcount    = 0, // placeholder, updated on sending
     };
 
-    if (dns_pack_header(&resolve->packet, &resolve->query_header)) {
+    if (dns_pack_header(resolve->packet, &resolve->query_header)) {
         log_warning("query header overflow");
+        dns_close(resolve);
         return 1;
     }
 
@@ -100,7 +149,7 @@ int dns_query_question (struct dns_resolve *resolve, const char *name, enum dns_
         return 1;
     }
 
-    if (dns_pack_question(&resolve->packet, &question)) {
+    if (dns_pack_question(resolve->packet, &question)) {
         log_warning("query overflow: %d", resolve->query_header.qdcount);
         return 1;
     }
@@ -115,69 +164,357 @@ int dns_query_question (struct dns_resolve *resolve, const char *name, enum dns_
     return 0;
 }
 
+/*
+ * Min-heap of pending resolves by timeout, as used for event timers.
+ */
+static inline bool dns_timer_before (const struct dns_resolve *a, const struct dns_resolve *b)
+{
+    return timercmp(&a->timeout, &b->timeout, <);
+}
+
+static inline void dns_timer_place (struct dns *dns, unsigned i, struct dns_resolve *resolve)
+{
+    dns->timers[i] = resolve;
+    resolve->timer = i + 1;
+}
+
+static void dns_timer_up (struct dns *dns, unsigned i)
+{
+    struct dns_resolve *resolve = dns->timers[i];
+
+    while (i > 0) {
+        unsigned parent = (i - 1) / 2;
+
+        if (!dns_timer_before(resolve, dns->timers[parent]))
+            break;
+
+        dns_timer_place(dns, i, dns->timers[parent]);
+        i = parent;
+    }
+
+    dns_timer_place(dns, i, resolve);
+}
+
+static void dns_timer_down (struct dns *dns, unsigned i)
+{
+    struct dns_resolve *resolve = dns->timers[i];
+
+    for (;;) {
+        unsigned child = 2 * i + 1;
+
+        if (child >= dns->timers_count)
+            break;
+
+        if (child + 1 < dns->timers_count && dns_timer_before(dns->timers[child + 1], dns->timers[child]))
+            child++;
+
+        if (!dns_timer_before(dns->timers[child], resolve))
+            break;
+
+        dns_timer_place(dns, i, dns->timers[child]);
+        i = child;
+    }
+
+    dns_timer_place(dns, i, resolve);
+}
+
+static int dns_timer_insert (struct dns *dns, struct dns_resolve *resolve)
+{
+    if (dns->timers_count >= dns->timers_size) {
+        unsigned size = dns->timers_size ? dns->timers_size * 2 : DNS_RESOLVE_TABLE;
+        struct dns_resolve **timers;
+
+        if (!(timers = realloc(dns->timers, size * sizeof(*timers)))) {
+            log_perror("realloc");
+            return -1;
+        }
+
+        dns->timers = timers;
+        dns->timers_size = size;
+    }
+
+    dns->timers[dns->timers_count] = resolve;
+    dns_timer_up(dns, dns->timers_count++);
+
+    return 0;
+}
+
+static void dns_timer_remove (struct dns *dns, struct dns_resolve *resolve)
+{
+    unsigned i = resolve->timer - 1;
+    struct dns_resolve *last = dns->timers[--dns->timers_count];
+
+    resolve->timer = 0;
+
+    if (last == resolve)
+        return;
+
+    // fill the hole with the last timer, which may need to move either way
+    dns->timers[i] = last;
+
+    if (i > 0 && dns_timer_before(last, dns->timers[(i - 1) / 2]))
+        dns_timer_up(dns, i);
+    else
+        dns_timer_down(dns, i);
+}
+
+/*
+ * Allocate an unused query id for the resolve, and register it for dispatching responses.
+ */
+static int dns_resolve_register (struct dns *dns, struct dns_resolve *resolve)
+{
+    unsigned mask;
+
+    if (dns->pending >= dns->table_size / 2) {
+        // grow, keeping the table at most half full, so that a free id is found within a few probes
+        unsigned size = dns->table_size ? dns->table_size * 2 : DNS_RESOLVE_TABLE;
+        struct dns_resolve **table;
+
+        if (size > DNS_RESOLVE_TABLE_MAX) {
+            log_warning("too many pending queries: %u", dns->pending);
+            return 1;
+        }
+
+        if (!(table = calloc(size, sizeof(*table)))) {
+            log_perror("calloc");
+            return -1;
+        }
+
+        // pending ids are unique modulo the old size, and thus also under the larger mask
+        for (unsigned i = 0; i < dns->table_size; i++) {
+            if (dns->table[i])
+                table[dns->table[i]->id & (size - 1)] = dns->table[i];
+        }
+
+        free(dns->table);
+
+        dns->table = table;
+        dns->table_size = size;
+    }
+
+    mask = dns->table_size - 1;
+
+    // skip any ids still pending
+    while (dns->table[dns->ids & mask])
+        dns->ids++;
+
+    resolve->id = dns->ids++;
+
+    dns->table[resolve->id & mask] = resolve;
+    dns->pending++;
+
+    TAILQ_INSERT_TAIL(&dns->resolves, resolve, dns_resolves);
+
+    return 0;
+}
+
+/*
+ * Remove a pending resolve from response dispatching.
+ */
+static void dns_resolve_unregister (struct dns *dns, struct dns_resolve *resolve)
+{
+    dns->table[resolve->id & (dns->table_size - 1)] = NULL;
+    dns->pending--;
+
+    TAILQ_REMOVE(&dns->resolves, resolve, dns_resolves);
+
+    if (resolve->timer)
+        dns_timer_remove(dns, resolve);
+}
+
+/*
+ * Score upstreams for sending queries to, lower is better.
+ *
+ * Unmeasured upstreams are tried first, in order, and upstreams that have timed out are backed off exponentially.
+ */
+static unsigned dns_upstream_score (const struct dns_upstream *upstream)
+{
+    unsigned rtt = upstream->srtt ? upstream->srtt : DNS_RESOLVE_TIMEOUT;
+    unsigned failures = upstream->failures < 8 ? upstream->failures : 8;
+
+    if (!upstream->srtt && !upstream->failures)
+        return 0;
+
+    return rtt << failures;
+}
+
+/*
+ * Timeout in microseconds for a query sent to the upstream, before retrying or hedging to the next upstream.
+ */
+static unsigned dns_upstream_timeout (const struct dns_upstream *upstream)
+{
+    unsigned timeout = upstream->srtt ? upstream->srtt + 4 * upstream->rttvar : DNS_RESOLVE_TIMEOUT;
+
+    if (timeout < DNS_RESOLVE_TIMEOUT_MIN)
+        timeout = DNS_RESOLVE_TIMEOUT_MIN;
+
+    return timeout;
+}
+
+/*
+ * Update the upstream RTT estimate with a new sample, per RFC 6298.
+ */
+static void dns_upstream_sample (struct dns_upstream *upstream, unsigned rtt)
+{
+    if (!upstream->srtt) {
+        upstream->rttvar = rtt / 2;
+        upstream->srtt = rtt;
+    } else {
+        unsigned delta = rtt > upstream->srtt ? rtt - upstream->srtt : upstream->srtt - rtt;
+
+        upstream->rttvar = (3 * upstream->rttvar + delta) / 4;
+        upstream->srtt = (7 * upstream->srtt + rtt) / 8;
+    }
+
+    // zero is reserved for unmeasured
+    if (!upstream->srtt)
+        upstream->srtt = 1;
+
+    log_debug("%s: rtt=%uus srtt=%uus rttvar=%uus", upstream->name, rtt, upstream->srtt, upstream->rttvar);
+}
+
+/*
+ * Queue the packed query to the best upstream not yet tried in this round, and set the timeout for it.
+ */
+static int dns_resolve_send (struct dns_resolve *resolve)
+{
+    struct dns *dns = resolve->dns;
+    struct dns_upstream *upstream = NULL;
+    unsigned all = (1u << dns->upstream_count) - 1, index, timeout;
+    int err;
+
+    // start a new round of retries once each upstream has been tried
+    if ((resolve->tried & all) == all)
+        resolve->tried = 0;
+
+    for (unsigned i = 0; i < dns->upstream_count; i++) {
+        if (resolve->tried & (1u << i))
+            continue;
+
+        if (!upstream || dns_upstream_score(&dns->upstreams[i]) < dns_upstream_score(upstream))
+            upstream = &dns->upstreams[i];
+    }
+
+    index = upstream - dns->upstreams;
+
+    if ((err = dns_queue(upstream, resolve->packet, &resolve->query_header))) {
+        log_error("dns_queue");
+        return err;
+    }
+
+    if (resolve->upstreams & (1u << index))
+        resolve->retransmits |= 1u << index;
+
+    resolve->upstreams |= 1u << index;
+    resolve->tried |= 1u << index;
+    resolve->upstream = upstream;
+
+    // back off for each round of retries, and wait the longest for the final response
+    timeout = dns_upstream_timeout(upstream) << (resolve->retry / dns->upstream_count);
+
+    if (timeout > DNS_RESOLVE_TIMEOUT_MAX || resolve->retry >= DNS_RESOLVE_RETRY)
+        timeout = DNS_RESOLVE_TIMEOUT_MAX;
+
+    resolve->sent[index] = *event_main_clock(dns->event_main);
+
+    struct timeval tv = { timeout / 1000000, timeout % 1000000 };
+
+    timeradd(&resolve->sent[index], &tv, &resolve->timeout);
+
+    return 0;
+}
+
+static void dns_receiver (void *ctx);
+
 /*
  * Send a finished query.
  */
 int dns_resolve_query (struct dns_resolve *resolve)
 {
+    struct dns *dns = resolve->dns;
     int err;
 
     // alloc an id
-    resolve->id = resolve->query_header.id = resolve->dns->ids++;
-
-    // dispatch with updated header
-    if ((err = dns_query(resolve->dns, &resolve->packet, &resolve->query_header))) {
-        log_error("dns_query");
+    if ((err = dns_resolve_register(dns, resolve)))
         return err;
+
+    resolve->query_header.id = resolve->id;
+
+    // advertise our UDP payload size, following the questions
+    if (dns->edns && !resolve->query_header.arcount) {
+        if (dns_pack_opt(resolve->packet, dns->edns)) {
+            log_warning("query overflow: OPT");
+            err = 1;
+            goto error;
+        }
+
+        resolve->query_header.arcount++;
     }
 
-    // set timeout
-    if (timestamp_from_timeout(&resolve->timeout, &dns_resolve_timeout)) {
-        log_error("timestamp_now");
+    // dispatch with updated header
+    if ((err = dns_resolve_send(resolve)))
+        goto error;
+
+    if ((err = dns_flush(resolve->upstream)))
+        goto error;
+
+    if ((err = dns_timer_insert(dns, resolve)))
         goto error;
-    }
 
     // response mapping
     resolve->query = true;
 
-    TAILQ_INSERT_TAIL(&resolve->dns->resolves, resolve, dns_resolves);
+    dns->stats.queries++;
+
+    // responses are received by a separate task for each upstream, if running with tasks
+    for (unsigned i = 0; i < dns->upstream_count && dns->event_main && dns_event(dns); i++) {
+        struct dns_upstream *upstream = &dns->upstreams[i];
+
+        if (upstream->receiver)
+            continue;
+
+        upstream->receiver = true;
+        dns->receivers++;
+
+        if (event_start(dns->event_main, dns_receiver, upstream)) {
+            log_error("event_start");
+
+            upstream->receiver = false;
+            dns->receivers--;
+        }
+    }
 
     return 0;
 
 error:
-    return -1;
+    dns_resolve_unregister(dns, resolve);
+
+    return err;
 }
 
 /*
- * Retransmit a query.
+ * Retransmit a query, or hedge it to the next upstream, queued until dns_flush().
  */
 int dns_resolve_retry (struct dns_resolve *resolve)
 {
     int err;
 
-    // dispatch; old packet should still be intact..
-    if ((err = dns_query(resolve->dns, &resolve->packet, &resolve->query_header))) {
-        log_error("dns_query");
-        return err;
-    }
-
-    // set new timeout
-    if (timestamp_from_timeout(&resolve->timeout, &dns_resolve_timeout)) {
-        log_error("timestamp_now");
-        goto error;
-    }
+    resolve->upstream->failures++;
 
     // mark as retried
     resolve->retry++;
+    resolve->dns->stats.retries++;
 
-    // move to head of queue
-    TAILQ_REMOVE(&resolve->dns->resolves, resolve, dns_resolves);
-    TAILQ_INSERT_TAIL(&resolve->dns->resolves, resolve, dns_resolves);
+    // dispatch the intact packet, including the question that dns_query() marked as the end of the packet
+    resolve->packet->ptr = resolve->packet->end;
 
-    return 0;
+    if ((err = dns_resolve_send(resolve)))
+        return err;
 
-error:
-    return -1;
+    // the new timeout is later
+    dns_timer_down(resolve->dns, resolve->timer - 1);
+
+    return 0;
 }
 
 int dns_resolve_async (struct dns *dns, struct dns_resolve **resolvep, const char *name, enum dns_type type)
@@ -207,208 +544,280 @@ err:
 }
 
 /*
- * Wait for a response to any of our resolves.
- *
- * Returns 0 on success with *resolvep updated to the responded resolve.
- * Returns 1 on retry, with *resolvep unset.
- * Returns -1 on error.
+ * Find a pending resolve for the same question.
  */
-int dns_resolve_response (struct dns *dns, struct dns_resolve **resolvep)
+static struct dns_resolve * dns_resolve_pending (struct dns *dns, const struct dns_question *question, unsigned hash)
 {
-    struct dns_packet packet;
-    struct dns_header header;
-    int err;
+    struct dns_resolve *resolve;
 
-    // timeout based on query sent still waiting for a response, which should be the most timeouty resolve, given fixed timeouts
-    struct dns_resolve *resolve = TAILQ_FIRST(&dns->resolves);
-    struct timeval timeout;
+    TAILQ_FOREACH(resolve, &dns->resolves, dns_resolves) {
+        if (resolve->question_hash == hash && resolve->question.qtype == question->qtype && resolve->question.qclass == question->qclass && !strcasecmp(resolve->question.qname, question->qname))
+            return resolve;
+    }
 
-    if ((err = timeout_from_timestamp(&timeout, &resolve->timeout)) < 0) {
-        log_error("timeout_from_timestamp");
-        return -1;
+    return NULL;
+}
 
-    } else if (err) {
-        // we presumeably have multiple resolves timeouting ~simultaneously
-        // keep err set for the skip-dns_response() below!
-        log_warning("%s[%d] timeout", resolve->name, resolve->id);
+/*
+ * Wait for the response to a pending resolve, instead of sending our own query.
+ */
+static void dns_resolve_follow (struct dns_resolve *resolve, struct dns_resolve *leader)
+{
+    log_debug("%s[%u] sharing pending query", resolve->name, leader->id);
+
+    resolve->id = leader->id;
+    resolve->leader = leader;
+
+    TAILQ_INSERT_TAIL(&leader->followers, resolve, dns_followers);
+}
+
+/*
+ * Wake up the task waiting in dns_resolve_sync(), if any.
+ */
+static void dns_resolve_notify (struct dns_resolve *resolve)
+{
+    if (!resolve->wait) {
+        log_debug("%s[%u] response for non-waiting resolve", resolve->name, resolve->id);
+
+    } else if (event_notify(dns_event(resolve->dns), &resolve->wait)) {
+        log_error("event_notify");
     }
+}
 
-    // do not dns_response if we already have err set from timeout-in-past above
-    // TODO: optimize common case of there only being one dns_resolve pending to recv directly into resolve->packet
-    if (!err && (err = dns_response(dns, &packet, &header, &timeout)) < 0) {
-        log_error("dns_response");
-        return -1;
+/*
+ * Complete a pending resolve with a response >0 or timeout <0, copying it to each of its followers, and waking up the
+ * waiting tasks.
+ *
+ * The notified tasks may dns_close() their resolves, including the given one, which must not be used afterwards.
+ */
+static void dns_resolve_complete (struct dns_resolve *leader, int response)
+{
+    struct dns_resolve *follower;
 
-    } else if (err && resolve->retry < DNS_RESOLVE_RETRY) {
-        // schedule for retry
-        if (dns_resolve_retry(resolve)) {
-            log_warning("%s[%d] retry failure", resolve->name, resolve->id);
-            return -1;
-        }
+    dns_resolve_unregister(leader->dns, leader);
 
-        log_warning("%s[%d] retry %d", resolve->name, resolve->id, resolve->retry);
+    leader->response = response;
 
-        // retry..
-        return 1;
+    // detach each follower before notifying, as it may dns_close() itself
+    while ((follower = TAILQ_FIRST(&leader->followers))) {
+        TAILQ_REMOVE(&leader->followers, follower, dns_followers);
 
-    } else if (err) {
-        log_warning("%s[%d] retry exceeded", resolve->name, resolve->id);
+        follower->leader = NULL;
 
-        // mark as timed out
-        resolve->response = -1;
+        if (response > 0) {
+            size_t size = leader->packet->end - leader->packet->buf;
 
-        TAILQ_REMOVE(&dns->resolves, resolve, dns_resolves);
+            memcpy(follower->packet->buf, leader->packet->buf, size);
 
-        *resolvep = resolve;
+            follower->packet->ptr = follower->packet->buf + (leader->packet->ptr - leader->packet->buf);
+            follower->packet->end = follower->packet->buf + size;
+            follower->response_header = leader->response_header;
+            follower->upstream = leader->upstream;
+        }
 
-        return 0;
+        follower->response = response;
+
+        dns_resolve_notify(follower);
     }
 
-    TAILQ_FOREACH(resolve, &dns->resolves, dns_resolves) {
-        if (resolve->id == header.id)
+    dns_resolve_notify(leader);
+}
+
+/*
+ * Send any queued retransmits to each upstream.
+ */
+static void dns_resolve_flush (struct dns *dns)
+{
+    for (unsigned i = 0; i < dns->upstream_count; i++) {
+        if (dns_flush(&dns->upstreams[i]))
+            log_warning("%s: dns_flush", dns->upstreams[i].name);
+    }
+}
+
+/*
+ * Retransmit or time out each expired query, sending the retransmits to each upstream in batches.
+ *
+ * Returns 0 with the timeout until the earliest pending query, 1 if none remain pending, <0 on error.
+ */
+static int dns_resolve_expire (struct dns *dns, struct timeval *timeout)
+{
+    struct dns_resolve *resolve;
+    int err;
+
+    while (dns->timers_count) {
+        resolve = dns->timers[0];
+
+        if (!(err = timeout_between(timeout, event_main_clock(dns->event_main), &resolve->timeout))) {
             break;
+
+        } else if (resolve->retry < DNS_RESOLVE_RETRY) {
+            log_warning("%s[%u] %s timeout", resolve->name, resolve->id, resolve->upstream->name);
+
+            if (dns_resolve_retry(resolve)) {
+                log_warning("%s[%u] retry failure", resolve->name, resolve->id);
+
+                dns->stats.timeouts++;
+
+                dns_resolve_flush(dns);
+                dns_resolve_complete(resolve, -1);
+
+            } else {
+                log_warning("%s[%u] retry %d: %s", resolve->name, resolve->id, resolve->retry, resolve->upstream->name);
+            }
+
+        } else {
+            log_warning("%s[%u] retry exceeded", resolve->name, resolve->id);
+
+            resolve->upstream->failures++;
+            dns->stats.timeouts++;
+
+            // the queued packets must be sent before any notified task may close their resolves
+            dns_resolve_flush(dns);
+            dns_resolve_complete(resolve, -1);
+        }
     }
 
-    if (!resolve) {
-        log_warning("unmatched response: %u", header.id);
-        return 1;
+    dns_resolve_flush(dns);
+
+    return dns->timers_count ? 0 : 1;
+}
+
+/*
+ * Dispatch a received response to the matching pending resolve, taking the packet and replacing it with a spare.
+ */
+static void dns_resolve_dispatch (struct dns_upstream *upstream, struct dns_packet **packetp, const struct dns_header *header)
+{
+    struct dns *dns = upstream->dns;
+    struct dns_resolve *resolve;
+    struct dns_packet *packet;
+    struct timeval now;
+    unsigned index = upstream - dns->upstreams;
+
+    if (!header->qr || !(resolve = dns->table[header->id & (dns->table_size - 1)]) || resolve->id != header->id) {
+        log_warning("%s: unmatched response: %u", upstream->name, header->id);
+        return;
     }
 
-    // copy in response
-    size_t size = packet.end - packet.buf;
-    memcpy(resolve->packet.buf, packet.buf, size);
-    resolve->packet.end = resolve->packet.buf + size;
+    if (!(resolve->upstreams & (1u << index))) {
+        log_warning("%s: unexpected response: %u", upstream->name, header->id);
+        return;
+    }
 
-    // the header has already been read
-    resolve->response_header = header;
-    resolve->packet.ptr = resolve->packet.buf + (packet.ptr - packet.buf);
+    // the RTT is ambiguous if the query was retransmitted to the same upstream, per Karn's algorithm
+    if (!(resolve->retransmits & (1u << index))) {
+        timersub(event_main_clock(dns->event_main), &resolve->sent[index], &now);
 
-    // mark as responded
-    resolve->response = 1;
+        dns_upstream_sample(upstream, now.tv_sec * 1000000 + now.tv_usec);
+    }
 
-    TAILQ_REMOVE(&dns->resolves, resolve, dns_resolves);
+    upstream->failures = 0;
 
-    *resolvep = resolve;
+    // answered by this upstream, for any TCP retry
+    resolve->upstream = upstream;
 
-    return 0;
+    // take the received packet, with the header already read, and keep the old query packet for the next response
+    packet = resolve->packet;
+    resolve->packet = *packetp;
+    *packetp = packet;
+
+    resolve->response_header = *header;
+
+    dns_resolve_complete(resolve, 1);
 }
 
 /*
- * Synchronize pending resolves, multiplexing tasks across the dns state.
+ * Receive and dispatch any available responses from the upstream, or handle the expired timeouts.
  *
- * The resolve should be dns_resolve_query()'d upon call, and will be dns_resolve_response()'d upon return.
+ * Returns <0 on error, 0 otherwise.
  */
-int dns_resolve_sync (struct dns_resolve *resolve)
+static int dns_receive (struct dns_upstream *upstream)
 {
-    struct event *event = dns_event(resolve->dns);
-    struct dns_resolve *next;
+    struct dns *dns = upstream->dns;
+    struct dns_header headers[DNS_UPSTREAM_BATCH];
+    struct timeval timeout;
+    unsigned count = DNS_UPSTREAM_BATCH;
     int err;
 
-    /*
-     * This uses very scary event_wait/notify() magic amongst all tasks waiting on this one event, which leads to
-     * all kinds of interesting (as in "May you live in interesting times") behaviour.
-     *
-     * event_wait() is based on the use of the event_switch() stack, i.e. tasks call into eachother in a linear
-     * hierarchy. event_main() will event_switch() into a task, which may event_start() another task, or event_notify()
-     * into another task, and so on. Once a task calls event_yield(), or event_wait(), it will rewind the task stack,
-     * eventually ending up back in event_main().
-     *
-     * However, this falls apart completely if a set of tasks uses event_notify() to freely switch
-     * between eachother, i.e. causing a loop in the task stack. Task A that has notify()'d task B may not itself be
-     * notify()'d by B (or C).
-     *
-     * Happily, though, once task A calls event_notify(B), it will still be sitting within event_notify() at the point
-     * where B might want to event_notify(A), and thus as long as we ensure that A->wait is not set when it calls
-     * event_notify(), we should be reasonably safe...
-     *
-     * The other issue, though, is that a task that is yield()'ing on an event has a strict responsibility to notify()
-     * any other tasks wait()'ing on that event - if it doesn't, those tasks will all die. Thus:
-     *
-     *  *   if we recv() a response for a different task that has previously wait()'ing, we will notify() it, and it will
-     *      eventually return back, whereupon our response may have been recv()'d by some notify()'d task, or we will
-     *      yield() if the notify()'d tasks have all finished, or we will wait() for the next main() iteration if some
-     *      notify()'d task has yield()'d.
-     *
-     *  *   if we recv() a response to our own resolv and we return it, our task might either perform another resolv(),
-     *      whereupon we will again yield() on the event, and any tasks that notify()'d us will wait(). If our response
-     *      was the final resolv for our task, and it goes off to do something else, then other tasks will be able to
-     *      continue if they have notify()'d us. However, if we were event_yield()'ing directly from main(), then we
-     *      must be careful to keep any other tasks that have wait()'d on us in some previous event_main() iteration
-     *      alive by giving them a "fake" notify() to get them to yield() instead.
-     */
-    while (!resolve->response) {
-        if (!event || !event_pending(event)) {
-            // there is no task yielding on the event already, so we are free to go ahead and yield on it.
-            if (event) {
-                log_debug("%s[%u] recv/yield on event[%p]...", resolve->name, resolve->id, event);
-            } else {
-                log_debug("%s[%u] recv without event...", resolve->name, resolve->id);
-            }
+    for (unsigned i = 0; i < DNS_UPSTREAM_BATCH; i++) {
+        if (!upstream->spares[i] && !(upstream->spares[i] = dns_packet_alloc()))
+            return -1;
+    }
 
-            // recv()/yield() a response
-            if ((err = dns_resolve_response(resolve->dns, &next)) < 0) {
-                log_error("%s[%u] dns_resolve_response", resolve->name, resolve->id);
-                return -1;
+    if ((err = dns_resolve_expire(dns, &timeout)))
+        return err < 0 ? err : 0;
 
-            } else if (err) {
-                log_debug("%s[%u] retry..", resolve->name, resolve->id);
-                continue;
-            }
+    if (timercmp(&timeout, &dns_resolve_poll, >))
+        timeout = dns_resolve_poll;
 
-            // the response that we get may not necessarily be our own
-            if (next == resolve) {
-                log_debug("%s[%u] immediate response", resolve->name, resolve->id);
-                break;
-            }
+    if ((err = dns_response(upstream, upstream->spares, headers, &count, &timeout)) < 0) {
+        log_error("dns_response");
+        return -1;
 
-            if (!event) {
-                // XXX: just buffer the resolv somewhere... currently dns_resolve_response() dequeues it, though..
-                log_fatal("dns_resolve_sync called with multiple pending queries in non-task mode; unable to operate");
-                return -1;
-            }
+    } else if (err) {
+        // timeout
+        return 0;
+    }
 
-            // dispatch and redo
-            if (!next->wait) {
-                log_debug("%s[%u] response for non-waiting resolv %s[%u], assuming it has notify()'d us", resolve->name, resolve->id, next->name, next->id);
-                continue;
-            }
+    for (unsigned i = 0; i < count; i++) {
+        dns_resolve_dispatch(upstream, &upstream->spares[i], &headers[i]);
+    }
 
-            log_debug("%s[%u] dispatching response to %s[%u]", resolve->name, resolve->id, next->name, next->id);
-            if ((err = event_notify(event, &next->wait))) {
-                log_error("event_notify");
-                continue;
-            }
+    return 0;
+}
 
-        } else {
-            // wait for some other task to recv our response...
-            log_debug("%s[%u] waiting on event[%p] for response...", resolve->name, resolve->id, event);
+/*
+ * Task receiving responses from one upstream for all pending resolves, and waking up the matching tasks.
+ *
+ * Runs until there are no pending resolves, and the final receiver performs any dns_destroy() deferred in the meantime.
+ */
+static void dns_receiver (void *ctx)
+{
+    struct dns_upstream *upstream = ctx;
+    struct dns *dns = upstream->dns;
 
-            // TODO: timeout support, in case the task servicing the event somehow e.g. dies with `return -1`?
-            if (event_wait(event, &resolve->wait)) {
-                log_error("event_wait");
-                return -1;
-            }
+    log_debug("%s: start", upstream->name);
 
-            if (resolve->response)
-                log_debug("%s[%u] got response from wait()", resolve->name, resolve->id);
-            else
-                log_debug("%s[%u] got notify()'d without a response, assuming some yield()'ing task is asking us to yield()", resolve->name, resolve->id);
+    while (dns->pending) {
+        if (dns_receive(upstream) < 0) {
+            // fail all pending resolves, including any new ones started by the notified tasks
+            while (dns->pending)
+                dns_resolve_complete(dns->timers[0], -1);
         }
     }
 
-    // in case we were yielding on an event, and other tasks waited on it, and we got our final response and never yield
-    // on it again, we must poke another waiting task at this point in order to keep the queue alive.
-    next = TAILQ_FIRST(&resolve->dns->resolves);
+    log_debug("%s: stop", upstream->name);
 
-    if (!next) {
-        log_debug("no resolves left");
-    } else if (!next->wait) {
-        log_debug("%s[%u] is not waiting, we assume they have notify()'d us previously", next->name, next->id);
-    } else {
-        // go ahead and notify them...
-        log_debug("%s[%u] is poking %s[%u] to keep resolvers alive", resolve->name, resolve->id, next->name, next->id);
-        if ((err = event_notify(event, &next->wait))) {
-            log_error("event_notify");
+    upstream->receiver = false;
+
+    if (!--dns->receivers && dns->destroy)
+        dns_destroy(dns);
+}
+
+/*
+ * Wait for the response to a resolve, either by the receiver tasks for the dns, or receiving directly if not running
+ * with tasks, from the upstream of the earliest pending query.
+ *
+ * The resolve should be dns_resolve_query()'d or following a pending resolve upon call.
+ *
+ * Returns 1 on timeout, <0 on error.
+ */
+int dns_resolve_sync (struct dns_resolve *resolve)
+{
+    struct dns *dns = resolve->dns;
+    int err;
+
+    while (!resolve->response) {
+        if (dns->receivers) {
+            log_debug("%s[%u] waiting for response...", resolve->name, resolve->id);
+
+            if (event_wait(dns_event(dns), &resolve->wait)) {
+                log_error("event_wait");
+                return -1;
+            }
+
+        } else if ((err = dns_receive(dns->timers[0]->upstream)) < 0) {
+            log_error("%s[%u] dns_receive", resolve->name, resolve->id);
+            return -1;
         }
     }
 
@@ -424,7 +833,221 @@ int dns_resolve_sync (struct dns_resolve *resolve)
     }
 }
 
-int dns_resolve (struct dns *dns, struct dns_resolve **resolvep, const char *name, enum dns_type type)
+/*
+ * Take an idle TCP connection to the upstream, or connect a new one.
+ *
+ * Returns 1 for an idle connection, which the upstream may have since closed, <0 on error.
+ */
+static int dns_upstream_tcp (struct dns_upstream *upstream, struct tcp **tcpp)
+{
+    if (upstream->tcp_count) {
+        *tcpp = upstream->tcp[--upstream->tcp_count];
+
+        return 1;
+    }
+
+    if (tcp_client(upstream->dns->event_main, tcpp, upstream->name, upstream->service)) {
+        log_warning("%s: tcp_client", upstream->name);
+        return -1;
+    }
+
+    tcp_read_timeout(*tcpp, &dns_resolve_tcp_timeout);
+    tcp_write_timeout(*tcpp, &dns_resolve_tcp_timeout);
+
+    return 0;
+}
+
+/*
+ * Keep a TCP connection to the upstream idle for re-use.
+ */
+static void dns_upstream_tcp_idle (struct dns_upstream *upstream, struct tcp *tcp)
+{
+    if (upstream->tcp_count < DNS_UPSTREAM_TCP) {
+        upstream->tcp[upstream->tcp_count++] = tcp;
+    } else {
+        tcp_destroy(tcp);
+    }
+}
+
+/*
+ * Send the query in the packet over TCP, and read the response into the packet, unpacking the header.
+ *
+ * Returns 1 on EOF or timeout, <0 on error.
+ */
+static int dns_resolve_tcp_query (struct tcp *tcp, struct dns_packet *packet, struct dns_header *header)
+{
+    struct stream *read = tcp_read_stream(tcp), *write = tcp_write_stream(tcp);
+    uint16_t len = htons(packet->ptr - packet->buf);
+    uint16_t id = ntohs(*(uint16_t *) packet->buf);
+    struct iovec iov[] = {
+        { &len,         sizeof(len) },
+        { packet->buf,  packet->ptr - packet->buf },
+    };
+    char *buf;
+    size_t size;
+    int err;
+
+    // two-byte length prefix, per RFC 1035 4.2.2
+    if ((err = stream_writev(write, iov, 2)) || (err = stream_flush(write))) {
+        log_warning("stream_write");
+        return err;
+    }
+
+    size = sizeof(len);
+
+    if ((err = stream_read(read, &buf, &size))) {
+        return err;
+    } else if (size < sizeof(len)) {
+        return 1;
+    }
+
+    memcpy(&len, buf, sizeof(len));
+
+    if ((size = ntohs(len)) > sizeof(packet->buf)) {
+        log_warning("response too large: %zu", size);
+        return -1;
+    }
+
+    if ((err = stream_read(read, &buf, &size)) < 0) {
+        return err;
+    } else if (err || size < ntohs(len)) {
+        return 1;
+    }
+
+    memcpy(packet->buf, buf, size);
+
+    packet->ptr = packet->buf;
+    packet->end = packet->buf + size;
+
+    if ((err = dns_unpack_header(packet, header))) {
+        log_warning("dns_unpack_header");
+        return -1;
+    }
+
+    if (!header->qr || header->id != id) {
+        log_warning("mismatched response: %u", header->id);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Retry a truncated response over TCP to the upstream that answered it, replacing the response on success.
+ *
+ * Returns 1 if the response remains truncated, <0 on error.
+ */
+static int dns_resolve_tcp (struct dns_resolve *resolve)
+{
+    struct dns *dns = resolve->dns;
+    struct dns_upstream *upstream = resolve->upstream;
+    struct dns_header query_header = resolve->query_header, header;
+    struct dns_packet *packet;
+    struct tcp *tcp;
+    int err, idle;
+
+    log_info("%s[%u] truncated, retry over TCP: %s", resolve->name, resolve->id, upstream->name);
+
+    if (!(packet = dns_packet_alloc()))
+        return -1;
+
+    // re-pack the single question, as a new query
+    query_header.id = dns->ids++;
+
+    if (dns_pack_header(packet, &query_header) || dns_pack_question(packet, &resolve->question) || (query_header.arcount && dns_pack_opt(packet, dns->edns))) {
+        log_warning("query overflow");
+        err = -1;
+        goto error;
+    }
+
+    // a re-used connection may have been closed by the upstream, in which case retry once on a new one
+    while ((idle = dns_upstream_tcp(upstream, &tcp)) >= 0) {
+        if (!(err = dns_resolve_tcp_query(tcp, packet, &header)))
+            break;
+
+        tcp_destroy(tcp);
+
+        if (!idle)
+            goto error;
+
+        // the packet still holds the query
+    }
+
+    if (idle < 0) {
+        err = -1;
+        goto error;
+    }
+
+    dns_upstream_tcp_idle(upstream, tcp);
+
+    if (header.tc) {
+        log_warning("%s[%u] truncated over TCP", resolve->name, resolve->id);
+        err = 1;
+        goto error;
+    }
+
+    // replace the truncated response
+    dns_packet_free(resolve->packet);
+
+    resolve->packet = packet;
+    resolve->response_header = header;
+
+    return 0;
+
+error:
+    dns_packet_free(packet);
+
+    return err;
+}
+
+/*
+ * Monotonic time in seconds, for cache TTLs.
+ */
+static time_t dns_resolve_now (struct dns *dns)
+{
+    return event_main_clock(dns->event_main)->tv_sec;
+}
+
+/*
+ * Answer a single-question query from the cache.
+ *
+ * Returns 1 if not cached.
+ */
+static int dns_resolve_cached (struct dns_resolve *resolve)
+{
+    struct dns_header header;
+    char *ptr = resolve->packet->ptr;
+    int err;
+
+    // the question as it will be sent, with the name normalized by packing
+    resolve->packet->ptr = resolve->packet->buf;
+
+    err = dns_unpack_header(resolve->packet, &header) || dns_unpack_question(resolve->packet, &resolve->question);
+
+    resolve->packet->ptr = ptr;
+
+    if (err) {
+        log_error("dns_unpack_question");
+        return -1;
+    }
+
+    resolve->question_hash = dns_question_hash(&resolve->question);
+
+    if ((err = dns_cache_lookup(resolve->dns->cache, &resolve->question, resolve->dns->ids++, resolve->packet, &resolve->response_header, dns_resolve_now(resolve->dns))))
+        return err;
+
+    log_debug("%s: cached %s", resolve->name, dns_rcode_str(resolve->response_header.rcode));
+
+    resolve->dns->stats.cached++;
+
+    resolve->id = resolve->response_header.id;
+    resolve->response = 1;
+    resolve->cached = true;
+
+    return 0;
+}
+
+int dns_resolve_start (struct dns *dns, struct dns_resolve **resolvep, const char *name, enum dns_type type)
 {
     struct dns_resolve *resolve;
     int err;
@@ -439,35 +1062,99 @@ int dns_resolve (struct dns *dns, struct dns_resolve **resolvep, const char *nam
     if ((err = dns_query_question(resolve, name, type)))
         goto err;
 
-    if ((err = dns_resolve_query(resolve)))
+    if ((err = dns_resolve_cached(resolve)) < 0) {
         goto err;
 
+    } else if (!err) {
+        *resolvep = resolve;
+
+        return 0;
+    }
+
+    // share any identical query that is already pending, otherwise send our own
+    struct dns_resolve *leader;
+
+    if ((leader = dns_resolve_pending(dns, &resolve->question, resolve->question_hash))) {
+        dns_resolve_follow(resolve, leader);
+
+        resolve->shared = true;
+
+    } else if ((err = dns_resolve_query(resolve))) {
+        goto err;
+    }
+
+    *resolvep = resolve;
+
+    return 0;
+
+err:
+    dns_close(resolve);
+
+    return err;
+}
+
+int dns_resolve_wait (struct dns_resolve *resolve)
+{
+    struct dns *dns = resolve->dns;
+    int err;
+
+    if (resolve->cached) {
+        resolve->name = NULL;
+
+        return resolve->response_header.rcode;
+    }
+
     // schedule across multiple resolves
     if ((err = dns_resolve_sync(resolve)) < 0) {
         log_error("dns_resolve_sync");
-        goto err;
+        return err;
 
     } else if (err) {
         log_error("dns_resolve_sync: timeout");
         // TODO: better format for error return codes, to support timeouts...
-        err = -2;
-        goto err;
+        return -2;
+    }
+
+    // not cached, as it may have omitted records
+    if (resolve->response_header.tc && resolve->upstream && dns_resolve_tcp(resolve) < 0) {
+        log_warning("%s: dns_resolve_tcp", resolve->name);
+    }
+
+    // a shared response was already cached by the leader
+    if (!resolve->shared && dns_cache_insert(dns->cache, &resolve->question, resolve->packet, dns_resolve_now(dns)) < 0) {
+        log_warning("dns_cache_insert");
     }
 
     // invalidate
     resolve->name = NULL;
 
-    // ok
-    *resolvep = resolve;
-
     return resolve->response_header.rcode;
+}
 
-err:
-    free(resolve);
+int dns_resolve (struct dns *dns, struct dns_resolve **resolvep, const char *name, enum dns_type type)
+{
+    struct dns_resolve *resolve;
+    int err;
+
+    if ((err = dns_resolve_start(dns, &resolve, name, type)))
+        return err;
+
+    if ((err = dns_resolve_wait(resolve)) < 0) {
+        dns_close(resolve);
+        return err;
+    }
+
+    // ok
+    *resolvep = resolve;
 
     return err;
 }
 
+int dns_resolve_lookup (struct dns *dns, const struct dns_question *question, uint16_t id, struct dns_packet *packet, struct dns_header *header)
+{
+    return dns_cache_lookup(dns->cache, question, id, packet, header, dns_resolve_now(dns));
+}
+
 int dns_resolve_multi (struct dns *dns, struct dns_resolve **resolvep, const char *name, enum dns_type *types)
 {
     struct dns_resolve *resolve;
@@ -501,11 +1188,16 @@ int dns_resolve_multi (struct dns *dns, struct dns_resolve **resolvep, const cha
     return resolve->response_header.rcode;
 
 err:
-    free(resolve);
+    dns_close(resolve);
 
     return err;
 }
 
+const struct dns_packet * dns_resolve_packet (struct dns_resolve *resolve)
+{
+    return resolve->packet;
+}
+
 int dns_resolve_header (struct dns_resolve *resolve, struct dns_header *header)
 {
     *header = resolve->response_header;
@@ -521,7 +1213,7 @@ int dns_resolve_question (struct dns_resolve *resolve, struct dns_question *ques
         return 1;
 
     // question
-    if ((err = dns_unpack_question(&resolve->packet, question))) {
+    if ((err = dns_unpack_question(resolve->packet, question))) {
         log_warning("dns_unpack_question: %d", resolve->response_questions);
         return err;
     }
@@ -565,7 +1257,7 @@ int dns_resolve_record (struct dns_resolve *resolve, enum dns_section *sectionp,
         *sectionp = section;
 
     // record
-    if ((err = dns_unpack_record(&resolve->packet, rr))) {
+    if ((err = dns_unpack_record(resolve->packet, rr))) {
         log_warning("dns_unpack_resource: %d", resolve->response_records);
         return -1;
     }
@@ -580,7 +1272,7 @@ int dns_resolve_record (struct dns_resolve *resolve, enum dns_section *sectionp,
 
     // decode
     if (rdata) {
-        if ((err = dns_unpack_rdata(&resolve->packet, rr, rdata))) {
+        if ((err = dns_unpack_rdata(resolve->packet, rr, rdata))) {
             log_warning("dns_unpack_rdata: %d", resolve->response_records);
             return -1;
         }
@@ -593,10 +1285,61 @@ int dns_resolve_record (struct dns_resolve *resolve, enum dns_section *sectionp,
 
 void dns_close (struct dns_resolve *resolve)
 {
-    if (resolve->query && !resolve->response) {
+    struct dns *dns = resolve->dns;
+    struct dns_resolve *next, *follower;
+
+    if (resolve->leader) {
+        TAILQ_REMOVE(&resolve->leader->followers, resolve, dns_followers);
+    }
+
+    if (resolve->query && !resolve->response && (next = TAILQ_FIRST(&resolve->followers))) {
+        // hand over the pending query to the first follower, which packed the same question
+        log_debug("%s[%u] hand over pending query", resolve->name, resolve->id);
+
+        TAILQ_REMOVE(&resolve->followers, next, dns_followers);
+
+        next->leader = NULL;
+        next->query_header = resolve->query_header;
+        next->query = true;
+        next->upstream = resolve->upstream;
+        next->timeout = resolve->timeout;
+        next->upstreams = resolve->upstreams;
+        next->retransmits = resolve->retransmits;
+        next->tried = resolve->tried;
+        next->retry = resolve->retry;
+
+        memcpy(next->sent, resolve->sent, sizeof(next->sent));
+
+        // the packed query header includes the OPT record
+        if (next->query_header.arcount && dns_pack_opt(next->packet, dns->edns)) {
+            log_warning("query overflow: OPT");
+        }
+
+        // mark the end of the packed query for dns_resolve_retry(), as dns_query() would
+        next->packet->end = next->packet->ptr;
+
+        while ((follower = TAILQ_FIRST(&resolve->followers))) {
+            TAILQ_REMOVE(&resolve->followers, follower, dns_followers);
+            TAILQ_INSERT_TAIL(&next->followers, follower, dns_followers);
+
+            follower->leader = next;
+        }
+
+        // take over the id and timeout, at the same position
+        dns->table[resolve->id & (dns->table_size - 1)] = next;
+        dns_timer_place(dns, resolve->timer - 1, next);
+
+        TAILQ_INSERT_BEFORE(resolve, next, dns_resolves);
+        TAILQ_REMOVE(&dns->resolves, resolve, dns_resolves);
+
+    } else if (resolve->query && !resolve->response) {
         log_warning("%s[%u] abort pending query", resolve->name, resolve->id);
-        TAILQ_REMOVE(&resolve->dns->resolves, resolve, dns_resolves);
+
+        dns_resolve_unregister(dns, resolve);
     }
 
+    if (resolve->packet)
+        dns_packet_free(resolve->packet);
+
     free(resolve);
 }
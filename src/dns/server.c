@@ -0,0 +1,757 @@
+#include "dns/server.h"
+#include "dns/dns.h"
+
+#include "common/log.h"
+#include "common/pool.h"
+#include "common/stream.h"
+#include "common/tcp.h"
+#include "common/udp.h"
+
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+/* Number of UDP queries received at once, with the responses answered locally sent at once */
+#define DNS_SERVER_BATCH 16
+
+/* Maximum UDP response size without EDNS0, per RFC 1035 */
+#define DNS_SERVER_UDP_SIZE 512
+
+struct dns_server {
+    struct event_main *event_main;
+
+    // forwarding resolver and cache
+    struct dns *dns;
+
+    // local records, or NULL
+    struct dns_zone *zone;
+
+    // statistics
+    unsigned queries, local, cached, forwarded, truncated, errors;
+};
+
+struct dns_server_udp {
+    struct dns_server *server;
+    struct udp *udp;
+};
+
+struct dns_server_tcp {
+    struct dns_server *server;
+    struct tcp_server *tcp;
+};
+
+/*
+ * One query being answered, with the response packed into the same packet.
+ */
+struct dns_server_query {
+    struct dns_server *server;
+    struct dns_packet *packet;
+
+    struct dns_header header;
+    struct dns_question question;
+    bool has_question;
+
+    // query included an EDNS0 OPT record
+    bool edns;
+
+    // maximum response size
+    size_t size;
+
+    // UDP listener and client address, for forwarded queries
+    struct dns_server_udp *udp;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+
+    // TCP client
+    struct tcp *tcp;
+};
+
+static struct pool dns_server_query_pool = POOL_INIT("dns_server_query", sizeof(struct dns_server_query));
+
+/* Idle TCP clients are disconnected after this */
+static const struct timeval dns_server_tcp_timeout = { .tv_sec = 10 };
+
+int dns_server_create (struct event_main *event_main, struct dns_server **serverp, struct dns *dns)
+{
+    struct dns_server *server;
+
+    if (!(server = calloc(1, sizeof(*server)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    server->event_main = event_main;
+    server->dns = dns;
+
+    *serverp = server;
+
+    return 0;
+}
+
+int dns_server_load_zone (struct dns_server *server, const char *path)
+{
+    int err;
+
+    if (!server->zone && (err = dns_zone_create(&server->zone)))
+        return err;
+
+    return dns_zone_load(server->zone, path);
+}
+
+static struct dns_server_query * dns_server_query_alloc (struct dns_server *server)
+{
+    struct dns_server_query *query;
+
+    if (!(query = pool_alloc(&dns_server_query_pool))) {
+        log_perror("pool_alloc");
+        return NULL;
+    }
+
+    if (!(query->packet = dns_packet_alloc())) {
+        pool_free(&dns_server_query_pool, query);
+        return NULL;
+    }
+
+    query->server = server;
+    query->udp = NULL;
+    query->tcp = NULL;
+
+    return query;
+}
+
+static void dns_server_query_free (struct dns_server_query *query)
+{
+    dns_packet_free(query->packet);
+    pool_free(&dns_server_query_pool, query);
+}
+
+/*
+ * Unpack the query header, question and any EDNS0 OPT record, raising the response size up to the advertised size.
+ *
+ * Returns a dns_rcode >0 for an error response, or <0 to drop the query without any response.
+ */
+static int dns_server_parse (struct dns_server_query *query, size_t len, size_t size)
+{
+    struct dns_packet *packet = query->packet;
+    struct dns_record rr;
+    unsigned count;
+
+    packet->ptr = packet->buf;
+    packet->end = packet->buf + len;
+
+    query->has_question = false;
+    query->edns = false;
+    query->size = size;
+
+    if (dns_unpack_header(packet, &query->header)) {
+        log_debug("short query: %zu", len);
+        return -1;
+    }
+
+    // never answer responses
+    if (query->header.qr)
+        return -1;
+
+    if (query->header.opcode != DNS_QUERY)
+        return DNS_NOTIMPL;
+
+    if (query->header.qdcount != 1)
+        return DNS_FMTERROR;
+
+    if (dns_unpack_question(packet, &query->question))
+        return DNS_FMTERROR;
+
+    query->has_question = true;
+
+    count = query->header.ancount + query->header.nscount + query->header.arcount;
+
+    for (unsigned i = 0; i < count; i++) {
+        if (dns_unpack_record(packet, &rr))
+            return DNS_FMTERROR;
+
+        // the class is the UDP payload size
+        if (rr.type == DNS_OPT) {
+            query->edns = true;
+
+            if (rr.class > query->size)
+                query->size = rr.class < DNS_PACKET ? rr.class : DNS_PACKET;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Pack a response without any records.
+ */
+static int dns_server_error (struct dns_server_query *query, enum dns_rcode rcode, bool tc)
+{
+    struct dns_packet *packet = query->packet;
+    struct dns_header header = {
+        .id         = query->header.id,
+        .qr         = 1,
+        .opcode     = query->header.opcode,
+        .tc         = tc,
+        .rd         = query->header.rd,
+        .ra         = 1,
+        .rcode      = rcode,
+        .qdcount    = query->has_question ? 1 : 0,
+        .arcount    = query->edns ? 1 : 0,
+    };
+
+    packet->ptr = packet->buf;
+    packet->end = packet->buf + sizeof(packet->buf);
+
+    if (
+            dns_pack_header(packet, &header)
+        ||  (query->has_question && dns_pack_question(packet, &query->question))
+        ||  (query->edns && dns_pack_opt(packet, DNS_EDNS_SIZE))
+    ) {
+        log_warning("response overflow");
+        return -1;
+    }
+
+    packet->end = packet->ptr;
+
+    if (rcode)
+        query->server->errors++;
+
+    return 0;
+}
+
+/*
+ * Pack a response from the zone.
+ *
+ * Returns 1 if the name is not in the zone.
+ */
+static int dns_server_zone (struct dns_server_query *query)
+{
+    struct dns_packet *packet = query->packet;
+    struct dns_header header = {
+        .id         = query->header.id,
+        .qr         = 1,
+        .opcode     = query->header.opcode,
+        .aa         = 1,
+        .rd         = query->header.rd,
+        .ra         = 1,
+        .rcode      = DNS_NOERROR,
+        .qdcount    = 1,
+        .arcount    = query->edns ? 1 : 0,
+    };
+    char *end;
+    unsigned count;
+    int err;
+
+    packet->ptr = packet->buf;
+    packet->end = packet->buf + sizeof(packet->buf);
+
+    // the header is re-packed once the answers are counted
+    if (dns_pack_header(packet, &header) || dns_pack_question(packet, &query->question)) {
+        log_warning("response overflow");
+        return -1;
+    }
+
+    if ((err = dns_zone_answer(query->server->zone, &query->question, packet, &count)))
+        return err;
+
+    if (query->edns && dns_pack_opt(packet, DNS_EDNS_SIZE)) {
+        log_warning("response overflow");
+        return -1;
+    }
+
+    end = packet->ptr;
+    header.ancount = count;
+
+    packet->ptr = packet->buf;
+
+    if (dns_pack_header(packet, &header))
+        return -1;
+
+    packet->end = end;
+
+    return 0;
+}
+
+/*
+ * Drop a trailing OPT record from the response, for queries without EDNS0 per RFC 6891.
+ */
+static int dns_server_strip_opt (struct dns_packet *packet, struct dns_header *header)
+{
+    struct dns_question question;
+    struct dns_record rr;
+    unsigned count = header->ancount + header->nscount + header->arcount;
+    char *start;
+
+    for (unsigned i = 0; i < header->qdcount; i++) {
+        if (dns_unpack_question(packet, &question))
+            return -1;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        start = packet->ptr;
+
+        if (dns_unpack_record(packet, &rr))
+            return -1;
+
+        if (rr.type == DNS_OPT && i == count - 1) {
+            packet->end = start;
+            header->arcount--;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Adapt a cached or forwarded response in the packet for the query, with the query id, flags and question name.
+ */
+static int dns_server_reply (struct dns_server_query *query)
+{
+    struct dns_packet *packet = query->packet;
+    struct dns_header header;
+
+    packet->ptr = packet->buf;
+
+    if (dns_unpack_header(packet, &header)) {
+        log_warning("invalid response");
+        return -1;
+    }
+
+    if (!query->edns && header.arcount && dns_server_strip_opt(packet, &header)) {
+        log_warning("invalid response");
+        return -1;
+    }
+
+    if (packet->end - packet->buf > query->size) {
+        log_debug("truncate %zu > %zu", (size_t) (packet->end - packet->buf), query->size);
+
+        query->server->truncated++;
+
+        return dns_server_error(query, header.rcode, true);
+    }
+
+    header.id = query->header.id;
+    header.rd = query->header.rd;
+
+    packet->ptr = packet->buf;
+
+    if (dns_pack_header(packet, &header))
+        return -1;
+
+    // the same name as queried, but using the query's case, which has the same length
+    if (header.qdcount == 1 && dns_pack_name(packet, query->question.qname))
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Answer the query in the packet from the zone or cache, leaving the response in the packet.
+ *
+ * Returns 1 if the query must be forwarded using dns_server_forward(), <0 to drop the query.
+ */
+static int dns_server_query (struct dns_server_query *query, size_t len, size_t size)
+{
+    struct dns_server *server = query->server;
+    struct dns_header header;
+    int err;
+
+    server->queries++;
+
+    if ((err = dns_server_parse(query, len, size)) < 0) {
+        return err;
+
+    } else if (err) {
+        log_debug("invalid query: %s", dns_rcode_str(err));
+        return dns_server_error(query, err, false);
+    }
+
+    log_debug("[%u] %s %s %s", query->header.id, query->question.qname, dns_class_str(query->question.qclass), dns_type_str(query->question.qtype));
+
+    if (server->zone && (err = dns_server_zone(query)) <= 0) {
+        server->local++;
+        return err;
+    }
+
+    // only single-question IN queries can be forwarded
+    if (query->question.qclass != DNS_IN || query->question.qtype == DNS_QTYPE_AXFR)
+        return dns_server_error(query, DNS_NOTIMPL, false);
+
+    if ((err = dns_resolve_lookup(server->dns, &query->question, query->header.id, query->packet, &header)) < 0) {
+        return err;
+    } else if (err) {
+        return 1;
+    }
+
+    server->cached++;
+
+    return dns_server_reply(query);
+}
+
+/*
+ * Forward the query to the resolver, leaving the response in the packet.
+ */
+static int dns_server_forward (struct dns_server_query *query)
+{
+    struct dns_server *server = query->server;
+    const struct dns_packet *response;
+    struct dns_resolve *resolve;
+    size_t len;
+    int err;
+
+    server->forwarded++;
+
+    if ((err = dns_resolve(server->dns, &resolve, query->question.qname, query->question.qtype)) < 0) {
+        log_warning("dns_resolve %s %s: %d", query->question.qname, dns_type_str(query->question.qtype), err);
+        return dns_server_error(query, DNS_SERVFAIL, false);
+    }
+
+    response = dns_resolve_packet(resolve);
+    len = response->end - response->buf;
+
+    memcpy(query->packet->buf, response->buf, len);
+
+    query->packet->end = query->packet->buf + len;
+
+    dns_close(resolve);
+
+    return dns_server_reply(query);
+}
+
+static void dns_server_udp_forward (void *ctx)
+{
+    struct dns_server_query *query = ctx;
+
+    if (!dns_server_forward(query)) {
+        struct udp_msg msg = {
+            .buf        = query->packet->buf,
+            .size       = query->packet->end - query->packet->buf,
+            .addr       = (struct sockaddr *) &query->addr,
+            .addrlen    = query->addrlen,
+        };
+
+        if (udp_write_batch(query->udp->udp, &msg, 1)) {
+            log_warning("udp_write_batch");
+        }
+    }
+
+    dns_server_query_free(query);
+}
+
+static void dns_server_udp_task (void *ctx)
+{
+    struct dns_server_udp *udp = ctx;
+    struct dns_server *server = udp->server;
+    struct dns_server_query *queries[DNS_SERVER_BATCH] = { };
+    struct udp_msg msgs[DNS_SERVER_BATCH], replies[DNS_SERVER_BATCH];
+    unsigned count, reply_count;
+    int err;
+
+    while (true) {
+        // replace any queries handed off to forwarding tasks
+        for (unsigned i = 0; i < DNS_SERVER_BATCH; i++) {
+            if (!queries[i] && !(queries[i] = dns_server_query_alloc(server)))
+                goto error;
+
+            queries[i]->udp = udp;
+
+            msgs[i] = (struct udp_msg) {
+                .buf        = queries[i]->packet->buf,
+                .size       = sizeof(queries[i]->packet->buf),
+                .addr       = (struct sockaddr *) &queries[i]->addr,
+                .addrlen    = sizeof(queries[i]->addr),
+            };
+        }
+
+        count = DNS_SERVER_BATCH;
+
+        if ((err = udp_read_batch(udp->udp, msgs, &count, NULL))) {
+            log_error("udp_read_batch");
+            goto error;
+        }
+
+        reply_count = 0;
+
+        for (unsigned i = 0; i < count; i++) {
+            struct dns_server_query *query = queries[i];
+
+            query->addrlen = msgs[i].addrlen;
+
+            if ((err = dns_server_query(query, msgs[i].size, DNS_SERVER_UDP_SIZE)) < 0) {
+                continue;
+
+            } else if (err) {
+                // the task owns the query, and sends the response itself
+                queries[i] = NULL;
+
+                if (event_start(server->event_main, dns_server_udp_forward, query)) {
+                    log_warning("event_start");
+                    dns_server_query_free(query);
+                }
+
+                continue;
+            }
+
+            replies[reply_count++] = (struct udp_msg) {
+                .buf        = query->packet->buf,
+                .size       = query->packet->end - query->packet->buf,
+                .addr       = (struct sockaddr *) &query->addr,
+                .addrlen    = query->addrlen,
+            };
+        }
+
+        if (reply_count && udp_write_batch(udp->udp, replies, reply_count)) {
+            log_warning("udp_write_batch: %u", reply_count);
+        }
+    }
+
+error:
+    for (unsigned i = 0; i < DNS_SERVER_BATCH; i++) {
+        if (queries[i])
+            dns_server_query_free(queries[i]);
+    }
+
+    udp_destroy(udp->udp);
+    free(udp);
+}
+
+/*
+ * Answer queries from a TCP client, each with a two-byte length prefix per RFC 1035 4.2.2, until EOF or timeout.
+ */
+static void dns_server_tcp_client (void *ctx)
+{
+    struct dns_server_query *query = ctx;
+    struct stream *read = tcp_read_stream(query->tcp), *write = tcp_write_stream(query->tcp);
+    uint16_t len;
+    char *buf;
+    size_t size;
+    int err;
+
+    while (true) {
+        size = sizeof(len);
+
+        if ((err = stream_read(read, &buf, &size)) || size < sizeof(len))
+            break;
+
+        memcpy(&len, buf, sizeof(len));
+
+        if ((size = ntohs(len)) > sizeof(query->packet->buf)) {
+            log_warning("query too large: %zu", size);
+            break;
+        }
+
+        if ((err = stream_read(read, &buf, &size)) < 0 || size < ntohs(len))
+            break;
+
+        memcpy(query->packet->buf, buf, size);
+
+        if ((err = dns_server_query(query, size, DNS_PACKET)) < 0) {
+            break;
+        } else if (err && dns_server_forward(query)) {
+            break;
+        }
+
+        len = htons(query->packet->end - query->packet->buf);
+
+        struct iovec iov[] = {
+            { &len,                 sizeof(len) },
+            { query->packet->buf,   query->packet->end - query->packet->buf },
+        };
+
+        if ((err = stream_writev(write, iov, 2)) || (err = stream_flush(write))) {
+            log_warning("stream_write");
+            break;
+        }
+    }
+
+    tcp_destroy(query->tcp);
+    dns_server_query_free(query);
+}
+
+static void dns_server_tcp_task (void *ctx)
+{
+    struct dns_server_tcp *tcp = ctx;
+    struct dns_server_query *query;
+    struct tcp *client;
+    int err;
+
+    while (true) {
+        if ((err = tcp_server_accept(tcp->tcp, &client))) {
+            log_error("tcp_server_accept");
+            break;
+        }
+
+        if (!(query = dns_server_query_alloc(tcp->server))) {
+            tcp_destroy(client);
+            continue;
+        }
+
+        query->tcp = client;
+
+        tcp_read_timeout(client, &dns_server_tcp_timeout);
+        tcp_write_timeout(client, &dns_server_tcp_timeout);
+
+        if (event_start(tcp->server->event_main, dns_server_tcp_client, query)) {
+            log_warning("event_start");
+            tcp_destroy(client);
+            dns_server_query_free(query);
+        }
+    }
+
+    tcp_server_destroy(tcp->tcp);
+    free(tcp);
+}
+
+/*
+ * Minimum TTL of the response records in the packet, excluding any OPT record.
+ */
+static int dns_server_ttl (struct dns_packet *packet, uint32_t *ttlp)
+{
+    struct dns_header header;
+    struct dns_question question;
+    struct dns_record rr;
+    uint32_t ttl = 0;
+    bool found = false;
+
+    packet->ptr = packet->buf;
+
+    if (dns_unpack_header(packet, &header))
+        return -1;
+
+    for (unsigned i = 0; i < header.qdcount; i++) {
+        if (dns_unpack_question(packet, &question))
+            return -1;
+    }
+
+    for (unsigned i = 0; i < header.ancount + header.nscount + header.arcount; i++) {
+        if (dns_unpack_record(packet, &rr))
+            return -1;
+
+        if (rr.type == DNS_OPT)
+            continue;
+
+        if (!found || rr.ttl < ttl)
+            ttl = rr.ttl;
+
+        found = true;
+    }
+
+    *ttlp = ttl;
+
+    return 0;
+}
+
+int dns_server_answer (struct dns_server *server, const char *buf, size_t len, char *out, size_t *sizep, uint32_t *ttlp)
+{
+    struct dns_server_query *query;
+    size_t size;
+    int err;
+
+    if (len > DNS_PACKET) {
+        log_warning("query too large: %zu", len);
+        return 1;
+    }
+
+    if (!(query = dns_server_query_alloc(server)))
+        return -1;
+
+    memcpy(query->packet->buf, buf, len);
+
+    if ((err = dns_server_query(query, len, DNS_PACKET)) < 0) {
+        err = 1;
+        goto out;
+    } else if (err && (err = dns_server_forward(query))) {
+        goto out;
+    }
+
+    if ((size = query->packet->end - query->packet->buf) > *sizep) {
+        log_warning("response too large: %zu", size);
+        err = -1;
+        goto out;
+    }
+
+    if ((err = dns_server_ttl(query->packet, ttlp))) {
+        log_warning("invalid response");
+        goto out;
+    }
+
+    memcpy(out, query->packet->buf, size);
+
+    *sizep = size;
+
+out:
+    dns_server_query_free(query);
+
+    return err;
+}
+
+int dns_server_listen (struct dns_server *server, const char *host, const char *port)
+{
+    struct dns_server_udp *udp;
+    struct dns_server_tcp *tcp;
+
+    if (!(udp = calloc(1, sizeof(*udp)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    if (!(tcp = calloc(1, sizeof(*tcp)))) {
+        log_perror("calloc");
+        free(udp);
+        return -1;
+    }
+
+    udp->server = tcp->server = server;
+
+    if (udp_listen(server->event_main, &udp->udp, host, port)) {
+        log_error("udp_listen %s:%s", host ? host : "", port);
+        goto error;
+    }
+
+    if (tcp_server(server->event_main, &tcp->tcp, host, port, 0, 0)) {
+        log_error("tcp_server %s:%s", host ? host : "", port);
+        goto error;
+    }
+
+    if (event_start(server->event_main, dns_server_udp_task, udp)) {
+        log_error("event_start");
+        goto error;
+    }
+
+    // the udp task now owns the udp listener
+    udp = NULL;
+
+    if (event_start(server->event_main, dns_server_tcp_task, tcp)) {
+        log_error("event_start");
+        goto error;
+    }
+
+    return 0;
+
+error:
+    if (udp && udp->udp)
+        udp_destroy(udp->udp);
+
+    if (tcp->tcp)
+        tcp_server_destroy(tcp->tcp);
+
+    free(udp);
+    free(tcp);
+
+    return -1;
+}
+
+void dns_server_destroy (struct dns_server *server)
+{
+    if (server->queries)
+        log_info("queries=%u local=%u cached=%u forwarded=%u truncated=%u errors=%u",
+                server->queries, server->local, server->cached, server->forwarded, server->truncated, server->errors
+        );
+
+    if (server->zone)
+        dns_zone_destroy(server->zone);
+
+    free(server);
+}
@@ -0,0 +1,59 @@
+#ifndef DNS_SERVER_H
+#define DNS_SERVER_H
+
+#include "../dns.h"
+
+#include "common/event.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Default listen service */
+#define DNS_SERVER_SERVICE DNS_SERVICE
+
+/*
+ * DNS server, answering UDP and TCP queries from a static zone, or by forwarding to the resolver, with its cache.
+ */
+struct dns_server;
+
+/*
+ * Create a new server, forwarding queries to the given resolver.
+ */
+int dns_server_create (struct event_main *event_main, struct dns_server **serverp, struct dns *dns);
+
+/*
+ * Answer queries for names in the given zone file locally, see dns_zone_load() for the format.
+ *
+ * Queries for names not in the zone are forwarded as usual.
+ *
+ * Returns 1 on zone file syntax errors, <0 on error.
+ */
+int dns_server_load_zone (struct dns_server *server, const char *path);
+
+/*
+ * Start serving queries on UDP and TCP on the given host:port.
+ *
+ * host may be NULL or empty to listen on any address.
+ */
+int dns_server_listen (struct dns_server *server, const char *host, const char *port);
+
+/*
+ * Answer a single wire-format query in buf of len bytes, for other transports such as DNS-over-HTTPS, copying the
+ * response into out, of *sizep bytes, with *sizep updated. The response is not truncated.
+ *
+ * Blocks the calling task while forwarding the query.
+ *
+ * The minimum TTL of the response records is returned in *ttlp, or 0 if there are none.
+ *
+ * Returns 1 for an invalid query without any response, <0 on error.
+ */
+int dns_server_answer (struct dns_server *server, const char *buf, size_t len, char *out, size_t *sizep, uint32_t *ttlp);
+
+/*
+ * Release all associated resources.
+ *
+ * Only do this once the event_main is no longer running any listeners or queries.
+ */
+void dns_server_destroy (struct dns_server *server);
+
+#endif
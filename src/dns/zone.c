@@ -0,0 +1,270 @@
+#include "dns/dns.h"
+
+#include "common/log.h"
+#include "common/util.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/queue.h>
+
+/* Number of hash buckets, must be a power of two */
+#define DNS_ZONE_BUCKETS 256
+
+/* Default TTL for records without one */
+#define DNS_ZONE_TTL 3600
+
+/* Field separators, including the line ending left by fgets() */
+#define DNS_ZONE_SPACE " \t\r\n"
+
+struct dns_zone_record {
+    struct dns_record rr;
+    union dns_rdata rdata;
+
+    unsigned hash;
+
+    TAILQ_ENTRY(dns_zone_record) zone_hash;
+};
+
+struct dns_zone {
+    unsigned count;
+
+    // records in file order, answered in the same order
+    TAILQ_HEAD(dns_zone_bucket, dns_zone_record) buckets[DNS_ZONE_BUCKETS];
+};
+
+int dns_zone_create (struct dns_zone **zonep)
+{
+    struct dns_zone *zone;
+
+    if (!(zone = calloc(1, sizeof(*zone)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    for (unsigned i = 0; i < DNS_ZONE_BUCKETS; i++) {
+        TAILQ_INIT(&zone->buckets[i]);
+    }
+
+    *zonep = zone;
+
+    return 0;
+}
+
+/*
+ * Copy a name, without any trailing dot, as unpacked from queries.
+ */
+static int dns_zone_name (char *buf, const char *name)
+{
+    size_t len = strlen(name);
+
+    if (len && name[len - 1] == '.')
+        len--;
+
+    if (len >= DNS_NAME)
+        return 1;
+
+    memcpy(buf, name, len);
+    buf[len] = '\0';
+
+    return 0;
+}
+
+/*
+ * Parse the rdata fields for the record type.
+ */
+static int dns_zone_rdata (struct dns_record *rr, union dns_rdata *rdata, char *tokens)
+{
+    const char *arg = strtok_r(NULL, DNS_ZONE_SPACE, &tokens);
+    unsigned preference;
+
+    if (!arg)
+        return 1;
+
+    switch (rr->type) {
+        case DNS_A:
+            return inet_pton(AF_INET, arg, &rdata->A) == 1 ? 0 : 1;
+
+        case DNS_AAAA:
+            return inet_pton(AF_INET6, arg, &rdata->AAAA) == 1 ? 0 : 1;
+
+        case DNS_NS:
+            return dns_zone_name(rdata->NS, arg);
+
+        case DNS_CNAME:
+            return dns_zone_name(rdata->CNAME, arg);
+
+        case DNS_PTR:
+            return dns_zone_name(rdata->PTR, arg);
+
+        case DNS_MX:
+            if (str_uint(arg, &preference) || preference > UINT16_MAX || !(arg = strtok_r(NULL, DNS_ZONE_SPACE, &tokens)))
+                return 1;
+
+            rdata->MX.preference = preference;
+
+            return dns_zone_name(rdata->MX.exchange, arg);
+
+        default:
+            return 1;
+    }
+}
+
+/*
+ * Parse one record line into the zone.
+ *
+ * Returns 1 if empty, 2 on syntax error, <0 on error.
+ */
+static int dns_zone_line (struct dns_zone *zone, char *line)
+{
+    struct dns_zone_record *record;
+    enum dns_type type;
+    char *tokens, *name, *arg;
+
+    line[strcspn(line, ";")] = '\0';
+
+    if (!(name = strtok_r(line, DNS_ZONE_SPACE, &tokens)))
+        return 1;
+
+    if (!(record = calloc(1, sizeof(*record)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    record->rr.class = DNS_IN;
+    record->rr.ttl = DNS_ZONE_TTL;
+
+    if (dns_zone_name(record->rr.name, name))
+        goto error;
+
+    // optional ttl and class
+    if ((arg = strtok_r(NULL, DNS_ZONE_SPACE, &tokens)) && isdigit((unsigned char) *arg)) {
+        unsigned ttl;
+
+        if (str_uint(arg, &ttl))
+            goto error;
+
+        record->rr.ttl = ttl;
+        arg = strtok_r(NULL, DNS_ZONE_SPACE, &tokens);
+    }
+
+    if (arg && !strcasecmp(arg, "IN"))
+        arg = strtok_r(NULL, DNS_ZONE_SPACE, &tokens);
+
+    if (!arg || dns_type_parse(&type, arg))
+        goto error;
+
+    record->rr.type = type;
+
+    if (dns_zone_rdata(&record->rr, &record->rdata, tokens))
+        goto error;
+
+    record->hash = dns_name_hash(record->rr.name);
+
+    TAILQ_INSERT_TAIL(&zone->buckets[record->hash % DNS_ZONE_BUCKETS], record, zone_hash);
+
+    zone->count++;
+
+    log_debug("%s %u %s %s", record->rr.name, record->rr.ttl, dns_type_str(record->rr.type), dns_rdata_str(&record->rr, &record->rdata));
+
+    return 0;
+
+error:
+    free(record);
+
+    return 2;
+}
+
+int dns_zone_load (struct dns_zone *zone, const char *path)
+{
+    char line[1024];
+    unsigned lineno = 0;
+    FILE *file;
+    int err = 0;
+
+    if (!(file = fopen(path, "r"))) {
+        log_perror("fopen %s", path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        lineno++;
+
+        if ((err = dns_zone_line(zone, line)) < 0) {
+            break;
+
+        } else if (err > 1) {
+            log_error("%s:%u: invalid record", path, lineno);
+            err = 1;
+            break;
+
+        } else {
+            err = 0;
+        }
+    }
+
+    if (!err && ferror(file)) {
+        log_perror("fgets %s", path);
+        err = -1;
+    }
+
+    fclose(file);
+
+    if (!err)
+        log_info("%s: %u records", path, zone->count);
+
+    return err;
+}
+
+int dns_zone_answer (struct dns_zone *zone, const struct dns_question *question, struct dns_packet *packet, unsigned *countp)
+{
+    struct dns_zone_record *record;
+    unsigned hash = dns_name_hash(question->qname), count = 0;
+    bool found = false;
+    int err;
+
+    TAILQ_FOREACH(record, &zone->buckets[hash % DNS_ZONE_BUCKETS], zone_hash) {
+        if (record->hash != hash || strcasecmp(record->rr.name, question->qname))
+            continue;
+
+        found = true;
+
+        if (question->qclass != record->rr.class && question->qclass != DNS_QCLASS_ANY)
+            continue;
+
+        if (question->qtype != record->rr.type && question->qtype != DNS_QTYPE_ANY && record->rr.type != DNS_CNAME)
+            continue;
+
+        if ((err = dns_pack_rdata(packet, &record->rr, &record->rdata))) {
+            log_warning("dns_pack_rdata: %s %s", record->rr.name, dns_type_str(record->rr.type));
+            return -1;
+        }
+
+        count++;
+    }
+
+    if (!found)
+        return 1;
+
+    *countp = count;
+
+    return 0;
+}
+
+void dns_zone_destroy (struct dns_zone *zone)
+{
+    struct dns_zone_record *record;
+
+    for (unsigned i = 0; i < DNS_ZONE_BUCKETS; i++) {
+        while ((record = TAILQ_FIRST(&zone->buckets[i]))) {
+            TAILQ_REMOVE(&zone->buckets[i], record, zone_hash);
+            free(record);
+        }
+    }
+
+    free(zone);
+}
@@ -1,14 +1,29 @@
 #include "server/server.h"
+#include "server/access.h"
 #include "server/static.h"
+#include "server/status.h"
 #include "server/dns.h"
+#include "server/proxy.h"
 
 #include "common/daemon.h"
 #include "common/event.h"
 #include "common/log.h"
+#include "common/pool.h"
+#include "common/stats.h"
+#include "common/tcp.h"
 #include "common/url.h"
 #include "common/util.h"
 
+#ifdef WITH_SSL
+#include "common/ssl.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <sys/resource.h>
@@ -16,19 +31,100 @@
 
 struct options {
     FILE *log_file;
+    unsigned log_buffer;
     bool daemon;
     unsigned nfiles;
     const char *iam;
     const char *S;
     const char *U;
     bool dns;
+    const char *status;
+    const char *proxy_path;
+    const char *proxy;
+    const char *proxy_check;
     const char *resolver;
+    const char *event_poll;
+    unsigned task_stack;
+    unsigned task_pool;
+    unsigned read_buffer;
+    unsigned write_buffer;
+    unsigned max_buffer;
+    unsigned output_buffer;
+    unsigned workers;
+    unsigned listen_backlog;
+    bool defer_accept;
+    bool fastopen;
+    bool nagle;
+    unsigned max_connections;
+    unsigned overload_connections;
+    unsigned header_timeout;
+    unsigned body_timeout;
+    unsigned keepalive_timeout;
+    unsigned drain_timeout;
+    unsigned static_memory;
+    unsigned static_max;
+    const char *mime_types;
+    const char *ssl_cert;
+    const char *ssl_key;
+    const char *access_log;
+    bool access_binary;
+
+    /* Listen addresses */
+    char **listens;
+    int listens_count;
 
     /* Processed */
+    rlim_t nfiles_limit;
+
+    /* Listen sockets for each worker in turn, bound or inherited before forking any workers */
+    int *listen_socks;
+    unsigned listen_socks_count;
+
+    /* Signals for reload/drain */
+    int signal_fd;
+    struct event *signal_event;
+#ifdef WITH_SSL
+    struct ssl_main *ssl_main;
+#endif
+    struct event_main *event_main;
     struct server *server;
+    struct server_access *server_access;
     struct server_static *server_static;
     struct server_static *server_upload;
     struct server_dns *server_dns;
+    struct server_status *server_status;
+    struct server_proxy *server_proxy;
+};
+
+enum opts {
+    OPT_START       = 255,
+    OPT_LOG_BUFFER,
+    OPT_ACCESS_BINARY,
+    OPT_EVENT_POLL,
+    OPT_TASK_STACK,
+    OPT_TASK_POOL,
+    OPT_READ_BUFFER,
+    OPT_WRITE_BUFFER,
+    OPT_MAX_BUFFER,
+    OPT_OUTPUT_BUFFER,
+    OPT_STATIC_MEMORY,
+    OPT_STATIC_MAX,
+    OPT_MIME_TYPES,
+    OPT_SSL_CERT,
+    OPT_SSL_KEY,
+    OPT_STATUS,
+    OPT_LISTEN_BACKLOG,
+    OPT_DEFER_ACCEPT,
+    OPT_FASTOPEN,
+    OPT_NAGLE,
+    OPT_MAX_CONNECTIONS,
+    OPT_OVERLOAD_CONNECTIONS,
+    OPT_HEADER_TIMEOUT,
+    OPT_BODY_TIMEOUT,
+    OPT_KEEPALIVE_TIMEOUT,
+    OPT_DRAIN_TIMEOUT,
+    OPT_PROXY,
+    OPT_PROXY_CHECK,
 };
 
 static const struct option main_options[] = {
@@ -37,17 +133,47 @@ static const struct option main_options[] = {
     { "verbose",    0,    NULL,        'v'    },
     { "debug",        0,    NULL,        'd'    },
     { "log-file",   1,  NULL,       'L' },
+    { "log-buffer", 1,  NULL,       OPT_LOG_BUFFER  },
+    { "access-log", 1,  NULL,       'A' },
+    { "access-binary",  0,  NULL,   OPT_ACCESS_BINARY   },
 
     { "daemon",        0,    NULL,        'D'    },
     { "nfiles",     1,  NULL,       'N' },
+    { "event-poll", 1,  NULL,       OPT_EVENT_POLL  },
+    { "task-stack", 1,  NULL,       OPT_TASK_STACK  },
+    { "task-pool",  1,  NULL,       OPT_TASK_POOL   },
+    { "read-buffer",    1,  NULL,   OPT_READ_BUFFER     },
+    { "write-buffer",   1,  NULL,   OPT_WRITE_BUFFER    },
+    { "max-buffer",     1,  NULL,   OPT_MAX_BUFFER      },
+    { "output-buffer",  1,  NULL,   OPT_OUTPUT_BUFFER   },
+    { "workers",    1,  NULL,       'W' },
+    { "listen-backlog", 1,  NULL,   OPT_LISTEN_BACKLOG  },
+    { "defer-accept",   0,  NULL,   OPT_DEFER_ACCEPT    },
+    { "fastopen",       0,  NULL,   OPT_FASTOPEN        },
+    { "nagle",          0,  NULL,   OPT_NAGLE           },
+    { "max-connections",        1,  NULL,   OPT_MAX_CONNECTIONS         },
+    { "overload-connections",   1,  NULL,   OPT_OVERLOAD_CONNECTIONS    },
+    { "header-timeout",     1,  NULL,   OPT_HEADER_TIMEOUT      },
+    { "body-timeout",       1,  NULL,   OPT_BODY_TIMEOUT        },
+    { "keepalive-timeout",  1,  NULL,   OPT_KEEPALIVE_TIMEOUT   },
+    { "drain-timeout",      1,  NULL,   OPT_DRAIN_TIMEOUT       },
 
     { "iam",        1,    NULL,        'I' },
     { "static",        1,    NULL,        'S' },
+    { "static-memory",      1,  NULL,   OPT_STATIC_MEMORY       },
+    { "static-max",         1,  NULL,   OPT_STATIC_MAX          },
+    { "mime-types",         1,  NULL,   OPT_MIME_TYPES          },
     { "upload",     1,  NULL,       'U' },
     { "dns",        0,  NULL,       'P' },
+    { "status",     1,  NULL,       OPT_STATUS      },
+    { "proxy",      1,  NULL,       OPT_PROXY       },
+    { "proxy-check",    1,  NULL,   OPT_PROXY_CHECK },
 
     { "resolver",   1,  NULL,       'R' },
 
+    { "ssl-cert",   1,  NULL,       OPT_SSL_CERT    },
+    { "ssl-key",    1,  NULL,       OPT_SSL_KEY     },
+
     { }
 };
 
@@ -60,16 +186,46 @@ void help (const char *argv0) {
             "   -v --verbose        More output\n"
             "   -d --debug          Debug output\n"
             "   -L --log-file       Write log to given file\n"
+            "      --log-buffer     Buffer log output in memory, in bytes, written once per event loop iteration\n"
+            "   -A --access-log     Append a record for each request to the given file\n"
+            "      --access-binary  Write binary access log records\n"
             "\n"
             "   -D --daemon         Daemonize\n"
             "   -N --nfiles         Limit number of open files\n"
+            "      --event-poll     Use given IO backend: epoll, io_uring, kqueue, select\n"
+            "      --task-stack     Stack size for per-connection tasks, in bytes\n"
+            "      --task-pool      Number of exited tasks to keep for re-use\n"
+            "      --read-buffer    Initial per-connection read buffer size, in bytes\n"
+            "      --write-buffer   Initial per-connection write buffer size, in bytes\n"
+            "      --max-buffer     Maximum per-connection buffer size, limiting header line length\n"
+            "      --output-buffer  Per-response output buffer size, in bytes, or 0 to stream all output\n"
+            "   -W --workers=N      Run N worker processes, pinned to separate CPUs\n"
+            "      --listen-backlog Queue of pending connections for each listen address\n"
+            "      --defer-accept   Only accept connections once the client has sent its request\n"
+            "      --fastopen       Accept TCP Fast Open connections, with request data in the SYN\n"
+            "      --nagle          Leave Nagle's algorithm enabled on accepted connections\n"
+            "      --max-connections Refuse connections with a 503 past this limit, default --nfiles less reserved fds\n"
+            "      --overload-connections Throttle accepts past this many connections, default 90%% of --max-connections\n"
+            "      --header-timeout Idle timeout for reading request headers, in seconds\n"
+            "      --body-timeout   Idle timeout for reading request bodies, in seconds\n"
+            "      --keepalive-timeout Idle timeout for persistent connections between requests, in seconds\n"
+            "      --drain-timeout  Deadline for open connections to finish on SIGQUIT or reload, in seconds\n"
             "\n"
             "   -I --iam=username   Send Iam header\n"
             "   -S --static=path    Serve static files from /\n"
+            "      --static-memory  Keep small static files in memory, up to the given total size in bytes\n"
+            "      --static-max     Maximum size of static files kept in memory, in bytes\n"
+            "      --mime-types     Load static file content types from file, default " SERVER_STATIC_MIME_TYPES "\n"
             "   -U --upload=path    Accept PUT files to /upload\n"
             "   -P --dns            Serve POST requests to /dns-query\n"
+            "      --status=path    Serve runtime stats for all workers at /path\n"
+            "      --proxy=path=url[,url...] Forward requests for /path to the given http://host:port upstreams\n"
+            "      --proxy-check=path Check the health of each --proxy upstream using GET /path\n"
+            "\n"
+            "   -R --resolver       DNS resolver addresses, comma-separated\n"
             "\n"
-            "   -R --resolver       DNS resolver address\n"
+            "      --ssl-cert=path  PEM certificate chain for https:// listen addresses\n"
+            "      --ssl-key=path   PEM private key, default --ssl-cert\n"
             "\n"
     , argv0);
 }
@@ -82,24 +238,29 @@ int init_nfiles (struct options *options, struct event_main *event_main)
     int max = event_get_max(event_main);
     struct rlimit nofile;
 
+    if (getrlimit(RLIMIT_NOFILE, &nofile)) {
+        log_perror("getrlimit: nofile");
+        return -1;
+    }
+
     if (options->nfiles) {
         nofile.rlim_cur = nofile.rlim_max = options->nfiles;
-    } else {
-        if (getrlimit(RLIMIT_NOFILE, &nofile)) {
-            log_perror("getrlimit: nofile");
-            return -1;
-        }
+
+    } else if (!max) {
+        // no limit imposed by the event_main, so go as high as we are allowed to
+        nofile.rlim_cur = nofile.rlim_max;
     }
 
-    if (!max || nofile.rlim_cur < max) {
-        log_info("using --nfiles limit %lu < %d", nofile.rlim_cur, max);
-        return 0;
+    if (max && nofile.rlim_cur >= max) {
+        log_warning("currently set --nfiles rlimit %lu is too high, adjusting to %d - 1", nofile.rlim_cur, max);
+
+        // safe limit...
+        nofile.rlim_cur = nofile.rlim_max = max - 1;
     }
 
-    log_warning("currently set --nfiles rlimit %lu is too high, adjusting to %d - 1", nofile.rlim_cur, max);
+    log_info("using --nfiles limit %lu", nofile.rlim_cur);
 
-    // safe limit...
-    nofile.rlim_cur = nofile.rlim_max = max - 1;
+    options->nfiles_limit = nofile.rlim_cur;
 
     if (setrlimit(RLIMIT_NOFILE, &nofile)) {
         log_perror("setrlimit: nofile: %lu/%lu", nofile.rlim_cur, nofile.rlim_max);
@@ -109,26 +270,518 @@ int init_nfiles (struct options *options, struct event_main *event_main)
     return 0;
 }
 
-int main_listen (struct options *options, const char *arg)
+/*
+ * Parse the listen address, and determine the server_listen_flags.
+ */
+int main_listen_parse (struct options *options, const char *arg, struct urlbuf *urlbuf, int *flagsp)
 {
-    struct urlbuf urlbuf;
+    int flags = 0;
     int err;
 
-    if ((err = urlbuf_parse(&urlbuf, arg))) {
+    if ((err = urlbuf_parse(urlbuf, arg))) {
         log_fatal("invalid server url: %s", arg);
         return err;
     }
 
-    log_info("%s: host=%s port=%s path=%s iam=%s", arg, urlbuf.url.host, urlbuf.url.port, urlbuf.url.path, options->iam);
+    // each worker listens on its own socket
+    if (options->workers)
+        flags |= SERVER_LISTEN_REUSEPORT;
+
+    if (urlbuf->url.scheme && strcmp(urlbuf->url.scheme, "https") == 0)
+        flags |= SERVER_LISTEN_SSL;
+
+    if (options->defer_accept)
+        flags |= SERVER_LISTEN_DEFER_ACCEPT;
+
+    if (options->fastopen)
+        flags |= SERVER_LISTEN_FASTOPEN;
+
+    // responses are written in one go, so there is nothing to gain from delaying small writes
+    if (!options->nagle)
+        flags |= SERVER_LISTEN_NODELAY;
+
+    *flagsp = flags;
+
+    return 0;
+}
+
+/*
+ * Bind the listen sockets for each worker, or use the ones inherited from a reload.
+ */
+int main_bind (struct options *options)
+{
+    unsigned count = (options->workers ? options->workers : 1) * options->listens_count;
+    struct urlbuf urlbuf;
+    int flags;
+    int err;
+
+    if ((err = daemon_inherit(&options->listen_socks, &options->listen_socks_count))) {
+        log_fatal("daemon_inherit");
+        return err;
+    }
+
+    if (options->listen_socks) {
+        if (options->listen_socks_count != count) {
+            log_fatal("inherited %u listen sockets, expected %u for the --workers and listen addresses", options->listen_socks_count, count);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    if (!(options->listen_socks = calloc(count, sizeof(*options->listen_socks)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        const char *arg = options->listens[i % options->listens_count];
+
+        if ((err = main_listen_parse(options, arg, &urlbuf, &flags)))
+            return err;
+
+        if ((err = server_listen_bind(&options->listen_socks[i], urlbuf.url.host, urlbuf.url.port, options->listen_backlog, flags))) {
+            log_fatal("server_listen_bind %s %s", urlbuf.url.host, urlbuf.url.port);
+            return err;
+        }
+
+        options->listen_socks_count++;
+    }
+
+    return 0;
+}
+
+/*
+ * Listen on the sockets for the given worker, closing the sockets of the other workers.
+ *
+ * The server uses a dup of each socket, leaving the original to pass over on reload.
+ */
+int main_listen (struct options *options, unsigned index)
+{
+    struct urlbuf urlbuf;
+    int flags, sock;
+    int err;
+
+    for (unsigned i = 0; i < options->listen_socks_count; i++) {
+        const char *arg = options->listens[i % options->listens_count];
+
+        if (i / options->listens_count != index) {
+            close(options->listen_socks[i]);
+            options->listen_socks[i] = -1;
+            continue;
+        }
+
+        if ((err = main_listen_parse(options, arg, &urlbuf, &flags)))
+            return err;
+
+        log_info("%s: host=%s port=%s path=%s iam=%s", arg, urlbuf.url.host, urlbuf.url.port, urlbuf.url.path, options->iam);
+
+        if ((sock = fcntl(options->listen_socks[i], F_DUPFD_CLOEXEC, 0)) < 0) {
+            log_perror("fcntl");
+            return -1;
+        }
+
+        if ((err = server_listen_sock(options->server, sock, flags))) {
+            log_fatal("server_listen %s %s", urlbuf.url.host, urlbuf.url.port);
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Stop the server once all connections have finished, or the --drain-timeout expires.
+ */
+int main_drain (struct options *options)
+{
+    struct timeval deadline = *event_main_clock(options->event_main);
+    struct event *event;
+    int connections;
+    int err = 0;
+
+    deadline.tv_sec += options->drain_timeout ? options->drain_timeout : SERVER_DRAIN_TIMEOUT.tv_sec;
+
+    if ((err = event_create(options->event_main, &event, -1))) {
+        log_error("event_create");
+        goto stop;
+    }
+
+    while ((connections = server_drain(options->server)) > 0) {
+        if (!timercmp(event_main_clock(options->event_main), &deadline, <)) {
+            log_warning("drain: timeout with %d connections open", connections);
+            break;
+        }
+
+        if ((err = event_sleep(event, &SERVER_DRAIN_INTERVAL))) {
+            log_error("event_sleep");
+            break;
+        }
+    }
+
+    event_destroy(event);
+
+stop:
+    log_info("drain: stop");
+
+    event_main_stop(options->event_main);
+
+    return err;
+}
+
+/*
+ * Start a new process using the same listen sockets, and drain once it has started up.
+ *
+ * Keeps running if the new process fails to start up.
+ */
+int main_reload (struct options *options)
+{
+    struct event *event = NULL;
+    unsigned count = 1;
+    int ready;
+    int err;
+
+    if ((err = daemon_reload(&ready))) {
+        log_error("daemon_reload");
+        return err;
+    }
+
+    if ((err = event_create(options->event_main, &event, ready))) {
+        log_error("event_create");
+        close(ready);
+        return err;
+    }
+
+    while ((err = daemon_reload_ready(ready, &count)) == 1) {
+        if ((err = event_yield(event, EVENT_READ, &(struct timeval) { .tv_sec = DAEMON_RELOAD_TIMEOUT })) > 0) {
+            log_error("reload: timeout");
+            break;
+
+        } else if (err < 0) {
+            log_error("event_yield");
+            break;
+        }
+    }
+
+    event_destroy(event);
+    close(ready);
+
+    if (err) {
+        log_error("reload: failed to start, keep running");
+        return err;
+    }
+
+    log_info("reload: ready");
+
+    return main_drain(options);
+}
+
+/*
+ * Handle SIGQUIT, and SIGHUP/SIGUSR2 if not running any workers.
+ */
+void main_signal_task (void *ctx)
+{
+    struct options *options = ctx;
+    unsigned char sig;
+    ssize_t ret;
+
+    while (true) {
+        if ((ret = read(options->signal_fd, &sig, 1)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (event_yield(options->signal_event, EVENT_READ, NULL)) {
+                log_error("event_yield");
+                break;
+            }
+
+            continue;
+
+        } else if (ret < 0 && errno == EINTR) {
+            continue;
+
+        } else if (ret <= 0) {
+            log_perror("read");
+            break;
+        }
+
+        log_info("signal: %s", strsignal(sig));
+
+        if (sig == SIGQUIT) {
+            main_drain(options);
+            break;
+
+        } else if (!main_reload(options)) {
+            break;
+        }
+    }
+}
+
+/*
+ * Handle signals within the event_main.
+ */
+int main_signals (struct options *options)
+{
+    int sigs[] = { SIGQUIT, SIGHUP, SIGUSR2 };
+    int err;
+
+    // workers are reloaded by the supervisor
+    if ((err = daemon_signals(&options->signal_fd, sigs, options->workers ? 1 : 3))) {
+        log_fatal("daemon_signals");
+        return err;
+    }
+
+    if ((err = event_create(options->event_main, &options->signal_event, options->signal_fd))) {
+        log_fatal("event_create");
+        return err;
+    }
+
+    if ((err = event_start(options->event_main, main_signal_task, options))) {
+        log_fatal("event_start");
+        return err;
+    }
+
+    return 0;
+}
+
+/*
+ * Setup the event_main and server, and start listening on the sockets for the given worker.
+ */
+int main_server (struct options *options, unsigned index)
+{
+    int err;
+
+    if ((err = event_main_create_poll(&options->event_main, options->event_poll))) {
+        log_fatal("event_main_create: %s", options->event_poll ? options->event_poll : "default");
+        return err;
+    }
+
+    if ((err = event_main_set_tasks(options->event_main, options->task_stack, options->task_pool))) {
+        log_fatal("invalid --task-stack/pool settings");
+        return err;
+    }
+
+    if ((err = tcp_set_buffers(
+                    options->read_buffer ? options->read_buffer : TCP_READ_SIZE,
+                    options->write_buffer ? options->write_buffer : TCP_WRITE_SIZE,
+                    options->max_buffer ? options->max_buffer : TCP_STREAM_MAX
+    ))) {
+        log_fatal("invalid --read/write/max-buffer settings");
+        return err;
+    }
+
+    if ((err = init_nfiles(options, options->event_main))) {
+        log_fatal("invalid --nfiles setting for event mainloop");
+        return err;
+    }
+
+    // apply
+    if ((err = server_create(options->event_main, &options->server))) {
+        log_fatal("server_create");
+        return err;
+    }
+
+    if ((err = server_set_output_buffer(options->server, options->output_buffer))) {
+        log_fatal("invalid --output-buffer settings");
+        return err;
+    }
+
+    if ((err = server_set_listen_backlog(options->server, options->listen_backlog))) {
+        log_fatal("invalid --listen-backlog settings");
+        return err;
+    }
+
+    if ((err = server_set_timeouts(options->server,
+                    options->header_timeout ? &(struct timeval) { .tv_sec = options->header_timeout } : NULL,
+                    options->body_timeout ? &(struct timeval) { .tv_sec = options->body_timeout } : NULL,
+                    options->keepalive_timeout ? &(struct timeval) { .tv_sec = options->keepalive_timeout } : NULL
+    ))) {
+        log_fatal("invalid --header/body/keepalive-timeout settings");
+        return err;
+    }
+
+    if (!options->max_connections && options->nfiles_limit > SERVER_RESERVE_FDS && options->nfiles_limit != RLIM_INFINITY) {
+        // leave some fds for files and other sockets
+        options->max_connections = options->nfiles_limit - SERVER_RESERVE_FDS;
+    }
+
+    if ((err = server_set_connections(options->server, options->max_connections, options->overload_connections))) {
+        log_fatal("invalid --max/overload-connections settings");
+        return err;
+    }
+
+    log_info("using --max-connections %u", options->max_connections);
+
+    if (options->access_log) {
+        if ((err = server_access_create(options->event_main, &options->server_access, options->access_log,
+                        options->access_binary ? SERVER_ACCESS_BINARY : 0
+        ))) {
+            log_fatal("server_access_create: %s", options->access_log);
+            return err;
+        }
+
+        if ((err = server_set_access_log(options->server, options->server_access))) {
+            log_fatal("server_set_access_log");
+            return err;
+        }
+    }
+
+#ifdef WITH_SSL
+    if (options->ssl_main && (err = server_set_ssl(options->server, options->ssl_main))) {
+        log_fatal("server_set_ssl");
+        return err;
+    }
+#endif
+
+    // the most-specific matching path is used, regardless of order
+    if (options->U) {
+        if ((err = server_static_create(&options->server_upload, options->U, options->server, "upload/", SERVER_STATIC_PUT))) {
+            log_fatal("server_static_create: %s", options->U);
+            return err;
+        }
+    }
+
+    if (options->dns) {
+        if ((err = server_dns_create(&options->server_dns, options->server, "dns-query/",
+                options->resolver
+        ))) {
+            log_fatal("server_dns_create");
+            return err;
+        }
+    }
+
+    if (options->status) {
+        if ((err = server_status_create(&options->server_status, options->server, options->status))) {
+            log_fatal("server_status_create: %s", options->status);
+            return err;
+        }
+    }
+
+    if (options->proxy) {
+        if ((err = server_proxy_create(&options->server_proxy, options->server, options->proxy_path, options->proxy))) {
+            log_fatal("server_proxy_create: %s", options->proxy);
+            return err;
+        }
+
+        if (options->proxy_check && (err = server_proxy_set_check(options->server_proxy, options->proxy_check))) {
+            log_fatal("server_proxy_set_check: %s", options->proxy_check);
+            return err;
+        }
+    }
+
+    if (options->S) {
+        if ((err = server_static_create(&options->server_static, options->S, options->server, "", SERVER_STATIC_GET))) {
+            log_fatal("server_static_add: %s", "/");
+            return err;
+        }
+
+        if ((err = server_static_set_memory(options->server_static,
+                        options->static_max ? options->static_max : SERVER_STATIC_MEMORY_FILE,
+                        options->static_memory
+        ))) {
+            log_fatal("invalid --static-memory/max settings");
+            return err;
+        }
+
+        if ((err = server_static_load_mimetypes(options->server_static, options->mime_types)) < 0) {
+            log_fatal("invalid --mime-types: %s", options->mime_types ? options->mime_types : SERVER_STATIC_MIME_TYPES);
+            return err;
+        }
+    }
 
-    if ((err = server_listen(options->server, urlbuf.url.host, urlbuf.url.port))) {
-        log_fatal("server_listen %s %s", urlbuf.url.host, urlbuf.url.port);
+    // headers
+    if (options->iam) {
+        if ((err = server_add_header(options->server, "Iam", options->iam))) {
+            log_fatal("server_add_header: Iam: %s", options->iam);
+            return err;
+        }
+    }
+
+    if ((err = main_listen(options, index))) {
+        log_fatal("server");
+        return err;
+    }
+
+    if ((err = main_signals(options))) {
+        log_fatal("signals");
         return err;
     }
 
     return 0;
 }
 
+/*
+ * Release server resources.
+ */
+void main_destroy (struct options *options)
+{
+    pool_log();
+
+    if (options->signal_event) {
+        event_destroy(options->signal_event);
+        close(options->signal_fd);
+    }
+
+    if (options->listen_socks) {
+        for (unsigned i = 0; i < options->listen_socks_count; i++) {
+            if (options->listen_socks[i] >= 0)
+                close(options->listen_socks[i]);
+        }
+
+        free(options->listen_socks);
+    }
+
+    if (options->server)
+        server_destroy(options->server);
+
+    if (options->server_static)
+        server_static_destroy(options->server_static);
+
+    if (options->server_status)
+        server_status_destroy(options->server_status);
+
+    if (options->server_proxy)
+        server_proxy_destroy(options->server_proxy);
+
+    if (options->server_access)
+        server_access_destroy(options->server_access);
+
+#ifdef WITH_SSL
+    if (options->ssl_main)
+        ssl_main_destroy(options->ssl_main);
+#endif
+}
+
+/*
+ * Run a separate server within each worker process.
+ */
+int main_worker (void *ctx, unsigned index)
+{
+    struct options *options = ctx;
+    int err = 0;
+
+    if (stats_select(index)) {
+        log_fatal("worker %u: stats_select", index);
+        return 1;
+    }
+
+    if (main_server(options, index)) {
+        log_fatal("worker %u: setup", index);
+        err = 1;
+        goto error;
+    }
+
+    daemon_ready();
+
+    if (event_main_run(options->event_main)) {
+        log_fatal("worker %u: event_main_run", index);
+        err = -1;
+        goto error;
+    }
+
+error:
+    main_destroy(options);
+
+    return err;
+}
+
 int main (int argc, char **argv)
 {
     int opt, longopt;
@@ -136,10 +789,12 @@ int main (int argc, char **argv)
     int err = 0;
     struct options options = {
         .iam        = getlogin(),
+        .task_stack = EVENT_TASK_SIZE,
+        .task_pool  = EVENT_TASK_POOL,
+        .output_buffer  = SERVER_OUTPUT_BUFFER,
     };
-    struct event_main *event_main;
 
-    while ((opt = getopt_long(argc, argv, "hqvdL:DN:I:S:U:PR:", main_options, &longopt)) >= 0) {
+    while ((opt = getopt_long(argc, argv, "hqvdL:A:DN:W:I:S:U:PR:", main_options, &longopt)) >= 0) {
         switch (opt) {
             case 'h':
                 help(argv[0]);
@@ -164,6 +819,21 @@ int main (int argc, char **argv)
                 }
                 break;
 
+            case 'A':
+                options.access_log = optarg;
+                break;
+
+            case OPT_ACCESS_BINARY:
+                options.access_binary = true;
+                break;
+
+            case OPT_LOG_BUFFER:
+                if (str_uint(optarg, &options.log_buffer)) {
+                    log_fatal("invalid --log-buffer: %s", optarg);
+                    return 1;
+                }
+                break;
+
             case 'D':
                 options.daemon = true;
                 break;
@@ -175,6 +845,138 @@ int main (int argc, char **argv)
                 }
                 break;
 
+            case 'W':
+                if (str_uint(optarg, &options.workers)) {
+                    log_fatal("invalid --workers/W: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_LISTEN_BACKLOG:
+                if (str_uint(optarg, &options.listen_backlog)) {
+                    log_fatal("invalid --listen-backlog: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_DEFER_ACCEPT:
+                options.defer_accept = true;
+                break;
+
+            case OPT_FASTOPEN:
+                options.fastopen = true;
+                break;
+
+            case OPT_NAGLE:
+                options.nagle = true;
+                break;
+
+            case OPT_MAX_CONNECTIONS:
+                if (str_uint(optarg, &options.max_connections)) {
+                    log_fatal("invalid --max-connections: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_OVERLOAD_CONNECTIONS:
+                if (str_uint(optarg, &options.overload_connections)) {
+                    log_fatal("invalid --overload-connections: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_HEADER_TIMEOUT:
+                if (str_uint(optarg, &options.header_timeout)) {
+                    log_fatal("invalid --header-timeout: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_BODY_TIMEOUT:
+                if (str_uint(optarg, &options.body_timeout)) {
+                    log_fatal("invalid --body-timeout: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_KEEPALIVE_TIMEOUT:
+                if (str_uint(optarg, &options.keepalive_timeout)) {
+                    log_fatal("invalid --keepalive-timeout: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_DRAIN_TIMEOUT:
+                if (str_uint(optarg, &options.drain_timeout)) {
+                    log_fatal("invalid --drain-timeout: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_EVENT_POLL:
+                options.event_poll = optarg;
+                break;
+
+            case OPT_TASK_STACK:
+                if (str_uint(optarg, &options.task_stack)) {
+                    log_fatal("invalid --task-stack: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_TASK_POOL:
+                if (str_uint(optarg, &options.task_pool)) {
+                    log_fatal("invalid --task-pool: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_READ_BUFFER:
+                if (str_uint(optarg, &options.read_buffer)) {
+                    log_fatal("invalid --read-buffer: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_WRITE_BUFFER:
+                if (str_uint(optarg, &options.write_buffer)) {
+                    log_fatal("invalid --write-buffer: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_MAX_BUFFER:
+                if (str_uint(optarg, &options.max_buffer)) {
+                    log_fatal("invalid --max-buffer: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_OUTPUT_BUFFER:
+                if (str_uint(optarg, &options.output_buffer)) {
+                    log_fatal("invalid --output-buffer: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_STATIC_MEMORY:
+                if (str_uint(optarg, &options.static_memory)) {
+                    log_fatal("invalid --static-memory: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_STATIC_MAX:
+                if (str_uint(optarg, &options.static_max)) {
+                    log_fatal("invalid --static-max: %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_MIME_TYPES:
+                options.mime_types = optarg;
+                break;
+
             case 'I':
                 options.iam = optarg;
                 break;
@@ -195,6 +997,39 @@ int main (int argc, char **argv)
                 options.resolver = optarg;
                 break;
 
+            case OPT_SSL_CERT:
+                options.ssl_cert = optarg;
+                break;
+
+            case OPT_SSL_KEY:
+                options.ssl_key = optarg;
+                break;
+
+            case OPT_STATUS:
+                options.status = optarg;
+                break;
+
+            case OPT_PROXY:
+                if (!(options.proxy = strchr(optarg, '='))) {
+                    log_fatal("invalid --proxy=path=url: %s", optarg);
+                    return 1;
+                }
+
+                // without the leading /, leaving argv as-is for any reload
+                while (*optarg == '/')
+                    optarg++;
+
+                if (!(options.proxy_path = strndup(optarg, options.proxy++ - optarg))) {
+                    log_perror("strndup");
+                    return 1;
+                }
+
+                break;
+
+            case OPT_PROXY_CHECK:
+                options.proxy_check = optarg;
+                break;
+
             default:
                 help(argv[0]);
                 return 1;
@@ -204,61 +1039,65 @@ int main (int argc, char **argv)
     // setup
     log_set_level(log_level);
 
-    daemon_init();
-
-    if ((err = event_main_create(&event_main))) {
-        log_fatal("event_main_create");
-        goto error;
+    if (options.log_buffer && log_set_buffer(options.log_buffer)) {
+        log_fatal("invalid --log-buffer: %u", options.log_buffer);
+        return 1;
     }
 
-    if ((err = init_nfiles(&options, event_main))) {
-        log_fatal("invalid --nfiles setting for event mainloop");
-        goto error;
+    if ((err = daemon_init())) {
+        log_fatal("daemon_init");
+        return 1;
     }
 
-    // apply
-    if ((err = server_create(event_main, &options.server))) {
-        log_fatal("server_create");
-        goto error;
+    options.listens = argv + optind;
+    options.listens_count = argc - optind;
+
+    // before forking any workers, to pass over on reload
+    if ((err = main_bind(&options))) {
+        log_fatal("listen");
+        return 1;
     }
 
-    // more-specifics first!
-    if (options.U) {
-        if ((err = server_static_create(&options.server_upload, options.U, options.server, "upload/", SERVER_STATIC_PUT))) {
-            log_fatal("server_static_create: %s", options.U);
-            goto error;
+    daemon_set_reload(argv, options.listen_socks, options.listen_socks_count);
+
+    if (options.ssl_cert) {
+#ifdef WITH_SSL
+        // created before forking any workers, sharing the session ticket keys
+        if ((err = ssl_server_create(&options.ssl_main, options.ssl_cert, options.ssl_key))) {
+            log_fatal("invalid --ssl-cert/key: %s", options.ssl_cert);
+            return 1;
         }
+#else
+        log_fatal("built without SSL support: --ssl-cert");
+        return 1;
+#endif
     }
 
-    if (options.dns) {
-        if ((err = server_dns_create(&options.server_dns, options.server, "dns-query/",
-                options.resolver
-        ))) {
-            log_fatal("server_dns_create");
-            goto error;
-        }
+    // one slot per worker, readable by all workers
+    if ((err = stats_share(options.workers))) {
+        log_fatal("stats_share");
+        return 1;
     }
 
-    if (options.S) {
-        if ((err = server_static_create(&options.server_static, options.S, options.server, "", SERVER_STATIC_GET))) {
-            log_fatal("server_static_add: %s", "/");
-            goto error;
+    if (options.workers) {
+        if (options.daemon) {
+            daemon_start();
         }
-    }
 
-    // headers
-    if (options.iam) {
-        if ((err = server_add_header(options.server, "Iam", options.iam))) {
-            log_fatal("server_add_header: Iam: %s", options.iam);
-            goto error;
+        if (options.log_file) {
+            log_set_file(options.log_file);
         }
-    }
 
-    while (optind < argc && !err) {
-        if ((err = main_listen(&options, argv[optind++]))) {
-            log_fatal("server");
-            goto error;
+        if ((err = daemon_workers(options.workers, main_worker, &options))) {
+            log_fatal("daemon_workers");
+            return 1;
         }
+
+        return 0;
+    }
+
+    if ((err = main_server(&options, 0))) {
+        goto error;
     }
 
     // run
@@ -270,18 +1109,16 @@ int main (int argc, char **argv)
         log_set_file(options.log_file);
     }
 
-    if ((err = event_main_run(event_main))) {
+    daemon_ready();
+
+    if ((err = event_main_run(options.event_main))) {
         log_fatal("event_main_run");
         goto error;
     }
 
 error:
-    if (options.server)
-        server_destroy(options.server);
+    main_destroy(&options);
 
-    if (options.server_static)
-        server_static_destroy(options.server_static);
-    
     if (err)
         return 1;
     else 
@@ -0,0 +1,258 @@
+#include "server/access.h"
+
+#include "common/log.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+struct server_access {
+    int fd;
+    int flags;
+
+    /* Buffered records, written out once full, or by the flush task */
+    char buf[SERVER_ACCESS_BUFFER];
+    size_t len;
+
+    /* Flush task timer */
+    struct event *event;
+};
+
+/*
+ * Periodically write out any buffered records.
+ */
+static void server_access_task (void *ctx)
+{
+    struct server_access *access = ctx;
+
+    while (true) {
+        if (event_sleep(access->event, &SERVER_ACCESS_INTERVAL) < 0) {
+            log_error("event_sleep");
+            break;
+        }
+
+        if (access->len && server_access_flush(access))
+            log_warning("server_access_flush");
+    }
+}
+
+int server_access_create (struct event_main *event_main, struct server_access **accessp, const char *path, int flags)
+{
+    struct server_access *access;
+
+    if (!(access = calloc(1, sizeof(*access)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    access->flags = flags;
+
+    if ((access->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        log_perror("open %s", path);
+        goto error;
+    }
+
+    if (event_create(event_main, &access->event, -1)) {
+        log_error("event_create");
+        goto error;
+    }
+
+    if (event_start(event_main, server_access_task, access)) {
+        log_error("event_start");
+        goto error;
+    }
+
+    *accessp = access;
+
+    return 0;
+
+error:
+    server_access_destroy(access);
+
+    return -1;
+}
+
+/*
+ * Format the peer address, for the text format.
+ */
+static const char * server_access_addr (const struct server_access_record *record, char *buf, size_t size)
+{
+    if (!record->family || !inet_ntop(record->family, record->addr, buf, size))
+        return "-";
+
+    return buf;
+}
+
+/*
+ * Append a string field to buf, escaping any whitespace and non-printable characters as %XX, returning the length.
+ *
+ * The request path is not decoded, so any % are left as-is.
+ */
+static size_t server_access_str (char *buf, size_t size, const char *str)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    size_t len = 0;
+
+    if (!str || !*str)
+        str = "-";
+
+    for (const unsigned char *c = (const unsigned char *) str; *c; c++) {
+        if (len + 3 >= size)
+            return size;
+
+        if (*c <= ' ' || *c >= 0x7f) {
+            buf[len++] = '%';
+            buf[len++] = hex[*c >> 4];
+            buf[len++] = hex[*c & 0xf];
+        } else {
+            buf[len++] = *c;
+        }
+    }
+
+    return len;
+}
+
+/*
+ * Format a text record, returning the length, or >= size if it does not fit.
+ *
+ *  time addr port method path status bytes_in bytes_out handler wait headers handler response total
+ *
+ * The durations are in microseconds: since the connection was accepted, reading the request headers, running the
+ * handler, sending the response, and for the entire request.
+ */
+static size_t server_access_text (char *buf, size_t size, const struct server_access_record *record, const char *method, const char *handler, const char *path)
+{
+    char addr[INET6_ADDRSTRLEN];
+    size_t len = 0;
+    int ret;
+
+    if ((ret = snprintf(buf, size, "%llu.%06llu %s %u ",
+                    (unsigned long long) record->time / 1000000, (unsigned long long) record->time % 1000000,
+                    server_access_addr(record, addr, sizeof(addr)), ntohs(record->port)
+    )) < 0 || (len += ret) >= size)
+        return size;
+
+    if ((len += server_access_str(buf + len, size - len, method)) + 1 >= size)
+        return size;
+
+    buf[len++] = ' ';
+
+    if ((len += server_access_str(buf + len, size - len, path)) >= size)
+        return size;
+
+    if ((ret = snprintf(buf + len, size - len, " %u %llu %llu ",
+                    record->status, (unsigned long long) record->bytes_in, (unsigned long long) record->bytes_out
+    )) < 0 || (len += ret) >= size)
+        return size;
+
+    if ((len += server_access_str(buf + len, size - len, handler)) >= size)
+        return size;
+
+    if ((ret = snprintf(buf + len, size - len, " %llu %llu %llu %llu %llu\n",
+                    (unsigned long long) (record->start - record->accept),
+                    (unsigned long long) (record->headers - record->start),
+                    (unsigned long long) (record->handler - record->headers),
+                    (unsigned long long) (record->end - record->handler),
+                    (unsigned long long) (record->end - record->start)
+    )) < 0 || (len += ret) >= size)
+        return size;
+
+    return len;
+}
+
+/*
+ * Format a binary record, returning the length, or >= size if it does not fit.
+ */
+static size_t server_access_binary (char *buf, size_t size, struct server_access_record *record, const char *method, const char *handler, const char *path)
+{
+    size_t method_len = method ? strnlen(method, UINT8_MAX) : 0;
+    size_t handler_len = handler ? strnlen(handler, UINT8_MAX) : 0;
+    size_t path_len = path ? strnlen(path, UINT16_MAX) : 0;
+    size_t len = sizeof(*record) + method_len + handler_len + path_len;
+
+    if (len >= size)
+        return size;
+
+    record->method_len = method_len;
+    record->handler_len = handler_len;
+    record->path_len = path_len;
+
+    memcpy(buf, record, sizeof(*record)); buf += sizeof(*record);
+    memcpy(buf, method, method_len); buf += method_len;
+    memcpy(buf, handler, handler_len); buf += handler_len;
+    memcpy(buf, path, path_len);
+
+    return len;
+}
+
+int server_access_log (struct server_access *access, struct server_access_record *record, const char *method, const char *handler, const char *path)
+{
+    for (int retry = 0; retry < 2; retry++) {
+        char *buf = access->buf + access->len;
+        size_t size = sizeof(access->buf) - access->len;
+        size_t len;
+
+        if (access->flags & SERVER_ACCESS_BINARY)
+            len = server_access_binary(buf, size, record, method, handler, path);
+        else
+            len = server_access_text(buf, size, record, method, handler, path);
+
+        if (len < size) {
+            access->len += len;
+            return 0;
+        }
+
+        // make room
+        if (server_access_flush(access))
+            return -1;
+    }
+
+    log_warning("record too large");
+
+    return 1;
+}
+
+int server_access_flush (struct server_access *access)
+{
+    size_t off = 0;
+    ssize_t ret;
+    int err = 0;
+
+    while (off < access->len) {
+        if ((ret = write(access->fd, access->buf + off, access->len - off)) < 0 && errno == EINTR) {
+            continue;
+
+        } else if (ret < 0) {
+            log_perror("write");
+            err = -1;
+            break;
+        }
+
+        off += ret;
+    }
+
+    // drop the records on errors, rather than growing without bound
+    access->len = 0;
+
+    return err;
+}
+
+void server_access_destroy (struct server_access *access)
+{
+    if (access->len)
+        server_access_flush(access);
+
+    if (access->event)
+        event_destroy(access->event);
+
+    if (access->fd >= 0)
+        close(access->fd);
+
+    free(access);
+}
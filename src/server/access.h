@@ -0,0 +1,91 @@
+#ifndef SERVER_ACCESS_H
+#define SERVER_ACCESS_H
+
+#include "common/event.h"
+
+#include <stdint.h>
+
+/*
+ * Access log, with one record per request, collected in memory and written out in batches.
+ */
+struct server_access;
+
+/* Size of the preallocated record buffer, written out once full */
+#define SERVER_ACCESS_BUFFER (64 * 1024)
+
+/* Interval for writing out buffered records */
+#define SERVER_ACCESS_INTERVAL ((struct timeval) { .tv_sec = 1 })
+
+enum server_access_flags {
+    /* Write struct server_access_record records, rather than text lines */
+    SERVER_ACCESS_BINARY    = 0x01,
+};
+
+/*
+ * Binary access log record, in host byte order, followed by the method, handler and path strings, without any NULs.
+ *
+ * The timestamps are CLOCK_MONOTONIC microseconds, and only meaningful relative to each other.
+ */
+struct server_access_record {
+    /* CLOCK_REALTIME of the request start, in microseconds since the epoch */
+    uint64_t time;
+
+    /* Connection accepted */
+    uint64_t accept;
+
+    /* Request started, once the first byte is readable */
+    uint64_t start;
+
+    /* Request headers read */
+    uint64_t headers;
+
+    /* Request handler returned */
+    uint64_t handler;
+
+    /* Response sent */
+    uint64_t end;
+
+    /* Bytes read/written on the connection */
+    uint64_t bytes_in, bytes_out;
+
+    /* Client address, in network byte order */
+    uint8_t addr[16];
+    uint16_t port;
+
+    /* Response status, or 0 if aborted without a response */
+    uint16_t status;
+
+    /* Lengths of the following strings */
+    uint16_t path_len;
+    uint8_t method_len, handler_len;
+
+    /* AF_INET/AF_INET6, or 0 if unknown */
+    uint8_t family;
+
+    /* Zero padding, for a fixed 96-byte record */
+    uint8_t reserved[7];
+};
+
+/*
+ * Open the access log file at path for appending, with some combination of enum server_access_flags.
+ *
+ * Buffered records are written out every SERVER_ACCESS_INTERVAL by a separate task.
+ */
+int server_access_create (struct event_main *event_main, struct server_access **accessp, const char *path, int flags);
+
+/*
+ * Add a record for one request, using the given request method, handler name and path, any of which may be NULL.
+ */
+int server_access_log (struct server_access *access, struct server_access_record *record, const char *method, const char *handler, const char *path);
+
+/*
+ * Write out any buffered records.
+ */
+int server_access_flush (struct server_access *access);
+
+/*
+ * Write out any buffered records, and release all resources.
+ */
+void server_access_destroy (struct server_access *access);
+
+#endif
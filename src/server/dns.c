@@ -1,9 +1,15 @@
 #include "server/dns.h"
 
 #include "common/log.h"
+#include "common/url.h"
 #include "../dns.h" // XXX: terrible naming failure
+#include "dns/server.h"
 
 #include <string.h>
+#include <strings.h>
+
+/* Media type for RFC 8484 wire-format messages */
+#define SERVER_DNS_MESSAGE "application/dns-message"
 
 struct server_dns {
     /* Embed */
@@ -11,8 +17,41 @@ struct server_dns {
 
     /* Shared across requests */
     struct dns *dns;
+
+    /* Answers wire-format queries using the dns resolver and cache */
+    struct dns_server *server;
 };
 
+/*
+ * Answer a wire-format query with the raw response, per RFC 8484, cacheable for the minimum TTL of its records.
+ */
+int server_dns_message (struct server_dns *s, struct server_client *client, const char *query, size_t len)
+{
+    char buf[DNS_PACKET];
+    size_t size = sizeof(buf);
+    uint32_t ttl;
+    int err;
+
+    if ((err = dns_server_answer(s->server, query, len, buf, &size, &ttl)) < 0) {
+        log_error("dns_server_answer");
+        return 500;
+
+    } else if (err) {
+        return server_response_error(client, 400, NULL, "Invalid DNS query");
+    }
+
+    if (
+            (err = server_response(client, 200, NULL))
+        ||  (err = server_response_header(client, "Content-Type", SERVER_DNS_MESSAGE))
+        ||  (err = server_response_header(client, "Cache-Control", "max-age=%u", ttl))
+        ||  (err = server_response_header(client, "Content-Length", "%zu", size))
+        ||  (err = server_response_headers(client))
+    )
+        return err;
+
+    return server_response_write(client, buf, size);
+}
+
 int server_dns_lookup (struct dns *dns, struct server_client *client, const char *name, const char *type)
 {
     int err;
@@ -108,43 +147,45 @@ int server_dns_lookup (struct dns *dns, struct server_client *client, const char
 int server_dns_request (struct server_handler *handler, struct server_client *client, const char *method, const struct url *url)
 {
     struct server_dns *s = (void *) handler;
-    const char *name = NULL, *type = NULL, *server = NULL;
+    const char *name = NULL, *type = NULL, *server = NULL, *message = NULL;
+    const char *content_type = server_request_header_value(client, HTTP_HEADER_CONTENT_TYPE);
     int err;
 
-    // read request
-    const char *header, *value;
-    log_debug("%s", url->query);
+    // RFC 8484 POST
+    if (!strcasecmp(method, "POST") && content_type && !strcasecmp(content_type, SERVER_DNS_MESSAGE)) {
+        char *query;
+        size_t len;
 
-    while (!(err = server_request_header(client, &header, &value))) {
+        if ((err = server_request_body(client, &query, &len, DNS_PACKET)))
+            return err;
 
+        return server_dns_message(s, client, query, len);
     }
 
-    if (err != 1) {
-        log_error("server_request_header: %d", err);
-        return err;
-    }
+    const struct url_params *params;
 
     // parse GET/POST parameters
-    const char *key;
-
-    while (!(err = server_request_param(client, &key, &value))) {
-        if (!strcasecmp(key, "name")) {
-            log_debug("name=%s", value);
-            name = value;
-        } else if (!strcasecmp(key, "type")) {
-            log_debug("type=%s", type);
-            type = value;
-        } else if (!strcasecmp(key, "server")) {
-            log_debug("server=%s", type);
-            server = value;
-        } else {
-            log_debug("%s?", key);
-        }
+    if ((err = server_request_params(client, &params))) {
+        log_error("server_request_params");
+        return err;
     }
 
-    if (err != 1) { // XXX
-        log_error("server_request_param");
-        return err;
+    name = url_params_get(params, "name");
+    type = url_params_get(params, "type");
+    server = url_params_get(params, "server");
+    message = url_params_get(params, "dns");
+
+    log_debug("name=%s type=%s server=%s dns=%s", name, type, server, message);
+
+    // RFC 8484 GET
+    if (message) {
+        char query[DNS_PACKET];
+        size_t len = sizeof(query);
+
+        if (base64url_decode(query, &len, message))
+            return server_response_error(client, 400, NULL, "Invalid <tt>dns=...</tt> parameter");
+
+        return server_dns_message(s, client, query, len);
     }
 
     // resolver
@@ -178,6 +219,7 @@ int server_dns_create (struct server_dns **sp, struct server *server, const char
     }
 
     s->handler.request = server_dns_request;
+    s->handler.name = "dns";
 
     log_info("GET %s", path);
 
@@ -196,6 +238,11 @@ int server_dns_create (struct server_dns **sp, struct server *server, const char
         goto error;
     }
 
+    if (dns_server_create(s->handler.event_main, &s->server, s->dns)) {
+        log_error("dns_server_create");
+        goto error;
+    }
+
     *sp = s;
     return 0;
 
@@ -206,6 +253,7 @@ error:
 
 void server_dns_destroy (struct server_dns *s)
 {
+    dns_server_destroy(s->server);
     dns_destroy(s->dns);
     free(s);
 }
@@ -0,0 +1,677 @@
+#include "server/proxy.h"
+
+#include "client/client.h"
+#include "common/log.h"
+#include "common/url.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* Idle timeout for upstream connections */
+#define SERVER_PROXY_TIMEOUT ((struct timeval) { .tv_sec = 30 })
+
+/* Limits on idle upstream connections kept in the pool, per upstream and in total */
+#define SERVER_PROXY_POOL_HOST 32
+#define SERVER_PROXY_POOL_MAX 256
+
+/* Maximum number of Connection headers within a response */
+#define SERVER_PROXY_CONNECTION_MAX 4
+
+/* Maximum length of a forwarded X-Forwarded-For header */
+#define SERVER_PROXY_FORWARDED_MAX 1024
+
+struct server_proxy_upstream {
+    struct urlbuf urlbuf;
+
+    /* Requests currently being forwarded */
+    unsigned active;
+
+    /* Failed to connect, skipped until the next health check */
+    bool down;
+};
+
+struct server_proxy {
+    /* Embed */
+    struct server_handler handler;
+
+    struct server_proxy_upstream upstreams[SERVER_PROXY_UPSTREAMS];
+    unsigned count;
+
+    /* Round-robin between upstreams with the same number of active requests */
+    unsigned next;
+
+    /* Idle upstream connections, shared across requests */
+    struct client_pool *pool;
+
+    /* Health checks, or NULL to just retry any upstreams marked down */
+    const char *check;
+    struct event *check_event;
+};
+
+/*
+ * Hop-by-hop headers, only meaningful for a single connection, per RFC 7230 section 6.1.
+ */
+static const char *server_proxy_hop_headers[] = {
+    "Connection",
+    "Keep-Alive",
+    "Proxy-Connection",
+    "Proxy-Authenticate",
+    "Proxy-Authorization",
+    "TE",
+    "Trailer",
+    "Transfer-Encoding",
+    "Upgrade",
+    NULL
+};
+
+/*
+ * Test for a hop-by-hop header, either well-known or named in any of the given Connection header values.
+ */
+static bool server_proxy_hop (const char *name, size_t len, const char **connections, const size_t *lens, unsigned count)
+{
+    for (const char **hop = server_proxy_hop_headers; *hop; hop++) {
+        if (strlen(*hop) == len && strncasecmp(*hop, name, len) == 0)
+            return true;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        if (http_header_token(connections[i], lens[i], name, len))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Select the upstream with the least active requests, skipping any upstreams marked down.
+ *
+ * Returns NULL if all upstreams are down.
+ */
+static struct server_proxy_upstream * server_proxy_select (struct server_proxy *s)
+{
+    struct server_proxy_upstream *select = NULL;
+
+    for (unsigned i = 0; i < s->count; i++) {
+        struct server_proxy_upstream *upstream = &s->upstreams[(s->next + i) % s->count];
+
+        if (upstream->down)
+            continue;
+
+        if (!select || upstream->active < select->active)
+            select = upstream;
+    }
+
+    s->next = (s->next + 1) % s->count;
+
+    return select;
+}
+
+/*
+ * Request headers to forward, collected once for any retries.
+ */
+struct server_proxy_request {
+    const char *names[HTTP_HEADERS_MAX], *values[HTTP_HEADERS_MAX];
+    unsigned count;
+
+    /* Any X-Forwarded-For from the client, and the client address to append to it */
+    const char *forwarded;
+    char peer[64];
+
+    /* Request body framing */
+    size_t content_length;
+    bool chunked;
+};
+
+/*
+ * Collect the request headers to forward, dropping any hop-by-hop headers.
+ */
+static int server_proxy_request_headers (struct server_proxy_request *request, struct server_client *server_client)
+{
+    const char *connection = server_request_header_value(server_client, HTTP_HEADER_CONNECTION);
+    size_t connection_len = connection ? strlen(connection) : 0;
+    const char *content_length = server_request_header_value(server_client, HTTP_HEADER_CONTENT_LENGTH);
+    const char *name, *value;
+    int err;
+
+    while (!(err = server_request_header(server_client, &name, &value))) {
+        if (server_proxy_hop(name, strlen(name), &connection, &connection_len, connection ? 1 : 0)) {
+            continue;
+
+        } else if (!strcasecmp(name, "Content-Length") || !strcasecmp(name, "Expect")) {
+            // re-framed, and not expecting any 100-continue from the upstream
+            continue;
+
+        } else if (!strcasecmp(name, "X-Forwarded-For")) {
+            request->forwarded = value;
+            continue;
+        }
+
+        request->names[request->count] = name;
+        request->values[request->count] = value;
+        request->count++;
+    }
+
+    if (err < 0) {
+        log_error("server_request_header");
+        return err;
+    }
+
+    if (server_request_peer(server_client, request->peer, sizeof(request->peer))) {
+        log_warning("server_request_peer");
+        strcpy(request->peer, "unknown");
+    }
+
+    // the server only accepts the chunked transfer-encoding
+    if (server_request_header_value(server_client, HTTP_HEADER_TRANSFER_ENCODING)) {
+        request->chunked = true;
+
+    } else if (content_length && (sscanf(content_length, "%zu", &request->content_length) != 1)) {
+        log_warning("invalid content-length: %s", content_length);
+        return HTTP_BAD_REQUEST;
+    }
+
+    return 0;
+}
+
+/*
+ * Send the request line and headers to the upstream.
+ */
+static int server_proxy_request_head (struct client *client, const struct server_proxy_request *request, const char *method, const struct url *url)
+{
+    int err;
+
+    if ((err = client_stream_request(client, method, url))) {
+        log_warning("client_stream_request");
+        return err;
+    }
+
+    for (unsigned i = 0; i < request->count; i++) {
+        if ((err = client_stream_header(client, request->names[i], "%s", request->values[i]))) {
+            log_warning("client_stream_header: %s", request->names[i]);
+            return err;
+        }
+    }
+
+    if (request->forwarded && strlen(request->forwarded) < SERVER_PROXY_FORWARDED_MAX)
+        err = client_stream_header(client, "X-Forwarded-For", "%s, %s", request->forwarded, request->peer);
+    else
+        err = client_stream_header(client, "X-Forwarded-For", "%s", request->peer);
+
+    if (err) {
+        log_warning("client_stream_header: X-Forwarded-For");
+        return err;
+    }
+
+    return client_stream_headers(client, request->content_length, request->chunked);
+}
+
+/*
+ * Stream the request body to the upstream.
+ *
+ * Returns 1 if any request body was sent.
+ */
+static int server_proxy_request_body (struct client *client, struct server_client *server_client)
+{
+    bool body = false;
+    int err;
+
+    while (true) {
+        char *buf;
+        size_t size = 0;
+
+        if ((err = server_request_read(server_client, &buf, &size)) < 0) {
+            log_warning("server_request_read");
+            return err;
+
+        } else if (err == 1) {
+            break;
+
+        } else if (err) {
+            return err;
+        }
+
+        if ((err = client_stream_write(client, buf, size))) {
+            log_warning("client_stream_write");
+            return -1;
+        }
+
+        body = true;
+    }
+
+    return body ? 1 : 0;
+}
+
+/*
+ * Send the upstream response status and headers, copying through the raw header lines, other than any hop-by-hop
+ * headers and the Date.
+ */
+static int server_proxy_response_headers (struct server_client *server_client, const struct client_stream_response *response)
+{
+    const char *connections[SERVER_PROXY_CONNECTION_MAX];
+    size_t connection_lens[SERVER_PROXY_CONNECTION_MAX];
+    unsigned connection_count = 0;
+    struct http_head_line line;
+    const char *head, *copy;
+    size_t len;
+    bool skip = false;
+    int err;
+
+    if ((err = server_response(server_client, response->status, response->reason)))
+        return err;
+
+    // any headers named in the Connection headers are dropped as well
+    for (head = response->head, len = response->head_len; !http_head_next(&head, &len, &line); ) {
+        if (line.name_len == 10 && !strncasecmp(line.name, "Connection", 10) && connection_count < SERVER_PROXY_CONNECTION_MAX) {
+            connections[connection_count] = line.value;
+            connection_lens[connection_count] = line.value_len;
+            connection_count++;
+        }
+    }
+
+    // copy through contiguous runs of header lines as-is
+    for (head = copy = response->head, len = response->head_len; !(err = http_head_next(&head, &len, &line)); ) {
+        bool drop;
+
+        if (!line.name_len) {
+            // folded, along with the header line before it
+            drop = skip;
+
+        } else if (line.name_len == 4 && !strncasecmp(line.name, "Date", 4)) {
+            // the server's own
+            drop = true;
+
+        } else if (line.name_len == 14 && !strncasecmp(line.name, "Content-Length", 14)) {
+            // re-framed by the server for a chunked response body
+            drop = response->chunked;
+
+        } else {
+            drop = server_proxy_hop(line.name, line.name_len, connections, connection_lens, connection_count);
+        }
+
+        if (drop && line.line > copy && (err = server_response_header_lines(server_client, copy, line.line - copy)))
+            return err;
+
+        if (drop)
+            copy = line.line + line.len;
+
+        skip = drop;
+    }
+
+    if (err < 0) {
+        log_warning("invalid upstream response headers");
+        return -1;
+    }
+
+    if (head > copy && (err = server_response_header_lines(server_client, copy, head - copy)))
+        return err;
+
+    // the rest of the headers are sent by the server, once it knows how to frame the response body
+    if (response->empty || response->has_length)
+        return server_response_headers(server_client);
+
+    return 0;
+}
+
+/*
+ * Stream the upstream response body to the client.
+ */
+static int server_proxy_response_body (struct client *client, struct server_client *server_client)
+{
+    int err;
+
+    while (true) {
+        char *buf;
+        size_t size = 0;
+
+        if ((err = client_stream_read(client, &buf, &size)) < 0) {
+            log_warning("client_stream_read");
+            return err;
+
+        } else if (err) {
+            return 0;
+        }
+
+        if ((err = server_response_write(server_client, buf, size))) {
+            log_warning("server_response_write");
+            return -1;
+        }
+    }
+}
+
+/*
+ * Forward the request to the given upstream.
+ *
+ * Returns 1 if the upstream failed before any of the request body was consumed, to retry on a different upstream.
+ */
+static int server_proxy_forward (struct server_proxy_upstream *upstream, struct client *client, struct server_client *server_client, const struct server_proxy_request *request, const char *method, const struct url *url)
+{
+    struct client_stream_response response;
+    struct url target = upstream->urlbuf.url;
+    int err;
+
+    target.path = url->path;
+    target.query = url->query;
+
+    if ((err = client_open(client, &target))) {
+        log_warning("client_open %s:%s", target.host, target.port ? target.port : "http");
+
+        upstream->down = true;
+
+        return 1;
+    }
+
+    for (bool retry = client_is_reused(client); ; retry = false) {
+        if ((err = server_proxy_request_head(client, request, method, &target))) {
+            log_warning("server_proxy_request_head");
+            return err < 0 ? HTTP_BAD_GATEWAY : err;
+        }
+
+        if ((err = server_proxy_request_body(client, server_client)) < 0) {
+            log_warning("server_proxy_request_body");
+            return err;
+
+        } else if (err == 1) {
+            // the request body can not be sent again
+            retry = false;
+
+        } else if (err) {
+            return err;
+        }
+
+        if ((err = client_stream_response(client, &response)) < 0) {
+            log_warning("client_stream_response");
+            return HTTP_BAD_GATEWAY;
+
+        } else if (err && retry) {
+            log_info("re-used upstream connection closed, retrying on a new connection");
+
+            if ((err = client_reconnect(client, &target))) {
+                upstream->down = true;
+                return 1;
+            }
+
+            continue;
+
+        } else if (err) {
+            log_warning("upstream connection closed without response");
+            return HTTP_BAD_GATEWAY;
+        }
+
+        break;
+    }
+
+    if ((err = server_proxy_response_headers(server_client, &response)))
+        return -1;
+
+    return server_proxy_response_body(client, server_client);
+}
+
+int server_proxy_request (struct server_handler *handler, struct server_client *server_client, const char *method, const struct url *url)
+{
+    struct server_proxy *s = (struct server_proxy *) handler;
+    struct server_proxy_request request = { };
+    struct server_proxy_upstream *upstream;
+    struct client *client;
+    int err;
+
+    if ((err = server_proxy_request_headers(&request, server_client)))
+        return err;
+
+    if ((err = client_create(handler->event_main, &client))) {
+        log_error("client_create");
+        return -1;
+    }
+
+    client_set_pool(client, s->pool);
+    client_set_request_version(client, HTTP_11);
+    client_set_timeout(client, &SERVER_PROXY_TIMEOUT);
+
+    // try each upstream in turn, until one accepts the connection
+    for (unsigned i = 0; i < s->count; i++) {
+        if (!(upstream = server_proxy_select(s))) {
+            log_warning("all upstreams are down");
+            err = HTTP_SERVICE_UNAVAILABLE;
+            break;
+        }
+
+        upstream->active++;
+
+        err = server_proxy_forward(upstream, client, server_client, &request, method, url);
+
+        upstream->active--;
+
+        if (err != 1)
+            break;
+
+        log_warning("upstream %s:%s failed, marked down", upstream->urlbuf.url.host, upstream->urlbuf.url.port);
+
+        err = HTTP_BAD_GATEWAY;
+    }
+
+    client_destroy(client);
+
+    return err;
+}
+
+/*
+ * Check one upstream using a GET request for the health check path.
+ *
+ * Returns 1 if unhealthy.
+ */
+static int server_proxy_check_upstream (struct server_proxy *s, struct server_proxy_upstream *upstream)
+{
+    struct client_stream_response response;
+    struct url target = upstream->urlbuf.url;
+    struct client *client;
+    int err;
+
+    target.path = s->check;
+    target.query = NULL;
+
+    if ((err = client_create(s->handler.event_main, &client))) {
+        log_error("client_create");
+        return -1;
+    }
+
+    // on a new connection each time, as any pooled connection may since have been closed while idle
+    client_set_request_version(client, HTTP_11);
+    client_set_timeout(client, &SERVER_PROXY_CHECK_INTERVAL);
+
+    if ((err = client_open(client, &target))) {
+        err = 1;
+
+    } else if ((err = client_stream_request(client, "GET", &target)) || (err = client_stream_headers(client, 0, false))) {
+        err = 1;
+
+    } else if ((err = client_stream_response(client, &response))) {
+        err = 1;
+
+    } else if (response.status < 200 || response.status > 399) {
+        log_info("%s:%s /%s: %u %s", target.host, target.port, target.path, response.status, response.reason);
+
+        err = 1;
+    }
+
+    // drain the response body
+    while (!err) {
+        char *buf;
+        size_t size = 0;
+
+        if ((err = client_stream_read(client, &buf, &size)) < 0) {
+            err = 1;
+        } else if (err) {
+            err = 0;
+            break;
+        }
+    }
+
+    client_destroy(client);
+
+    return err;
+}
+
+/*
+ * Periodically check each upstream, or mark them up for retrying without any health check path.
+ */
+static void server_proxy_check_task (void *ctx)
+{
+    struct server_proxy *s = ctx;
+
+    while (true) {
+        if (event_sleep(s->check_event, &SERVER_PROXY_CHECK_INTERVAL) < 0) {
+            log_error("event_sleep");
+            break;
+        }
+
+        for (unsigned i = 0; i < s->count; i++) {
+            struct server_proxy_upstream *upstream = &s->upstreams[i];
+            bool down;
+
+            if (s->check)
+                down = server_proxy_check_upstream(s, upstream) != 0;
+            else
+                down = false;
+
+            if (down != upstream->down)
+                log_info("upstream %s:%s is %s", upstream->urlbuf.url.host, upstream->urlbuf.url.port, down ? "down" : "up");
+
+            upstream->down = down;
+        }
+    }
+}
+
+/*
+ * Parse the comma-separated upstreams.
+ */
+static int server_proxy_parse (struct server_proxy *s, const char *upstreams)
+{
+    char *buf, *str, *next;
+    int err = 0;
+
+    if (!(buf = strdup(upstreams))) {
+        log_perror("strdup");
+        return -1;
+    }
+
+    for (next = buf; (str = strsep(&next, ",")); ) {
+        struct server_proxy_upstream *upstream = &s->upstreams[s->count];
+        const struct url *url = &upstream->urlbuf.url;
+
+        if (!*str)
+            continue;
+
+        if (s->count >= SERVER_PROXY_UPSTREAMS) {
+            log_error("too many upstreams, maximum of %d", SERVER_PROXY_UPSTREAMS);
+            err = 1;
+            break;
+        }
+
+        if (urlbuf_parse(&upstream->urlbuf, str)) {
+            log_error("invalid upstream url: %s", str);
+            err = 1;
+            break;
+        }
+
+        if (url->scheme && *url->scheme && strcmp(url->scheme, "http")) {
+            log_error("unsupported upstream url scheme: %s", str);
+            err = 1;
+            break;
+        }
+
+        if (!url->host || !*url->host || (url->path && *url->path) || (url->query && *url->query)) {
+            log_error("upstream url must be of the form http://host:port: %s", str);
+            err = 1;
+            break;
+        }
+
+        // for logging
+        if (!url->port)
+            upstream->urlbuf.url.port = "http";
+
+        log_info("upstream %s:%s", url->host, url->port);
+
+        s->count++;
+    }
+
+    if (!err && !s->count) {
+        log_error("no upstreams given");
+        err = 1;
+    }
+
+    free(buf);
+
+    return err;
+}
+
+int server_proxy_create (struct server_proxy **sp, struct server *server, const char *path, const char *upstreams)
+{
+    struct server_proxy *s;
+
+    if (!(s = calloc(1, sizeof(*s)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    s->handler.request = server_proxy_request;
+    s->handler.name = "proxy";
+
+    if (server_proxy_parse(s, upstreams)) {
+        log_error("server_proxy_parse");
+        goto error;
+    }
+
+    if (client_pool_create(&s->pool, SERVER_PROXY_POOL_HOST, SERVER_PROXY_POOL_MAX, &(struct timeval) { .tv_sec = CLIENT_POOL_IDLE })) {
+        log_error("client_pool_create");
+        goto error;
+    }
+
+    log_info("%s -> %s", path, upstreams);
+
+    if (server_add_handler(server, NULL, path, &s->handler)) {
+        log_error("server_add_handler");
+        goto error;
+    }
+
+    if (event_create(s->handler.event_main, &s->check_event, -1)) {
+        log_error("event_create");
+        goto error;
+    }
+
+    if (event_start(s->handler.event_main, server_proxy_check_task, s)) {
+        log_error("event_start");
+        goto error;
+    }
+
+    *sp = s;
+
+    return 0;
+
+error:
+    server_proxy_destroy(s);
+
+    return -1;
+}
+
+int server_proxy_set_check (struct server_proxy *s, const char *path)
+{
+    // without the leading /
+    while (*path == '/')
+        path++;
+
+    s->check = path;
+
+    return 0;
+}
+
+void server_proxy_destroy (struct server_proxy *s)
+{
+    if (s->check_event)
+        event_destroy(s->check_event);
+
+    if (s->pool)
+        client_pool_destroy(s->pool);
+
+    free(s);
+}
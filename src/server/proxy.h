@@ -0,0 +1,36 @@
+#ifndef SERVER_PROXY_H
+#define SERVER_PROXY_H
+
+#include "server/server.h"
+
+struct server_proxy;
+
+/* Maximum number of upstreams per proxy */
+#define SERVER_PROXY_UPSTREAMS 16
+
+/* Interval between health checks, and for retrying upstreams marked down without any health check path */
+#define SERVER_PROXY_CHECK_INTERVAL ((struct timeval) { .tv_sec = 5 })
+
+/*
+ * Initialize and mount onto the given server path, forwarding any requests to the given comma-separated list of
+ * http://host:port upstreams, including the original request path.
+ *
+ * Requests are balanced across the upstreams by the least number of active requests, skipping any upstreams that
+ * failed to connect until their next health check. Connections to the upstreams are kept in a shared pool for re-use.
+ */
+int server_proxy_create (struct server_proxy **sp, struct server *server, const char *path, const char *upstreams);
+
+/*
+ * Check the health of each upstream every SERVER_PROXY_CHECK_INTERVAL using a GET request for the given /path,
+ * marking upstreams down unless they return a 2xx or 3xx response.
+ */
+int server_proxy_set_check (struct server_proxy *s, const char *path);
+
+/*
+ * Release all associated resources.
+ *
+ * Only do this after the handler has been unregistered, i.e. server_destroy()!
+ */
+void server_proxy_destroy (struct server_proxy *s);
+
+#endif
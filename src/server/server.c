@@ -1,15 +1,33 @@
+// fallocate
+#define _GNU_SOURCE
 #include "server/server.h"
+#include "server/server_test.h"
+#include "server/access.h"
 
 #include "common/http.h"
 #include "common/log.h"
+#include "common/pool.h"
 #include "common/sock.h"
+#include "common/stats.h"
 #include "common/tcp.h"
+#include "common/util.h"
 
+#ifdef WITH_SSL
+#include "common/ssl.h"
+#endif
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/queue.h>
+#include <time.h>
 #include <unistd.h>
 
 struct server {
@@ -18,34 +36,123 @@ struct server {
     /* Listen tasks */
     TAILQ_HEAD(server_listens, server_listen) listens;
 
-    /* Handler lookup */
-    TAILQ_HEAD(server_handlers, server_handler_item) handlers;
+    /* Parked persistent connections */
+    TAILQ_HEAD(server_idles, server_idle) idles;
+
+    /* Stopped accepting new connections, and closing persistent connections, see server_drain() */
+    bool draining;
+
+    /* Handler lookup, by path segment */
+    struct server_route_node *routes;
+
+    /* Custom response headers, serialized */
+    char *headers;
+    size_t headers_len;
+
+    /* Date response header, formatted for date_time */
+    char date[64];
+    size_t date_len;
+    time_t date_time;
+
+    /* Default response output buffer size */
+    size_t output_buffer;
+
+    /* listen() backlog, or 0 for the default */
+    int listen_backlog;
+
+    /* Idle timeouts, see server_set_timeouts() */
+    struct timeval header_timeout, body_timeout, keepalive_timeout;
 
-    /* Response headers */
-    TAILQ_HEAD(server_headers, server_header) headers;
+    /* Open client connections, and limits, see server_set_connections() */
+    unsigned connections;
+    unsigned max_connections, overload_connections;
+
+    /* Optional access log */
+    struct server_access *access;
+
+#ifdef WITH_SSL
+    /* Server context for SERVER_LISTEN_SSL */
+    struct ssl_main *ssl_main;
+#endif
 };
 
 struct server_listen {
     struct server *server;
     struct tcp_server *tcp;
 
+    /* Timer for pacing accepts while overloaded */
+    struct event *event;
+
+    /* enum server_listen_flags */
+    int flags;
+
     TAILQ_ENTRY(server_listen) server_listens;
 };
 
-struct server_handler_item {
-    const char *method;
-    const char *path;
+/*
+ * Request methods known to the route table.
+ */
+enum server_method {
+    SERVER_METHOD_GET,
+    SERVER_METHOD_HEAD,
+    SERVER_METHOD_POST,
+    SERVER_METHOD_PUT,
+    SERVER_METHOD_DELETE,
+    SERVER_METHOD_OPTIONS,
+    SERVER_METHOD_PATCH,
+
+    SERVER_METHOD_COUNT
+};
 
-    struct server_handler *handler;
+static const char *server_method_names[SERVER_METHOD_COUNT] = {
+    [SERVER_METHOD_GET]     = "GET",
+    [SERVER_METHOD_HEAD]    = "HEAD",
+    [SERVER_METHOD_POST]    = "POST",
+    [SERVER_METHOD_PUT]     = "PUT",
+    [SERVER_METHOD_DELETE]  = "DELETE",
+    [SERVER_METHOD_OPTIONS] = "OPTIONS",
+    [SERVER_METHOD_PATCH]   = "PATCH",
+};
+
+/*
+ * Handlers registered for one route.
+ */
+struct server_route {
+    /* Bitmask of 1 << enum server_method with a handler */
+    unsigned methods;
+
+    /* Handler for each method */
+    struct server_handler *handlers[SERVER_METHOD_COUNT];
+
+    /* Handler for any other method */
+    struct server_handler *any;
+};
+
+/*
+ * Route trie node, for one path segment.
+ */
+struct server_route_node {
+    /* Path segment, not NUL-terminated */
+    const char *name;
+    size_t len;
 
-    TAILQ_ENTRY(server_handler_item) server_handlers;
+    /* Routes for this exact path, and for this path and anything below it */
+    struct server_route *exact, *prefix;
+
+    /* Child nodes, sorted by server_route_cmp() */
+    struct server_route_node **children;
+    unsigned children_count, children_size;
 };
 
-struct server_header {
-    char *name;
-    char *value;
+/*
+ * Connection state for the access log, kept across requests.
+ */
+struct server_conn {
+    /* event_main_usec() when accepted */
+    uint64_t accept;
 
-    TAILQ_ENTRY(server_header) server_headers;
+    /* Client address */
+    struct sockaddr_storage peer;
 };
 
 struct server_client {
@@ -53,6 +160,13 @@ struct server_client {
     struct tcp *tcp;
     struct http *http;
 
+    /* Only used with an access log, with an AF_UNSPEC peer otherwise */
+    struct server_conn conn;
+
+    /* Response output buffer, allocated on first use */
+    char *output;
+    size_t output_size;
+
     /* Request */
     struct server_request {
         /* Storage for request method field */
@@ -67,9 +181,21 @@ struct server_client {
         /* Decoded request URL, including query */
         struct url url;
 
+        /* Request headers, parsed in-place in the read buffer */
+        struct http_headers header_table;
+
+        /* Iterating headers for server_request_header() */
+        unsigned header_index;
+
         /* Size of request entity, or zero */
         size_t content_length;
 
+        /* Request entity uses the chunked transfer-encoding, of unknown size */
+        bool chunked;
+
+        /* Amount of request entity read using server_request_read() */
+        size_t body_read;
+
         /* Does the client support HTTP/1.1? */
         bool http11;
 
@@ -91,6 +217,10 @@ struct server_client {
         /* Decoding POST params */
         char *post_form;
 
+        /* All GET or POST params, decoded at once by server_request_params() */
+        struct url_params param_table;
+        bool params;
+
     } request;
     
     /* Response */
@@ -117,13 +247,29 @@ struct server_client {
          */ 
         bool close;
 
+        /* Response body output is being buffered, up to output_max, with output_len bytes pending */
+        bool buffered;
+        size_t output_len, output_max;
+
     } response;
 
     int err;
 };
 
-/* Idle timeout used for client reads; reset on every read operation */
-static const struct timeval SERVER_READ_TIMEOUT = { .tv_sec = 10 };
+/*
+ * Idle persistent client connection, parked between requests without any task or request state.
+ */
+struct server_idle {
+    struct server *server;
+    struct tcp *tcp;
+    struct server_conn conn;
+
+    /* Parked connections, for server_drain() */
+    TAILQ_ENTRY(server_idle) server_idles;
+};
+
+static struct pool server_client_pool = POOL_INIT("server_client", sizeof(struct server_client));
+static struct pool server_idle_pool = POOL_INIT("server_idle", sizeof(struct server_idle));
 
 /* Idle timeout used for client write buffering; reset on every write operation */
 static const struct timeval SERVER_WRITE_TIMEOUT = { .tv_sec = 10 };
@@ -138,135 +284,441 @@ int server_create (struct event_main *event_main, struct server **serverp)
     }
 
     TAILQ_INIT(&server->listens);
-    TAILQ_INIT(&server->handlers);
-    TAILQ_INIT(&server->headers);
+    TAILQ_INIT(&server->idles);
+
+    if (!(server->routes = calloc(1, sizeof(*server->routes)))) {
+        log_perror("calloc");
+        free(server);
+        return -1;
+    }
 
     server->event_main = event_main;
+    server->output_buffer = SERVER_OUTPUT_BUFFER;
+    server->header_timeout = SERVER_HEADER_TIMEOUT;
+    server->body_timeout = SERVER_BODY_TIMEOUT;
+    server->keepalive_timeout = SERVER_KEEPALIVE_TIMEOUT;
 
     *serverp = server;
 
     return 0;
 }
 
+/*
+ * Lookup a known method.
+ *
+ * Returns <0 if not known.
+ */
+static int server_method (const char *method)
+{
+    for (int i = 0; i < SERVER_METHOD_COUNT; i++) {
+        if (!strcmp(server_method_names[i], method))
+            return i;
+    }
+
+    return -1;
+}
+
+/*
+ * Compare a path segment against a node, ordering by length first.
+ */
+static int server_route_cmp (const struct server_route_node *node, const char *name, size_t len)
+{
+    if (node->len != len)
+        return node->len < len ? -1 : 1;
+
+    return memcmp(node->name, name, len);
+}
+
+/*
+ * Find the child node for the given path segment, or the index to insert it at.
+ */
+static struct server_route_node *server_route_child (struct server_route_node *node, const char *name, size_t len, unsigned *indexp)
+{
+    unsigned lo = 0, hi = node->children_count;
+
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        int cmp = server_route_cmp(node->children[mid], name, len);
+
+        if (!cmp)
+            return node->children[mid];
+        else if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (indexp)
+        *indexp = lo;
+
+    return NULL;
+}
+
+/*
+ * Find or insert a child node for the given path segment.
+ */
+static struct server_route_node *server_route_insert (struct server_route_node *node, const char *name, size_t len)
+{
+    struct server_route_node *child;
+    unsigned index;
+
+    if ((child = server_route_child(node, name, len, &index)))
+        return child;
+
+    if (node->children_count >= node->children_size) {
+        unsigned size = node->children_size ? node->children_size * 2 : 4;
+        struct server_route_node **children;
+
+        if (!(children = realloc(node->children, size * sizeof(*children)))) {
+            log_perror("realloc");
+            return NULL;
+        }
+
+        node->children = children;
+        node->children_size = size;
+    }
+
+    if (!(child = calloc(1, sizeof(*child)))) {
+        log_perror("calloc");
+        return NULL;
+    }
+
+    child->name = name;
+    child->len = len;
+
+    memmove(&node->children[index + 1], &node->children[index], (node->children_count - index) * sizeof(*node->children));
+
+    node->children[index] = child;
+    node->children_count++;
+
+    return child;
+}
+
 int server_add_handler (struct server *server, const char *method, const char *path, struct server_handler *handler)
 {
-    struct server_handler_item *h = NULL;
+    struct server_route_node *node = server->routes;
+    struct server_route **routep, *route;
+    int m = -1;
 
     if (!handler) {
         log_fatal("NULL handler given");
         return -1;
     }
 
-    if (!(h = calloc(1, sizeof(*h)))) {
-        log_pwarning("calloc");
+    if (method && (m = server_method(method)) < 0) {
+        log_fatal("unknown method: %s", method);
+        return -1;
+    }
+
+    if (!path)
+        path = "";
+
+    // walk path segments, omitting any trailing /
+    for (const char *segment = path, *end; *segment; segment = end + 1) {
+        if (!(end = strchr(segment, '/')))
+            end = segment + strlen(segment);
+
+        if (!(node = server_route_insert(node, segment, end - segment)))
+            return -1;
+
+        if (!*end || !end[1])
+            break;
+    }
+
+    // empty path, or a trailing / matches anything below
+    if (!*path || path[strlen(path) - 1] == '/')
+        routep = &node->prefix;
+    else
+        routep = &node->exact;
+
+    if (!(route = *routep) && !(route = *routep = calloc(1, sizeof(*route)))) {
+        log_perror("calloc");
         return -1;
     }
 
-    h->method = method;
-    h->path = path;
-    h->handler = handler;
+    if (m < 0 && !route->any) {
+        route->any = handler;
+
+    } else if (m >= 0 && !route->handlers[m]) {
+        route->handlers[m] = handler;
+        route->methods |= 1 << m;
 
-    TAILQ_INSERT_TAIL(&server->handlers, h, server_handlers);
+    } else {
+        log_warning("%s /%s: already registered", method ? method : "*", path);
+    }
 
     // export state to handler
     handler->event_main = server->event_main;
+    handler->stats = stats_handler(handler->name);
 
     return 0;
 }
 
 /*
- * Match request path against handler.
- *
- * Returns 1 on mismatch, 0 on match.
+ * Lookup a handler for the given route and method, or NULL.
  */
-int server_match_handler_path (struct server_handler_item *handler, const char *path)
+static struct server_handler *server_route_handler (const struct server_route *route, int method)
 {
-    size_t pathlen = strlen(handler->path), requestlen = strlen(path);
+    if (method >= 0 && route->methods & (1 << method))
+        return route->handlers[method];
+    else
+        return route->any;
+}
 
-    if (!handler->path || !pathlen)
-        // empty path always matches
-        return 0;
+/* Maximum number of routes matching a request path */
+#define SERVER_ROUTE_DEPTH 32
+
+int server_lookup_handler (struct server *server, const char *method, const char *path, struct server_handler **handlerp)
+{
+    const struct server_route *routes[SERVER_ROUTE_DEPTH];
+    struct server_route_node *node = server->routes;
+    struct server_handler *handler;
+    int count = 0, m = server_method(method);
+    bool exact = true;
 
-    // handle trailing /
-    size_t prefixlen = pathlen - 1;
-    char endswith = handler->path[prefixlen];
+    if (node->prefix)
+        routes[count++] = node->prefix;
 
-    if (endswith != '/') {
-        // no trailing /: strict match
-        return strcmp(handler->path, path);
-    } else {
-        // trailing /: prefix match, but with optional trailing / in request
-        if (requestlen == prefixlen)
-            // strict match, omitting trailing /
-            return strncmp(handler->path, path, prefixlen);
-        else
-            // prefix match, including trailing /
-            return strncmp(handler->path, path, pathlen);
+    // walk path segments, collecting prefix routes
+    for (const char *segment = path, *end; *segment; segment = end + 1) {
+        if (!(end = strchr(segment, '/')))
+            end = segment + strlen(segment);
+
+        if (!(node = server_route_child(node, segment, end - segment, NULL))) {
+            exact = false;
+            break;
+        }
+
+        if (node->prefix && count < SERVER_ROUTE_DEPTH)
+            routes[count++] = node->prefix;
+
+        if (!*end)
+            break;
+
+        if (!end[1]) {
+            // trailing / only matches prefix routes
+            exact = false;
+            break;
+        }
+    }
+
+    // exact match takes precedence
+    if (exact && node->exact && count < SERVER_ROUTE_DEPTH)
+        routes[count++] = node->exact;
+
+    // most-specific route first, falling back to less specific routes for other methods
+    for (int i = count - 1; i >= 0; i--) {
+        if ((handler = server_route_handler(routes[i], m))) {
+            *handlerp = handler;
+            return 0;
+        }
+    }
+
+    // a matching path but mismatching method is 405
+    log_warning("%s: %d", path, count ? 405 : 404);
+
+    return count ? 405 : 404;
+}
+
+int server_set_output_buffer (struct server *server, size_t size)
+{
+    server->output_buffer = size;
+
+    return 0;
+}
+
+int server_set_listen_backlog (struct server *server, int backlog)
+{
+    if (backlog < 0) {
+        log_error("invalid backlog: %d", backlog);
+        return -1;
+    }
+
+    server->listen_backlog = backlog;
+
+    return 0;
+}
+
+int server_set_timeouts (struct server *server, const struct timeval *header, const struct timeval *body, const struct timeval *keepalive)
+{
+    if (header)
+        server->header_timeout = *header;
+
+    if (body)
+        server->body_timeout = *body;
+
+    if (keepalive)
+        server->keepalive_timeout = *keepalive;
+
+    return 0;
+}
+
+int server_set_connections (struct server *server, unsigned max, unsigned overload)
+{
+    if (!overload)
+        overload = (unsigned long long) max * SERVER_OVERLOAD_PERCENT / 100;
+
+    if (max && (!overload || overload > max)) {
+        log_error("invalid overload threshold %u for %u connections", overload, max);
+        return -1;
     }
+
+    server->max_connections = max;
+    server->overload_connections = overload;
+
+    return 0;
 }
 
 /*
- * Lookup a handler for the given request.
+ * Test for at least the given number of connections, or false if unlimited.
  */
-int server_lookup_handler (struct server *server, const char *method, const char *path, struct server_handler **handlerp)
+static bool server_connections_over (struct server *server, unsigned limit)
 {
-    struct server_handler_item *h;
-    enum http_status status = 404;
+    return limit && server->connections >= limit;
+}
 
-    TAILQ_FOREACH(h, &server->handlers, server_handlers) {
-        if (h->path && server_match_handler_path(h, path))
-            continue;
+/*
+ * Close a client connection, once done with it.
+ */
+static void server_close (struct server *server, struct tcp *tcp)
+{
+    server->connections--;
 
-        if (h->method && strcmp(h->method, method)) {
-            // chain along so that a matching path but mismatching method is 405
-            status = 405;
-            continue;
+    tcp_destroy(tcp);
+}
+
+int server_add_header (struct server *server, const char *name, const char *value)
+{
+    size_t len = strlen(name) + 2 + strlen(value) + 2;
+    char *headers;
+
+    if (!(headers = realloc(server->headers, server->headers_len + len + 1))) {
+        log_perror("realloc");
+        return -1;
+    }
+
+    server->headers = headers;
+
+    // name: value\r\n
+    snprintf(server->headers + server->headers_len, len + 1, "%s: %s\r\n", name, value);
+
+    server->headers_len += len;
+
+    return 0;
+}
+
+/*
+ * Return the Date response header line, re-formatting it at most once per second.
+ */
+static const char *server_date (struct server *server, size_t *lenp)
+{
+    time_t now = event_main_now(server->event_main)->tv_sec;
+    struct tm tm;
+
+    if (now != server->date_time) {
+        if (!gmtime_r(&now, &tm)) {
+            log_perror("gmtime_r");
+            return NULL;
         }
 
-        log_debug("%s", h->path);
+        if (!(server->date_len = strftime(server->date, sizeof(server->date), "Date: " HTTP_DATE_FORMAT "\r\n", &tm))) {
+            log_error("strftime");
+            return NULL;
+        }
 
-        *handlerp = h->handler;
-        return 0;
+        server->date_time = now;
     }
 
-    log_warning("%s: %d", path, status);
-    return status;
+    *lenp = server->date_len;
+
+    return server->date;
 }
 
-int server_add_header (struct server *server, const char *name, const char *value)
+/*
+ * Process the well-known request headers.
+ *
+ * Returns 0 on success, http 4xx on client error.
+ */
+static int server_request_headers (struct server_client *client)
 {
-    struct server_header *header;
+    const struct http_headers *headers = &client->request.header_table;
+    const char *value;
 
-    if (!(header = calloc(1, sizeof(*header)))) {
-        log_perror("calloc");
-        return -1;
+    for (unsigned i = 0; i < headers->count; i++) {
+        log_info("\t%20s : %s", headers->headers[i].name, headers->headers[i].value);
     }
 
-    if (!(header->name = strdup(name))) {
-        log_perror("strdup");
-        goto error;
+    if ((value = http_headers_get(headers, HTTP_HEADER_CONTENT_LENGTH))) {
+        if (sscanf(value, "%zu", &client->request.content_length) != 1) {
+            log_warning("invalid content_length: %s", value);
+            return 400;
+        }
+
+        log_debug("content_length=%zu", client->request.content_length);
     }
 
-    if (!(header->value = strdup(value))) {
-        log_perror("strdup");
-        goto error;
+    if ((value = http_headers_get(headers, HTTP_HEADER_TRANSFER_ENCODING))) {
+        if (strcasecmp(value, "chunked") != 0) {
+            log_warning("unsupported transfer-encoding: %s", value);
+            return 501;
+        }
+
+        log_debug("request content is chunked");
+
+        client->request.chunked = true;
+
+        if (client->request.content_length) {
+            // ambiguous framing, do not trust the rest of the connection
+            client->request.content_length = 0;
+            client->response.close = true;
+        }
     }
 
-    // ok
-    TAILQ_INSERT_TAIL(&server->headers, header, server_headers);
+    if ((value = http_headers_get(headers, HTTP_HEADER_HOST))) {
+        if (strlen(value) >= sizeof(client->request.hostbuf)) {
+            log_warning("host is too long: %zu", strlen(value));
+            return 400;
+        } else {
+            strncpy(client->request.hostbuf, value, sizeof(client->request.hostbuf));
+        }
 
-    return 0;
+        // TODO: parse :port?
+        client->request.url.host = client->request.hostbuf;
+    }
 
-error:
-    free(header->value);
-    free(header->name);
-    free(header);
+    if ((value = http_headers_get(headers, HTTP_HEADER_CONNECTION))) {
+        if (strcasecmp(value, "close") == 0) {
+            log_debug("using connection-close");
 
-    return -1;
+            client->response.close = true;
+
+        } else if (strcasecmp(value, "keep-alive") == 0) {
+            /* Used by some HTTP/1.1 clients, apparently to request persistent connections.. */
+            log_debug("explicitly not using connection-close");
+
+            client->response.close = false;
+
+        } else {
+            log_warning("unknown connection header: %s", value);
+        }
+    }
+
+    if ((value = http_headers_get(headers, HTTP_HEADER_CONTENT_TYPE))) {
+        if (strcasecmp(value, "application/x-www-form-urlencoded") == 0) {
+            log_debug("request content is form data");
+
+            client->request.content_form = true;
+        }
+    }
+
+    // all headers have been read
+    client->request.headers = true;
+
+    return 0;
 }
 
 /*
- * Read the client request line.
+ * Read the client request line and headers.
  *
  * Returns 0 on success, <0 on internal error, 1 on EOF, http 4xx on client error.
  */
@@ -280,7 +732,7 @@ int server_request (struct server_client *client)
         return -1;
     }
 
-    if ((err = http_read_request(client->http, &method, &path, &version)))
+    if ((err = http_read_request_headers(client->http, &method, &path, &version, &client->request.header_table)))
         return err;
 
     if (strlen(method) >= sizeof(client->request.method)) {
@@ -333,7 +785,7 @@ int server_request (struct server_client *client)
         client->request.post = true;
     }
 
-    return 0;
+    return server_request_headers(client);
 }
 
 int server_request_query (struct server_client *client, const char **keyp, const char **valuep)
@@ -345,82 +797,56 @@ int server_request_query (struct server_client *client, const char **keyp, const
 
 int server_request_header (struct server_client *client, const char **namep, const char **valuep)
 {
-    int err;
+    const struct http_headers *headers = &client->request.header_table;
 
     if (!client->request.request) {
         log_fatal("premature read of request headers before request line");
         return -1;
     }
 
-    if (client->request.headers) {
-        log_warning("request headers have already been read");
-        
-        // ignore..
-        return 1;
-    }
-
-    if ((err = http_read_header(client->http, namep, valuep)) < 0) {
-        log_warning("http_read_header");
-        return err;
-    }
-
-    if (err == 1) {
+    if (client->request.header_index >= headers->count) {
         log_debug("end of headers");
-        client->request.headers = true;
         return 1;
-    } else if (err) {
-        log_warning("http_read_header: %d", err);
-        return err;
     }
 
+    const struct http_header *header = &headers->headers[client->request.header_index++];
+
     // mark as having read some headers
     client->request.header = true;
 
-    log_info("\t%20s : %s", *namep, *valuep);
-
-    if (strcasecmp(*namep, "Content-Length") == 0) {
-        if (sscanf(*valuep, "%zu", &client->request.content_length) != 1) {
-            log_warning("invalid content_length: %s", *valuep);
-            return 400;
-        }
+    *namep = header->name;
+    *valuep = header->value;
 
-        log_debug("content_length=%zu", client->request.content_length);
+    return 0;
+}
 
-    } else if (strcasecmp(*namep, "Host") == 0) {
-        if (strlen(*valuep) >= sizeof(client->request.hostbuf)) {
-            log_warning("host is too long: %zu", strlen(*valuep));
-            return 400;
-        } else {
-            strncpy(client->request.hostbuf, *valuep, sizeof(client->request.hostbuf));
-        }
-        
-        // TODO: parse :port?
-        client->request.url.host = client->request.hostbuf;
-
-    } else if (strcasecmp(*namep, "Connection") == 0) {
-        if (strcasecmp(*valuep, "close") == 0) {
-            log_debug("using connection-close");
-
-            client->response.close = true;
-
-        } else if (strcasecmp(*valuep, "keep-alive") == 0) {
-            /* Used by some HTTP/1.1 clients, apparently to request persistent connections.. */
-            log_debug("explicitly not using connection-close");
+const char * server_request_header_value (struct server_client *client, enum http_header_id id)
+{
+    if (!client->request.request) {
+        log_fatal("premature read of request headers before request line");
+        return NULL;
+    }
 
-            client->response.close = false;
+    return http_headers_get(&client->request.header_table, id);
+}
 
-        } else {
-            log_warning("unknown connection header: %s", *valuep);
-        }
+int server_request_peer (struct server_client *client, char *buf, size_t size)
+{
+    struct sockaddr_storage addr = client->conn.peer;
+    socklen_t len = sizeof(addr);
+    int err;
 
-    } else if (strcasecmp(*namep, "Content-Type") == 0) {
-        if (strcasecmp(*valuep, "application/x-www-form-urlencoded") == 0) {
-            log_debug("request content is form data");
+    // only known with an access log
+    if (addr.ss_family == AF_UNSPEC && getpeername(tcp_sock(client->tcp), (struct sockaddr *) &addr, &len)) {
+        log_pwarning("getpeername");
+        return -1;
+    }
 
-            client->request.content_form = true;
-        }
+    if ((err = getnameinfo((struct sockaddr *) &addr, sizeof(addr), buf, size, NULL, 0, NI_NUMERICHOST))) {
+        log_warning("getnameinfo: %s", gai_strerror(err));
+        return -1;
     }
-    
+
     return 0;
 }
 
@@ -477,6 +903,148 @@ int server_request_param (struct server_client *client, const char **keyp, const
     return server_request_form(client, keyp, valuep);
 }
 
+int server_request_params (struct server_client *client, const struct url_params **paramsp)
+{
+    char *query;
+
+    if (client->request.params) {
+        // already decoded
+        *paramsp = &client->request.param_table;
+
+        return 0;
+    }
+
+    if (client->request.get_query || !client->request.post) {
+        query = client->request.get_query;
+        client->request.get_query = NULL;
+
+    } else if (!client->request.headers) {
+        log_fatal("reading request form data before headers?");
+        return -1;
+
+    } else if (!client->request.content_length) {
+        return 411; // Length Required
+
+    } else if (!client->request.content_form) {
+        return 415; // Unsupported Media Type
+
+    } else {
+        if (!client->request.post_form && !client->request.body) {
+            if (http_read_string(client->http, &client->request.post_form, client->request.content_length)) {
+                log_warning("http_read_string");
+                return -1;
+            }
+
+            client->request.body = true;
+        }
+
+        query = client->request.post_form;
+        client->request.post_form = NULL;
+    }
+
+    log_debug("%s", query);
+
+    if (url_params_parse(&client->request.param_table, query)) {
+        log_warning("url_params_parse");
+        return -1;
+    }
+
+    client->request.params = true;
+    *paramsp = &client->request.param_table;
+
+    return 0;
+}
+
+int server_request_body (struct server_client *client, char **bufp, size_t *lenp, size_t max)
+{
+    int err;
+
+    if (!client->request.headers) {
+        log_fatal("read request body without reading headers!?");
+        return -1;
+    }
+
+    if (client->request.body || client->request.body_read) {
+        log_fatal("re-reading request body...");
+        return -1;
+    }
+
+    if (!client->request.content_length) {
+        log_debug("no request body given");
+        return 411;
+    }
+
+    if (client->request.content_length > max) {
+        log_warning("request body too large: %zu > %zu", client->request.content_length, max);
+        return 413;
+    }
+
+    if ((err = http_read_string(client->http, bufp, client->request.content_length))) {
+        log_warning("http_read_string");
+        return err < 0 ? err : 400;
+    }
+
+    client->request.body = true;
+
+    *lenp = client->request.content_length;
+
+    return 0;
+}
+
+int server_request_read (struct server_client *client, char **bufp, size_t *sizep)
+{
+    int err;
+
+    if (!client->request.headers) {
+        log_fatal("read request body without reading headers!?");
+        return -1;
+    }
+
+    if (client->request.body) {
+        return 1;
+
+    } else if (!client->request.chunked && client->request.body_read >= client->request.content_length) {
+        client->request.body = true;
+        return 1;
+    }
+
+    // any deferred responses to earlier pipelined requests must not wait behind the body
+    if (!client->request.body_read && (err = http_flush(client->http))) {
+        log_warning("http_flush");
+        return err;
+    }
+
+    if (client->request.chunked) {
+        if ((err = http_read_chunked(client->http, bufp, sizep)) < 0) {
+            log_warning("http_read_chunked");
+            return err;
+
+        } else if (err) {
+            client->request.body = true;
+            return 1;
+        }
+
+    } else {
+        size_t remaining = client->request.content_length - client->request.body_read;
+
+        if (!*sizep || *sizep > remaining)
+            *sizep = remaining;
+
+        if ((err = http_read(client->http, bufp, sizep)) < 0) {
+            log_warning("http_read");
+            return err;
+
+        } else if (err) {
+            log_warning("premature EOF: %zu", remaining);
+            return 400;
+        }
+    }
+
+    client->request.body_read += *sizep;
+
+    return 0;
+}
+
 int server_request_file (struct server_client *client, int fd)
 {
     int err;
@@ -493,13 +1061,37 @@ int server_request_file (struct server_client *client, int fd)
         return -1;
     }
 
-    // TODO: Transfer-Encoding?
-    if (!client->request.content_length) {
+    if (!client->request.content_length && !client->request.chunked) {
         log_debug("no request body given");
         return 411;
     }
-        
-    if (((err = http_read_file(client->http, fd, client->request.content_length)))){
+
+    // any deferred responses to earlier pipelined requests must not wait behind the body
+    if ((err = http_flush(client->http))) {
+        log_warning("http_flush");
+        return err;
+    }
+
+    if (client->request.chunked) {
+        // continues after any server_request_read()
+        if ((err = http_read_chunked_file(client->http, fd))) {
+            log_warning("http_read_chunked_file");
+            return err;
+        }
+
+        client->request.body = true;
+
+        return 0;
+    }
+
+#ifdef FALLOC_FL_KEEP_SIZE
+    // reserve space up front to avoid fragmenting large uploads; purely advisory
+    if (!client->request.body_read && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, client->request.content_length))
+        log_pdebug("fallocate");
+#endif
+
+    if (client->request.body_read < client->request.content_length
+            && (err = http_read_file(client->http, fd, client->request.content_length - client->request.body_read))) {
         log_warning("http_read_file");
         return err;
     }
@@ -529,16 +1121,30 @@ int server_response (struct server_client *client, enum http_status status, cons
         return err;
     }
 
-    // custom headers
-    struct server_header *header;
+    // date and custom headers
+    struct iovec iov[2] = {
+        { NULL, 0 },
+        { client->server->headers, client->server->headers_len },
+    };
 
-    TAILQ_FOREACH(header, &client->server->headers, server_headers) {
-        if ((err = http_write_header(client->http, header->name, "%s", header->value))) {
-            log_error("failed to write response header");
-            return -1;
-        }
+    if (!(iov[0].iov_base = (char *) server_date(client->server, &iov[0].iov_len))) {
+        log_error("failed to format date header");
+        return -1;
     }
-    
+
+    if ((err = http_writev(client->http, iov, 2))) {
+        log_error("failed to write response headers");
+        return -1;
+    }
+
+    // let the client know to reconnect elsewhere for any further requests
+    if (client->server->draining && !client->response.close) {
+        client->response.close = true;
+
+        if ((err = server_response_header(client, "Connection", "close")))
+            return err;
+    }
+
     return 0;
 }
 
@@ -574,6 +1180,28 @@ int server_response_header (struct server_client *client, const char *name, cons
     return 0;
 }
 
+int server_response_header_lines (struct server_client *client, const char *buf, size_t len)
+{
+    if (!client->response.status) {
+        log_fatal("attempting to send headers without status");
+        return -1;
+    }
+
+    if (client->response.headers) {
+        log_fatal("attempting to re-send headers");
+        return -1;
+    }
+
+    client->response.header = true;
+
+    if (len && http_write(client->http, buf, len)) {
+        log_error("failed to write response header lines");
+        return -1;
+    }
+
+    return 0;
+}
+
 int server_response_headers (struct server_client *client)
 {
     client->response.headers = true;
@@ -586,6 +1214,26 @@ int server_response_headers (struct server_client *client)
     return 0;
 }
 
+/*
+ * Send the response body from the given file offset, leaving the file position as-is for any other users of the same fd.
+ */
+static int server_response_body_file (struct server_client *client, int fd, off_t offset, size_t length)
+{
+    if (client->response.body) {
+        log_fatal("attempting to re-send body");
+        return -1;
+    }
+
+    client->response.body = true;
+
+    if (http_write_file(client->http, fd, &offset, length)) {
+        log_error("http_write_file");
+        return -1;
+    }
+
+    return 0;
+}
+
 int server_response_file (struct server_client *client, int fd, size_t content_length)
 {
     int err;
@@ -609,82 +1257,413 @@ int server_response_file (struct server_client *client, int fd, size_t content_l
         return err;
     }
 
-    // body
-    if (client->response.body) {
-        log_fatal("attempting to re-send body");
+    // from the start of the file
+    return server_response_body_file(client, fd, 0, content_length);
+}
+
+int server_response_buffer (struct server_client *client, const char *head, size_t head_len, const char *body, size_t body_len)
+{
+    if (!client->response.status) {
+        log_fatal("attempting to send headers without status");
         return -1;
     }
 
+    if (client->response.headers || client->response.body) {
+        log_fatal("attempting to re-send headers or body");
+        return -1;
+    }
+
+    client->response.header = true;
+    client->response.headers = true;
     client->response.body = true;
 
-    if (http_write_file(client->http, fd, content_length)) {
-        log_error("http_write_file");
+    // together with the buffered response line, if it fits
+    struct iovec iov[2] = {
+        { (char *) head, head_len },
+        { (char *) body, body_len },
+    };
+
+    if (http_writev(client->http, iov, 2)) {
+        log_error("http_writev");
         return -1;
     }
 
     return 0;
 }
 
-int server_response_print (struct server_client *client, const char *fmt, ...)
+/*
+ * Format one multipart/byteranges part header into buf, or just return the length if buf is NULL.
+ */
+static int server_response_part (char *buf, size_t size, const char *boundary, const char *content_type, const struct http_range *range, off_t file_size)
 {
-    va_list args;
-    int err = 0;
+    return snprintf(buf, size, "\r\n--%s\r\n%s%s%sContent-Range: bytes %jd-%jd/%jd\r\n\r\n",
+            boundary,
+            content_type ? "Content-Type: " : "",
+            content_type ? content_type : "",
+            content_type ? "\r\n" : "",
+            (intmax_t) range->start, (intmax_t) (range->start + range->length - 1), (intmax_t) file_size
+    );
+}
 
-    if (!client->response.status) {
-        log_fatal("attempting to send response body without status");
-        return -1;
-    }
+int server_response_file_ranges (struct server_client *client, int fd, off_t size, const struct http_range *ranges, unsigned count, const char *content_type)
+{
+    static unsigned boundary_seq;
+    char boundary[32], part[512];
+    size_t content_length = 0;
+    int err, len;
 
-    if (!client->response.headers) {
-        // use chunked transfer-encoding for HTTP/1.1, and close connection for HTTP/1.0
-        if (client->request.http11) {
-            log_debug("using chunked transfer-encoding");
+    if (count == 1) {
+        const struct http_range *range = &ranges[0];
 
-            client->response.chunked = true;
+        if (content_type && (err = server_response_header(client, "Content-Type", "%s", content_type)))
+            return err;
 
-            err |= server_response_header(client, "Transfer-Encoding", "chunked");
-            err |= server_response_headers(client);
-        } else {
-            log_debug("using connection close");
+        if ((err = server_response_header(client, "Content-Range", "bytes %jd-%jd/%jd",
+                (intmax_t) range->start, (intmax_t) (range->start + range->length - 1), (intmax_t) size
+        )))
+            return err;
 
-            client->response.close = true;
+        if ((err = server_response_header(client, "Content-Length", "%jd", (intmax_t) range->length)))
+            return err;
 
-            err |= server_response_header(client, "Connection", "close");
-            err |= server_response_headers(client);
+        if ((err = server_response_headers(client)))
+            return err;
+
+        return server_response_body_file(client, fd, range->start, range->length);
+    }
+
+    // unique enough to not appear in the parts
+    snprintf(boundary, sizeof(boundary), "%08x%08x", (unsigned) time(NULL), boundary_seq++);
+
+    // total length of all parts, for a fixed Content-Length
+    for (unsigned i = 0; i < count; i++) {
+        if ((len = server_response_part(NULL, 0, boundary, content_type, &ranges[i], size)) < 0 || len >= sizeof(part)) {
+            log_error("multipart header too long");
+            return -1;
         }
+
+        content_length += len + ranges[i].length;
     }
 
-    if (err)
+    content_length += snprintf(NULL, 0, "\r\n--%s--\r\n", boundary);
+
+    if ((err = server_response_header(client, "Content-Type", "multipart/byteranges; boundary=%s", boundary)))
         return err;
-    
-    // body
-    client->response.body = true;
 
-    va_start(args, fmt);
-    if (client->response.chunked) {
-        err = http_vprint_chunk(client->http, fmt, args);
-    } else {
-        err = http_vwrite(client->http, fmt, args);
+    if ((err = server_response_header(client, "Content-Length", "%zu", content_length)))
+        return err;
+
+    if ((err = server_response_headers(client)))
+        return err;
+
+    for (unsigned i = 0; i < count; i++) {
+        len = server_response_part(part, sizeof(part), boundary, content_type, &ranges[i], size);
+
+        if ((err = http_write(client->http, part, len))) {
+            log_error("http_write");
+            return err;
+        }
+
+        // re-sets response.body for each part
+        client->response.body = false;
+
+        if ((err = server_response_body_file(client, fd, ranges[i].start, ranges[i].length)))
+            return err;
     }
-    va_end(args);
 
-    if (err) {
-        log_warning("http_write");
+    if ((err = http_writef(client->http, "\r\n--%s--\r\n", boundary))) {
+        log_error("http_writef");
         return err;
     }
 
     return 0;
 }
 
-int server_response_redirect (struct server_client *client, const char *host, const char *fmt, ...)
+/*
+ * Send the end-of-headers for a response body of unknown length.
+ */
+static int server_response_start (struct server_client *client)
 {
-    char path[HTTP_PATH_MAX];
-    int ret;
-    va_list args;
+    int err = 0;
 
-    va_start(args, fmt);
-    ret = vsnprintf(path, sizeof(path), fmt, args);
-    va_end(args);
+    // use chunked transfer-encoding for HTTP/1.1, and close connection for HTTP/1.0
+    if (client->request.http11) {
+        log_debug("using chunked transfer-encoding");
+
+        client->response.chunked = true;
+
+        err |= server_response_header(client, "Transfer-Encoding", "chunked");
+        err |= server_response_headers(client);
+    } else {
+        log_debug("using connection close");
+
+        client->response.close = true;
+
+        err |= server_response_header(client, "Connection", "close");
+        err |= server_response_headers(client);
+    }
+
+    return err;
+}
+
+/*
+ * Start a response body of unknown length, if not yet started.
+ *
+ * With an output buffer, the end-of-headers are deferred until the buffer overflows, or the response ends.
+ */
+static int server_response_stream (struct server_client *client)
+{
+    int err = 0;
+
+    if (!client->response.status) {
+        log_fatal("attempting to send response body without status");
+        return -1;
+    }
+
+    if (client->response.headers || client->response.buffered) {
+        // already started
+    } else if (client->response.output_max) {
+        if (client->output_size < client->response.output_max) {
+            char *output;
+
+            if (!(output = realloc(client->output, client->response.output_max))) {
+                log_perror("realloc");
+                return -1;
+            }
+
+            client->output = output;
+            client->output_size = client->response.output_max;
+        }
+
+        log_debug("buffering response output");
+
+        client->response.buffered = true;
+
+    } else if ((err = server_response_start(client))) {
+        return err;
+    }
+
+    // body
+    client->response.body = true;
+
+    return 0;
+}
+
+/*
+ * Send out the buffered response output as one chunk, starting the response body if not yet started.
+ */
+static int server_response_output (struct server_client *client)
+{
+    int err;
+
+    if (!client->response.headers && (err = server_response_start(client)))
+        return err;
+
+    if (!client->response.output_len) {
+        return 0;
+
+    } else if (client->response.chunked) {
+        err = http_write_chunk(client->http, client->output, client->response.output_len);
+    } else {
+        err = http_write(client->http, client->output, client->response.output_len);
+    }
+
+    if (err) {
+        log_warning("http_write");
+        return err;
+    }
+
+    client->response.output_len = 0;
+
+    return 0;
+}
+
+/*
+ * End the buffered response output, using a Content-Length if the response body was not yet started.
+ */
+static int server_response_end (struct server_client *client)
+{
+    int err = 0;
+
+    if (!client->response.buffered)
+        return 0;
+
+    client->response.buffered = false;
+
+    if (client->response.headers)
+        return server_response_output(client);
+
+    log_debug("using content-length for buffered output");
+
+    err |= server_response_header(client, "Content-Length", "%zu", client->response.output_len);
+    err |= server_response_headers(client);
+
+    if (err)
+        return err;
+
+    if (client->response.output_len && (err = http_write(client->http, client->output, client->response.output_len))) {
+        log_warning("http_write");
+        return err;
+    }
+
+    return 0;
+}
+
+int server_response_write (struct server_client *client, const char *buf, size_t size)
+{
+    int err;
+
+    if ((err = server_response_stream(client)))
+        return err;
+
+    if (!size)
+        return 0;
+
+    if (client->response.buffered) {
+        if (client->response.output_len + size > client->response.output_max && (err = server_response_output(client)))
+            return err;
+
+        if (client->response.output_len + size <= client->response.output_max) {
+            memcpy(client->output + client->response.output_len, buf, size);
+            client->response.output_len += size;
+
+            return 0;
+        }
+
+        // too large to buffer
+    }
+
+    if (client->response.chunked) {
+        err = http_write_chunk(client->http, buf, size);
+    } else {
+        err = http_write(client->http, buf, size);
+    }
+
+    if (err) {
+        log_warning("http_write");
+        return err;
+    }
+
+    return 0;
+}
+
+int server_response_reserve (struct server_client *client, char **bufp, size_t *sizep)
+{
+    // a buffer for the spans, even without any output buffering
+    size_t size = client->response.output_max ? client->response.output_max : SERVER_OUTPUT_BUFFER;
+    int err;
+
+    if (*sizep > size) {
+        log_error("reserve %zu > output buffer %zu", *sizep, size);
+        return -1;
+    }
+
+    if ((err = server_response_stream(client)))
+        return err;
+
+    if (client->output_size < size) {
+        char *output;
+
+        if (!(output = realloc(client->output, size))) {
+            log_perror("realloc");
+            return -1;
+        }
+
+        client->output = output;
+        client->output_size = size;
+    }
+
+    if (client->response.buffered) {
+        // make room, waiting for the client to accept the buffered output
+        if (client->response.output_len + (*sizep ? *sizep : 1) > size && (err = server_response_output(client)))
+            return err;
+    }
+
+    *bufp = client->output + client->response.output_len;
+    *sizep = size - client->response.output_len;
+
+    return 0;
+}
+
+int server_response_commit (struct server_client *client, size_t size)
+{
+    client->response.output_len += size;
+
+    // send out right away without any output buffering
+    if (!client->response.buffered)
+        return server_response_output(client);
+
+    return 0;
+}
+
+int server_response_print (struct server_client *client, const char *fmt, ...)
+{
+    va_list args;
+    int ret, err;
+
+    if ((err = server_response_stream(client)))
+        return err;
+
+    if (client->response.buffered) {
+        size_t len = client->response.output_len, size = client->response.output_max - len;
+
+        // format into the output buffer, if it fits
+        va_start(args, fmt);
+        ret = vsnprintf(client->output + len, size, fmt, args);
+        va_end(args);
+
+        if (ret < 0) {
+            log_perror("vsnprintf");
+            return -1;
+
+        } else if ((size_t) ret < size) {
+            client->response.output_len += ret;
+
+            return 0;
+        }
+
+        // send out the buffer, and retry if it would fit into an empty buffer
+        if ((err = server_response_output(client)))
+            return err;
+
+        if ((size_t) ret < client->response.output_max) {
+            va_start(args, fmt);
+            ret = vsnprintf(client->output, client->response.output_max, fmt, args);
+            va_end(args);
+
+            client->response.output_len = ret;
+
+            return 0;
+        }
+
+        // too large to buffer
+    }
+
+    va_start(args, fmt);
+    if (client->response.chunked) {
+        err = http_vprint_chunk(client->http, fmt, args);
+    } else {
+        err = http_vwrite(client->http, fmt, args);
+    }
+    va_end(args);
+
+    if (err) {
+        log_warning("http_write");
+        return err;
+    }
+
+    return 0;
+}
+
+int server_response_redirect (struct server_client *client, const char *host, const char *fmt, ...)
+{
+    char path[HTTP_PATH_MAX];
+    int ret;
+    va_list args;
+
+    va_start(args, fmt);
+    ret = vsnprintf(path, sizeof(path), fmt, args);
+    va_end(args);
 
     if (ret < 0) {
         log_perror("vsnprintf");
@@ -729,6 +1708,90 @@ int server_response_error (struct server_client *client, enum http_status status
     return err;
 }
 
+/*
+ * Record the connection state for the access log, if any.
+ */
+static void server_conn_init (struct server *server, struct tcp *tcp, struct server_conn *conn)
+{
+    socklen_t len = sizeof(conn->peer);
+
+    if (!server->access) {
+        conn->peer.ss_family = AF_UNSPEC;
+        return;
+    }
+
+    conn->accept = event_main_usec(server->event_main);
+
+    if (getpeername(tcp_sock(tcp), (struct sockaddr *) &conn->peer, &len)) {
+        log_pwarning("getpeername");
+        conn->peer.ss_family = AF_UNSPEC;
+    }
+}
+
+/*
+ * Write the access log record for the request, once the response has been sent at record->end, or with status 0 if
+ * aborted.
+ */
+static void server_client_access (struct server_client *client, struct server_access_record *record, const struct server_handler *handler, unsigned status)
+{
+    const struct sockaddr_storage *peer = &client->conn.peer;
+    const struct timeval *now = event_main_now(client->server->event_main);
+    char path[HTTP_PATH_MAX + 1];
+
+    record->time = (uint64_t) now->tv_sec * 1000000 + now->tv_usec;
+    record->accept = client->conn.accept;
+
+    // headers/handler are left unset if the request failed early
+    if (!record->headers)
+        record->headers = record->end;
+    if (!record->handler)
+        record->handler = record->end;
+
+    // pipelined requests read ahead on the connection are counted towards the earlier request
+    record->bytes_in = tcp_read_stream(client->tcp)->total - record->bytes_in;
+    record->bytes_out = tcp_write_stream(client->tcp)->total - record->bytes_out;
+
+    if (peer->ss_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *) peer;
+
+        record->family = AF_INET;
+        record->port = sin->sin_port;
+        memcpy(record->addr, &sin->sin_addr, sizeof(sin->sin_addr));
+
+    } else if (peer->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) peer;
+
+        record->family = AF_INET6;
+        record->port = sin6->sin6_port;
+        memcpy(record->addr, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+    }
+
+    record->status = status;
+
+    // the request path is decoded in-place, without the leading /
+    if (!client->request.request) {
+        path[0] = '\0';
+    } else {
+        snprintf(path, sizeof(path), "/%s", client->request.url.path ? client->request.url.path : "");
+    }
+
+    if (server_access_log(client->server->access, record, client->request.method, handler ? handler->name : NULL, path) < 0)
+        log_warning("server_access_log");
+}
+
+/*
+ * Count the request, using status 0 if aborted, and its latency in microseconds.
+ */
+static void server_client_stats (const struct server_handler *handler, unsigned status, uint64_t usec)
+{
+    struct stats_handler *s = &stats->server_handlers[handler ? handler->stats : 0];
+
+    s->requests++;
+    s->status[status / 100 < STATS_STATUS_CLASSES ? status / 100 : 0]++;
+
+    stats_histogram_add(&stats->server_latency, usec);
+}
+
 /*
  * Read, process and respond to one request.
  *
@@ -737,9 +1800,23 @@ int server_response_error (struct server_client *client, enum http_status status
 int server_client_request (struct server *server, struct server_client *client)
 {
     struct server_handler *handler = NULL;
+    struct server_access_record record = { };
     enum http_status status = 0;
     int err;
 
+    client->response.output_max = server->output_buffer;
+
+    // from when the request is ready to read in this event loop iteration, which also counts any time spent queued behind
+    // other tasks
+    record.start = event_main_usec(server->event_main);
+
+    tcp_read_timeout(client->tcp, &server->header_timeout);
+
+    if (server->access) {
+        record.bytes_in = tcp_read_stream(client->tcp)->total;
+        record.bytes_out = tcp_write_stream(client->tcp)->total;
+    }
+
     // request
     if ((err = server_request(client)) < 0) {
         goto error;
@@ -752,6 +1829,11 @@ int server_client_request (struct server *server, struct server_client *client)
         goto error;
     } 
 
+    if (server->access)
+        record.headers = event_main_usec(server->event_main);
+
+    tcp_read_timeout(client->tcp, &server->body_timeout);
+
     // handler 
     if ((err = server_lookup_handler(server, client->request.method, client->request.url.path, &handler)) < 0) {
         goto error;
@@ -760,27 +1842,20 @@ int server_client_request (struct server *server, struct server_client *client)
         handler = NULL;
 
     } else {
+        if (handler->output_buffer)
+            client->response.output_max = handler->output_buffer;
+
         if ((err = handler->request(handler, client, client->request.method, &client->request.url))) {
             log_warning("handler failed with %d", err);
         }
-    }
 
-    // headers?
-    if (!client->request.headers) {
-        const char *header, *value;
-
-        log_debug("reading remaining headers...");
-
-        // read remaining headers, in case they contain anything relevant for the error response
-        // don't clobber err!
-        while (!server_request_header(client, &header, &value)) {
-
-        }
+        if (server->access)
+            record.handler = monotonic_usec();
     }
 
     // body?
     // TODO: needs better logic for when a request contains a body?
-    if (!client->request.body && client->request.content_length) {
+    if (!client->request.body && (client->request.content_length || client->request.chunked)) {
         // force close, as pipelining will fail
         // we don't want to wait for the entire request body to upload before failing the request...
         log_debug("ignoring client request body");
@@ -794,6 +1869,16 @@ error:
         // sock send/recv error or timeout, or other internal error
         // abort without response
         log_warning("aborting request without response");
+
+        record.end = monotonic_usec();
+
+        // only requests that were read, not connections closed or timed out between requests
+        if (client->request.request)
+            server_client_stats(handler, 0, record.end - record.start);
+
+        if (server->access && client->request.request)
+            server_client_access(client, &record, handler, 0);
+
         return err;
 
     } else if (err > 0) {
@@ -820,9 +1905,26 @@ error:
             err = -1;
         }
     }
-    
+
+    // buffered entity
+    if (server_response_end(client)) {
+        log_warning("failed to send buffered response");
+        err = -1;
+    }
+
     // headers
     if (!client->response.headers) {
+        unsigned response_status = client->response.status;
+
+        // without any body or headers, e.g. 201 for PUT, the end of the response would only be signalled by closing
+        if (!client->response.header && response_status >= 200 && response_status != 204 && response_status != 304
+                && strcasecmp(client->request.method, "HEAD")) {
+            if (server_response_header(client, "Content-Length", "0")) {
+                log_warning("failed to send response headers");
+                err = -1;
+            }
+        }
+
         // end-of-headers
         if (server_response_headers(client)) {
             log_warning("failed to end response headers");
@@ -839,8 +1941,33 @@ error:
         }
     }
 
+    // keep buffering responses to pipelined requests, the write buffer is flushed once full, before sendfile, or
+    // once the read buffer drains
+    if (!client->response.close && http_read_pending(client->http)) {
+        log_debug("pipelined request pending, deferring flush");
+
+    } else if (http_flush(client->http)) {
+        log_warning("failed to send response");
+
+        record.end = monotonic_usec();
+
+        server_client_stats(handler, 0, record.end - record.start);
+
+        if (server->access)
+            server_client_access(client, &record, handler, 0);
+
+        return -1;
+    }
+
+    record.end = monotonic_usec();
+
+    server_client_stats(handler, client->response.status, record.end - record.start);
+
+    if (server->access)
+        server_client_access(client, &record, handler, client->response.status);
+
     // persistent connection?
-    if (client->response.close) {
+    if (client->response.close || server->draining) {
         return 1;
 
     } else {
@@ -850,6 +1977,47 @@ error:
     return err;
 }
 
+static void server_client_resume (void *ctx);
+
+/*
+ * Park an idle client connection until the next request, releasing the client.
+ *
+ * Returns 1 if the client has a pipelined request already buffered, and was not parked.
+ */
+static int server_client_park (struct server_client *client)
+{
+    struct server_idle *idle;
+    int err;
+
+    if (!(idle = pool_alloc(&server_idle_pool))) {
+        log_error("pool_alloc");
+        return -1;
+    }
+
+    idle->server = client->server;
+    idle->tcp = client->tcp;
+    idle->conn = client->conn;
+
+    // let idle connections go sooner, for others to get in
+    if (server_connections_over(client->server, client->server->overload_connections))
+        tcp_read_timeout(client->tcp, &SERVER_OVERLOAD_KEEPALIVE_TIMEOUT);
+    else
+        tcp_read_timeout(client->tcp, &client->server->keepalive_timeout);
+
+    if ((err = tcp_park(client->tcp, server_client_resume, idle))) {
+        pool_free(&server_idle_pool, idle);
+        return err;
+    }
+
+    TAILQ_INSERT_TAIL(&client->server->idles, idle, server_idles);
+
+    http_destroy(client->http);
+    free(client->output);
+    pool_free(&server_client_pool, client);
+
+    return 0;
+}
+
 /*
  * Handle one client.
  */
@@ -858,8 +2026,7 @@ void server_client_task (void *ctx)
     struct server_client *client = ctx;
     int err;
 
-    // set idle timeouts
-    tcp_read_timeout(client->tcp, &SERVER_READ_TIMEOUT);
+    // set idle timeouts, the read timeout is set for each request
     tcp_write_timeout(client->tcp, &SERVER_WRITE_TIMEOUT);
 
     // handle multiple requests
@@ -877,6 +2044,15 @@ void server_client_task (void *ctx)
             log_debug("end of client requests");
             break;
         }
+
+        // release this task while waiting for the next request
+        if ((err = server_client_park(client)) < 0) {
+            log_warning("server_client_park");
+            goto error;
+
+        } else if (!err) {
+            return;
+        }
     }
 
 error:
@@ -884,19 +2060,25 @@ error:
         http_destroy(client->http);
     
     // TODO: clean close vs reset?
-    tcp_destroy(client->tcp);
+    server_close(client->server, client->tcp);
 
-    free(client);
+    free(client->output);
+    pool_free(&server_client_pool, client);
 }
 
-int server_client (struct server *server, struct tcp *tcp)
+/*
+ * Setup a new client for the given connection.
+ *
+ * The tcp connection is not released on errors.
+ */
+static int server_client_create (struct server *server, struct tcp *tcp, struct server_client **clientp)
 {
     struct server_client *client;
-    int err = 0;
+    int err;
 
-    if (!(client = calloc(1, sizeof(*client)))) {
-        log_perror("calloc");
-        goto error;
+    if (!(client = pool_calloc(&server_client_pool))) {
+        log_error("pool_calloc");
+        return -1;
     }
 
     client->server = server;
@@ -904,9 +2086,155 @@ int server_client (struct server *server, struct tcp *tcp)
 
     if ((err = http_create(&client->http, tcp_read_stream(tcp), tcp_write_stream(tcp)))) {
         log_perror("http_create");
+        pool_free(&server_client_pool, client);
+        return err;
+    }
+
+    *clientp = client;
+
+    return 0;
+}
+
+/*
+ * Handle the next request on a parked client connection.
+ */
+static void server_client_resume (void *ctx)
+{
+    struct server_idle *idle = ctx;
+    struct server *server = idle->server;
+    struct tcp *tcp = idle->tcp;
+    struct server_conn conn = idle->conn;
+    struct server_client *client;
+    int err;
+
+    TAILQ_REMOVE(&server->idles, idle, server_idles);
+    pool_free(&server_idle_pool, idle);
+
+    if ((err = tcp_unpark(tcp)) < 0) {
+        log_warning("tcp_unpark");
+        goto error;
+
+    } else if (err) {
+        log_debug("idle timeout");
+        goto error;
+    }
+
+    if (server_client_create(server, tcp, &client)) {
+        log_warning("server_client_create");
+        goto error;
+    }
+
+    client->conn = conn;
+
+    server_client_task(client);
+
+    return;
+
+error:
+    server_close(server, tcp);
+}
+
+int server_set_access_log (struct server *server, struct server_access *access)
+{
+    server->access = access;
+
+    return 0;
+}
+
+#ifdef WITH_SSL
+int server_set_ssl (struct server *server, struct ssl_main *ssl_main)
+{
+    server->ssl_main = ssl_main;
+
+    return 0;
+}
+
+/*
+ * Perform the SSL handshake on a new client connection, before handling any requests.
+ */
+static void server_client_ssl (void *ctx)
+{
+    struct server_idle *idle = ctx;
+    struct server *server = idle->server;
+    struct tcp *tcp = idle->tcp;
+    struct server_conn conn = idle->conn;
+    struct server_client *client;
+    int err;
+
+    pool_free(&server_idle_pool, idle);
+
+    // the handshake uses the same idle timeouts as requests
+    tcp_read_timeout(tcp, &server->header_timeout);
+    tcp_write_timeout(tcp, &SERVER_WRITE_TIMEOUT);
+
+    if ((err = ssl_server_accept(server->ssl_main, tcp)) < 0) {
+        log_warning("ssl_server_accept");
+        goto error;
+
+    } else if (err) {
+        log_debug("handshake timeout");
+        goto error;
+    }
+
+    if (server_client_create(server, tcp, &client)) {
+        log_warning("server_client_create");
+        goto error;
+    }
+
+    client->conn = conn;
+
+    server_client_task(client);
+
+    return;
+
+error:
+    server_close(server, tcp);
+}
+
+/*
+ * Start a new SSL client connection.
+ */
+static int server_client_ssl_start (struct server *server, struct tcp *tcp)
+{
+    struct server_idle *idle;
+
+    if (!(idle = pool_alloc(&server_idle_pool))) {
+        log_error("pool_alloc");
+        goto error;
+    }
+
+    idle->server = server;
+    idle->tcp = tcp;
+
+    server_conn_init(server, tcp, &idle->conn);
+
+    if (event_start(server->event_main, server_client_ssl, idle)) {
+        log_perror("event_start");
+        pool_free(&server_idle_pool, idle);
+        goto error;
+    }
+
+    return 0;
+
+error:
+    server_close(server, tcp);
+
+    return -1;
+}
+#endif
+
+int server_client (struct server *server, struct tcp *tcp)
+{
+    struct server_client *client = NULL;
+    int err = 0;
+
+    if ((err = server_client_create(server, tcp, &client))) {
+        log_warning("server_client_create");
         goto error;
     }
 
+    server_conn_init(server, tcp, &client->conn);
+
     if ((err = event_start(server->event_main, server_client_task, client))) {
         log_perror("event_start");
         goto error;
@@ -919,89 +2247,262 @@ error:
         if (client->http)
             http_destroy(client->http);
 
-        free(client);
+        pool_free(&server_client_pool, client);
     }
     
-    tcp_destroy(tcp);
+    server_close(server, tcp);
 
     return -1;
 }
 
+/*
+ * Refuse a new connection with an immediate 503 response, without starting any task for it.
+ */
+static void server_refuse (struct server_listen *listen, struct tcp *tcp)
+{
+    static const char response[] = "HTTP/1.1 503 Service Unavailable\r\n"
+        "Content-Length: 0\r\n"
+        "Retry-After: 1\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+    static char buf[4096];
+    int sock = tcp_sock(tcp);
+
+    stats->server_refused++;
+
+    // the SSL handshake would cost more than the connection itself
+    if (listen->flags & SERVER_LISTEN_SSL)
+        goto close;
+
+    // consume any request already received, so that the close does not reset the connection before the response
+    while (read(sock, buf, sizeof(buf)) == sizeof(buf))
+        ;
+
+    if (write(sock, response, sizeof(response) - 1) < 0)
+        log_pdebug("write");
+
+close:
+    server_close(listen->server, tcp);
+}
+
 void server_listen_task (void *ctx)
 {
     struct server_listen *listen = ctx;
+    struct server *server = listen->server;
 
     struct tcp *tcp;
     int err;
 
-    while (true) {
-        if ((err = tcp_server_accept(listen->tcp, &tcp))) {
+    while (!server->draining) {
+        // leave new connections queued within the listen backlog, while the current ones finish
+        if (server_connections_over(server, server->overload_connections)) {
+            if ((err = event_sleep(listen->event, &SERVER_OVERLOAD_DELAY))) {
+                log_fatal("event_sleep");
+                break;
+            }
+
+            if (server->draining)
+                break;
+        }
+
+        if ((err = tcp_server_accept(listen->tcp, &tcp)) < 0) {
             log_fatal("tcp_server_accept");
             break;
+
+        } else if (err == 2) {
+            log_debug("stop accepting");
+            break;
+        }
+
+        server->connections++;
+
+        if (err || (server->max_connections && server->connections > server->max_connections)) {
+            log_debug("refusing connection: %u connections", server->connections);
+
+            server_refuse(listen, tcp);
+
+            continue;
         }
         
+#ifdef WITH_SSL
+        if (listen->flags & SERVER_LISTEN_SSL) {
+            if ((err = server_client_ssl_start(listen->server, tcp)))
+                log_warning("server_client_ssl_start");
+
+            continue;
+        }
+#endif
+
         if ((err = server_client(listen->server, tcp))) {
             log_warning("server_client");
         }
     }
 
+    TAILQ_REMOVE(&server->listens, listen, server_listens);
+
+    event_destroy(listen->event);
     tcp_server_destroy(listen->tcp);
     free(listen);
 }
 
-int server_listen (struct server *server, const char *host, const char *port)
+/*
+ * Start accepting connections on the listen->tcp server, releasing the listen on errors.
+ */
+static int server_listen_start (struct server *server, struct server_listen *listen)
 {
-    struct server_listen *listen;
-
-    if (!(listen = calloc(1, sizeof(*listen)))) {
-        log_perror("calloc");
-        return -1;
-    }
-
-    listen->server = server;
-
-    if (tcp_server(server->event_main, &listen->tcp, host, port)) {
-        log_warning("tcp_server");
+    if (event_create(server->event_main, &listen->event, -1)) {
+        log_warning("event_create");
         goto error;
     }
 
+    TAILQ_INSERT_TAIL(&server->listens, listen, server_listens);
+
     if (event_start(server->event_main, server_listen_task, listen)) {
         log_warning("event_start");
+        TAILQ_REMOVE(&server->listens, listen, server_listens);
         goto error;
     }
 
     return 0;
 
 error:
-    if (listen->tcp)
-        tcp_server_destroy(listen->tcp);
+    if (listen->event)
+        event_destroy(listen->event);
 
+    tcp_server_destroy(listen->tcp);
     free(listen);
 
     return -1;
 }
 
-void server_destroy (struct server *server)
+/*
+ * Allocate a new listen, checking the flags.
+ */
+static struct server_listen * server_listen_create (struct server *server, int flags)
 {
-    // TODO: listens
+    struct server_listen *listen;
 
-    // handlers
-    struct server_handler_item *h;
+    if (flags & SERVER_LISTEN_SSL) {
+#ifdef WITH_SSL
+        if (!server->ssl_main) {
+            log_error("SSL listen without server_set_ssl()");
+            return NULL;
+        }
+#else
+        log_error("built without SSL support");
+        return NULL;
+#endif
+    }
 
-    while ((h = TAILQ_FIRST(&server->handlers))) {
-        TAILQ_REMOVE(&server->handlers, h, server_handlers);
-        free(h);
+    if (!(listen = calloc(1, sizeof(*listen)))) {
+        log_perror("calloc");
+        return NULL;
     }
 
-    // headers
-    struct server_header *sh;
+    listen->server = server;
+    listen->flags = flags;
+
+    return listen;
+}
+
+int server_listen_bind (int *sockp, const char *host, const char *port, int backlog, int flags)
+{
+    int tcp_flags = 0;
+
+    if (flags & SERVER_LISTEN_REUSEPORT)
+        tcp_flags |= TCP_LISTEN_REUSEPORT;
+
+    if (flags & SERVER_LISTEN_DEFER_ACCEPT)
+        tcp_flags |= TCP_LISTEN_DEFER_ACCEPT;
+
+    if (flags & SERVER_LISTEN_FASTOPEN)
+        tcp_flags |= TCP_LISTEN_FASTOPEN;
+
+    if (flags & SERVER_LISTEN_NODELAY)
+        tcp_flags |= TCP_LISTEN_NODELAY;
+
+    if (tcp_listen(sockp, host, port, backlog ? backlog : TCP_LISTEN_BACKLOG, tcp_flags)) {
+        log_warning("tcp_listen");
+        return -1;
+    }
+
+    return 0;
+}
+
+int server_listen (struct server *server, const char *host, const char *port, int flags)
+{
+    int sock;
 
-    while ((sh = TAILQ_FIRST(&server->headers))) {
-        TAILQ_REMOVE(&server->headers, sh, server_headers);
-        free(sh->name);
-        free(sh->value);
-        free(sh);
+    if (server_listen_bind(&sock, host, port, server->listen_backlog, flags))
+        return -1;
+
+    return server_listen_sock(server, sock, flags);
+}
+
+int server_listen_sock (struct server *server, int sock, int flags)
+{
+    struct server_listen *listen;
+
+    if (!(listen = server_listen_create(server, flags))) {
+        close(sock);
+        return -1;
     }
 
+    if (tcp_server_sock(server->event_main, &listen->tcp, sock)) {
+        log_warning("tcp_server_sock");
+        free(listen);
+        return -1;
+    }
+
+    return server_listen_start(server, listen);
+}
+
+int server_drain (struct server *server)
+{
+    struct server_listen *listen;
+    struct server_idle *idle;
+
+    if (!server->draining)
+        log_info("draining %u connections", server->connections);
+
+    server->draining = true;
+
+    // the listen tasks exit once woken up
+    TAILQ_FOREACH(listen, &server->listens, server_listens) {
+        if (tcp_server_cancel(listen->tcp) < 0 || event_cancel(listen->event) < 0)
+            log_warning("cancel listen");
+    }
+
+    // the parked connections are resumed as if timed out, and closed
+    TAILQ_FOREACH(idle, &server->idles, server_idles) {
+        if (tcp_cancel(idle->tcp) < 0)
+            log_warning("tcp_cancel");
+    }
+
+    return server->connections;
+}
+
+static void server_route_destroy (struct server_route_node *node)
+{
+    for (unsigned i = 0; i < node->children_count; i++) {
+        server_route_destroy(node->children[i]);
+    }
+
+    free(node->children);
+    free(node->exact);
+    free(node->prefix);
+    free(node);
+}
+
+void server_destroy (struct server *server)
+{
+    // TODO: listens
+
+    // handlers
+    server_route_destroy(server->routes);
+
+    // headers
+    free(server->headers);
+
     free(server);
 }
@@ -22,17 +22,136 @@ struct server_handler {
 
     /* Handler implementation */
     int (*request)(struct server_handler *handler, struct server_client *client, const char *method, const struct url *url);
+
+    /* Optional: response output buffer size for this handler, see server_set_output_buffer() */
+    size_t output_buffer;
+
+    /* Optional: name for the access log and stats */
+    const char *name;
+
+    /* Index into stats.server_handlers, set by server_add_handler */
+    unsigned stats;
 };
 
+/* Default response output buffer size */
+#define SERVER_OUTPUT_BUFFER 4096
+
+/* Default idle timeouts for reading the request headers and body, and for persistent connections between requests */
+#define SERVER_HEADER_TIMEOUT ((struct timeval) { .tv_sec = 10 })
+#define SERVER_BODY_TIMEOUT ((struct timeval) { .tv_sec = 10 })
+#define SERVER_KEEPALIVE_TIMEOUT ((struct timeval) { .tv_sec = 10 })
+
+/* Shortened timeout for persistent connections between requests, while overloaded */
+#define SERVER_OVERLOAD_KEEPALIVE_TIMEOUT ((struct timeval) { .tv_sec = 1 })
+
+/* Default overload threshold, as a percentage of the connection limit */
+#define SERVER_OVERLOAD_PERCENT 90
+
+/* Delay between accepting each new connection while overloaded */
+#define SERVER_OVERLOAD_DELAY ((struct timeval) { .tv_usec = 10000 })
+
+/* Number of fds to leave for files and other sockets, when deriving the connection limit from the nfiles limit */
+#define SERVER_RESERVE_FDS 64
+
+/* Deadline for open connections to finish after server_drain(), and the interval for checking */
+#define SERVER_DRAIN_TIMEOUT ((struct timeval) { .tv_sec = 30 })
+#define SERVER_DRAIN_INTERVAL ((struct timeval) { .tv_usec = 100 * 1000 })
+
 /*
  * Initialize a new server.
  */
 int server_create (struct event_main *event_main, struct server **serverp);
 
+enum server_listen_flags {
+    /* Share the listen address with other server processes, see TCP_LISTEN_REUSEPORT */
+    SERVER_LISTEN_REUSEPORT = 0x01,
+
+    /* Accept SSL connections, see server_set_ssl() */
+    SERVER_LISTEN_SSL       = 0x02,
+
+    /* Only accept connections once the request has arrived, see TCP_LISTEN_DEFER_ACCEPT */
+    SERVER_LISTEN_DEFER_ACCEPT  = 0x04,
+
+    /* Accept TCP Fast Open requests, see TCP_LISTEN_FASTOPEN */
+    SERVER_LISTEN_FASTOPEN  = 0x08,
+
+    /* Disable Nagle's algorithm on accepted connections, see TCP_LISTEN_NODELAY */
+    SERVER_LISTEN_NODELAY   = 0x10,
+};
+
+/*
+ * Set the listen() backlog for any following server_listen(), or 0 for the default TCP_LISTEN_BACKLOG.
+ */
+int server_set_listen_backlog (struct server *server, int backlog);
+
+/*
+ * Set the idle timeouts for reading request headers, reading request bodies, and for persistent connections waiting
+ * for the next request, any of which may be given as NULL to keep the current value.
+ *
+ * The idle timeouts are reset on every read operation. SSL handshakes use the header timeout.
+ */
+int server_set_timeouts (struct server *server, const struct timeval *header, const struct timeval *body, const struct timeval *keepalive);
+
+/*
+ * Limit the number of open client connections, or 0 for no limit.
+ *
+ * Once max connections are open, any further connections are accepted and refused with a 503 response, without
+ * reading the request. With overload connections open, which defaults to SERVER_OVERLOAD_PERCENT of max if 0, the
+ * server is overloaded: new connections are only accepted one per SERVER_OVERLOAD_DELAY, leaving the rest queued in
+ * the listen backlog, and idle persistent connections are closed after SERVER_OVERLOAD_KEEPALIVE_TIMEOUT.
+ *
+ * Connections accepted once out of fds are also refused, see tcp_server_accept().
+ */
+int server_set_connections (struct server *server, unsigned max, unsigned overload);
+
+struct server_access;
+
+/*
+ * Add a record for each request to the given access log, see server_access_create().
+ *
+ * The access log must remain valid for the lifetime of the server.
+ */
+int server_set_access_log (struct server *server, struct server_access *access);
+
+#ifdef WITH_SSL
+struct ssl_main;
+
 /*
- * Listen on given host/port
+ * Use the given SSL server context, see ssl_server_create(), for SERVER_LISTEN_SSL connections.
+ *
+ * The ssl_main must remain valid for the lifetime of the server.
  */
-int server_listen (struct server *server, const char *host, const char *port);
+int server_set_ssl (struct server *server, struct ssl_main *ssl_main);
+#endif
+
+/*
+ * Listen on given host/port, with some combination of enum server_listen_flags.
+ *
+ * Returns <0 on error, including SERVER_LISTEN_SSL without SSL support.
+ */
+int server_listen (struct server *server, const char *host, const char *port, int flags);
+
+/*
+ * Open a listening socket for server_listen_sock(), using the given listen backlog, or the default for 0.
+ *
+ * This does not need any server, e.g. to bind the sockets before forking any workers.
+ */
+int server_listen_bind (int *sockp, const char *host, const char *port, int backlog, int flags);
+
+/*
+ * Listen on the given socket, already listening from server_listen_bind(), taking ownership of it.
+ *
+ * Only SERVER_LISTEN_SSL is used from the flags, the socket options are left as-is.
+ */
+int server_listen_sock (struct server *server, int sock, int flags);
+
+/*
+ * Gracefully stop the server: stop accepting new connections, close persistent connections once idle, and respond to
+ * any further requests with Connection: close.
+ *
+ * This may be called repeatedly, returning the number of connections that remain open.
+ */
+int server_drain (struct server *server);
 
 /*
  * Add a server handler for requests.
@@ -49,6 +168,14 @@ int server_listen (struct server *server, const char *host, const char *port);
  */
 int server_add_handler (struct server *server, const char *method, const char *path, struct server_handler *handler);
 
+/*
+ * Set the default size of the output buffer used for server_response_print()/server_response_write(), or 0 to disable.
+ *
+ * A response body that fits into the buffer is sent in one go with a Content-Length, otherwise the buffered output is
+ * sent one buffer-full chunk at a time. Handlers may override this using server_handler.output_buffer.
+ */
+int server_set_output_buffer (struct server *server, size_t size);
+
 /*
  * Add a custom header to all responses.
  *
@@ -64,12 +191,24 @@ int server_add_header (struct server *server, const char *name, const char *valu
 int server_request_query (struct server_client *client, const char **keyp, const char **valuep);
 
 /*
- * Read request header.
+ * Iterate over the request headers, returning the next header.
  *
  * Returns 1 on end-of-headers.
  */
 int server_request_header (struct server_client *client, const char **name, const char **value);
 
+/*
+ * Return the value of the given well-known request header, or NULL if not present.
+ *
+ * The returned value remains valid until the request body is read.
+ */
+const char * server_request_header_value (struct server_client *client, enum http_header_id id);
+
+/*
+ * Format the numeric address of the client into buf, without any port.
+ */
+int server_request_peer (struct server_client *client, char *buf, size_t size);
+
 /*
  * Read request body form param.
  *
@@ -90,9 +229,45 @@ int server_request_form (struct server_client *client, const char **keyp, const
 int server_request_param (struct server_client *client, const char **keyp, const char **valuep);
 
 /*
- * Read request body from client into FILE.
+ * Decode all request parameters at once, either the GET query or the POST <form> body as in server_request_param(),
+ * for lookups by name using url_params_get().
+ *
+ * Any params not yet read using server_request_query() or server_request_form() are consumed. The returned params
+ * remain valid until the next request.
+ *
+ * Returns 415 on a POST request with non-form Content-Type.
+ * Returns 411 on a POST request with no Content-Length.
+ *
+ * Returns <0 on internal error, >0 on HTTP error, 0 on success.
+ */
+int server_request_params (struct server_client *client, const struct url_params **paramsp);
+
+/*
+ * Read the complete request body into memory, up to the given maximum size.
+ *
+ * The returned body remains valid until the next request, and is NUL-terminated, but may contain NUL bytes.
+ *
+ * Returns 411 on a request with no Content-Length, 413 if larger than max, <0 on error.
+ */
+int server_request_body (struct server_client *client, char **bufp, size_t *lenp, size_t max);
+
+/*
+ * Read the next span of the request body, decoding any chunked transfer-encoding, see stream_read_some().
+ *
+ * *sizep may be passed as 0 to read as much as is available, or a maximum amount to return. The returned data points
+ * into the read buffer, and remains valid until the next read. More data is only read from the client once the
+ * buffered data has been consumed, leaving the client waiting on TCP flow control.
+ *
+ * Once started, the rest of the body can also be read using server_request_file().
+ *
+ * Returns 1 on end-of-body, including requests without any body, 400 on premature EOF, <0 on error.
+ */
+int server_request_read (struct server_client *client, char **bufp, size_t *sizep);
+
+/*
+ * Read request body from client into FILE, continuing after any server_request_read().
  *
- * Returns 1 if there was no request body.
+ * Returns 411 if there was no request body.
  */
 int server_request_file (struct server_client *client, int fd);
 
@@ -108,14 +283,65 @@ int server_response_header (struct server_client *client, const char *name, cons
     __attribute((format (printf, 3, 4)));
 
 /*
- * Send response body from file.
+ * Send pre-formatted response header lines as-is, each including the line ending.
+ */
+int server_response_header_lines (struct server_client *client, const char *buf, size_t len);
+
+/*
+ * Send end-of-headers, for a response body of a known Content-Length sent with server_response_write().
+ */
+int server_response_headers (struct server_client *client);
+
+/*
+ * Send response body from the start of the file.
+ *
+ * The file position is not used or changed, so the same fd can be used for concurrent responses.
  */
 int server_response_file (struct server_client *client, int fd, size_t content_length);
 
 /*
- * Send formatted data as part of the response.
+ * Send a complete pre-serialized block of response headers, including the Content-Length and end-of-headers, followed by
+ * the response body.
+ */
+int server_response_buffer (struct server_client *client, const char *head, size_t head_len, const char *body, size_t body_len);
+
+/*
+ * Send the given byte ranges of a file of the given size as the response body, after a 206 response status.
  *
- * The response is sent without a Content-Length, and closed.
+ * A single range is sent with a Content-Range header, and multiple ranges as multipart/byteranges parts, each using
+ * the given Content-Type, if any. Like server_response_file(), the file position is not used or changed.
+ */
+int server_response_file_ranges (struct server_client *client, int fd, off_t size, const struct http_range *ranges, unsigned count, const char *content_type);
+
+/*
+ * Send raw data as part of the response.
+ *
+ * Like server_response_print(), the output is buffered, and the response is sent with a Content-Length if it fits
+ * into the output buffer. Otherwise the response is sent using the chunked transfer-encoding for HTTP/1.1 clients,
+ * and closed otherwise.
+ *
+ * If the end-of-headers were already sent, the data is sent as-is.
+ */
+int server_response_write (struct server_client *client, const char *buf, size_t size);
+
+/*
+ * Return a span of free space within the response output buffer, for the handler to produce the response body into
+ * directly, followed by server_response_commit().
+ *
+ * *sizep may be passed as 0 for any free space, or the minimum amount needed, at most the output buffer size. Once the
+ * buffer is full, it is first sent out, waiting for the client to accept it.
+ *
+ * With the output buffer disabled, a buffer of SERVER_OUTPUT_BUFFER is used, and each span is sent out on commit.
+ */
+int server_response_reserve (struct server_client *client, char **bufp, size_t *sizep);
+
+/*
+ * Add size bytes written into the span returned by server_response_reserve() to the response body.
+ */
+int server_response_commit (struct server_client *client, size_t size);
+
+/*
+ * Send formatted data as part of the response, as with server_response_write().
  */
 int server_response_print (struct server_client *client, const char *fmt, ...)
     __attribute((format (printf, 2, 3)));
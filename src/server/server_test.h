@@ -0,0 +1,13 @@
+#ifndef SERVER_TEST_H
+#define SERVER_TEST_H
+
+#include "server/server.h"
+
+/*
+ * Lookup a handler for the given request method and path.
+ *
+ * Returns 0 on match, 404 if no handler matches the path, 405 if no handler matching the path accepts the method.
+ */
+int server_lookup_handler (struct server *server, const char *method, const char *path, struct server_handler **handlerp);
+
+#endif
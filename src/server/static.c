@@ -1,117 +1,1169 @@
 #include "server/static.h"
 
+#include "common/event.h"
 #include "common/log.h"
 #include "common/parse.h"
+#include "common/stats.h"
+#include "common/util.h"
 
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <fnmatch.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/queue.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+
+/* Number of hash buckets for the open file cache, a power of two */
+#define SERVER_STATIC_CACHE_BUCKETS (SERVER_STATIC_CACHE_SIZE * 2)
+
+/* Read/write size when compressing on the fly */
+#define SERVER_STATIC_DEFLATE_BLOCK (16 * 1024)
+
+/*
+ * Content-codings for precompressed sibling files, in order of preference.
+ */
+enum server_static_encoding {
+    SERVER_STATIC_BR,
+    SERVER_STATIC_GZIP,
+
+    SERVER_STATIC_ENCODINGS
+};
+
+static const struct server_static_coding {
+    const char *name;
+    const char *suffix;
+
+} server_static_codings[SERVER_STATIC_ENCODINGS] = {
+    [SERVER_STATIC_BR]      = { "br",   ".br"   },
+    [SERVER_STATIC_GZIP]    = { "gzip", ".gz"   },
+};
+
+/*
+ * Precompressed sibling of a file, sent as-is using a Content-Encoding.
+ */
+struct server_static_variant {
+    /* Open sibling file, or -1 if there is none */
+    int fd;
+    struct stat stat;
+};
+
+/*
+ * Rendered directory listing, cached by request path until the directory is modified.
+ */
+struct server_static_dir {
+    char *path;
+
+    /* Directory identity and modification time, and time of reading */
+    dev_t dev;
+    ino_t ino;
+    time_t mtime, built;
+
+    /* Rendered list items, in sorted order, with count + 1 offsets into items */
+    char *items;
+    size_t *offsets;
+    unsigned count;
+
+    /* Number of requests sending the listing; an evicted listing is freed once released */
+    unsigned refs;
+    bool evicted;
+
+    TAILQ_ENTRY(server_static_dir) dir_lru;
+};
+
+/*
+ * Open file cached for GET requests, by request path.
+ */
+struct server_static_file {
+    char *path;
+    unsigned hash;
+
+    int fd;
+    struct stat stat;
+    const struct server_static_mimetype *mime;
+
+    /* Precompressed siblings, only looked up for compressible files */
+    struct server_static_variant variants[SERVER_STATIC_ENCODINGS];
+
+    /* Compressed on the fly, once complete */
+    char *deflated;
+    size_t deflated_len;
+
+    /* Pre-serialized response headers followed by the file content, for small files */
+    char *memory;
+    size_t memory_head, memory_len;
+
+    /* Cached until */
+    time_t expire;
+
+    /* Number of requests using the fd; an evicted file is closed once released */
+    unsigned refs;
+    bool evicted;
+
+    LIST_ENTRY(server_static_file) cache_bucket;
+    TAILQ_ENTRY(server_static_file) cache_lru;
+};
+
 struct server_static {
     /* Embed */
     struct server_handler handler;
 
-    const char *root;
-    const char *path;
-    int flags;
-};
+    const char *root;
+    const char *path;
+    int flags;
+
+    /* Open file cache, with most recently used files first */
+    LIST_HEAD(server_static_bucket, server_static_file) cache_buckets[SERVER_STATIC_CACHE_BUCKETS];
+    TAILQ_HEAD(server_static_lru, server_static_file) cache_lru;
+    unsigned cache_count;
+
+    /* Total size of compressed files in the cache */
+    size_t deflated_size;
+
+    /* Files kept in memory, up to the given file size and total size */
+    size_t memory_file, memory_max, memory_size;
+
+    /* Directory listing cache, with most recently used listings first */
+    TAILQ_HEAD(server_static_dir_lru, server_static_dir) dir_lru;
+    unsigned dir_count;
+
+    /* Loaded from a mime.types file, pointing into the file contents */
+    char *mimetypes_buf;
+    struct server_static_mimetype *mimetypes;
+    unsigned mimetypes_count;
+
+    /* Lookup by file extension, open-addressed, a power of two */
+    const struct server_static_mimetype **mimetype_table;
+    unsigned mimetype_size;
+};
+
+struct server_static_mimetype {
+    /* File extension, without the leading . */
+    const char *ext;
+    const char *content_type;
+    const char *glyphicon;
+
+    /* Text content, worth compressing */
+    bool compress;
+};
+
+/*
+ * Built-in types, taking precedence over any loaded from mime.types.
+ */
+static const struct server_static_mimetype server_static_mimetypes[] = {
+    { "html",       "text/html",                "globe",        true    },
+    { "txt",        "text/plain",               "align-left",   true    },
+    { "css",        "text/css",                 NULL,           true    },
+    { "js",         "text/javascript",          NULL,           true    },
+    { "svg",        "image/svg+xml",            "picture",      true    },
+    { }
+};
+
+static unsigned server_static_mimetype_hash (const char *ext)
+{
+    // FNV-1a, case-insensitive
+    unsigned hash = 2166136261u;
+
+    for (const char *c = ext; *c; c++) {
+        hash ^= (unsigned char) tolower((unsigned char) *c);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Add the given type to the lookup table, unless its extension is already known.
+ */
+static void server_static_mimetype_insert (struct server_static *ss, const struct server_static_mimetype *mime)
+{
+    unsigned mask = ss->mimetype_size - 1;
+
+    for (unsigned i = server_static_mimetype_hash(mime->ext) & mask; ; i = (i + 1) & mask) {
+        if (!ss->mimetype_table[i]) {
+            ss->mimetype_table[i] = mime;
+            return;
+
+        } else if (!strcasecmp(ss->mimetype_table[i]->ext, mime->ext)) {
+            return;
+        }
+    }
+}
+
+/*
+ * (Re-)build the lookup table from the built-in and loaded types.
+ */
+static int server_static_mimetypes_build (struct server_static *ss)
+{
+    unsigned count = ss->mimetypes_count + sizeof(server_static_mimetypes) / sizeof(*server_static_mimetypes);
+    unsigned size = 16;
+
+    // at most half full
+    while (size < count * 2)
+        size *= 2;
+
+    free(ss->mimetype_table);
+
+    if (!(ss->mimetype_table = calloc(size, sizeof(*ss->mimetype_table)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    ss->mimetype_size = size;
+
+    for (const struct server_static_mimetype *mime = server_static_mimetypes; mime->ext; mime++) {
+        server_static_mimetype_insert(ss, mime);
+    }
+
+    for (unsigned i = 0; i < ss->mimetypes_count; i++) {
+        server_static_mimetype_insert(ss, &ss->mimetypes[i]);
+    }
+
+    return 0;
+}
+
+/*
+ * Lookup a `struct server_static_mimetype` for the given (file) path, by the extension after the last '.'.
+ *
+ * Returns 1 if not found.
+ */
+int server_static_lookup_mimetype (const struct server_static_mimetype **mimep, struct server_static *ss, const char *path)
+{
+    const char *ext;
+    unsigned mask = ss->mimetype_size - 1;
+
+    if (!(ext = strrchr(path, '.')) || !*++ext)
+        return 1;
+
+    for (unsigned i = server_static_mimetype_hash(ext) & mask; ss->mimetype_table[i]; i = (i + 1) & mask) {
+        if (!strcasecmp(ss->mimetype_table[i]->ext, ext)) {
+            *mimep = ss->mimetype_table[i];
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static unsigned server_static_hash (const char *path)
+{
+    // FNV-1a
+    unsigned hash = 2166136261u;
+
+    for (const char *c = path; *c; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static time_t server_static_now (struct server_static *ss)
+{
+    return event_main_now(ss->handler.event_main)->tv_sec;
+}
+
+/*
+ * Close any open precompressed siblings.
+ */
+static void server_static_variants_close (struct server_static_variant *variants)
+{
+    for (enum server_static_encoding e = 0; e < SERVER_STATIC_ENCODINGS; e++) {
+        if (variants[e].fd >= 0 && close(variants[e].fd))
+            log_pwarning("close");
+
+        variants[e].fd = -1;
+    }
+}
+
+static void server_static_cache_free (struct server_static *ss, struct server_static_file *file)
+{
+    if (close(file->fd))
+        log_pwarning("close %s", file->path);
+
+    server_static_variants_close(file->variants);
+
+    if (file->deflated) {
+        ss->deflated_size -= file->deflated_len;
+        free(file->deflated);
+    }
+
+    if (file->memory) {
+        ss->memory_size -= file->memory_len;
+        free(file->memory);
+    }
+
+    free(file->path);
+    free(file);
+}
+
+/*
+ * Remove the file from the cache, closing it once no longer used.
+ */
+static void server_static_cache_evict (struct server_static *ss, struct server_static_file *file)
+{
+    log_debug("%s", file->path);
+
+    LIST_REMOVE(file, cache_bucket);
+    TAILQ_REMOVE(&ss->cache_lru, file, cache_lru);
+    ss->cache_count--;
+
+    if (file->refs)
+        file->evicted = true;
+    else
+        server_static_cache_free(ss, file);
+}
+
+/*
+ * Lookup a cached file for the given request path, taking a reference to it.
+ *
+ * Returns NULL if not cached.
+ */
+static struct server_static_file *server_static_cache_get (struct server_static *ss, const char *path)
+{
+    unsigned hash = server_static_hash(path);
+    struct server_static_file *file;
+
+    LIST_FOREACH(file, &ss->cache_buckets[hash % SERVER_STATIC_CACHE_BUCKETS], cache_bucket) {
+        if (file->hash == hash && !strcmp(file->path, path))
+            break;
+    }
+
+    if (!file)
+        return NULL;
+
+    if (file->expire <= server_static_now(ss)) {
+        // stale, re-validate via server_static_lookup()
+        server_static_cache_evict(ss, file);
+        return NULL;
+    }
+
+    // most recently used
+    TAILQ_REMOVE(&ss->cache_lru, file, cache_lru);
+    TAILQ_INSERT_HEAD(&ss->cache_lru, file, cache_lru);
+
+    file->refs++;
+
+    return file;
+}
+
+/*
+ * Cache a newly looked up file, taking ownership of the fd and any variants, and taking a reference to it.
+ *
+ * Returns NULL on error, in which case the fd and variants are left as-is.
+ */
+static struct server_static_file *server_static_cache_put (struct server_static *ss, const char *path, int fd, const struct stat *stat, const struct server_static_mimetype *mime, const struct server_static_variant *variants)
+{
+    struct server_static_file *file;
+
+    if (!(file = calloc(1, sizeof(*file)))) {
+        log_perror("calloc");
+        return NULL;
+    }
+
+    if (!(file->path = strdup(path))) {
+        log_perror("strdup");
+        free(file);
+        return NULL;
+    }
+
+    file->hash = server_static_hash(path);
+    file->fd = fd;
+    file->stat = *stat;
+    file->mime = mime;
+    memcpy(file->variants, variants, sizeof(file->variants));
+    file->expire = server_static_now(ss) + SERVER_STATIC_CACHE_TTL;
+    file->refs = 1;
+
+    // bounded, evict least recently used
+    if (ss->cache_count >= SERVER_STATIC_CACHE_SIZE)
+        server_static_cache_evict(ss, TAILQ_LAST(&ss->cache_lru, server_static_lru));
+
+    LIST_INSERT_HEAD(&ss->cache_buckets[file->hash % SERVER_STATIC_CACHE_BUCKETS], file, cache_bucket);
+    TAILQ_INSERT_HEAD(&ss->cache_lru, file, cache_lru);
+    ss->cache_count++;
+
+    return file;
+}
+
+/*
+ * Release a reference to a cached file.
+ */
+static void server_static_cache_release (struct server_static *ss, struct server_static_file *file)
+{
+    if (!--file->refs && file->evicted)
+        server_static_cache_free(ss, file);
+}
+
+/*
+ * Format a strong ETag for the given file, from its inode, size and modification time, and any content-coding applied
+ * on the fly.
+ */
+static int server_static_etag (char *buf, size_t size, const struct stat *stat, const char *coding)
+{
+    int ret = snprintf(buf, size, "\"%llx-%llx-%llx%s%s\"",
+            (unsigned long long) stat->st_ino,
+            (unsigned long long) stat->st_size,
+            (unsigned long long) stat->st_mtime,
+            coding ? "-" : "", coding ? coding : ""
+    );
+
+    if (ret < 0 || ret >= size) {
+        log_error("snprintf");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Check an If-None-Match header value against the given ETag, using the weak comparison.
+ *
+ * Returns 1 on match.
+ */
+static int server_static_etag_match (const char *header, const char *etag)
+{
+    size_t len = strlen(etag);
+
+    while (*header) {
+        // skip separators
+        if (*header == ' ' || *header == '\t' || *header == ',') {
+            header++;
+            continue;
+        }
+
+        if (*header == '*')
+            return 1;
+
+        if (!strncmp(header, "W/", 2))
+            header += 2;
+
+        if (!strncmp(header, etag, len) && (!header[len] || strchr(" \t,", header[len])))
+            return 1;
+
+        // skip to next
+        if (!(header = strchr(header, ',')))
+            break;
+    }
+
+    return 0;
+}
+
+/*
+ * Check conditional request headers against the given validators.
+ *
+ * Returns 1 if the client has a matching copy of the file.
+ */
+static int server_static_not_modified (struct server_client *client, const char *etag, time_t mtime)
+{
+    const char *value;
+    time_t since;
+
+    // If-None-Match takes precedence over If-Modified-Since
+    if ((value = server_request_header_value(client, HTTP_HEADER_IF_NONE_MATCH)))
+        return server_static_etag_match(value, etag);
+
+    if ((value = server_request_header_value(client, HTTP_HEADER_IF_MODIFIED_SINCE))) {
+        if (http_parse_date(value, &since)) {
+            log_debug("ignore invalid If-Modified-Since: %s", value);
+            return 0;
+        }
+
+        return mtime <= since;
+    }
+
+    return 0;
+}
+
+/*
+ * Parse the Range header against the file, unless If-Range does not match the current validators.
+ *
+ * Returns 1 if the full file should be sent.
+ */
+static int server_static_range (struct server_client *client, const char *etag, const struct stat *stat, struct http_range *ranges, unsigned *countp)
+{
+    const char *range, *if_range;
+    time_t date;
+
+    if (!(range = server_request_header_value(client, HTTP_HEADER_RANGE)))
+        return 1;
+
+    if ((if_range = server_request_header_value(client, HTTP_HEADER_IF_RANGE))) {
+        // strong comparison for the ETag, exact match for the date
+        if (*if_range == '"' ? strcmp(if_range, etag) : http_parse_date(if_range, &date) || date != stat->st_mtime) {
+            log_debug("If-Range does not match: %s", if_range);
+            return 1;
+        }
+    }
+
+    if (http_parse_range(range, stat->st_size, ranges, countp)) {
+        log_debug("ignore invalid Range: %s", range);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Send the validator headers for the selected representation of a file.
+ */
+static int server_static_headers (struct server_client *client, const char *etag, const char *last_modified, const char *encoding, bool vary)
+{
+    int err;
+
+    if ((err = server_response_header(client, "ETag", "%s", etag)))
+        return err;
+
+    if ((err = server_response_header(client, "Last-Modified", "%s", last_modified)))
+        return err;
+
+    if (encoding && (err = server_response_header(client, "Content-Encoding", "%s", encoding)))
+        return err;
+
+    if (vary && (err = server_response_header(client, "Vary", "Accept-Encoding")))
+        return err;
+
+    return 0;
+}
+
+#ifdef WITH_ZLIB
+/*
+ * Send the file compressed on the fly using gzip, keeping the compressed data in the cached file if `cache`.
+ */
+static int server_static_deflate (struct server_static *ss, struct server_client *client, struct server_static_file *file, bool cache)
+{
+    z_stream z = { };
+    char *in = NULL, *out, *copy = NULL;
+    size_t copy_len = 0, copy_size = 0;
+    off_t offset = 0;
+    int flush = Z_NO_FLUSH, ret, err = 0;
+
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        log_error("deflateInit2: %s", z.msg);
+        return -1;
+    }
+
+    // keep off the task stack
+    if (!(in = malloc(SERVER_STATIC_DEFLATE_BLOCK * 2))) {
+        log_perror("malloc");
+        err = -1;
+        goto error;
+    }
+
+    out = in + SERVER_STATIC_DEFLATE_BLOCK;
+
+    if (file->stat.st_size > SERVER_STATIC_DEFLATE_MAX || ss->deflated_size + file->stat.st_size > SERVER_STATIC_DEFLATE_CACHE)
+        cache = false;
+
+    do {
+        if (!z.avail_in && flush == Z_NO_FLUSH) {
+            ssize_t len;
+
+            if ((len = pread(file->fd, in, SERVER_STATIC_DEFLATE_BLOCK, offset)) < 0) {
+                log_perror("pread");
+                err = -1;
+                goto error;
+            }
+
+            offset += len;
+
+            z.next_in = (Bytef *) in;
+            z.avail_in = len;
+
+            if (!len)
+                flush = Z_FINISH;
+        }
+
+        z.next_out = (Bytef *) out;
+        z.avail_out = SERVER_STATIC_DEFLATE_BLOCK;
+
+        if ((ret = deflate(&z, flush)) == Z_STREAM_ERROR) {
+            log_error("deflate: %s", z.msg);
+            err = -1;
+            goto error;
+        }
+
+        size_t len = SERVER_STATIC_DEFLATE_BLOCK - z.avail_out;
+
+        if (cache && copy_len + len > copy_size) {
+            size_t size = copy_size ? copy_size * 2 : SERVER_STATIC_DEFLATE_BLOCK;
+            char *buf;
+
+            while (size < copy_len + len)
+                size *= 2;
+
+            if (size > SERVER_STATIC_DEFLATE_MAX || !(buf = realloc(copy, size))) {
+                log_debug("not caching compressed %s", file->path);
+                cache = false;
+            } else {
+                copy = buf;
+                copy_size = size;
+            }
+        }
+
+        if (cache) {
+            memcpy(copy + copy_len, out, len);
+            copy_len += len;
+        }
+
+        // the file may be evicted while blocked on the client, but not released
+        if (len && (err = server_response_write(client, out, len)))
+            goto error;
+
+    } while (ret != Z_STREAM_END);
+
+    log_debug("%s: %jd -> %ju bytes", file->path, (intmax_t) offset, (uintmax_t) z.total_out);
+
+    // a concurrent request may have beaten us to it
+    if (cache && !file->deflated && ss->deflated_size + copy_len <= SERVER_STATIC_DEFLATE_CACHE) {
+        file->deflated = copy;
+        file->deflated_len = copy_len;
+        ss->deflated_size += copy_len;
+        copy = NULL;
+    }
+
+error:
+    deflateEnd(&z);
+    free(copy);
+    free(in);
+
+    return err;
+}
+#endif
+
+/*
+ * Make room for size bytes of files in memory, dropping the least recently used files not currently in use.
+ *
+ * Returns 1 if there is not enough room.
+ */
+static int server_static_memory_reserve (struct server_static *ss, size_t size)
+{
+    struct server_static_file *file, *prev;
+
+    if (size > ss->memory_max)
+        return 1;
+
+    for (file = TAILQ_LAST(&ss->cache_lru, server_static_lru); file && ss->memory_size + size > ss->memory_max; file = prev) {
+        prev = TAILQ_PREV(file, server_static_lru, cache_lru);
+
+        if (!file->memory || file->refs)
+            continue;
+
+        log_debug("drop %s", file->path);
+
+        ss->memory_size -= file->memory_len;
+        free(file->memory);
+        file->memory = NULL;
+    }
+
+    return ss->memory_size + size > ss->memory_max;
+}
+
+/*
+ * Format the response headers for a file kept in memory into buf, or just return the length if buf is NULL.
+ *
+ * These must match the headers sent by server_static_file_get().
+ */
+static int server_static_memory_head (char *buf, size_t size, const struct server_static_file *file, const char *etag, const char *last_modified)
+{
+    const struct server_static_mimetype *mime = file->mime;
+
+    return snprintf(buf, size, "ETag: %s\r\nLast-Modified: %s\r\n%sAccept-Ranges: bytes\r\n%s%s%sContent-Length: %zu\r\n\r\n",
+            etag, last_modified,
+            mime && mime->compress ? "Vary: Accept-Encoding\r\n" : "",
+            mime ? "Content-Type: " : "", mime ? mime->content_type : "", mime ? "\r\n" : "",
+            (size_t) file->stat.st_size
+    );
+}
+
+/*
+ * Read the cached file into memory, along with the response headers that follow the status line.
+ *
+ * Returns 1 if the file does not fit in memory.
+ */
+static int server_static_memory_load (struct server_static *ss, struct server_static_file *file, const char *etag, const char *last_modified)
+{
+    size_t size = file->stat.st_size, len = 0;
+    char *buf;
+    int head;
+
+    if ((head = server_static_memory_head(NULL, 0, file, etag, last_modified)) < 0) {
+        log_error("snprintf");
+        return -1;
+    }
+
+    if (server_static_memory_reserve(ss, head + size))
+        return 1;
+
+    if (!(buf = malloc(head + 1 + size))) {
+        log_perror("malloc");
+        return -1;
+    }
+
+    server_static_memory_head(buf, head + 1, file, etag, last_modified);
+
+    while (len < size) {
+        ssize_t ret;
+
+        if ((ret = pread(file->fd, buf + head + len, size - len, len)) < 0) {
+            log_perror("pread %s", file->path);
+            free(buf);
+            return -1;
+
+        } else if (!ret) {
+            log_warning("%s: truncated at %zu bytes", file->path, len);
+            free(buf);
+            return 1;
+        }
+
+        len += ret;
+    }
+
+    file->memory = buf;
+    file->memory_head = head;
+    file->memory_len = head + size;
+    ss->memory_size += file->memory_len;
+
+    return 0;
+}
+
+/*
+ * Process a GET request for the given resolved file, which may be an uncached temporary if not `cache`.
+ */
+int server_static_file_get (struct server_static *ss, struct server_client *client, struct server_static_file *file, bool cache)
+{
+    const struct server_static_mimetype *mime = file->mime;
+    const struct stat *stat = &file->stat;
+    const char *accept = NULL, *encoding = NULL;
+    bool deflate = false;
+    int fd = file->fd;
+    char etag[80], last_modified[HTTP_DATE_MAX];
+    struct http_range ranges[HTTP_RANGES_MAX];
+    unsigned range_count;
+    int err;
+
+    if (mime && mime->compress)
+        accept = server_request_header_value(client, HTTP_HEADER_ACCEPT_ENCODING);
+
+    // prefer precompressed siblings, sent using sendfile
+    for (enum server_static_encoding e = 0; accept && !encoding && e < SERVER_STATIC_ENCODINGS; e++) {
+        if (file->variants[e].fd >= 0 && http_parse_accept(accept, server_static_codings[e].name)) {
+            encoding = server_static_codings[e].name;
+            fd = file->variants[e].fd;
+            stat = &file->variants[e].stat;
+        }
+    }
+
+#ifdef WITH_ZLIB
+    if (accept && !encoding && stat->st_size > 0 && http_parse_accept(accept, "gzip")) {
+        encoding = "gzip";
+        deflate = true;
+    }
+#endif
+
+    if ((err = server_static_etag(etag, sizeof(etag), stat, deflate ? encoding : NULL)))
+        return err;
+
+    if ((err = http_format_date(last_modified, sizeof(last_modified), stat->st_mtime)))
+        return err;
+
+    if (server_static_not_modified(client, etag, stat->st_mtime)) {
+        log_debug("not modified: %s", etag);
+
+        if ((err = server_response(client, 304, NULL)))
+            return err;
+
+        if ((err = server_static_headers(client, etag, last_modified, NULL, mime && mime->compress)))
+            return err;
+
+        // no body, end-of-headers are sent by the server
+        return 0;
+    }
+
+    // ranges of the compressed stream are not supported on the fly
+    if (!deflate && !server_static_range(client, etag, stat, ranges, &range_count)) {
+        if (!range_count) {
+            log_debug("range not satisfiable");
+
+            if ((err = server_response(client, 416, NULL)))
+                return err;
+
+            if ((err = server_response_header(client, "Content-Range", "bytes */%jd", (intmax_t) stat->st_size)))
+                return err;
+
+            return server_response_header(client, "Content-Length", "0");
+        }
+
+        if ((err = server_response(client, 206, NULL)))
+            return err;
+
+        if ((err = server_static_headers(client, etag, last_modified, encoding, mime && mime->compress)))
+            return err;
+
+        return server_response_file_ranges(client, fd, stat->st_size, ranges, range_count, mime ? mime->content_type : NULL);
+    }
+
+    // small files from memory, with a single write
+    if (cache && !encoding && ss->memory_max && stat->st_size <= ss->memory_file) {
+        if (file->memory) {
+            stats->static_memory_hits++;
+        } else {
+            stats->static_memory_misses++;
+
+            if ((err = server_static_memory_load(ss, file, etag, last_modified)) < 0)
+                return err;
+        }
+
+        if (file->memory) {
+            if ((err = server_response(client, 200, NULL)))
+                return err;
+
+            return server_response_buffer(client,
+                    file->memory, file->memory_head,
+                    file->memory + file->memory_head, file->memory_len - file->memory_head
+            );
+        }
+    }
+
+    // respond
+    if ((err = server_response(client, 200, NULL)))
+        return err;
+
+    if ((err = server_static_headers(client, etag, last_modified, encoding, mime && mime->compress)))
+        return err;
+
+    if (!deflate && (err = server_response_header(client, "Accept-Ranges", "bytes")))
+        return err;
+
+    if (mime && (err = server_response_header(client, "Content-Type", "%s", mime->content_type)))
+        return err;
+
+#ifdef WITH_ZLIB
+    if (deflate && file->deflated) {
+        log_debug("using cached compressed %s", file->path);
+
+        if ((err = server_response_header(client, "Content-Length", "%zu", file->deflated_len)))
+            return err;
+
+        if ((err = server_response_headers(client)))
+            return err;
+
+        return server_response_write(client, file->deflated, file->deflated_len);
+
+    } else if (deflate) {
+        return server_static_deflate(ss, client, file, cache);
+    }
+#endif
+
+    if (stat->st_size > 0) {
+        if ((err = server_response_file(client, fd, stat->st_size)))
+            return err;
+
+    } else {
+        // XXX: empty file
+    }
+
+    return 0;
+}
+
+int server_static_file_put (struct server_static *s, struct server_client *client, int fd, const struct server_static_mimetype *mime)
+{
+    int err;
+
+    // upload
+    if ((err = server_request_file(client, fd)))
+        return err;
+
+    // done
+    if ((err = server_response(client, 201, NULL)))
+        return err;
+
+    return 0;
+}
+
+/*
+ * Append formatted output to a growing buffer.
+ */
+static int server_static_dir_printf (char **bufp, size_t *sizep, size_t *lenp, const char *fmt, ...)
+    __attribute((format (printf, 4, 5)));
+
+static int server_static_dir_printf (char **bufp, size_t *sizep, size_t *lenp, const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+
+    for (;;) {
+        va_start(args, fmt);
+        ret = vsnprintf(*bufp ? *bufp + *lenp : NULL, *bufp ? *sizep - *lenp : 0, fmt, args);
+        va_end(args);
+
+        if (ret < 0) {
+            log_perror("vsnprintf");
+            return -1;
+        }
+
+        if (*bufp && *lenp + ret < *sizep)
+            break;
+
+        // grow, including the NUL
+        size_t size = *sizep ? *sizep : 4096;
+        char *buf;
+
+        while (size <= *lenp + ret)
+            size *= 2;
+
+        if (!(buf = realloc(*bufp, size))) {
+            log_perror("realloc");
+            return -1;
+        }
+
+        *bufp = buf;
+        *sizep = size;
+    }
+
+    *lenp += ret;
+
+    return 0;
+}
+
+/*
+ * Render the directory listing for a single item.
+ */
+static int server_static_dir_item (char **bufp, size_t *sizep, size_t *lenp, const char *path, bool dir, const char *glyphicon, const char *title)
+{
+    return server_static_dir_printf(bufp, sizep, lenp, "\t\t\t<li%s%s%s>%s%s%s<a href='%s%s'>%s%s</a></li>\n",
+            title ? " title='" : "", title ? title : "", title ? "'" : "",
+            glyphicon ? "<span class='glyphicon glyphicon-" : "", glyphicon ? glyphicon : "", glyphicon ? "'></span>" : "",
+            path, dir ? "/" : "",
+            path, dir ? "/" : ""
+    );
+}
+
+struct server_static_dirent {
+    char *name;
+    bool dir;
+};
+
+static int server_static_dirent_cmp (const void *a, const void *b)
+{
+    const struct server_static_dirent *da = a, *db = b;
+
+    return strcmp(da->name, db->name);
+}
+
+static void server_static_dir_free (struct server_static *ss, struct server_static_dir *listing)
+{
+    free(listing->path);
+    free(listing->items);
+    free(listing->offsets);
+    free(listing);
+}
+
+/*
+ * Remove the listing from the cache, freeing it once no longer used.
+ */
+static void server_static_dir_evict (struct server_static *ss, struct server_static_dir *listing)
+{
+    TAILQ_REMOVE(&ss->dir_lru, listing, dir_lru);
+    ss->dir_count--;
+
+    if (listing->refs)
+        listing->evicted = true;
+    else
+        server_static_dir_free(ss, listing);
+}
+
+static void server_static_dir_release (struct server_static *ss, struct server_static_dir *listing)
+{
+    if (!--listing->refs && listing->evicted)
+        server_static_dir_free(ss, listing);
+}
+
+/*
+ * Lookup a cached listing for the given directory, taking a reference to it.
+ *
+ * Listings built within the same second as the directory mtime are not trusted, as the directory may have been modified
+ * again within the same second.
+ */
+static struct server_static_dir *server_static_dir_get (struct server_static *ss, const char *path, const struct stat *stat)
+{
+    struct server_static_dir *listing;
+
+    TAILQ_FOREACH(listing, &ss->dir_lru, dir_lru) {
+        if (!strcmp(listing->path, path))
+            break;
+    }
+
+    if (!listing)
+        return NULL;
+
+    if (listing->dev != stat->st_dev || listing->ino != stat->st_ino || listing->mtime != stat->st_mtime || listing->built <= listing->mtime) {
+        log_debug("%s: modified", path);
+        server_static_dir_evict(ss, listing);
+        return NULL;
+    }
+
+    // most recently used
+    TAILQ_REMOVE(&ss->dir_lru, listing, dir_lru);
+    TAILQ_INSERT_HEAD(&ss->dir_lru, listing, dir_lru);
+
+    listing->refs++;
+
+    return listing;
+}
+
+/*
+ * Read and render the sorted directory items into a new cached listing, taking a reference to it.
+ */
+static struct server_static_dir *server_static_dir_build (struct server_static *ss, int fd, const char *path, const struct stat *stat)
+{
+    struct server_static_dir *listing = NULL;
+    struct server_static_dirent *entries = NULL;
+    unsigned count = 0, size = 0;
+    size_t items_size = 0, items_len = 0;
+    struct dirent *d;
+    DIR *dir = NULL;
+    int dirfd = -1;
+
+    // readdir() reads in bulk; leave the given fd for the caller
+    if ((dirfd = dup(fd)) < 0) {
+        log_perror("dup");
+        goto error;
+    }
+
+    if (!(dir = fdopendir(dirfd))) {
+        log_perror("fdopendir");
+        goto error;
+    }
+
+    dirfd = -1;
+
+    while ((d = readdir(dir))) {
+        // ignore hidden files
+        if (d->d_name[0] == '.')
+            continue;
+
+        if (count >= size) {
+            struct server_static_dirent *grow;
+
+            size = size ? size * 2 : 64;
+
+            if (!(grow = realloc(entries, size * sizeof(*entries)))) {
+                log_perror("realloc");
+                goto error;
+            }
+
+            entries = grow;
+        }
+
+        if (!(entries[count].name = strdup(d->d_name))) {
+            log_perror("strdup");
+            goto error;
+        }
+
+        entries[count++].dir = (d->d_type == DT_DIR);
+    }
+
+    qsort(entries, count, sizeof(*entries), server_static_dirent_cmp);
+
+    if (!(listing = calloc(1, sizeof(*listing)))) {
+        log_perror("calloc");
+        goto error;
+    }
+
+    if (!(listing->path = strdup(path))) {
+        log_perror("strdup");
+        goto error;
+    }
 
-struct server_static_mimetype {
-    const char *glob;
-    const char *content_type;
-    const char *glyphicon;
+    if (!(listing->offsets = calloc(count + 1, sizeof(*listing->offsets)))) {
+        log_perror("calloc");
+        goto error;
+    }
 
-} server_static_mimetypes[] = {
-    { "*.html",     "text/html",    "globe"         },
-    { "*.txt",      "text/plain",   "align-left"    },
-    { "*.css",      "text/css"      },
-    { }
-};
+    listing->count = count;
 
-/*
- * Lookup a `struct server_static_mimetype` for the given (file) path.
- */
-int server_static_lookup_mimetype (const struct server_static_mimetype **mimep, struct server_static *s, const char *path)
-{
-    struct server_static_mimetype *mime;
+    // directory items
+    for (unsigned i = 0; i < count; i++) {
+        const struct server_static_mimetype *mime = NULL;
 
-    for (mime = server_static_mimetypes; mime->glob && mime->content_type; mime++) {
-        if (fnmatch(mime->glob, path, 0) == 0) {
-            *mimep = mime;
-            return 0;
+        // eyecandy
+        if ((server_static_lookup_mimetype(&mime, ss, entries[i].name)) < 0) {
+            log_warning("server_static_lookup_mimetype: %s%s", path, entries[i].name);
+        }
+
+        const char *glyphicon = mime ? mime->glyphicon : NULL;
+        const char *title = mime ? mime->content_type : NULL;
+
+        if (!glyphicon) {
+            glyphicon = entries[i].dir ? "folder-open" : "file";
         }
+
+        listing->offsets[i] = items_len;
+
+        if (server_static_dir_item(&listing->items, &items_size, &items_len, entries[i].name, entries[i].dir, glyphicon, title))
+            goto error;
     }
 
-    return 1;
-}
+    listing->offsets[count] = items_len;
 
-/*
- * Process a GET request for the given resolved file.
- */
-int server_static_file_get (struct server_static *s, struct server_client *client, int fd, const struct stat *stat, const struct server_static_mimetype *mime)
-{
-    int err;
+    listing->dev = stat->st_dev;
+    listing->ino = stat->st_ino;
+    listing->mtime = stat->st_mtime;
+    listing->built = server_static_now(ss);
+    listing->refs = 1;
 
-    // respond
-    if ((err = server_response(client, 200, NULL)))
-        return err;
+    // bounded, evict least recently used
+    if (ss->dir_count >= SERVER_STATIC_DIR_CACHE)
+        server_static_dir_evict(ss, TAILQ_LAST(&ss->dir_lru, server_static_dir_lru));
 
-    if (mime && (err = server_response_header(client, "Content-Type", "%s", mime->content_type)))
-        return err;
+    TAILQ_INSERT_HEAD(&ss->dir_lru, listing, dir_lru);
+    ss->dir_count++;
 
-    if (stat->st_size > 0) {
-        if ((err = server_response_file(client, fd, stat->st_size)))
-            return err;
+    goto done;
 
-    } else {
-        // XXX: empty file
-    }
+error:
+    if (listing)
+        server_static_dir_free(ss, listing);
 
-    return 0;
-}
+    listing = NULL;
 
-int server_static_file_put (struct server_static *s, struct server_client *client, int fd, const struct server_static_mimetype *mime)
-{
-    int err;
+done:
+    for (unsigned i = 0; i < count; i++)
+        free(entries[i].name);
 
-    // upload
-    if ((err = server_request_file(client, fd)))
-        return err;
+    free(entries);
 
-    // done
-    if ((err = server_response(client, 201, NULL)))
-        return err;
+    if (dir)
+        closedir(dir);
 
-    return 0;
-}
+    if (dirfd >= 0)
+        close(dirfd);
 
-/*
- * Print out the directory listing for a single item.
- */
-static int server_static_dir_item (struct server_client *client, const char *path, bool dir, const char *glyphicon, const char *title)
-{
-    return server_response_print(client, "\t\t\t<li%s%s%s>%s%s%s<a href='%s%s'>%s%s</a></li>\n",
-            title ? " title='" : "", title ? title : "", title ? "'" : "",
-            glyphicon ? "<span class='glyphicon glyphicon-" : "", glyphicon ? glyphicon : "", glyphicon ? "'></span>" : "",
-            path, dir ? "/" : "",
-            path, dir ? "/" : ""
-    );
+    return listing;
 }
 
 /*
- * Send directory listing, in text/html.
+ * Send directory listing, in text/html, optionally paginated using ?offset=&limit=
  *
  * XXX: we assume that the given path is XSS-free.
  */
-int server_static_dir (struct server_static *s, struct server_client *client, DIR *dir, const struct url *url)
+int server_static_dir (struct server_static *ss, struct server_client *client, int fd, const struct stat *stat, const struct url *url)
 {
-    struct dirent *d;
+    struct server_static_dir *listing;
+    const char *key, *value;
+    unsigned offset = 0, limit = 0, end;
+    char *head = NULL, *foot = NULL;
+    size_t head_size = 0, head_len = 0, foot_size = 0, foot_len = 0;
     int err;
 
     // ensure dir path ends in /
@@ -119,13 +1171,44 @@ int server_static_dir (struct server_static *s, struct server_client *client, DI
         return server_response_redirect(client, NULL, "%s/", url->path);
     }
 
-    if ((err = server_response(client, 200, NULL)))
+    // ignore any other params, such as cache-busters
+    while (!(err = server_request_query(client, &key, &value))) {
+        unsigned *uintp;
+
+        if (!strcmp(key, "offset")) {
+            uintp = &offset;
+        } else if (!strcmp(key, "limit")) {
+            uintp = &limit;
+        } else {
+            log_debug("ignore query param: %s", key);
+            continue;
+        }
+
+        if (!value || str_uint(value, uintp)) {
+            log_warning("invalid query param: %s=%s", key, value ? value : "");
+            return 400;
+        }
+    }
+
+    if (err < 0)
         return err;
 
-    err |= server_response_header(client, "Content-Type", "text/html");
-    
-    // first server_response_print finishes headers
-    err |= server_response_print(client, 
+    err = 0;
+
+    if ((listing = server_static_dir_get(ss, url->path, stat))) {
+        log_debug("%s: cached", url->path);
+
+    } else if (!(listing = server_static_dir_build(ss, fd, url->path, stat))) {
+        log_error("server_static_dir_build: %s", url->path);
+        return -1;
+    }
+
+    if (offset > listing->count)
+        offset = listing->count;
+
+    end = (limit && limit < listing->count - offset) ? offset + limit : listing->count;
+
+    err |= server_static_dir_printf(&head, &head_size, &head_len,
             "<!DOCTYPE html>\n"
             "<html>\n"
             "\t<head>\n"
@@ -134,46 +1217,68 @@ int server_static_dir (struct server_static *s, struct server_client *client, DI
             "\t</head>\n"
             "\t<body><div class='container'>\n"
             "\t\t<h1><tt>%s</tt></h1>\n"
-            "\t\t<ul class='index'>\n", 
+            "\t\t<ul class='index'>\n",
             url->path, url->path);
 
-    if (*url->path) {
+    if (*url->path && !offset) {
         // underneath root
-        err |= server_static_dir_item(client, "..", false, "folder-close", NULL);
+        err |= server_static_dir_item(&head, &head_size, &head_len, "..", false, "folder-close", NULL);
     }
-    
-    // directory items
-    while ((d = readdir(dir))) {
-        const struct server_static_mimetype *mime = NULL;
-        
-        // ignore hidden files
-        if (d->d_name[0] == '.')
-            continue;
 
-        bool isdir = (d->d_type == DT_DIR);
-        
-        // eyecandy
-        if ((server_static_lookup_mimetype(&mime, s, d->d_name)) < 0) {
-            log_warning("server_static_lookup_mimetype: %s%s", url->path, d->d_name);
-        }
-        
-        const char *glyphicon = mime ? mime->glyphicon : NULL;
-        const char *title = mime ? mime->content_type : NULL;
-        
-        if (!glyphicon) {
-            glyphicon = isdir ? "folder-open" : "file";
-        }
-        
-        if ((err = server_static_dir_item(client, d->d_name, isdir, glyphicon, title)))
-            break;
+    err |= server_static_dir_printf(&foot, &foot_size, &foot_len, "\t\t</ul>\n");
+
+    if (offset || end < listing->count) {
+        unsigned page = end - offset;
+
+        err |= server_static_dir_printf(&foot, &foot_size, &foot_len, "\t\t<p class='pages'>%u-%u of %u", offset, end, listing->count);
+
+        if (offset)
+            err |= server_static_dir_printf(&foot, &foot_size, &foot_len, " <a href='?offset=%u&limit=%u'>previous</a>", offset > page ? offset - page : 0, page);
+
+        if (end < listing->count)
+            err |= server_static_dir_printf(&foot, &foot_size, &foot_len, " <a href='?offset=%u&limit=%u'>next</a>", end, page);
+
+        err |= server_static_dir_printf(&foot, &foot_size, &foot_len, "</p>\n");
     }
-    
-    err |= server_response_print(client, 
-            "\t\t</ul>\n"
+
+    err |= server_static_dir_printf(&foot, &foot_size, &foot_len,
             "\t</div></body>\n"
             "</html>\n"
             );
 
+    if (err)
+        goto error;
+
+    // a single body with a known length
+    size_t items_len = listing->offsets[end] - listing->offsets[offset];
+
+    if ((err = server_response(client, 200, NULL)))
+        goto error;
+
+    if ((err = server_response_header(client, "Content-Type", "text/html")))
+        goto error;
+
+    if ((err = server_response_header(client, "Content-Length", "%zu", head_len + items_len + foot_len)))
+        goto error;
+
+    if ((err = server_response_headers(client)))
+        goto error;
+
+    if ((err = server_response_write(client, head, head_len)))
+        goto error;
+
+    // the listing may be evicted while blocked on the client, but not released
+    if ((err = server_response_write(client, listing->items + listing->offsets[offset], items_len)))
+        goto error;
+
+    if ((err = server_response_write(client, foot, foot_len)))
+        goto error;
+
+error:
+    server_static_dir_release(ss, listing);
+    free(head);
+    free(foot);
+
     return err;
 }
 
@@ -322,8 +1427,9 @@ int server_static_lookup (struct server_static *ss, const char *path, int create
                     mode = O_RDONLY;
 
                 } else {
-                    log_warning("%s!", path);
-                    return 404;
+                    log_debug("%s!", path);
+                    ret = 404;
+                    goto error;
                 }
 
                 if ((filefd = openat(dirfd, name, mode, 0644)) < 0) {
@@ -377,6 +1483,42 @@ error:
     return ret;
 }
 
+/*
+ * Lookup precompressed siblings of the given compressible file, ignoring any that are older than the file itself.
+ */
+static void server_static_variants_lookup (struct server_static *ss, const char *path, const struct stat *stat, const struct server_static_mimetype *mime, struct server_static_variant *variants)
+{
+    char name[PATH_MAX];
+
+    for (enum server_static_encoding e = 0; e < SERVER_STATIC_ENCODINGS; e++) {
+        struct server_static_variant *variant = &variants[e];
+        const struct server_static_mimetype *variant_mime;
+
+        variant->fd = -1;
+
+        if (!mime || !mime->compress)
+            continue;
+
+        if (snprintf(name, sizeof(name), "%s%s", path, server_static_codings[e].suffix) >= sizeof(name))
+            continue;
+
+        if (server_static_lookup(ss, name, 0, &variant->fd, &variant->stat, &variant_mime)) {
+            variant->fd = -1;
+            continue;
+        }
+
+        if ((variant->stat.st_mode & S_IFMT) != S_IFREG || variant->stat.st_mtime < stat->st_mtime) {
+            log_info("ignoring stale %s", name);
+
+            close(variant->fd);
+            variant->fd = -1;
+            continue;
+        }
+
+        log_debug("%s: %s", path, name);
+    }
+}
+
 /*
  * Request handler.
  */
@@ -390,16 +1532,6 @@ int server_static_request (struct server_handler *handler, struct server_client
     int ret = 0;
     int create;
 
-    // see if there are any interesting request headers
-    const char *header, *value;
-
-    while (!(ret = server_request_header(client, &header, &value))) {
-
-    }
-
-    if (ret < 0)
-        goto error;
-
     // lookup
     if (strcasecmp(method, "GET") == 0 && (ss->flags & SERVER_STATIC_GET)) {
         create = 0;
@@ -412,6 +1544,19 @@ int server_static_request (struct server_handler *handler, struct server_client
         return 400;
     }
 
+    // cached?
+    struct server_static_file *file;
+
+    if (!create && (file = server_static_cache_get(ss, url->path))) {
+        log_info("%s %s %s %s (cached)", ss->root, method, url->path, file->mime ? file->mime->content_type : "(unknown mimetype)");
+
+        ret = server_static_file_get(ss, client, file, true);
+
+        server_static_cache_release(ss, file);
+
+        return ret;
+    }
+
     if ((ret = server_static_lookup(ss, url->path, create, &fd, &stat, &mime))) {
         return ret;
     }
@@ -424,30 +1569,37 @@ int server_static_request (struct server_handler *handler, struct server_client
         ret = server_static_file_put(ss, client, fd, mime);
 
     } else if ((stat.st_mode & S_IFMT) == S_IFREG) {
-        // get existing file
-        ret = server_static_file_get(ss, client, fd, &stat, mime);
+        struct server_static_variant variants[SERVER_STATIC_ENCODINGS];
+
+        server_static_variants_lookup(ss, url->path, &stat, mime, variants);
+
+        if ((file = server_static_cache_put(ss, url->path, fd, &stat, mime, variants))) {
+            // get existing file, shared with any concurrent requests
+            fd = -1;
+
+            ret = server_static_file_get(ss, client, file, true);
+
+            server_static_cache_release(ss, file);
+
+        } else {
+            // get existing file, without caching
+            struct server_static_file temp = { .path = (char *) url->path, .fd = fd, .stat = stat, .mime = mime };
+
+            memcpy(temp.variants, variants, sizeof(temp.variants));
+
+            ret = server_static_file_get(ss, client, &temp, false);
+
+            server_static_variants_close(temp.variants);
+        }
     
     } else if ((stat.st_mode & S_IFMT) == S_IFDIR) {
-        DIR *dir;
-        
         if (create) {
             log_warning("cannot create directory: %s", url->path);
-            return 405;
-        }
-
-        if (!(dir = fdopendir(fd))) {
-            log_pwarning("fdiropen");
-            ret = -1;
+            ret = 405;
             goto error;
-        } else {
-            fd = -1;
         }
-        
-        ret = server_static_dir(ss, client, dir, url);
 
-        if (closedir(dir)) {
-            log_pwarning("closedir");
-        }
+        ret = server_static_dir(ss, client, fd, &stat, url);
 
     } else {
         log_warning("%s/%s: not a file", ss->root, url->path);
@@ -475,7 +1627,18 @@ int server_static_create (struct server_static **sp, const char *root, struct se
     s->path = path;
     s->flags = flags;
 
+    for (int i = 0; i < SERVER_STATIC_CACHE_BUCKETS; i++) {
+        LIST_INIT(&s->cache_buckets[i]);
+    }
+
+    TAILQ_INIT(&s->cache_lru);
+    TAILQ_INIT(&s->dir_lru);
+
+    if (server_static_mimetypes_build(s))
+        goto error;
+
     s->handler.request = server_static_request;
+    s->handler.name = (flags & SERVER_STATIC_PUT) ? "upload" : "static";
 
     const char *method = (flags & SERVER_STATIC_PUT) ? "PUT" : "GET";
 
@@ -490,11 +1653,151 @@ int server_static_create (struct server_static **sp, const char *root, struct se
     return 0;
 
 error:
+    free(s->mimetype_table);
     free(s);
     return -1;
 }
 
+/*
+ * Guess if the given content type is text, worth compressing.
+ */
+static bool server_static_mimetype_compress (const char *content_type)
+{
+    return !strncmp(content_type, "text/", 5)
+        || strstr(content_type, "+xml")
+        || strstr(content_type, "json")
+        || strstr(content_type, "javascript");
+}
+
+int server_static_load_mimetypes (struct server_static *s, const char *path)
+{
+    struct server_static_mimetype *mimetypes = NULL;
+    unsigned count = 0, size = 0;
+    struct stat stat;
+    char *buf = NULL, *line, *next;
+    ssize_t len = 0;
+    int fd, err = 0;
+
+    if ((fd = open(path ? path : SERVER_STATIC_MIME_TYPES, O_RDONLY)) < 0 && !path && errno == ENOENT) {
+        log_info("no %s, using built-in types", SERVER_STATIC_MIME_TYPES);
+        return 1;
+
+    } else if (fd < 0) {
+        log_perror("open %s", path ? path : SERVER_STATIC_MIME_TYPES);
+        return -1;
+    }
+
+    if (fstat(fd, &stat)) {
+        log_perror("fstat");
+        err = -1;
+        goto error;
+    }
+
+    if (!(buf = malloc(stat.st_size + 1))) {
+        log_perror("malloc");
+        err = -1;
+        goto error;
+    }
+
+    for (ssize_t ret; len < stat.st_size; len += ret) {
+        if ((ret = read(fd, buf + len, stat.st_size - len)) < 0) {
+            log_perror("read");
+            err = -1;
+            goto error;
+        } else if (!ret) {
+            break;
+        }
+    }
+
+    buf[len] = '\0';
+
+    // type ext ext ..., and # comments
+    for (line = buf; line; line = next) {
+        char *type, *ext, *tokens;
+
+        if ((next = strchr(line, '\n')))
+            *next++ = '\0';
+
+        line[strcspn(line, "#")] = '\0';
+
+        if (!(type = strtok_r(line, " \t\r", &tokens)))
+            continue;
+
+        while ((ext = strtok_r(NULL, " \t\r", &tokens))) {
+            if (count >= size) {
+                struct server_static_mimetype *grow;
+
+                size = size ? size * 2 : 256;
+
+                if (!(grow = realloc(mimetypes, size * sizeof(*mimetypes)))) {
+                    log_perror("realloc");
+                    err = -1;
+                    goto error;
+                }
+
+                mimetypes = grow;
+            }
+
+            mimetypes[count++] = (struct server_static_mimetype) {
+                .ext            = ext,
+                .content_type   = type,
+                .compress       = server_static_mimetype_compress(type),
+            };
+        }
+    }
+
+    log_info("%s: %u types", path ? path : SERVER_STATIC_MIME_TYPES, count);
+
+    // replace
+    free(s->mimetypes);
+    free(s->mimetypes_buf);
+
+    s->mimetypes_buf = buf;
+    s->mimetypes = mimetypes;
+    s->mimetypes_count = count;
+
+    buf = NULL;
+    mimetypes = NULL;
+
+    err = server_static_mimetypes_build(s);
+
+error:
+    free(mimetypes);
+    free(buf);
+    close(fd);
+
+    return err;
+}
+
+int server_static_set_memory (struct server_static *s, size_t file_size, size_t total_size)
+{
+    if (total_size && !file_size) {
+        log_error("file size must be given");
+        return -1;
+    }
+
+    s->memory_file = file_size;
+    s->memory_max = total_size;
+
+    return 0;
+}
+
 void server_static_destroy (struct server_static *s)
 {
+    struct server_static_file *file;
+
+    struct server_static_dir *listing;
+
+    while ((file = TAILQ_FIRST(&s->cache_lru))) {
+        server_static_cache_evict(s, file);
+    }
+
+    while ((listing = TAILQ_FIRST(&s->dir_lru))) {
+        server_static_dir_evict(s, listing);
+    }
+
+    free(s->mimetype_table);
+    free(s->mimetypes);
+    free(s->mimetypes_buf);
     free(s);
 }
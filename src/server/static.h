@@ -5,6 +5,27 @@
 
 struct server_static;
 
+/* Maximum number of open files cached by each handler, for GET requests */
+#define SERVER_STATIC_CACHE_SIZE 256
+
+/* Number of seconds to cache open files for, before looking them up again */
+#define SERVER_STATIC_CACHE_TTL 1
+
+/* Maximum size of files to keep compressed in memory, when compressing on the fly WITH_ZLIB */
+#define SERVER_STATIC_DEFLATE_MAX (1024 * 1024)
+
+/* Maximum total size of compressed files kept in memory by each handler */
+#define SERVER_STATIC_DEFLATE_CACHE (16 * 1024 * 1024)
+
+/* Maximum number of rendered directory listings cached by each handler */
+#define SERVER_STATIC_DIR_CACHE 16
+
+/* Default file to load content types from */
+#define SERVER_STATIC_MIME_TYPES "/etc/mime.types"
+
+/* Default maximum size of files kept in memory, once enabled using server_static_set_memory() */
+#define SERVER_STATIC_MEMORY_FILE (16 * 1024)
+
 enum server_static_flags {
     SERVER_STATIC_GET       = 0x01,
     SERVER_STATIC_PUT       = 0x02,
@@ -15,6 +36,22 @@ enum server_static_flags {
  */
 int server_static_create (struct server_static **sp, const char *root, struct server *server, const char *path, int flags);
 
+/*
+ * Load content types by file extension from the given mime.types file, or the default SERVER_STATIC_MIME_TYPES if NULL.
+ *
+ * The built-in types for common text files take precedence. Only call this before serving any requests.
+ *
+ * Returns 1 if the default file does not exist.
+ */
+int server_static_load_mimetypes (struct server_static *s, const char *path);
+
+/*
+ * Keep the response headers and content of cached files up to file_size bytes in memory, up to a total of total_size.
+ *
+ * Disabled by default, or if total_size is zero.
+ */
+int server_static_set_memory (struct server_static *s, size_t file_size, size_t total_size);
+
 /*
  * Release all associated resources.
  *
@@ -0,0 +1,336 @@
+#include "server/status.h"
+
+#include "common/log.h"
+#include "common/stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+struct server_status {
+    /* Embed */
+    struct server_handler handler;
+};
+
+/* Labels for stats_handler.status */
+static const char *server_status_classes[STATS_STATUS_CLASSES] = {
+    "aborted", "1xx", "2xx", "3xx", "4xx", "5xx",
+};
+
+static void server_status_histogram_sum (struct stats_histogram *total, const struct stats_histogram *h)
+{
+    total->count += h->count;
+    total->sum += h->sum;
+
+    for (unsigned i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+        total->buckets[i] += h->buckets[i];
+}
+
+/*
+ * Add up the handler counts by name, as workers may have added their handlers in a different order.
+ */
+static void server_status_handlers_sum (struct stats *total, const struct stats *s)
+{
+    for (unsigned i = 0; i < s->server_handler_count; i++) {
+        const struct stats_handler *h = &s->server_handlers[i];
+        unsigned j;
+
+        for (j = 0; j < total->server_handler_count; j++) {
+            if (strcmp(total->server_handlers[j].name, h->name) == 0)
+                break;
+        }
+
+        if (j >= STATS_HANDLERS)
+            continue;
+
+        if (j == total->server_handler_count)
+            strcpy(total->server_handlers[total->server_handler_count++].name, h->name);
+
+        total->server_handlers[j].requests += h->requests;
+
+        for (unsigned k = 0; k < STATS_STATUS_CLASSES; k++)
+            total->server_handlers[j].status[k] += h->status[k];
+    }
+}
+
+/*
+ * Add up the stats of all running workers, returning the number of workers.
+ *
+ * The start time is the earliest worker start.
+ */
+static unsigned server_status_sum (struct stats *total)
+{
+    unsigned workers = 0;
+
+    *total = (struct stats) { };
+
+    for (unsigned i = 0; i < stats_count(); i++) {
+        const struct stats *s = stats_slot(i);
+
+        if (!s->start)
+            continue;
+
+        if (!total->start || s->start < total->start)
+            total->start = s->start;
+
+        total->event_iterations += s->event_iterations;
+        server_status_histogram_sum(&total->event_ready, &s->event_ready);
+        total->event_poll_usec += s->event_poll_usec;
+        total->event_run_usec += s->event_run_usec;
+        total->event_tasks += s->event_tasks;
+        total->event_stacks += s->event_stacks;
+
+        total->tcp_accepts += s->tcp_accepts;
+        total->tcp_connections += s->tcp_connections;
+
+        total->stream_sendfile_bytes += s->stream_sendfile_bytes;
+        total->stream_write_bytes += s->stream_write_bytes;
+
+        total->dns_cache_hits += s->dns_cache_hits;
+        total->dns_cache_misses += s->dns_cache_misses;
+
+        total->static_memory_hits += s->static_memory_hits;
+        total->static_memory_misses += s->static_memory_misses;
+
+        total->server_refused += s->server_refused;
+        server_status_handlers_sum(total, s);
+        server_status_histogram_sum(&total->server_latency, &s->server_latency);
+
+        workers++;
+    }
+
+    return workers;
+}
+
+/*
+ * Highest used histogram bucket, or 0 if empty.
+ */
+static unsigned server_status_histogram_max (const struct stats_histogram *h)
+{
+    unsigned max = 0;
+
+    for (unsigned i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        if (h->buckets[i])
+            max = i;
+    }
+
+    return max;
+}
+
+/*
+ * Prometheus histogram with cumulative buckets, scaling the bucket bounds by the given divisor.
+ */
+static int server_status_prometheus_histogram (struct server_client *client, const char *name, const char *help, const struct stats_histogram *h, double scale)
+{
+    unsigned max = server_status_histogram_max(h);
+    uint64_t count = 0;
+    int err = 0;
+
+    err |= server_response_print(client, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+    for (unsigned i = 0; i <= max && i < STATS_HISTOGRAM_BUCKETS - 1; i++) {
+        count += h->buckets[i];
+
+        err |= server_response_print(client, "%s_bucket{le=\"%g\"} %llu\n", name, stats_histogram_bound(i) / scale, (unsigned long long) count);
+    }
+
+    err |= server_response_print(client, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long) h->count);
+    err |= server_response_print(client, "%s_sum %g\n", name, h->sum / scale);
+    err |= server_response_print(client, "%s_count %llu\n", name, (unsigned long long) h->count);
+
+    return err;
+}
+
+static int server_status_prometheus_metric (struct server_client *client, const char *name, const char *type, const char *help, double value)
+{
+    return server_response_print(client, "# HELP %s %s\n# TYPE %s %s\n%s %.15g\n", name, help, name, type, name, value);
+}
+
+static int server_status_prometheus (struct server_client *client, const struct stats *s, unsigned workers)
+{
+    int err = 0;
+
+    err |= server_response(client, 200, NULL);
+    err |= server_response_header(client, "Content-Type", "text/plain; version=0.0.4");
+    err |= server_response_header(client, "Cache-Control", "no-cache");
+
+    err |= server_status_prometheus_metric(client, "server_workers", "gauge", "Running worker processes", workers);
+    err |= server_status_prometheus_metric(client, "server_start_time_seconds", "gauge", "Earliest worker start time", s->start);
+
+    err |= server_status_prometheus_metric(client, "server_accepts_total", "counter", "Accepted connections", s->tcp_accepts);
+    err |= server_status_prometheus_metric(client, "server_connections", "gauge", "Open connections", s->tcp_connections);
+    err |= server_status_prometheus_metric(client, "server_refused_total", "counter", "Connections refused while overloaded", s->server_refused);
+
+    err |= server_response_print(client, "# HELP server_requests_total Requests by handler and status class\n");
+    err |= server_response_print(client, "# TYPE server_requests_total counter\n");
+
+    for (unsigned i = 0; i < s->server_handler_count; i++) {
+        const struct stats_handler *h = &s->server_handlers[i];
+
+        for (unsigned j = 0; j < STATS_STATUS_CLASSES; j++) {
+            if (!h->status[j])
+                continue;
+
+            err |= server_response_print(client, "server_requests_total{handler=\"%s\",status=\"%s\"} %llu\n",
+                    *h->name ? h->name : "-", server_status_classes[j], (unsigned long long) h->status[j]
+            );
+        }
+    }
+
+    err |= server_status_prometheus_histogram(client, "server_request_duration_seconds", "Request latency", &s->server_latency, 1e6);
+
+    err |= server_status_prometheus_metric(client, "server_sendfile_bytes_total", "counter", "Bytes sent using sendfile", s->stream_sendfile_bytes);
+    err |= server_status_prometheus_metric(client, "server_write_bytes_total", "counter", "Bytes sent from memory", s->stream_write_bytes);
+
+    err |= server_status_prometheus_metric(client, "event_iterations_total", "counter", "Event loop iterations", s->event_iterations);
+    err |= server_status_prometheus_histogram(client, "event_ready_events", "Ready events per event loop iteration", &s->event_ready, 1);
+    err |= server_status_prometheus_metric(client, "event_poll_seconds_total", "counter", "Time spent waiting for events", s->event_poll_usec / 1e6);
+    err |= server_status_prometheus_metric(client, "event_run_seconds_total", "counter", "Time spent running tasks", s->event_run_usec / 1e6);
+    err |= server_status_prometheus_metric(client, "event_tasks", "gauge", "Running or waiting tasks", s->event_tasks);
+    err |= server_status_prometheus_metric(client, "event_stacks", "gauge", "Allocated task stacks, including pooled", s->event_stacks);
+
+    err |= server_status_prometheus_metric(client, "dns_cache_hits_total", "counter", "DNS cache hits", s->dns_cache_hits);
+    err |= server_status_prometheus_metric(client, "dns_cache_misses_total", "counter", "DNS cache misses", s->dns_cache_misses);
+
+    err |= server_status_prometheus_metric(client, "static_memory_hits_total", "counter", "Static file memory cache hits", s->static_memory_hits);
+    err |= server_status_prometheus_metric(client, "static_memory_misses_total", "counter", "Static file memory cache misses", s->static_memory_misses);
+
+    return err;
+}
+
+static int server_status_json_histogram (struct server_client *client, const char *name, const struct stats_histogram *h)
+{
+    unsigned max = server_status_histogram_max(h);
+    int err = 0;
+
+    err |= server_response_print(client, "\"%s\":{\"count\":%llu,\"sum\":%llu,\"buckets\":[", name,
+            (unsigned long long) h->count, (unsigned long long) h->sum
+    );
+
+    // the upper bound of each bucket, as in le=
+    for (unsigned i = 0; i <= max && h->count; i++) {
+        err |= server_response_print(client, "%s[%llu,%llu]", i ? "," : "",
+                (unsigned long long) stats_histogram_bound(i), (unsigned long long) h->buckets[i]
+        );
+    }
+
+    err |= server_response_print(client, "]}");
+
+    return err;
+}
+
+static int server_status_json (struct server_client *client, const struct stats *s, unsigned workers)
+{
+    int err = 0;
+
+    err |= server_response(client, 200, NULL);
+    err |= server_response_header(client, "Content-Type", "application/json");
+    err |= server_response_header(client, "Cache-Control", "no-cache");
+
+    err |= server_response_print(client, "{\"workers\":%u,\"start\":%lld,\"uptime\":%lld,",
+            workers, (long long) s->start, (long long) (time(NULL) - s->start)
+    );
+    err |= server_response_print(client, "\"accepts\":%llu,\"connections\":%lld,\"refused\":%llu,",
+            (unsigned long long) s->tcp_accepts, (long long) s->tcp_connections, (unsigned long long) s->server_refused
+    );
+
+    err |= server_response_print(client, "\"handlers\":{");
+
+    for (unsigned i = 0; i < s->server_handler_count; i++) {
+        const struct stats_handler *h = &s->server_handlers[i];
+
+        err |= server_response_print(client, "%s\"%s\":{\"requests\":%llu", i ? "," : "",
+                *h->name ? h->name : "-", (unsigned long long) h->requests
+        );
+
+        for (unsigned j = 0; j < STATS_STATUS_CLASSES; j++)
+            err |= server_response_print(client, ",\"%s\":%llu", server_status_classes[j], (unsigned long long) h->status[j]);
+
+        err |= server_response_print(client, "}");
+    }
+
+    err |= server_response_print(client, "},");
+    err |= server_status_json_histogram(client, "latency_usec", &s->server_latency);
+
+    err |= server_response_print(client, ",\"sendfile_bytes\":%llu,\"write_bytes\":%llu,",
+            (unsigned long long) s->stream_sendfile_bytes, (unsigned long long) s->stream_write_bytes
+    );
+    err |= server_response_print(client, "\"event\":{\"iterations\":%llu,\"poll_usec\":%llu,\"run_usec\":%llu,\"tasks\":%lld,\"stacks\":%lld,",
+            (unsigned long long) s->event_iterations, (unsigned long long) s->event_poll_usec, (unsigned long long) s->event_run_usec,
+            (long long) s->event_tasks, (long long) s->event_stacks
+    );
+    err |= server_status_json_histogram(client, "ready", &s->event_ready);
+    err |= server_response_print(client, "},\"dns_cache\":{\"hits\":%llu,\"misses\":%llu},",
+            (unsigned long long) s->dns_cache_hits, (unsigned long long) s->dns_cache_misses
+    );
+    err |= server_response_print(client, "\"static_memory\":{\"hits\":%llu,\"misses\":%llu}}\n",
+            (unsigned long long) s->static_memory_hits, (unsigned long long) s->static_memory_misses
+    );
+
+    return err;
+}
+
+int server_status_request (struct server_handler *handler, struct server_client *client, const char *method, const struct url *url)
+{
+    const char *key, *value, *format = NULL;
+    struct stats total;
+    unsigned workers;
+    int err;
+
+    while (!(err = server_request_query(client, &key, &value))) {
+        if (!strcasecmp(key, "format"))
+            format = value;
+    }
+
+    if (err < 0) {
+        log_error("server_request_query");
+        return err;
+    }
+
+    workers = server_status_sum(&total);
+
+    if (!format || !strcasecmp(format, "prometheus")) {
+        return server_status_prometheus(client, &total, workers);
+
+    } else if (!strcasecmp(format, "json")) {
+        return server_status_json(client, &total, workers);
+
+    } else {
+        return server_response_error(client, 400, NULL, "Invalid <tt>format=...</tt> parameter");
+    }
+}
+
+int server_status_create (struct server_status **sp, struct server *server, const char *path)
+{
+    struct server_status *s;
+
+    if (!(s = calloc(1, sizeof(*s)))) {
+        log_perror("calloc");
+        return -1;
+    }
+
+    s->handler.request = server_status_request;
+    s->handler.name = "status";
+
+    log_info("GET %s", path);
+
+    if (server_add_handler(server, "GET", path, &s->handler)) {
+        log_error("server_add_handler: GET");
+        goto error;
+    }
+
+    *sp = s;
+
+    return 0;
+
+error:
+    free(s);
+
+    return -1;
+}
+
+void server_status_destroy (struct server_status *s)
+{
+    free(s);
+}
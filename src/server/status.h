@@ -0,0 +1,22 @@
+#ifndef SERVER_STATUS_H
+#define SERVER_STATUS_H
+
+#include "server/server.h"
+
+struct server_status;
+
+/*
+ * Initialize and mount onto the given server path, serving the stats of all worker processes, see stats_share().
+ *
+ * The stats are returned in the Prometheus text format, or as JSON for ?format=json.
+ */
+int server_status_create (struct server_status **sp, struct server *server, const char *path);
+
+/*
+ * Release all associated resources.
+ *
+ * Only do this after the handler has been unregistered, i.e. server_destroy()!
+ */
+void server_status_destroy (struct server_status *s);
+
+#endif
@@ -35,6 +35,7 @@ int test_pack_name (const struct pack_name_test *test) {
     // reset
     pkt.ptr = pkt.buf;
     pkt.end = pkt.buf + sizeof(pkt.buf);
+    pkt.names_count = 0;
 
     if (test->pack) {
         if (dns_pack_name(&pkt, test->pack)) {
@@ -80,6 +81,249 @@ int test_pack_name (const struct pack_name_test *test) {
     return 0;
 }
 
+/*
+ * Names following the header are compressed against the longest suffix already packed.
+ */
+int test_pack_compress (void)
+{
+    const char *names[] = { "foo.example", "bar.example", "EXAMPLE", "foo.example", "baz.bar.example", "other", NULL };
+    const char expected[] = {
+        3, 'f', 'o', 'o', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 0,      // @12
+        3, 'b', 'a', 'r', 0xc0, 16,                                     // @25
+        0xc0, 16,                                                       // @31
+        0xc0, 12,                                                       // @33
+        3, 'b', 'a', 'z', 0xc0, 25,                                     // @35
+        5, 'o', 't', 'h', 'e', 'r', 0,                                  // @41
+    };
+    struct dns_header header = { };
+    struct dns_packet pkt = { .ptr = pkt.buf, .end = pkt.buf + sizeof(pkt.buf), .names_count = 1 };
+    char name[DNS_NAME];
+    int err = 0;
+
+    // packing the header starts a new packet
+    if (dns_pack_header(&pkt, &header)) {
+        log_error("dns_pack_header");
+        return -1;
+    }
+
+    for (const char **n = names; *n; n++) {
+        if (dns_pack_name(&pkt, *n)) {
+            log_error("[ERROR] pack %s", *n);
+            return -1;
+        }
+    }
+
+    if (pkt.ptr - pkt.buf != 12 + sizeof(expected) || memcmp(pkt.buf + 12, expected, sizeof(expected))) {
+        log_warning("[FAIL] compress: %zu bytes", (size_t) (pkt.ptr - pkt.buf - 12));
+        return 1;
+    }
+
+    pkt.end = pkt.ptr;
+    pkt.ptr = pkt.buf + 12;
+
+    for (const char **n = names; *n; n++) {
+        if (dns_unpack_name(&pkt, name, sizeof(name))) {
+            log_error("[ERROR] unpack %s", *n);
+            return -1;
+        }
+
+        err |= test_string(*n, !strcmp(*n, "EXAMPLE") ? "example" : *n, name);
+    }
+
+    if (!err)
+        log_info("[OK] compress");
+
+    return err;
+}
+
+/*
+ * Pack a response to name/type with the given rcode, an answer record if ttl is given, and an authority SOA if minimum
+ * is given.
+ */
+static int test_cache_response (struct dns_packet *pkt, enum dns_rcode rcode, const char *name, enum dns_type type, uint32_t ttl, uint32_t minimum)
+{
+    struct dns_header header = {
+        .id         = 1,
+        .qr         = 1,
+        .rd         = 1,
+        .ra         = 1,
+        .rcode      = rcode,
+        .qdcount    = 1,
+        .ancount    = ttl ? 1 : 0,
+        .nscount    = minimum ? 1 : 0,
+    };
+    struct dns_question question = { .qtype = type, .qclass = DNS_IN };
+    char a[4] = { 127, 0, 0, 1 };
+    char soa[22] = { 0, 0, [18] = minimum >> 24, minimum >> 16, minimum >> 8, minimum };
+    struct dns_record answer = { .type = type, .class = DNS_IN, .ttl = ttl, .rdlength = sizeof(a), .rdatap = a };
+    struct dns_record authority = { .type = DNS_SOA, .class = DNS_IN, .ttl = 3600, .rdlength = sizeof(soa), .rdatap = soa };
+
+    strcpy(question.qname, name);
+    strcpy(answer.name, name);
+    strcpy(authority.name, "example");
+
+    pkt->ptr = pkt->buf;
+    pkt->end = pkt->buf + sizeof(pkt->buf);
+
+    if (dns_pack_header(pkt, &header) || dns_pack_question(pkt, &question))
+        return -1;
+
+    if (ttl && dns_pack_record(pkt, &answer))
+        return -1;
+
+    if (minimum && dns_pack_record(pkt, &authority))
+        return -1;
+
+    pkt->end = pkt->ptr;
+
+    return 0;
+}
+
+struct cache_test {
+    const char *name;
+
+    enum dns_rcode rcode;
+    uint32_t ttl, minimum;
+
+    /* Expected dns_cache_insert() return */
+    int insert;
+
+    /* Lookup after the given age, expecting a hit with the given answer TTL, or a miss if -1 */
+    const char *lookup;
+    uint32_t age;
+    int hit_ttl;
+} cache_tests[] = {
+    { "positive",       DNS_NOERROR,    300,    0,      0,  "example",  10,     290 },
+    { "case",           DNS_NOERROR,    300,    0,      0,  "EXAMPLE",  0,      300 },
+    { "expired",        DNS_NOERROR,    300,    0,      0,  "example",  300,    -1  },
+    { "zero ttl",       DNS_NOERROR,    0,      0,      1,  },
+    { "nxdomain",       DNS_NXDOMAIN,   0,      60,     0,  "example",  59,     0   },
+    { "nxdomain expired", DNS_NXDOMAIN, 0,      60,     0,  "example",  60,     -1  },
+    { "nodata",         DNS_NOERROR,    0,      60,     0,  "example",  1,      0   },
+    { "nxdomain no soa", DNS_NXDOMAIN,  0,      0,      1,  },
+    { "servfail",       DNS_SERVFAIL,   300,    0,      1,  },
+    { }
+};
+
+int test_cache (const struct cache_test *test)
+{
+    struct dns_cache *cache;
+    struct dns_packet pkt;
+    struct dns_header header;
+    struct dns_question question = { .qname = "example", .qtype = DNS_A, .qclass = DNS_IN };
+    int err = 0, ret;
+
+    if (dns_cache_create(&cache, 4096)) {
+        log_error("dns_cache_create");
+        return -1;
+    }
+
+    if (test_cache_response(&pkt, test->rcode, "example", DNS_A, test->ttl, test->minimum)) {
+        log_error("test_cache_response");
+        err = -1;
+        goto out;
+    }
+
+    if ((ret = dns_cache_insert(cache, &question, &pkt, 1000)) != test->insert) {
+        log_warning("[FAIL] %s: insert %d", test->name, ret);
+        err = 1;
+        goto out;
+    }
+
+    if (test->lookup) {
+        strcpy(question.qname, test->lookup);
+
+        if ((ret = dns_cache_lookup(cache, &question, 2, &pkt, &header, 1000 + test->age)) < 0) {
+            log_error("dns_cache_lookup");
+            err = -1;
+
+        } else if (ret && test->hit_ttl >= 0) {
+            log_warning("[FAIL] %s: miss", test->name);
+            err = 1;
+
+        } else if (!ret && test->hit_ttl < 0) {
+            log_warning("[FAIL] %s: hit", test->name);
+            err = 1;
+
+        } else if (!ret) {
+            struct dns_question qq;
+            struct dns_record rr;
+
+            if (header.id != 2 || header.rcode != test->rcode) {
+                log_warning("[FAIL] %s: header id=%u rcode=%u", test->name, header.id, header.rcode);
+                err = 1;
+
+            } else if (dns_unpack_question(&pkt, &qq)) {
+                log_error("dns_unpack_question");
+                err = -1;
+
+            } else if (test->ttl && dns_unpack_record(&pkt, &rr)) {
+                log_error("dns_unpack_record");
+                err = -1;
+
+            } else if (test->ttl && rr.ttl != test->hit_ttl) {
+                log_warning("[FAIL] %s: ttl %u", test->name, rr.ttl);
+                err = 1;
+            }
+        }
+    }
+
+    if (!err)
+        log_info("[OK] cache %s", test->name);
+
+out:
+    dns_cache_destroy(cache);
+
+    return err;
+}
+
+/*
+ * The least recently used response is evicted once full.
+ */
+int test_cache_lru (void)
+{
+    struct dns_cache *cache;
+    struct dns_packet pkt;
+    struct dns_header header;
+    struct dns_question a = { .qname = "a.example", .qtype = DNS_A, .qclass = DNS_IN };
+    struct dns_question b = { .qname = "b.example", .qtype = DNS_A, .qclass = DNS_IN };
+    int err = 0;
+
+    if (test_cache_response(&pkt, DNS_NOERROR, a.qname, DNS_A, 300, 0)) {
+        log_error("test_cache_response");
+        return -1;
+    }
+
+    // room for just one entry
+    if (dns_cache_create(&cache, 2 * (sizeof(struct dns_question) + (pkt.end - pkt.buf)))) {
+        log_error("dns_cache_create");
+        return -1;
+    }
+
+    err |= dns_cache_insert(cache, &a, &pkt, 0);
+    err |= test_cache_response(&pkt, DNS_NOERROR, b.qname, DNS_A, 300, 0);
+    err |= dns_cache_insert(cache, &b, &pkt, 0);
+
+    if (err) {
+        log_warning("[FAIL] cache lru: insert");
+
+    } else if (dns_cache_lookup(cache, &a, 0, &pkt, &header, 0) != 1) {
+        log_warning("[FAIL] cache lru: a not evicted");
+        err = 1;
+
+    } else if (dns_cache_lookup(cache, &b, 0, &pkt, &header, 0) != 0) {
+        log_warning("[FAIL] cache lru: b evicted");
+        err = 1;
+
+    } else {
+        log_info("[OK] cache lru");
+    }
+
+    dns_cache_destroy(cache);
+
+    return err;
+}
+
 int main (int argc, char **argv)
 {
     int err = 0;
@@ -93,5 +337,13 @@ int main (int argc, char **argv)
         err |= test_pack_name(test);
     }
 
+    err |= test_pack_compress();
+
+    for (const struct cache_test *test = cache_tests; test->name; test++) {
+        err |= test_cache(test);
+    }
+
+    err |= test_cache_lru();
+
     return err;
 }
@@ -1,7 +1,10 @@
 #include "common/http.h"
 #include "common/http_test.h"
 #include "common/log.h"
+#include "test.h"
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -42,6 +45,268 @@ int test_header (const char *str)
     return 0;
 }
 
+int test_head ()
+{
+    char buf[] = "GET / HTTP/1.1\r\nHost: foo\r\nX-Foo: bar\r\ncontent-length:  5\r\nHost: bar\r\n\r\n";
+    struct http_headers headers;
+    char *line;
+    int err = 0;
+
+    if (http_parse_head(buf, sizeof(buf) - 1, &line, &headers)) {
+        log_error("[ERROR] http_parse_head");
+        return 1;
+    }
+
+    err |= test_string("line", "GET / HTTP/1.1", line);
+    err |= test_string("host", "foo", http_headers_get(&headers, HTTP_HEADER_HOST));
+    err |= test_string("content-length", "5", http_headers_get(&headers, HTTP_HEADER_CONTENT_LENGTH));
+    err |= test_string("range", NULL, http_headers_get(&headers, HTTP_HEADER_RANGE));
+
+    if (headers.count != 4) {
+        log_warning("headers: count=%u", headers.count);
+        err = 1;
+    } else {
+        err |= test_string("name", "X-Foo", headers.headers[1].name);
+        err |= test_string("value", "bar", headers.headers[1].value);
+    }
+
+    if (err) {
+        log_warning("[FAIL] http_parse_head");
+    } else {
+        log_info("[OK] http_parse_head");
+    }
+
+    return err;
+}
+
+int test_date (const char *str, time_t expected)
+{
+    char buf[HTTP_DATE_MAX];
+    time_t time;
+    int err = 0;
+
+    if (http_parse_date(str, &time)) {
+        log_warning("[FAIL] http_parse_date: %s", str);
+        return 1;
+    }
+
+    if (time != expected) {
+        log_warning("[FAIL] http_parse_date: %s: %ld != %ld", str, (long) time, (long) expected);
+        return 1;
+    }
+
+    if (http_format_date(buf, sizeof(buf), time)) {
+        log_warning("[FAIL] http_format_date: %ld", (long) time);
+        return 1;
+    }
+
+    err |= test_string("date", str, buf);
+
+    if (err) {
+        log_warning("[FAIL] %s", str);
+    } else {
+        log_info("[OK] %s", str);
+    }
+
+    return err;
+}
+
+/*
+ * Check parsed ranges, formatted as start+length pairs, or NULL if the header should be ignored.
+ */
+int test_range (const char *str, off_t size, const char *expected)
+{
+    struct http_range ranges[HTTP_RANGES_MAX];
+    unsigned count;
+    char buf[256] = "", *p = buf;
+    int err = 0;
+
+    if (http_parse_range(str, size, ranges, &count)) {
+        if (expected) {
+            log_warning("[FAIL] http_parse_range: %s", str);
+            return 1;
+        }
+
+        log_info("[OK] %s: ignored", str);
+        return 0;
+
+    } else if (!expected) {
+        log_warning("[FAIL] http_parse_range: %s: expected to be ignored", str);
+        return 1;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        p += snprintf(p, buf + sizeof(buf) - p, "%s%jd+%jd", i ? "," : "", (intmax_t) ranges[i].start, (intmax_t) ranges[i].length);
+    }
+
+    err |= test_string("ranges", expected, buf);
+
+    if (err) {
+        log_warning("[FAIL] %s", str);
+    } else {
+        log_info("[OK] %s: %s", str, buf);
+    }
+
+    return err;
+}
+
+int test_accept (const char *str, const char *token, int expected)
+{
+    int ret = http_parse_accept(str, token);
+
+    if (ret != expected) {
+        log_warning("[FAIL] %s: %s: %d != %d", str, token, ret, expected);
+        return 1;
+    }
+
+    log_info("[OK] %s: %s: %d", str, token, ret);
+
+    return 0;
+}
+
+/*
+ * In-memory stream, reading from a string in small chunks.
+ */
+struct test_mem {
+    const char *in;
+    size_t chunk;
+};
+
+static int test_mem_read (char *buf, size_t *sizep, void *ctx)
+{
+    struct test_mem *mem = ctx;
+    size_t len = strlen(mem->in);
+
+    if (len > mem->chunk)
+        len = mem->chunk;
+
+    if (len > *sizep)
+        len = *sizep;
+
+    memcpy(buf, mem->in, len);
+    mem->in += len;
+    *sizep = len;
+
+    return len ? 0 : 1;
+}
+
+static const struct stream_type test_mem_type = {
+    .read   = test_mem_read,
+};
+
+/*
+ * Decode a chunked body, arriving in pieces of the given size, reading spans of at most max bytes.
+ */
+int test_chunked (const char *str, size_t chunk, size_t max, const char *expected)
+{
+    struct test_mem mem = { .in = str, .chunk = chunk };
+    struct stream *stream = NULL;
+    struct http *http = NULL;
+    char out[1024];
+    size_t len = 0;
+    int err, ret;
+
+    if ((err = stream_create(&test_mem_type, &stream, 64, 0, &mem))) {
+        log_error("stream_create");
+        return 1;
+    }
+
+    if ((err = http_create(&http, stream, NULL))) {
+        log_error("http_create");
+        goto error;
+    }
+
+    while (true) {
+        size_t size = max;
+        char *buf;
+
+        if ((ret = http_read_chunked(http, &buf, &size)))
+            break;
+
+        if (size > max && max) {
+            log_error("[ERROR] %s: span %zu > %zu", str, size, max);
+            err = 1;
+            goto error;
+        }
+
+        if (len + size >= sizeof(out)) {
+            log_error("[ERROR] %s: output overflow", str);
+            err = 1;
+            goto error;
+        }
+
+        memcpy(out + len, buf, size);
+        len += size;
+    }
+
+    out[len] = '\0';
+
+    if (ret < 0 && !expected) {
+        log_info("[OK] %zu/%zu: invalid", chunk, max);
+    } else if (ret < 0) {
+        log_error("[ERROR] %s: http_read_chunked", str);
+        err = 1;
+    } else {
+        err = test_string("chunked", expected, out);
+    }
+
+error:
+    if (http)
+        http_destroy(http);
+
+    stream_destroy(stream);
+
+    return err;
+}
+
+/*
+ * Read a response status line and head, formatting the status, reason and header lines as "status reason|name=value|..."
+ */
+int test_response_head (const char *str, const char *expected)
+{
+    struct test_mem mem = { .in = str, .chunk = 64 };
+    struct stream *stream = NULL;
+    struct http *http = NULL;
+    struct http_head_line line;
+    enum http_version version;
+    unsigned status;
+    const char *reason, *head;
+    char out[1024];
+    size_t len;
+    int err, ret, off;
+
+    if ((err = stream_create(&test_mem_type, &stream, 256, 0, &mem))) {
+        log_error("stream_create");
+        return 1;
+    }
+
+    if ((err = http_create(&http, stream, NULL))) {
+        log_error("http_create");
+        goto error;
+    }
+
+    if ((ret = http_read_response_head(http, &version, &status, &reason, &head, &len))) {
+        err = test_string("head", expected, NULL);
+        goto error;
+    }
+
+    off = snprintf(out, sizeof(out), "%u %s", status, reason);
+
+    while (!(ret = http_head_next(&head, &len, &line)) && off < sizeof(out)) {
+        off += snprintf(out + off, sizeof(out) - off, "|%.*s=%.*s", (int) line.name_len, line.name, (int) line.value_len, line.value);
+    }
+
+    err = test_string("head", expected, ret < 0 ? NULL : out);
+
+error:
+    if (http)
+        http_destroy(http);
+
+    stream_destroy(stream);
+
+    return err;
+}
+
 int main (int argc, char **argv)
 {
     const char *arg;
@@ -52,6 +317,52 @@ int main (int argc, char **argv)
     // skip argv0
     argv++;
 
+    err |= test_head();
+    err |= test_date("Sun, 06 Nov 1994 08:49:37 GMT", 784111777);
+    err |= test_date("Thu, 01 Jan 1970 00:00:00 GMT", 0);
+    err |= test_date("Tue, 29 Feb 2028 23:59:59 GMT", 1835481599);
+    err |= test_range("bytes=0-9", 100, "0+10");
+    err |= test_range("bytes=90-", 100, "90+10");
+    err |= test_range("bytes=-10", 100, "90+10");
+    err |= test_range("bytes=-200", 100, "0+100");
+    err |= test_range("bytes=50-200", 100, "50+50");
+    err |= test_range("bytes=0-0, 10-19,-5", 100, "0+1,10+10,95+5");
+    err |= test_range("bytes=100-", 100, "");
+    err |= test_range("bytes=-0", 100, "");
+    err |= test_range("bytes=9-0", 100, NULL);
+    err |= test_range("bytes=x-", 100, NULL);
+    err |= test_range("items=0-9", 100, NULL);
+    err |= test_range("bytes=", 100, NULL);
+    err |= test_range("bytes=0-1,2-3,4-5,6-7,8-9,10-11,12-13,14-15,16-17", 100, NULL);
+
+    err |= test_accept("gzip, deflate, br", "gzip", 1);
+    err |= test_accept("gzip, deflate, br", "br", 1);
+    err |= test_accept("deflate", "gzip", 0);
+    err |= test_accept("GZIP;q=0.5", "gzip", 1);
+    err |= test_accept("gzip;q=0, *", "gzip", 0);
+    err |= test_accept("gzip ; q=0.000", "gzip", 0);
+    err |= test_accept("br;q=1.0, *;q=0", "gzip", 0);
+    err |= test_accept("*", "br", 1);
+    err |= test_accept("x-gzip", "gzip", 0);
+    err |= test_accept("", "gzip", 0);
+
+    err |= test_chunked("5\r\nhello\r\n7\r\n, world\r\n0\r\n\r\n", 64, 0, "hello, world");
+    err |= test_chunked("5\r\nhello\r\n7\r\n, world\r\n0\r\n\r\n", 3, 0, "hello, world");
+    err |= test_chunked("5\r\nhello\r\n7\r\n, world\r\n0\r\n\r\n", 64, 2, "hello, world");
+    err |= test_chunked("a;ext=1\r\n0123456789\r\n0\r\nX-Trailer: 1\r\n\r\n", 5, 4, "0123456789");
+    err |= test_chunked("0\r\n\r\n", 64, 0, "");
+    err |= test_chunked("5\r\nhello\r\n", 64, 0, NULL);
+    err |= test_chunked("5\r\nhelloX\r\n0\r\n\r\n", 64, 0, NULL);
+    err |= test_chunked("x\r\n\r\n", 64, 0, NULL);
+    err |= test_chunked("46\r\n0123456789012345678901234567890123456789012345678901234567890123456789\r\n0\r\n\r\n", 16, 0,
+            "0123456789012345678901234567890123456789012345678901234567890123456789");
+
+    err |= test_response_head("HTTP/1.1 200 OK\r\nContent-Length: 5\r\nX-Foo:bar  \r\n\r\nhello", "200 OK|Content-Length=5|X-Foo=bar");
+    err |= test_response_head("HTTP/1.0 404 Not Found\n\n", "404 Not Found");
+    err |= test_response_head("HTTP/1.1 204\r\nA: 1\r\n  2\r\n\r\n", "204 |A=1|=2");
+    err |= test_response_head("HTTP/1.1 20x OK\r\n\r\n", NULL);
+    err |= test_response_head("HTTP/1.1 200 OK\r\nnocolon\r\n\r\n", NULL);
+
     // first arg is response line
     err |= test_response(*argv++);
 
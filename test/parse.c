@@ -2,6 +2,7 @@
 
 #include "common/log.h"
 #include "common/parse.h"
+#include "common/parse_test.h"
 
 #include <limits.h>
 #include <stdlib.h>
@@ -92,6 +93,10 @@ int main (int argc, char **argv)
     } else {
         log_set_level(LOG_INFO);
 
+        // compiled tables must match scanning the transitions
+        parse_set_compile(false);
+        err |= test_path();
+        parse_set_compile(true);
         err |= test_path();
     }
 
@@ -0,0 +1,172 @@
+#include "server/server_test.h"
+
+#include "common/log.h"
+#include "test.h"
+
+#include <stdbool.h>
+
+static struct server_handler static_handler = { .name = "static" };
+static struct server_handler upload_handler = { .name = "upload" };
+static struct server_handler status_handler = { .name = "status" };
+static struct server_handler proxy_handler = { .name = "proxy" };
+static struct server_handler items_handler = { .name = "items" };
+
+struct route_test {
+    const char *method;
+    const char *path;
+    struct server_handler *handler;
+};
+
+struct lookup_test {
+    const char *method;
+    const char *path;
+
+    /* Expected handler, or NULL for the expected status */
+    struct server_handler *handler;
+    int status;
+};
+
+/*
+ * A static fallback, with the handlers below it as given by bin/server.
+ */
+static const struct route_test site_routes[] = {
+    { "GET",    "",                 &static_handler },
+    { "PUT",    "upload/",          &upload_handler },
+    { "GET",    "server-status",    &status_handler },
+    { NULL,     "api/",             &proxy_handler  },
+    { "GET",    "api/v1/items",     &items_handler  },
+    { }
+};
+
+static const struct lookup_test site_lookups[] = {
+    { "GET",    "",                     &static_handler },
+    { "GET",    "index.html",           &static_handler },
+    { "PUT",    "index.html",           NULL,   405     },
+
+    // prefix route, falling back to the static handler for other methods
+    { "PUT",    "upload/",              &upload_handler },
+    { "PUT",    "upload/foo.txt",       &upload_handler },
+    { "GET",    "upload/foo.txt",       &static_handler },
+    { "HEAD",   "upload/foo.txt",       NULL,   405     },
+
+    // exact route, not matching anything below it
+    { "GET",    "server-status",        &status_handler },
+    { "GET",    "server-status/",       &static_handler },
+    { "GET",    "server-status/foo",    &static_handler },
+    { "GET",    "server-statusfoo",     &static_handler },
+    { "POST",   "server-status",        NULL,   405     },
+
+    // exact route below a prefix route for any method
+    { "GET",    "api/v1/items",         &items_handler  },
+    { "POST",   "api/v1/items",         &proxy_handler  },
+    { "GET",    "api/v1/items/1",       &proxy_handler  },
+    { "GET",    "api/v1/items/",        &proxy_handler  },
+    { "DELETE", "api/v2/foo",           &proxy_handler  },
+    { "GET",    "apifoo",               &static_handler },
+    { }
+};
+
+/*
+ * Without any fallback, only matching paths have any handler.
+ */
+static const struct route_test api_routes[] = {
+    { NULL,     "api/",             &proxy_handler  },
+    { "GET",    "server-status",    &status_handler },
+    { "GET",    "api/v1/items",     &items_handler  },
+    { }
+};
+
+static const struct lookup_test api_lookups[] = {
+    { "GET",    "",                     NULL,   404     },
+    { "GET",    "index.html",           NULL,   404     },
+    { "GET",    "server-status",        &status_handler },
+    { "POST",   "server-status",        NULL,   405     },
+    { "GET",    "server-status/foo",    NULL,   404     },
+    { "GET",    "server-statusfoo",     NULL,   404     },
+    { "GET",    "api/v1/items",         &items_handler  },
+    { "POST",   "api/v1/items",         &proxy_handler  },
+    { "PUT",    "api/foo",              &proxy_handler  },
+    { "GET",    "apifoo",               NULL,   404     },
+    { }
+};
+
+static int test_lookup (struct server *server, const char *name, const struct lookup_test *test)
+{
+    struct server_handler *handler = NULL;
+    int err;
+
+    if ((err = server_lookup_handler(server, test->method, test->path, &handler)) < 0) {
+        log_error("[ERROR] %s: %s /%s", name, test->method, test->path);
+        return -1;
+    }
+
+    if (test->handler && err) {
+        log_warning("[FAIL] %s: %s /%s: %s <= %d", name, test->method, test->path, test->handler->name, err);
+        return 1;
+
+    } else if (test->handler && handler != test->handler) {
+        log_warning("[FAIL] %s: %s /%s: %s <= %s", name, test->method, test->path, test->handler->name, handler->name);
+        return 1;
+
+    } else if (!test->handler && err != test->status) {
+        log_warning("[FAIL] %s: %s /%s: %d <= %s", name, test->method, test->path, test->status, err ? "?" : handler->name);
+        return 1;
+    }
+
+    log_info("[OK] %s: %s /%s -> %s", name, test->method, test->path, test->handler ? test->handler->name : "-");
+
+    return 0;
+}
+
+/*
+ * Register the routes in order, or in reverse order, and check each lookup.
+ */
+static int test_routes (const char *name, const struct route_test *routes, const struct lookup_test *lookups, bool reverse)
+{
+    struct server *server;
+    const struct route_test *route;
+    unsigned count = 0;
+    int err = 0;
+
+    for (route = routes; route->handler; route++)
+        count++;
+
+    if (server_create(NULL, &server)) {
+        log_error("server_create");
+        return -1;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        route = &routes[reverse ? count - 1 - i : i];
+
+        if (server_add_handler(server, route->method, route->path, route->handler)) {
+            log_error("[ERROR] %s: server_add_handler %s /%s", name, route->method ? route->method : "*", route->path);
+            err = -1;
+            goto error;
+        }
+    }
+
+    for (const struct lookup_test *test = lookups; test->method; test++) {
+        err |= test_lookup(server, name, test);
+    }
+
+error:
+    server_destroy(server);
+
+    return err;
+}
+
+int main (int argc, char **argv)
+{
+    int err = 0;
+
+    log_set_level(LOG_INFO);
+
+    // the route trie is independent of the registration order
+    for (int reverse = 0; reverse <= 1; reverse++) {
+        err |= test_routes(reverse ? "site/reverse" : "site", site_routes, site_lookups, reverse);
+        err |= test_routes(reverse ? "api/reverse" : "api", api_routes, api_lookups, reverse);
+    }
+
+    return err;
+}
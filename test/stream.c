@@ -0,0 +1,229 @@
+#include "common/stream.h"
+#include "common/log.h"
+#include "test.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * In-memory stream, reading from a string in small chunks, and writing into a buffer.
+ */
+struct test_mem {
+    const char *in;
+    size_t chunk;
+
+    char out[1024];
+    size_t out_len;
+};
+
+static int test_mem_read (char *buf, size_t *sizep, void *ctx)
+{
+    struct test_mem *mem = ctx;
+    size_t len = strlen(mem->in);
+
+    if (len > mem->chunk)
+        len = mem->chunk;
+
+    if (len > *sizep)
+        len = *sizep;
+
+    memcpy(buf, mem->in, len);
+    mem->in += len;
+    *sizep = len;
+
+    return len ? 0 : 1;
+}
+
+static int test_mem_write (const char *buf, size_t *sizep, void *ctx)
+{
+    struct test_mem *mem = ctx;
+
+    if (mem->out_len + *sizep >= sizeof(mem->out)) {
+        log_error("output overflow");
+        return -1;
+    }
+
+    memcpy(mem->out + mem->out_len, buf, *sizep);
+    mem->out_len += *sizep;
+    mem->out[mem->out_len] = '\0';
+
+    return 0;
+}
+
+static const struct stream_type test_mem_type = {
+    .read   = test_mem_read,
+    .write  = test_mem_write,
+};
+
+struct test_line {
+    const char *name;
+    const char *str;
+
+    size_t size, max;
+
+    /* Expected lines, or NULL for buffer-full error */
+    const char *lines[4];
+} line_tests[] = {
+    { "short",      "foo\r\nbar\r\n",                         8, 0,    { "foo", "bar" } },
+    { "fixed",      "foobarfoobar\r\nquux\r\n",               8, 0,    { NULL } },
+    { "grow",       "foobarfoobar\r\nquux\r\n",               8, 64,   { "foobarfoobar", "quux" } },
+    { "max",        "foobarfoobarfoobarfoobar\r\nquux\r\n",   8, 16,   { NULL } },
+    { "compact",    "foo\r\nfoobarfoo\r\nbar\r\n",            8, 16,   { "foo", "foobarfoo", "bar" } },
+    { "lf",         "foo\nbar\r\n\r\n",                       8, 0,    { "foo", "bar", "" } },
+    { "cr",         "foo\rbar\r\n",                           16, 0,   { "foo\rbar" } },
+    { }
+};
+
+int test_stream_lines (struct test_line *test)
+{
+    struct test_mem mem = { .in = test->str, .chunk = 3 };
+    struct stream *stream;
+    char *line;
+    int err = 0, ret;
+
+    if (stream_create(&test_mem_type, &stream, test->size, test->max, &mem)) {
+        log_error("stream_create");
+        return -1;
+    }
+
+    for (const char **expected = test->lines; ; expected++) {
+        if ((ret = stream_read_line(stream, &line)) < 0) {
+            if (*expected) {
+                log_warning("unexpected error, expected line: %s", *expected);
+                err = 1;
+            }
+            break;
+
+        } else if (ret) {
+            if (*expected) {
+                log_warning("unexpected EOF, expected line: %s", *expected);
+                err = 1;
+            }
+            break;
+
+        } else if (!*expected) {
+            log_warning("unexpected line: %s", line);
+            err = 1;
+            break;
+        }
+
+        err |= test_string("line", *expected, line);
+    }
+
+    if (stream->size > (test->max ? test->max : test->size)) {
+        log_warning("buffer size %zu exceeds maximum", stream->size);
+        err = 1;
+    }
+
+    if (err) {
+        log_warning("[FAIL] %s", test->name);
+    } else {
+        log_info("[OK] %s", test->name);
+    }
+
+    stream_destroy(stream);
+
+    return err;
+}
+
+int test_stream_printf (size_t size, size_t max, const char *str, bool full)
+{
+    struct test_mem mem = { .in = "" };
+    struct stream *stream;
+    int err = 0, ret;
+
+    if (stream_create(&test_mem_type, &stream, size, max, &mem)) {
+        log_error("stream_create");
+        return -1;
+    }
+
+    if ((ret = stream_printf(stream, "%s", str)) < 0) {
+        log_warning("stream_printf failed");
+        err = 1;
+
+    } else if (!ret && (ret = stream_flush(stream))) {
+        log_warning("stream_flush failed");
+        err = 1;
+
+    } else if (ret) {
+        if (!full) {
+            log_warning("unexpected full buffer");
+            err = 1;
+        }
+
+    } else if (full) {
+        log_warning("expected full buffer");
+        err = 1;
+
+    } else {
+        err |= test_string("output", str, mem.out);
+    }
+
+    if (err) {
+        log_warning("[FAIL] printf %zu/%zu: %s", size, max, str);
+    } else {
+        log_info("[OK] printf %zu/%zu: %s", size, max, str);
+    }
+
+    stream_destroy(stream);
+
+    return err;
+}
+
+int test_stream_pending (const char *str, size_t chunk, bool pending)
+{
+    struct test_mem mem = { .in = str, .chunk = chunk };
+    struct stream *stream;
+    char *buf;
+    size_t size;
+    int err = 0, ret;
+
+    if (stream_create(&test_mem_type, &stream, 64, 0, &mem)) {
+        log_error("stream_create");
+        return -1;
+    }
+
+    // consume the first head, leaving whatever else was read in the buffer
+    if ((ret = stream_read_head(stream, &buf, &size))) {
+        log_warning("stream_read_head: %d", ret);
+        err = 1;
+
+    } else if ((ret = stream_pending_head(stream)) != pending) {
+        log_warning("stream_pending_head: %d", ret);
+        err = 1;
+    }
+
+    if (err) {
+        log_warning("[FAIL] pending %zu: %s", chunk, str);
+    } else {
+        log_info("[OK] pending %zu: %s", chunk, str);
+    }
+
+    stream_destroy(stream);
+
+    return err;
+}
+
+int main (int argc, char **argv)
+{
+    int err = 0;
+
+    log_set_level(LOG_INFO);
+
+    for (struct test_line *test = line_tests; test->name; test++) {
+        err |= test_stream_lines(test);
+    }
+
+    err |= test_stream_printf(8, 0, "foo", false);
+    err |= test_stream_printf(8, 0, "foobarfoobar", true);
+    err |= test_stream_printf(8, 64, "foobarfoobar", false);
+    err |= test_stream_printf(8, 16, "foobarfoobarfoobar", true);
+
+    err |= test_stream_pending("GET /a\r\n\r\nGET /b\r\n\r\n", 64, true);
+    err |= test_stream_pending("GET /a\r\n\r\nGET /b\r\n\r\n", 10, false);
+    err |= test_stream_pending("GET /a\n\nGET /b\n\n", 64, true);
+    err |= test_stream_pending("GET /a\r\n\r\nGET /b\r\nHost: x\r\n", 64, false);
+    err |= test_stream_pending("GET /a\r\n\r\nGET /b\r\nHost: x\r\n\r", 64, false);
+
+    return err;
+}
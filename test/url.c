@@ -5,6 +5,7 @@
 #include "common/util.h"
 
 #include <stdio.h>
+#include <string.h>
 
 struct test_parse {
     const char *str;
@@ -141,6 +142,180 @@ int test_url_decode (struct test_decode *test)
     return err;
 }
 
+struct test_unquote {
+    const char *str;
+
+    /* Expected output, or NULL for invalid input */
+    const char *out;
+} unquote_tests[] = {
+    { "",                                       "" },
+    { "foo",                                    "foo" },
+    { "foo+bar%21",                             "foo bar!" },
+    { "0123456789abcdef0123456789abcdef+",      "0123456789abcdef0123456789abcdef " },
+    { "0123456789abcde%2F0123456789abcd%2f",    "0123456789abcde/0123456789abcd/" },
+    { "%41%42%43%44%45%46%47%48%49%4A%4b+%4C",  "ABCDEFGHIJK L" },
+    { "foo%",                                   NULL },
+    { "foo%4",                                  NULL },
+    { "foo%4g",                                 NULL },
+    { "foo%00",                                 NULL },
+    { }
+};
+
+int test_url_unquote (struct test_unquote *test)
+{
+    char buf[1024];
+
+    // at each alignment within a block
+    for (unsigned offset = 0; offset < 16; offset++) {
+        if (str_copy(buf + offset, sizeof(buf) - offset, test->str)) {
+            log_error("failed to copy input string");
+            return -1;
+        }
+
+        int ret = url_unquote(buf + offset);
+
+        if (!test->out && !ret) {
+            log_warning("[FAIL] unquote %s: expected error", test->str);
+            return 1;
+
+        } else if (test->out && ret) {
+            log_warning("[FAIL] unquote %s: error", test->str);
+            return 1;
+
+        } else if (test->out && test_string("unquote", test->out, buf + offset)) {
+            log_warning("[FAIL] unquote %s @ %u", test->str, offset);
+            return 1;
+        }
+    }
+
+    log_info("[OK] unquote %s", test->str);
+
+    return 0;
+}
+
+int test_url_params ()
+{
+    char buf[] = "name=foo&type=A&Name=bar&empty&dns=a%2Bb+c&&x=1=2";
+    struct url_params params;
+    const struct url_param *param;
+    int err = 0;
+
+    if (url_params_parse(&params, buf)) {
+        log_error("url_params_parse");
+        return -1;
+    }
+
+    if (params.count != 7) {
+        log_warning("[FAIL] params: count=%u", params.count);
+        return 1;
+    }
+
+    err |= test_string("name", "foo", url_params_get(&params, "NAME"));
+    err |= test_string("type", "A", url_params_get(&params, "type"));
+    err |= test_string("dns", "a+b c", url_params_get(&params, "dns"));
+    err |= test_string("x", "1=2", url_params_get(&params, "x"));
+    err |= test_string("missing", NULL, url_params_get(&params, "missing"));
+    err |= test_string("empty", NULL, url_params_get(&params, "empty"));
+    err |= test_string("params[2]", "bar", params.params[2].value);
+
+    if (!(param = url_params_find(&params, "empty")) || strcmp(param->name, "empty")) {
+        log_warning("[FAIL] params: find empty");
+        err |= 1;
+    }
+
+    if (!(param = url_params_find(&params, "")) || param->value) {
+        log_warning("[FAIL] params: find \"\"");
+        err |= 1;
+    }
+
+    if (err) {
+        log_warning("[FAIL] params %s", buf);
+    } else {
+        log_info("[OK] params");
+    }
+
+    return err;
+}
+
+int test_url_params_max ()
+{
+    char buf[URL_PARAMS_MAX * 16] = "", last[16], past[16], value[16];
+    struct url_params params;
+    size_t len = 0;
+    int err = 0;
+
+    for (unsigned i = 0; i < URL_PARAMS_MAX + 8; i++)
+        len += snprintf(buf + len, sizeof(buf) - len, "%sp%u=%u", i ? "&" : "", i, i);
+
+    // any params past the limit are ignored
+    if (url_params_parse(&params, buf)) {
+        log_warning("[FAIL] params: error on %u params", URL_PARAMS_MAX + 8);
+        return 1;
+    }
+
+    if (params.count != URL_PARAMS_MAX) {
+        log_warning("[FAIL] params: count=%u", params.count);
+        return 1;
+    }
+
+    snprintf(last, sizeof(last), "p%u", URL_PARAMS_MAX - 1);
+    snprintf(past, sizeof(past), "p%u", URL_PARAMS_MAX);
+    snprintf(value, sizeof(value), "%u", URL_PARAMS_MAX - 1);
+
+    err |= test_string("p0", "0", url_params_get(&params, "p0"));
+    err |= test_string(last, value, url_params_get(&params, last));
+    err |= test_string(past, NULL, url_params_get(&params, past));
+
+    if (!err)
+        log_info("[OK] params max");
+
+    return err;
+}
+
+struct test_base64url {
+    const char *str;
+
+    /* Expected output and length, or NULL for invalid input */
+    const char *out;
+    size_t len;
+} base64url_tests[] = {
+    { "",               "",                 0 },
+    { "Zm9v",           "foo",              3 },
+    { "Zm9vYg",         "foob",             4 },
+    { "Zm9vYmE",        "fooba",            5 },
+    { "Zm9vYmE=",       "fooba",            5 },
+    { "-_8",            "\xfb\xff",         2 },
+    { "AAABAAAB",       "\0\0\1\0\0\1",     6 },
+    { "Zm9v+",          NULL },
+    { "Zm9vY",          NULL },
+    { "Zm=9v",          NULL },
+    { }
+};
+
+int test_base64url (struct test_base64url *test)
+{
+    char buf[64];
+    size_t size = sizeof(buf);
+    int ret = base64url_decode(buf, &size, test->str);
+
+    if (!test->out && !ret) {
+        log_warning("[FAIL] base64url %s: expected error", test->str);
+        return 1;
+
+    } else if (test->out && ret) {
+        log_warning("[FAIL] base64url %s: error", test->str);
+        return 1;
+
+    } else if (test->out && (size != test->len || memcmp(buf, test->out, size))) {
+        log_warning("[FAIL] base64url %s: %zu bytes", test->str, size);
+        return 1;
+    }
+
+    log_info("[OK] base64url %s", test->str);
+
+    return 0;
+}
+
 int test_arg (const char *str)
 {
     struct urlbuf urlbuf;
@@ -161,7 +336,7 @@ int test_arg (const char *str)
 int main (int argc, char **argv)
 {
     const char *arg;
-    int err;
+    int err = 0;
 
     
     // skip argv0
@@ -189,6 +364,17 @@ int main (int argc, char **argv)
             err |= test_url_decode(test);
         }
 
+        for (struct test_unquote *test = unquote_tests; test->str; test++) {
+            err |= test_url_unquote(test);
+        }
+
+        err |= test_url_params();
+        err |= test_url_params_max();
+
+        for (struct test_base64url *test = base64url_tests; test->str; test++) {
+            err |= test_base64url(test);
+        }
+
     }
 
     return err;